@@ -0,0 +1,441 @@
+﻿#include "action_journal.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <iostream>
+#include <iterator>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_serialization.h"
+#include "state_file.h"
+
+namespace infrastructure {
+	using namespace std::literals;
+	namespace state_file = serialization::state_file;
+
+	namespace {
+
+		constexpr std::array<char, 8> journal_signature = { 'G', 'S', 'J', 'O', 'U', 'R', 'N', '\x1A' };
+		constexpr std::uint32_t journal_version = 1;
+		// Сигнатура, версия, 4 байта резерва и номер поколения
+		constexpr size_t journal_header_size = 24;
+		// Длина и контрольная сумма данных записи
+		constexpr size_t record_header_size = 8;
+
+		enum class RecordType : std::uint8_t {
+			JOIN = 1,
+			PLAYER_ACTION,
+			TICK,
+		};
+
+		std::string JournalPrefix(const std::string& state_file) {
+			return std::filesystem::path(state_file).filename().string() + ".journal."s;
+		}
+
+		std::filesystem::path JournalDirectory(const std::string& state_file) {
+			auto dir = std::filesystem::path(state_file).parent_path();
+			return dir.empty() ? std::filesystem::path(".") : dir;
+		}
+
+		std::string JournalPath(const std::string& state_file, std::uint64_t generation) {
+			return state_file + ".journal."s + std::to_string(generation);
+		}
+
+		// Файлы поколений журнала по возрастанию номера поколения
+		std::vector<std::pair<std::uint64_t, std::filesystem::path>> FindJournalFiles(const std::string& state_file) {
+			std::vector<std::pair<std::uint64_t, std::filesystem::path>> files;
+			const auto prefix = JournalPrefix(state_file);
+
+			std::error_code ec;
+			for (const auto& entry : std::filesystem::directory_iterator(JournalDirectory(state_file), ec)) {
+				const auto name = entry.path().filename().string();
+				if (!name.starts_with(prefix)) {
+					continue;
+				}
+				const std::string_view suffix = std::string_view(name).substr(prefix.size());
+				std::uint64_t generation = 0;
+				const auto [ptr, err] = std::from_chars(suffix.data(), suffix.data() + suffix.size(), generation);
+				if (err == std::errc{} && ptr == suffix.data() + suffix.size() && !suffix.empty()) {
+					files.emplace_back(generation, entry.path());
+				}
+			}
+			std::sort(files.begin(), files.end());
+			return files;
+		}
+
+		void ApplyRecord(std::span<const char> payload, app::Application& app) {
+			state_file::BinaryInputArchive input_archive(payload);
+			RecordType type;
+			input_archive >> type;
+
+			auto game = app.GetGame();
+			switch (type) {
+			case RecordType::JOIN: {
+				std::string map_id;
+				serialization::PlayerRepr player_repr;
+				serialization::DogRepr dog_repr;
+				input_archive >> map_id >> player_repr >> dog_repr;
+				auto* session = game->FindGameSessions(model::Map::Id(map_id));
+				if (!session) {
+					throw std::runtime_error("Unknown map " + map_id);
+				}
+				serialization::RestorePlayer(app, *session, dog_repr, player_repr);
+				break;
+			}
+			case RecordType::PLAYER_ACTION: {
+				std::string token;
+				std::string move;
+				input_archive >> token >> move;
+				try {
+					app.ApplyPlayerAction(app::Token::FromString(token), move);
+				}
+				catch (const app::GameError<app::AuthorizationGameErrorReason>&) {
+					throw std::runtime_error("Unknown player token");
+				}
+				catch (const app::GameError<app::ActionGameErrorReason>&) {
+					throw std::runtime_error("Invalid move " + move);
+				}
+				break;
+			}
+			case RecordType::TICK: {
+				std::int64_t delta = 0;
+				std::uint32_t session_count = 0;
+				input_archive >> delta >> session_count;
+
+				auto& sessions = game->GetGameSessions();
+				std::vector<model::Loots> spawned(sessions.size());
+				for (std::uint32_t i = 0; i < session_count; ++i) {
+					std::string map_id;
+					std::uint32_t loot_count = 0;
+					input_archive >> map_id >> loot_count;
+					auto* session = game->FindGameSessions(model::Map::Id(map_id));
+					if (!session) {
+						throw std::runtime_error("Unknown map " + map_id);
+					}
+					auto& loots = spawned[static_cast<size_t>(session - sessions.data())];
+					for (std::uint32_t j = 0; j < loot_count; ++j) {
+						model::Loot loot;
+						input_archive >> loot.type >> loot.score >> loot.position.x >> loot.position.y;
+						loots.push_back(loot);
+					}
+				}
+				app.ReplayTick(std::chrono::milliseconds(delta), std::move(spawned));
+				break;
+			}
+			default:
+				throw std::runtime_error("Unknown journal record type");
+			}
+		}
+
+		// Повторяет записи файла и возвращает их количество. Испорченный хвост отрезается
+		size_t ReplayFile(const std::filesystem::path& path, std::uint64_t generation, app::Application& app) {
+			size_t records = 0;
+			size_t valid_size = 0;
+			size_t file_size = 0;
+			{
+				state_file::MappedFile mapped_file(path);
+				const auto data = mapped_file.GetData();
+				file_size = data.size();
+
+				if (data.size() < journal_header_size
+					|| !std::equal(journal_signature.begin(), journal_signature.end(), data.begin())
+					|| state_file::detail::LoadLittleEndian<std::uint32_t>(data.data() + 8) != journal_version
+					|| state_file::detail::LoadLittleEndian<std::uint64_t>(data.data() + 16) != generation) {
+					std::cerr << "Journal error: " << path.string() << " is not a journal of generation " << generation << std::endl;
+					return 0;
+				}
+
+				size_t pos = journal_header_size;
+				while (data.size() - pos >= record_header_size) {
+					const auto length = state_file::detail::LoadLittleEndian<std::uint32_t>(data.data() + pos);
+					const auto checksum = state_file::detail::LoadLittleEndian<std::uint32_t>(data.data() + pos + 4);
+					if (data.size() - pos - record_header_size < length) {
+						break;
+					}
+					const auto payload = data.subspan(pos + record_header_size, length);
+					if (state_file::Checksum(payload) != checksum) {
+						break;
+					}
+					try {
+						ApplyRecord(payload, app);
+						++records;
+					}
+					catch (const std::exception& exc) {
+						std::cerr << "Journal replay error: " << exc.what() << std::endl;
+					}
+					catch (...) {
+						std::cerr << "Journal replay error: record at offset " << pos << " of " << path.string() << " is not applied" << std::endl;
+					}
+					pos += record_header_size + length;
+				}
+				valid_size = pos;
+			}
+
+			// Запись, оборванная сбоем, отрезается, чтобы за ней можно было дописывать
+			if (valid_size != file_size) {
+				std::cerr << "Journal error: " << path.string() << " is truncated at offset " << valid_size << std::endl;
+				std::filesystem::resize_file(path, valid_size);
+			}
+			return records;
+		}
+
+	}  // namespace
+
+	ActionJournal::ActionJournal(std::string state_file, std::uint64_t generation, std::chrono::milliseconds commit_period)
+		: state_file_(std::move(state_file))
+		, commit_period_(commit_period)
+		, current_{ generation }
+		, thread_([this] { Run(); }) {
+	}
+
+	ActionJournal::~ActionJournal() {
+		{
+			std::lock_guard lock(mutex_);
+			stop_ = true;
+		}
+		work_cv_.notify_one();
+		thread_.join();
+		CloseFile();
+	}
+
+	template <typename Encode>
+	void ActionJournal::Append(Encode&& encode) {
+		std::lock_guard lock(mutex_);
+		auto& data = current_.data;
+		const size_t record_pos = data.size();
+		data.resize(record_pos + record_header_size);
+
+		state_file::BinaryOutputArchive output_archive(data);
+		encode(output_archive);
+
+		const size_t payload_pos = record_pos + record_header_size;
+		const std::span<const char> payload(data.data() + payload_pos, data.size() - payload_pos);
+		state_file::detail::StoreLittleEndian(data.data() + record_pos, static_cast<std::uint32_t>(payload.size()));
+		state_file::detail::StoreLittleEndian(data.data() + record_pos + 4, state_file::Checksum(payload));
+		++current_.records;
+		++accepted_records_;
+	}
+
+	void ActionJournal::OnJoin(const model::Map::Id& map_id, model::DogRef dog, const app::Player& player) {
+		Append([&](state_file::BinaryOutputArchive& output_archive) {
+			output_archive << RecordType::JOIN << *map_id
+				<< serialization::PlayerRepr(&player, player.GetToken()) << serialization::DogRepr(dog);
+			});
+	}
+
+	void ActionJournal::OnPlayerAction(const app::Token& token, std::string_view move) {
+		Append([&](state_file::BinaryOutputArchive& output_archive) {
+			const auto token_chars = token.ToChars();
+			output_archive << RecordType::PLAYER_ACTION << std::string_view(token_chars.data(), token_chars.size()) << move;
+			});
+	}
+
+	void ActionJournal::OnTick(std::chrono::milliseconds delta,
+		const model::Game::GameSessions& sessions, const std::vector<model::Loots>& spawned) {
+		Append([&](state_file::BinaryOutputArchive& output_archive) {
+			const auto session_count = std::count_if(spawned.begin(), spawned.end(),
+				[](const model::Loots& loots) { return !loots.empty(); });
+			output_archive << RecordType::TICK << static_cast<std::int64_t>(delta.count())
+				<< static_cast<std::uint32_t>(session_count);
+
+			for (size_t i = 0; i < spawned.size() && i < sessions.size(); ++i) {
+				if (spawned[i].empty()) {
+					continue;
+				}
+				output_archive << *sessions[i].GetMap()->GetId() << static_cast<std::uint32_t>(spawned[i].size());
+				for (const auto& loot : spawned[i]) {
+					output_archive << loot.type << loot.score << loot.position.x << loot.position.y;
+				}
+			}
+			});
+	}
+
+	std::uint64_t ActionJournal::Rotate() {
+		std::lock_guard lock(mutex_);
+		const std::uint64_t generation = current_.generation + 1;
+		if (current_.records > 0) {
+			sealed_.push_back(std::move(current_));
+		}
+		current_ = Batch{ generation };
+		return generation;
+	}
+
+	void ActionJournal::Flush() {
+		std::unique_lock lock(mutex_);
+		const size_t target = accepted_records_;
+		const size_t failures = failures_;
+		flush_requested_ = true;
+		work_cv_.notify_one();
+		commit_cv_.wait(lock, [this, target, failures] { return committed_records_ >= target || failures_ != failures; });
+		if (committed_records_ < target) {
+			throw std::runtime_error("Journal records are not written to disk"s);
+		}
+	}
+
+	size_t ActionJournal::GetCommittedRecords() const {
+		std::lock_guard lock(mutex_);
+		return committed_records_;
+	}
+
+	size_t ActionJournal::GetCommits() const {
+		std::lock_guard lock(mutex_);
+		return commits_;
+	}
+
+	void ActionJournal::Run() {
+		std::unique_lock lock(mutex_);
+		while (true) {
+			work_cv_.wait_for(lock, commit_period_, [this] { return stop_ || flush_requested_; });
+			flush_requested_ = false;
+			const bool stop = stop_;
+
+			writing_.swap(sealed_);
+			if (current_.records > 0) {
+				const auto generation = current_.generation;
+				writing_.push_back(std::move(current_));
+				current_ = Batch{ generation };
+			}
+			lock.unlock();
+
+			// Все записи группы сбрасываются на диск одним fsync. Группы прежних поколений
+			// сбрасываются при переходе к следующему поколению
+			const bool has_records = !writing_.empty();
+			size_t synced = 0;
+			bool failed = false;
+			try {
+				for (size_t i = 0; i < writing_.size(); ++i) {
+					if (fd_ >= 0 && fd_generation_ != writing_[i].generation) {
+						SyncFile();
+						CloseFile();
+						synced = i;
+					}
+					WriteBatch(writing_[i]);
+				}
+				if (has_records) {
+					SyncFile();
+				}
+				synced = writing_.size();
+			}
+			catch (const std::exception& exc) {
+				std::cerr << "Journal error: " << exc.what() << std::endl;
+				RollBackFile();
+				failed = true;
+			}
+
+			size_t synced_records = 0;
+			for (size_t i = 0; i < synced; ++i) {
+				synced_records += writing_[i].records;
+			}
+
+			lock.lock();
+			// Несброшенные группы возвращаются в начало очереди, чтобы сохранить порядок записей
+			sealed_.insert(sealed_.begin(), std::make_move_iterator(writing_.begin() + synced), std::make_move_iterator(writing_.end()));
+			writing_.clear();
+			if (synced > 0) {
+				++commits_;
+			}
+			if (failed) {
+				++failures_;
+			}
+			committed_records_ += synced_records;
+			commit_cv_.notify_all();
+			if (stop) {
+				if (failed) {
+					std::cerr << "Journal error: " << accepted_records_ - committed_records_ << " records are not written" << std::endl;
+				}
+				return;
+			}
+		}
+	}
+
+	void ActionJournal::WriteBatch(const Batch& batch) {
+		if (fd_ < 0 || fd_generation_ != batch.generation) {
+			// Прежнее поколение сбрасывается на диск до перехода к следующему
+			SyncFile();
+			CloseFile();
+
+			const auto path = JournalPath(state_file_, batch.generation);
+			synced_size_ = 0;
+			written_size_ = 0;
+			fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+			if (fd_ < 0) {
+				throw std::system_error(errno, std::generic_category(), "Cannot open "s + path);
+			}
+			fd_generation_ = batch.generation;
+
+			struct stat file_stat {};
+			if (::fstat(fd_, &file_stat) != 0) {
+				throw std::system_error(errno, std::generic_category(), "Cannot stat "s + path);
+			}
+			synced_size_ = written_size_ = static_cast<std::uint64_t>(file_stat.st_size);
+			if (file_stat.st_size == 0) {
+				std::array<char, journal_header_size> header{};
+				std::copy(journal_signature.begin(), journal_signature.end(), header.begin());
+				state_file::detail::StoreLittleEndian(header.data() + 8, journal_version);
+				state_file::detail::StoreLittleEndian(header.data() + 16, batch.generation);
+				written_size_ = header.size();
+				state_file::WriteAll(fd_, std::string_view(header.data(), header.size()), path);
+				state_file::SyncDirectory(JournalDirectory(state_file_));
+			}
+		}
+		// Размер обновляется до записи: при ошибке отрезается и часть группы, которую write успел записать
+		written_size_ += batch.data.size();
+		state_file::WriteAll(fd_, batch.data, JournalPath(state_file_, batch.generation));
+	}
+
+	void ActionJournal::SyncFile() {
+		if (fd_ >= 0) {
+			if (::fdatasync(fd_) != 0) {
+				throw std::system_error(errno, std::generic_category(), "Cannot sync journal"s);
+			}
+			synced_size_ = written_size_;
+		}
+	}
+
+	void ActionJournal::RollBackFile() noexcept {
+		if (fd_ < 0) {
+			return;
+		}
+		// Без этого следующая группа дописывалась бы после оборванной записи, и при восстановлении
+		// отрезалась бы вместе с ней
+		if (::ftruncate(fd_, static_cast<off_t>(synced_size_)) != 0) {
+			std::cerr << "Journal error: cannot truncate " << JournalPath(state_file_, fd_generation_)
+				<< " to " << synced_size_ << " bytes" << std::endl;
+		}
+		CloseFile();
+	}
+
+	void ActionJournal::CloseFile() noexcept {
+		if (fd_ >= 0) {
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	JournalReplayResult ReplayJournal(const std::string& state_file, std::uint64_t first_generation, app::Application& app) {
+		JournalReplayResult result{ 0, first_generation };
+		for (const auto& [generation, path] : FindJournalFiles(state_file)) {
+			result.next_generation = std::max(result.next_generation, generation + 1);
+			if (generation < first_generation) {
+				std::error_code ec;
+				std::filesystem::remove(path, ec);
+				continue;
+			}
+			result.records += ReplayFile(path, generation, app);
+		}
+		return result;
+	}
+
+	void RemoveJournalBefore(const std::string& state_file, std::uint64_t generation) {
+		for (const auto& [file_generation, path] : FindJournalFiles(state_file)) {
+			if (file_generation < generation) {
+				std::error_code ec;
+				std::filesystem::remove(path, ec);
+			}
+		}
+	}
+
+}  // namespace infrastructure
@@ -0,0 +1,116 @@
+﻿#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "app.h"
+
+namespace infrastructure {
+
+	// Журнал действий, изменяющих состояние игры, для восстановления после сбоя.
+	//
+	// Журнал делится на поколения - файлы <state file>.journal.<N>. Снимок состояния помнит поколение,
+	// с которого начинаются не вошедшие в него действия, поэтому при старте после снимка
+	// повторяются только эти поколения, а после записи снимка прежние поколения удаляются.
+	//
+	// Файл поколения: сигнатура, версия, номер поколения, затем записи - длина uint32,
+	// CRC-32 uint32 и данные. Записи копятся в памяти и раз в commit_period записываются
+	// одной группой с одним fsync, поэтому при сбое теряется не больше одного периода.
+	// Если запись или fsync не удались, файл обрезается до последнего сброшенного на диск размера,
+	// а группа остается в очереди и записывается повторно в следующий период
+	class ActionJournal : public app::ActionJournal {
+	public:
+		ActionJournal(std::string state_file, std::uint64_t generation, std::chrono::milliseconds commit_period);
+
+		ActionJournal(const ActionJournal&) = delete;
+		ActionJournal& operator=(const ActionJournal&) = delete;
+
+		// Записывает накопленные записи и останавливает поток записи
+		~ActionJournal() override;
+
+		void OnJoin(const model::Map::Id& map_id, model::DogRef dog, const app::Player& player) override;
+
+		void OnPlayerAction(const app::Token& token, std::string_view move) override;
+
+		void OnTick(std::chrono::milliseconds delta,
+			const model::Game::GameSessions& sessions, const std::vector<model::Loots>& spawned) override;
+
+		// Начинает новое поколение и возвращает его номер. Принятые до вызова записи остаются в прежнем
+		std::uint64_t Rotate();
+
+		// Записывает на диск все принятые записи, не дожидаясь конца периода.
+		// Выбрасывает std::runtime_error, если записать их не удалось - они остаются в очереди
+		void Flush();
+
+		size_t GetCommittedRecords() const;
+
+		size_t GetCommits() const;
+
+	private:
+		// Записи одного поколения, ожидающие записи
+		struct Batch {
+			std::uint64_t generation = 0;
+			std::string data;
+			size_t records = 0;
+		};
+
+		// Кодирует запись в конец текущей группы. encode пишет данные записи в архив
+		template <typename Encode>
+		void Append(Encode&& encode);
+
+		void Run();
+
+		void WriteBatch(const Batch& batch);
+
+		void SyncFile();
+
+		// Отрезает от файла все, что не сброшено на диск, и закрывает его
+		void RollBackFile() noexcept;
+
+		void CloseFile() noexcept;
+
+	private:
+		const std::string state_file_;
+		const std::chrono::milliseconds commit_period_;
+
+		mutable std::mutex mutex_;
+		std::condition_variable work_cv_;
+		std::condition_variable commit_cv_;
+		Batch current_;
+		std::vector<Batch> sealed_;
+		size_t accepted_records_ = 0;
+		size_t committed_records_ = 0;
+		size_t commits_ = 0;
+		size_t failures_ = 0;
+		bool flush_requested_ = false;
+		bool stop_ = false;
+
+		// Используются только потоком записи
+		std::vector<Batch> writing_;
+		int fd_ = -1;
+		std::uint64_t fd_generation_ = 0;
+		// Размер файла после последнего fdatasync и после последней записи
+		std::uint64_t synced_size_ = 0;
+		std::uint64_t written_size_ = 0;
+
+		std::thread thread_;
+	};
+
+	struct JournalReplayResult {
+		size_t records = 0;
+		// Первое поколение, не занятое файлами журнала - с него продолжается запись
+		std::uint64_t next_generation = 0;
+	};
+
+	// Повторяет в app действия из поколений журнала начиная с first_generation.
+	// Испорченный хвост файла (оборванная при сбое запись) отрезается, файлы прежних поколений удаляются
+	JournalReplayResult ReplayJournal(const std::string& state_file, std::uint64_t first_generation, app::Application& app);
+
+	// Удаляет файлы поколений журнала до generation - их действия уже вошли в сохраненный снимок
+	void RemoveJournalBefore(const std::string& state_file, std::uint64_t generation);
+
+}  // namespace infrastructure
@@ -0,0 +1,31 @@
+﻿#include "alloc_counter.h"
+#include <cstdlib>
+#include <new>
+
+namespace alloc_counter {
+	namespace {
+		thread_local size_t thread_allocations = 0;
+	}  // namespace
+
+	size_t GetThreadAllocations() noexcept {
+		return thread_allocations;
+	}
+}  // namespace alloc_counter
+
+// Замена глобального operator new. Остальные формы new (nothrow, массивы)
+// в стандартной библиотеке выражены через него и тоже учитываются
+void* operator new(std::size_t size) {
+	++alloc_counter::thread_allocations;
+	if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
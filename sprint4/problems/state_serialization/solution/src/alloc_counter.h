@@ -0,0 +1,15 @@
+﻿#pragma once
+#include <cstddef>
+
+namespace alloc_counter {
+#ifdef ALLOC_COUNTER_DISABLED
+	// Сборка без alloc_counter.cpp: глобальный operator new не заменяется, выделения не считаются
+	inline size_t GetThreadAllocations() noexcept {
+		return 0;
+	}
+#else
+	// Количество вызовов глобального operator new в текущем потоке с момента его запуска.
+	// Разность значений до и после участка кода показывает, сколько раз он выделял память
+	size_t GetThreadAllocations() noexcept;
+#endif
+}  // namespace alloc_counter
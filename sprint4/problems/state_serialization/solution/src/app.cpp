@@ -3,6 +3,9 @@
 // boost.beast будет использовать std::string_view вместо boost::string_view
 #define BOOST_BEAST_USE_STD_STRING_VIEW
 #include "app.h"
+#include "alloc_counter.h"
+#include "state_writer.h"
+#include <latch>
 #include <random>
 
 
@@ -15,8 +18,10 @@ namespace app {
 	const double office_width = 0.5;
 	const double road_width = 0.4;
 	const double ms_per_second = 1000.;
+	// Префикс значения заголовка Authorization перед токеном
+	constexpr std::string_view bearer = "Bearer "sv;
 
-	static model::Loot CreateLoot(std::mt19937& gen, const model::ConstPtrRoad& road, int type, model::Map::LootsDescription& loots_desc) {
+	static model::Loot CreateLoot(std::mt19937& gen, const model::ConstPtrRoad& road, int type, const model::Map::LootsDescription& loots_desc) {
 		model::Loot new_loot;
 		new_loot.type = std::move(type);
 		new_loot.score = loots_desc[type]->value_;
@@ -34,11 +39,149 @@ namespace app {
 		return new_loot;
 	}
 
-	static collision_detector::Item CreateItem(const model::Point& position, double item_width) {
-		collision_detector::Item item;
-		item.position = geom::Point2D{ static_cast<double>(position.x),static_cast<double>(position.y) };
-		item.width = item_width;
-		return item;
+	static void AddItem(const model::Point& position, double item_width,
+		std::vector<double>& xs, std::vector<double>& ys, std::vector<double>& widths) {
+		xs.push_back(static_cast<double>(position.x));
+		ys.push_back(static_cast<double>(position.y));
+		widths.push_back(item_width);
+	}
+
+	// Рабочие буферы обновления сессии. У каждого потока свои, так как сессии обновляются параллельно
+	struct TickScratch {
+		std::vector<double> item_xs, item_ys, item_widths;
+		std::vector<double> start_xs, start_ys, end_xs, end_ys, gatherer_widths;
+		std::vector<size_t> gatherers;
+		std::vector<collision_detector::GatheringEvent> events;
+		std::vector<bool> collected;
+		std::vector<model::Loot::Id> extracted;
+
+		void Clear() noexcept {
+			item_xs.clear();
+			item_ys.clear();
+			item_widths.clear();
+			start_xs.clear();
+			start_ys.clear();
+			end_xs.clear();
+			end_ys.clear();
+			gatherer_widths.clear();
+			gatherers.clear();
+			events.clear();
+			extracted.clear();
+		}
+	};
+
+	static thread_local TickScratch tick_scratch;
+
+	enum class Axis {
+		X,
+		Y,
+	};
+
+	// Ядро перемещения собаки вдоль оси axis: sign > 0 - к большим координатам, sign < 0 - к меньшим.
+	// Возвращает новую координату, если собака сошла со своей дороги, и 0, если осталась на ней
+	template <Axis axis, int sign>
+	static double MoveDog(const model::RoadGraph& graph, model::DogRef dog, double new_pos, double w_road) {
+		using RoadInfo = model::RoadGraph::RoadInfo;
+		constexpr auto dir = axis == Axis::Y
+			? (sign > 0 ? model::Direction::DIR_SOUTH : model::Direction::DIR_NORTH)
+			: (sign > 0 ? model::Direction::DIR_EAST : model::Direction::DIR_WEST);
+
+		// Граница дороги по ходу движения
+		constexpr auto bound_of = [](const RoadInfo& road) {
+			if constexpr (axis == Axis::X) {
+				return sign > 0 ? road.max_x : road.min_x;
+			}
+			else {
+				return sign > 0 ? road.max_y : road.min_y;
+			}
+		};
+		constexpr auto beyond = [](double pos, double bound) {
+			return sign > 0 ? pos > bound : pos < bound;
+		};
+		const auto move_to = [&dog](double pos) {
+			const auto& cur = dog.GetPosition();
+			dog.SetPosition(axis == Axis::X ? geom::Point2D(pos, cur.y) : geom::Point2D(cur.x, pos));
+		};
+
+		const size_t road_index = dog.GetRoadIndex();
+		const auto& curr_road = graph.GetRoad(road_index);
+		int bound = bound_of(curr_road);
+
+		if (!beyond(new_pos, bound + sign * w_road)) {
+			move_to(new_pos);
+			return 0.;
+		}
+
+		size_t road = model::RoadGraph::npos;
+		// Сойти с поперечной дороги можно только в её концах
+		if (axis == Axis::Y ? curr_road.horizontal : curr_road.vertical) {
+			const double cross_pos = axis == Axis::Y ? dog.GetPosition().x : dog.GetPosition().y;
+			const int start = axis == Axis::Y ? curr_road.start.x : curr_road.start.y;
+			const int end = axis == Axis::Y ? curr_road.end.x : curr_road.end.y;
+
+			if (cross_pos >= start - w_road && cross_pos <= start + w_road) {
+				road = graph.FindJunction(road_index, start, dir);
+			}
+			else if (cross_pos >= end - w_road && cross_pos <= end + w_road) {
+				road = graph.FindJunction(road_index, end, dir);
+			}
+		}
+		else {
+			road = graph.FindJunction(road_index, bound, dir);
+		}
+
+		while (road != model::RoadGraph::npos && beyond(new_pos, bound = bound_of(graph.GetRoad(road)))) {
+			road = graph.FindJunction(road, bound, dir);
+		}
+
+		if (road != model::RoadGraph::npos) {
+			dog.SetRoadIndex(road);
+			move_to(new_pos);
+			return new_pos;
+		}
+		dog.SetSpeed(geom::Vec2D{ 0, 0 });
+		move_to(bound + sign * w_road);
+		return bound + sign * w_road;
+	}
+
+	// Перемещает всех собак сессии за время time. Собаки, сошедшие со своей дороги,
+	// попадают в список собирателей вместе с начальной и конечной позицией
+	static void MoveDogs(model::GameSession& session, double time, TickScratch& scratch) {
+		const auto& graph = session.GetMap()->GetRoadGraph();
+
+		for (size_t i = 0; i < session.GetDogCount(); ++i) {
+			auto dog = session.GetDog(i);
+			const auto start_pos = dog.GetPosition();
+			const auto& speed = dog.GetSpeed();
+			const double new_x = start_pos.x + (speed.x * time / ms_per_second);
+			const double new_y = start_pos.y + (speed.y * time / ms_per_second);
+
+			double distance = 0.;
+			switch (dog.GetDirection()) {
+			case model::Direction::DIR_NORTH:
+				distance = speed.y != 0 ? MoveDog<Axis::Y, -1>(graph, dog, new_y, road_width) : 0.;
+				break;
+			case model::Direction::DIR_SOUTH:
+				distance = speed.y != 0 ? MoveDog<Axis::Y, 1>(graph, dog, new_y, road_width) : 0.;
+				break;
+			case model::Direction::DIR_WEST:
+				distance = speed.x != 0 ? MoveDog<Axis::X, -1>(graph, dog, new_x, road_width) : 0.;
+				break;
+			case model::Direction::DIR_EAST:
+				distance = speed.x != 0 ? MoveDog<Axis::X, 1>(graph, dog, new_x, road_width) : 0.;
+				break;
+			}
+
+			if (distance != 0.) {
+				const auto& end_pos = dog.GetPosition();
+				scratch.start_xs.push_back(start_pos.x);
+				scratch.start_ys.push_back(start_pos.y);
+				scratch.end_xs.push_back(end_pos.x);
+				scratch.end_ys.push_back(end_pos.y);
+				scratch.gatherer_widths.push_back(gatherer_width / 2.);
+				scratch.gatherers.push_back(i);
+			}
+		}
 	}
 
 	const Player::Id& Player::GetId() const noexcept {
@@ -49,27 +192,30 @@ namespace app {
 		return game_session_;
 	}
 
-	std::shared_ptr<model::Dog> Player::GetDogName() const {
-		if (!dog_) {
-			throw std::invalid_argument("Invalid ptr dog_ = nullptr");
+	model::DogRef Player::GetDog() const {
+		if (!game_session_) {
+			throw std::invalid_argument("Invalid ptr game_session_ = nullptr");
 		}
-		return dog_;
+		if (auto dog = game_session_->FindDog(dog_id_); dog) {
+			return *dog;
+		}
+		throw std::invalid_argument("Dog with id " + std::to_string(*dog_id_) + " not found");
 	}
 
-	const geom::Vec2D& Player::GetSpeed() const noexcept {
-		return dog_->GetSpeed();
+	const geom::Vec2D& Player::GetSpeed() const {
+		return GetDog().GetSpeed();
 	}
 
 	void Player::SetSpeed(geom::Vec2D speed) {
-		dog_->SetSpeed(std::move(speed));
+		GetDog().SetSpeed(std::move(speed));
 	}
 
 	void Player::SetDir(model::Direction dir) {
-		dog_->SetDirection(std::move(dir));
+		GetDog().SetDirection(std::move(dir));
 	}
 
-	model::Direction Player::GetDir() const noexcept {
-		return dog_->GetDirection();
+	model::Direction Player::GetDir() const {
+		return GetDog().GetDirection();
 	}
 
 	void Player::SetToken(Token token) {
@@ -79,40 +225,78 @@ namespace app {
 		return token_;
 	}
 
-	Player& Players::Add(std::shared_ptr<model::Dog> dog, model::GameSession* game_session) {
+	Player& Players::Add(model::DogRef dog, model::GameSession* game_session) {
 		if (!game_session) {
 			throw std::invalid_argument("Invalid ptr game_session = nullptr");
 		}
 
-		auto key = std::pair{ dog->GetName(), *(game_session->GetMap()->GetId()) };
-		players_.emplace(key, std::move(Player(Player::Id(*dog->GetId()), game_session, dog)));
+		auto key = std::pair{ dog.GetName(), *(game_session->GetMap()->GetId()) };
+		std::lock_guard lock(mutex_);
+		players_.emplace(key, std::move(Player(Player::Id(*dog.GetId()), game_session, dog.GetId())));
 		return players_[key];
 	};
 
+	std::vector<const Player*> Players::Add(model::GameSession* game_session, size_t first_dog, std::span<const Token> tokens) {
+		if (!game_session) {
+			throw std::invalid_argument("Invalid ptr game_session = nullptr");
+		}
+
+		const auto& map_id = *game_session->GetMap()->GetId();
+		std::vector<const Player*> added;
+		added.reserve(tokens.size());
+
+		std::lock_guard lock(mutex_);
+		players_.reserve(players_.size() + tokens.size());
+		for (size_t i = 0; i < tokens.size(); ++i) {
+			const auto dog = game_session->GetDog(first_dog + i);
+			auto [it, inserted] = players_.try_emplace(std::pair{ dog.GetName(), map_id },
+				Player(Player::Id(*dog.GetId()), game_session, dog.GetId()));
+			it->second.SetToken(tokens[i]);
+			added.push_back(&it->second);
+		}
+		return added;
+	}
+
 	const Player* Players::FindByDogIdAndMapId(const std::string& name, model::Map::Id map_id) {
+		std::lock_guard lock(mutex_);
 		if (auto it_player = players_.find(std::pair{ name, *map_id }); it_player != players_.end()) {
 			return &it_player->second;
 		}
 		return nullptr;
 	}
 
-	std::shared_ptr<Player> PlayerTokens::FindPlayerByToken(Token token) {
-		if (token_to_player_.count(token)) {
-			return token_to_player_[token];
+	std::shared_ptr<Player> PlayerTokens::FindPlayerByToken(const Token& token) const {
+		std::shared_lock lock(mutex_);
+		if (const auto* player = token_to_player_.Find(token); player) {
+			return *player;
 		}
 		return nullptr;
 	}
 
 	Token  PlayerTokens::FindTokenByPlayer(const Player* player) const {
-		auto it = std::find_if(token_to_player_.begin(), token_to_player_.end(), [&](const auto& pair) {
-			return pair.second.get() == player;
-			});
-		if (it != token_to_player_.end()) {
-			return it->first;
+		if (player) {
+			std::shared_lock lock(mutex_);
+			if (auto it = player_to_token_.find(PlayerKey{ player->GetGameSession(), *player->GetId() }); it != player_to_token_.end()) {
+				return it->second;
+			}
 		}
 		throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND);
 	}
 
+	void PlayerTokens::AddTokens(std::span<const Player* const> players) {
+		std::lock_guard lock(mutex_);
+		token_to_player_.Reserve(token_to_player_.Size() + players.size());
+		player_to_token_.reserve(player_to_token_.size() + players.size());
+		for (const Player* player : players) {
+			Insert(player->GetToken(), std::make_shared<Player>(*player));
+		}
+	}
+
+	void PlayerTokens::Insert(const Token& token, std::shared_ptr<Player> player) {
+		player_to_token_[PlayerKey{ player->GetGameSession(), *player->GetId() }] = token;
+		token_to_player_.InsertOrAssign(token, std::move(player));
+	}
+
 	Token GameResult::GetPlayerTokens() const noexcept {
 		return token_;
 	}
@@ -151,15 +335,14 @@ namespace app {
 		throw GameError(JoinGameErrorReason::INVALIDE_MAP);
 	}
 
-	void JoinGameUseCase::JoinGame(std::shared_ptr<model::Dog> dog, model::GameSession* game_session, Token token) {
-		if (!dog) {
-			throw std::invalid_argument("Invalid ptr dog = nullptr");
-		}
+	void JoinGameUseCase::JoinGame(model::DogRef dog, model::GameSession* game_session, Token token) {
 		if (!game_session) {
 			throw std::invalid_argument("Invalid ptr game_session = nullptr");
 		}
 
 		auto& player = players_->Add(dog, game_session);
+		// Токен нужен и в списке игроков: по нему сохраняется состояние
+		player.SetToken(token);
 
 		if (!player_tokens_) {
 			throw std::invalid_argument("Invalid ptr player_tokens_ = nullptr");
@@ -168,30 +351,53 @@ namespace app {
 		player_tokens_->AddToken(token, player);
 	}
 
+	void JoinGameUseCase::RestorePlayers(model::GameSession* game_session, std::span<const std::pair<model::Dog, Token>> dogs) {
+		if (!game_session) {
+			throw std::invalid_argument("Invalid ptr game_session = nullptr");
+		}
+		if (!players_ || !player_tokens_) {
+			throw std::invalid_argument("Invalid ptr players_ or player_tokens_ = nullptr");
+		}
+
+		const size_t first_dog = game_session->GetDogCount();
+		game_session->ReserveDogs(first_dog + dogs.size());
+		std::vector<Token> tokens;
+		tokens.reserve(dogs.size());
+		for (const auto& [dog, token] : dogs) {
+			game_session->AddDog(dog);
+			tokens.push_back(token);
+		}
+
+		const auto added = players_->Add(game_session, first_dog, tokens);
+		player_tokens_->AddTokens(added);
+	}
+
 	std::shared_ptr<Players> JoinGameUseCase::GetListPlayersUseCase() const noexcept {
 		return players_;
 	}
 
 	Token Authorization::TryExtractToken(std::string_view authorization_body) {
-		std::string bearer;
-		std::string token;
-
-		if (authorization_body.empty()) {
+		if (!authorization_body.starts_with(bearer)) {
 			throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_INVALIDE_TOKEN);
 		}
 
-		auto pos = authorization_body.find(' ');
-		if (pos == std::string::npos) {
+		const auto token = authorization_body.substr(bearer.size());
+		if (token.length() != Token::hex_length) {
 			throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_INVALIDE_TOKEN);
 		}
+		if (auto parsed = Token::Parse(token); parsed) {
+			return *parsed;
+		}
+		// Строка нужной длины, но не из шестнадцатеричных цифр: такой токен не выдавался
+		throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND);
+	}
 
-		bearer = authorization_body.substr(0, pos);
-		token = authorization_body.substr(pos + 1);
-
-		if (bearer.empty() || token.empty() || bearer != "Bearer" || token.length() != 32) {
-			throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_INVALIDE_TOKEN);
+	std::shared_ptr<Player> Authorization::FindPlayer(std::string_view authorization_body) const {
+		if (!authorization_body.starts_with(bearer)) {
+			return nullptr;
 		}
-		return Token(token);
+		const auto token = Token::Parse(authorization_body.substr(bearer.size()));
+		return token ? player_tokens_->FindPlayerByToken(*token) : nullptr;
 	}
 
 	Token Authorization::FindTokenByPlayer(const Player* player) const {
@@ -214,8 +420,17 @@ namespace app {
 	}
 
 	GameResult Application::JoinGame(const std::string& map_id, const std::string& name) {
+		std::shared_lock lock(state_mutex_);
 		try {
-			return join_game_use_case_.JoinGame(map_id, name);
+			auto result = join_game_use_case_.JoinGame(map_id, name);
+			if (auto session = game_->FindGameSessions(model::Map::Id(map_id))) {
+				session->ResetStateSnapshot();
+				if (journal_) {
+					const auto player = FindPlayerByToken(result.GetPlayerTokens());
+					journal_->OnJoin(session->GetMap()->GetId(), player->GetDog(), *player);
+				}
+			}
+			return result;
 		}
 		catch (app::GameError<app::JoinGameErrorReason> err) {
 
@@ -231,15 +446,29 @@ namespace app {
 		}
 	}
 
-	void Application::JoinGame(std::shared_ptr<model::Dog> dog, model::GameSession* game_session, Token token) {
+	void Application::JoinGame(model::DogRef dog, model::GameSession* game_session, Token token) {
 		join_game_use_case_.JoinGame(dog, game_session, token);
+		game_session->ResetStateSnapshot();
+	}
+
+	void Application::RestorePlayers(model::GameSession& game_session, std::span<const std::pair<model::Dog, Token>> dogs) {
+		std::shared_lock lock(state_mutex_);
+		join_game_use_case_.RestorePlayers(&game_session, dogs);
+		game_session.ResetStateSnapshot();
 	}
 
 	void Application::Tick(std::chrono::milliseconds delta) {
+		std::unique_lock lock(state_mutex_);
 		UpdateGameState(delta);
-		if (listener_) {
+		// Тик попадает в журнал раньше, чем слушатели снимут копию состояния с его результатом
+		if (journal_) {
+			journal_->OnTick(delta, game_->GetGameSessions(), tick_loots_);
+		}
+		if (!listeners_.empty()) {
 			auto now = std::chrono::system_clock::now();
-			listener_->OnTick(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()));
+			for (const auto& listener : listeners_) {
+				listener->OnTick(std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()));
+			}
 		}
 	}
 
@@ -247,16 +476,23 @@ namespace app {
 		return join_game_use_case_.GetListPlayersUseCase();
 	}
 
+	const model::Map::Id* Application::FindSessionMapId(std::string_view authorization_body) noexcept {
+		// Сессии и карты живут до конца игры, поэтому указатель на id остается действительным
+		auto* session = FindPlayerSession(authorization_body);
+		return session ? &session->GetMap()->GetId() : nullptr;
+	}
+
 	std::string Application::GetPlayers(std::string_view authorization_body) {
+		std::shared_lock lock(state_mutex_);
 		try {
 			auto token = TryExtractToken(authorization_body);
 			auto player = FindPlayerByToken(token);
 			auto game_session = player->GetGameSession();
-			auto dogs = game_session->GetDogs();
 
 			json::object obj;
-			for (const auto& dog : dogs) {
-				obj[std::to_string(*(dog.second->GetId()))] = json::value{ {key_name, dog.second->GetName()} };
+			for (size_t i = 0; i < game_session->GetDogCount(); ++i) {
+				const auto dog = game_session->GetDog(i);
+				obj[std::to_string(*(dog.GetId()))] = json::value{ {key_name, dog.GetName()} };
 			}
 			return json::serialize(obj);
 		}
@@ -272,69 +508,39 @@ namespace app {
 	}
 
 	std::string Application::GetGameState(std::string_view authorization_body) {
+		std::shared_lock lock(state_mutex_);
 		try {
 			auto token = TryExtractToken(authorization_body);
 			auto player = FindPlayerByToken(token);
 			auto game_session = player->GetGameSession();
-			auto dogs = game_session->GetDogs();
-			json::object obj;
-			obj[key_players] = json::object();
-			obj[key_lost_objects] = json::object();
-
-			for (const auto& dog : dogs) {
-				json::object player;
-				std::string dir;
-				switch (dog.second->GetDirection()) {
-				case model::Direction::DIR_NORTH:
-					dir = "U"s;
-					break;
-				case model::Direction::DIR_SOUTH:
-					dir = "D"s;
-					break;
-				case model::Direction::DIR_EAST:
-					dir = "R"s;
-					break;
-				case model::Direction::DIR_WEST:
-					dir = "L"s;
-					break;
-				}
-
-				json::array arr_pos;
-				arr_pos.push_back(dog.second->GetPosition().x);
-				arr_pos.push_back(dog.second->GetPosition().y);
 
-				json::array arr_speed;
-				arr_speed.push_back(dog.second->GetSpeed().x);
-				arr_speed.push_back(dog.second->GetSpeed().y);
-				auto dog_id = std::to_string(*(dog.second->GetId()));
-
-				json::array bag;
-				auto bag_content = dog.second->GetBagContent();
-				for (auto& item : bag_content) {
-					bag.push_back(json::object{ {key_id, *item.id}, {key_type, item.type} });
-				}
-
-				obj[key_players].as_object()[dog_id] =
-					json::object{ {key_pos, arr_pos},
-									{key_speed, arr_speed},
-									{key_dir, dir},
-									{key_bag, bag},
-									{key_score, dog.second->GetScore()} };
+			auto snapshot = game_session->GetStateSnapshot();
+			if (!snapshot) {
+				snapshot = PublishStateSnapshot(*game_session);
 			}
+			return *snapshot;
+		}
+		catch (app::GameError<app::AuthorizationGameErrorReason> err) {
+			if (err.GetErrorReason() == AUTHORIZATION_INVALIDE_TOKEN) {
+				throw GameError(AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ);
+			}
+			throw err;
+		}
+		catch (...) {
+			throw GameError(ErrorReason::FAILED_PARSE_JSON);
+		}
+	}
 
-			const auto map = game_session->GetMap();
-			auto loots = map->GetLoots();
-
-			if (loots.size() > 0) {
+	std::string Application::GetStateChanges(std::string_view authorization_body, std::optional<std::uint64_t> since) {
+		std::shared_lock lock(state_mutex_);
+		try {
+			auto token = TryExtractToken(authorization_body);
+			auto player = FindPlayerByToken(token);
 
-				json::object pos;
-				for (int i = 0; i < loots.size(); ++i) {
-					obj[key_lost_objects].as_object()[std::to_string(*(loots[i].id))] =
-						json::object({ {key_type, loots[i].type},
-							{key_pos, json::array{ static_cast<double>(loots[i].position.x), static_cast<double>(loots[i].position.y)}} });
-				}
-			}
-			return json::serialize(obj);
+			static thread_local state_writer::ChangesScratch scratch;
+			std::string result;
+			state_writer::WriteStateChanges(*player->GetGameSession(), since, result, scratch);
+			return result;
 		}
 		catch (app::GameError<app::AuthorizationGameErrorReason> err) {
 			if (err.GetErrorReason() == AUTHORIZATION_INVALIDE_TOKEN) {
@@ -347,35 +553,24 @@ namespace app {
 		}
 	}
 
-	std::string Application::SetPlayerAction(std::string_view authorization_body, const std::string& base_body) {
+	model::StateSnapshot::Ptr Application::FindStateSnapshot(std::string_view authorization_body) noexcept {
+		// Сессии создаются при загрузке игры, поэтому указатель игрока на сессию остается действительным
+		auto player = FindPlayer(authorization_body);
+		return player ? player->GetGameSession()->GetStateSnapshot() : nullptr;
+	}
+
+	std::string Application::SetPlayerAction(std::string_view authorization_body, std::string_view base_body) {
+		std::shared_lock lock(state_mutex_);
 		try {
 			auto token = TryExtractToken(authorization_body);
 			auto player = FindPlayerByToken(token);
 			auto json_obj = json::parse(base_body).as_object();
-			auto dir = json_obj.at(key_move).as_string().c_str();
-			auto speed = player->GetGameSession()->GetMap()->GetSpeed();
+			const auto& move = json_obj.at(key_move).as_string();
+			const std::string_view dir(move.data(), move.size());
 
-			if (std::strcmp(dir, "") == 0) {
-				player->SetSpeed(geom::Vec2D{ 0,0 });
-			}
-			else if (std::strcmp(dir, "L") == 0) {
-				player->SetSpeed(geom::Vec2D{ -speed,0 });
-				player->SetDir(model::Direction::DIR_WEST);
-			}
-			else if (std::strcmp(dir, "R") == 0) {
-				player->SetSpeed(geom::Vec2D{ speed, 0 });
-				player->SetDir(model::Direction::DIR_EAST);
-			}
-			else if (std::strcmp(dir, "U") == 0) {
-				player->SetSpeed(geom::Vec2D{ 0,-speed });
-				player->SetDir(model::Direction::DIR_NORTH);
-			}
-			else if (std::strcmp(dir, "D") == 0) {
-				player->SetSpeed(geom::Vec2D{ 0,speed });
-				player->SetDir(model::Direction::DIR_SOUTH);
-			}
-			else {
-				throw GameError(ActionGameErrorReason::FAILED_PARSE_ACTION);
+			ApplyMove(*player, dir);
+			if (journal_) {
+				journal_->OnPlayerAction(token, dir);
 			}
 			return json::serialize(json::object());
 		}
@@ -390,7 +585,40 @@ namespace app {
 		}
 	}
 
-	std::string Application::SetTimeDelta(const std::string& base_body) {
+	void Application::ApplyPlayerAction(const Token& token, std::string_view move) {
+		std::shared_lock lock(state_mutex_);
+		ApplyMove(*FindPlayerByToken(token), move);
+	}
+
+	void Application::ApplyMove(Player& player, std::string_view move) {
+		auto speed = player.GetGameSession()->GetMap()->GetSpeed();
+
+		if (move == ""sv) {
+			player.SetSpeed(geom::Vec2D{ 0,0 });
+		}
+		else if (move == "L"sv) {
+			player.SetSpeed(geom::Vec2D{ -speed,0 });
+			player.SetDir(model::Direction::DIR_WEST);
+		}
+		else if (move == "R"sv) {
+			player.SetSpeed(geom::Vec2D{ speed, 0 });
+			player.SetDir(model::Direction::DIR_EAST);
+		}
+		else if (move == "U"sv) {
+			player.SetSpeed(geom::Vec2D{ 0,-speed });
+			player.SetDir(model::Direction::DIR_NORTH);
+		}
+		else if (move == "D"sv) {
+			player.SetSpeed(geom::Vec2D{ 0,speed });
+			player.SetDir(model::Direction::DIR_SOUTH);
+		}
+		else {
+			throw GameError(ActionGameErrorReason::FAILED_PARSE_ACTION);
+		}
+		player.GetGameSession()->ResetStateSnapshot();
+	}
+
+	std::string Application::SetTimeDelta(std::string_view base_body) {
 		try {
 			auto json_obj = json::parse(base_body).as_object();
 			std::chrono::milliseconds time(json_obj.at(key_time_delta).as_int64());
@@ -403,115 +631,77 @@ namespace app {
 		}
 	}
 
-	void Application::SetApplicationListener(std::shared_ptr<ApplicationListener> listener) {
-		listener_ = listener;
+	void Application::AddApplicationListener(std::shared_ptr<ApplicationListener> listener) {
+		if (!listener) {
+			throw std::invalid_argument("Invalid ptr listener = nullptr"s);
+		}
+		listeners_.push_back(std::move(listener));
 	}
 
-	void Application::UpdateGameState(std::chrono::milliseconds delta) {
-		try {
-			auto time = delta.count();
-			if (time <= 0) {
-				throw GameError(ErrorReason::FAILED_PARSE_JSON);;
-			}
-
-			auto maps = game_->GetMaps();
-			auto loot_generator = game_->GetLootGenerator();
+	model::GameSession* Application::FindPlayerSession(std::string_view authorization_body) noexcept {
+		auto player = FindPlayer(authorization_body);
+		return player ? player->GetGameSession() : nullptr;
+	}
 
-			for (auto map : maps) {
-				if (auto* session = game_->FindGameSessions(map->GetId()); session) {
-					auto dogs = session->GetDogs();
+	void Application::SetActionJournal(std::shared_ptr<ActionJournal> journal) noexcept {
+		journal_ = std::move(journal);
+	}
 
-					if (!loot_generator) {
-						throw std::invalid_argument("Invalid ptr loot_generator = nullptr");;
-					}
+	void Application::SetTickThreads(unsigned num_threads) {
+		tick_pool_.reset();
+		if (num_threads > 1) {
+			tick_pool_ = std::make_unique<net::thread_pool>(num_threads);
+		}
+	}
 
-					auto count = loot_generator->Generate(delta, map->GetLootCount(), dogs.size());
+	void Application::UpdateGameState(std::chrono::milliseconds delta) {
+		UpdateSessions(delta, false);
+	}
 
-					auto roads = session->GetMap()->GetRoads();
-					std::random_device rd;
-					std::mt19937 gen(rd());
-					auto loot_desc = map->GetDescription();
+	void Application::ReplayTick(std::chrono::milliseconds delta, std::vector<model::Loots> spawned) {
+		std::unique_lock lock(state_mutex_);
+		spawned.resize(game_->GetGameSessions().size());
+		tick_loots_ = std::move(spawned);
+		UpdateSessions(delta, true);
+	}
 
-					for (auto i = 0; i < count; ++i) {
-						auto index = std::rand() % roads.size();
-						map->AddLoot(CreateLoot(gen, roads[index], i % loot_desc.size(), loot_desc));
-					}
+	void Application::UpdateSessions(std::chrono::milliseconds delta, bool replay) {
+		try {
+			if (delta.count() <= 0) {
+				throw GameError(ErrorReason::FAILED_PARSE_JSON);;
+			}
 
-					auto loots = map->GetLoots();
+			last_tick_allocations_ = 0;
 
-					std::vector<collision_detector::Item> items;
-					for (const auto& loot : loots) {
-						items.emplace_back(CreateItem(loot.position, item_width));
-					}
+			auto& sessions = game_->GetGameSessions();
+			tick_loots_.resize(sessions.size());
+			if (!tick_pool_ || sessions.size() < 2) {
+				for (size_t i = 0; i < sessions.size(); ++i) {
+					UpdateSession(sessions[i], delta, tick_loots_[i], replay);
+				}
+				return;
+			}
 
-					auto offices = map->GetOffices();
-					for (const auto& office : offices) {
-						items.emplace_back(CreateItem(office.GetPosition(), item_width));
+			// Сессии не разделяют изменяемого состояния, поэтому обновляются независимо.
+			// Дожидаемся всех сессий до выхода, чтобы OnTick видел согласованное состояние
+			tick_errors_.assign(sessions.size(), nullptr);
+			std::latch done(static_cast<std::ptrdiff_t>(sessions.size()));
+			for (size_t i = 0; i < sessions.size(); ++i) {
+				net::post(*tick_pool_, [this, &sessions, &done, i, delta, replay] {
+					try {
+						UpdateSession(sessions[i], delta, tick_loots_[i], replay);
 					}
-
-					std::vector<collision_detector::Gatherer> gatherers;
-					std::vector<std::shared_ptr<model::Dog>> temp_list_dogs;
-
-					for (const auto& dog : dogs) {
-						auto dog_ = dog.second;
-
-						auto roads = map->GetRoadmap();
-						auto new_x = dog_->GetPosition().x + (dog_->GetSpeed().x * time / ms_per_second);
-						auto new_y = dog_->GetPosition().y + (dog_->GetSpeed().y * time / ms_per_second);
-
-						auto cur_dir = dog_->GetDirection();
-						double w_road = road_width;
-						double distance = 0.;
-
-						auto start_pos = dog_->GetPosition();
-
-						switch (cur_dir) {
-						case model::Direction::DIR_NORTH:
-							if (dog_->GetSpeed().y != 0) {
-								distance = GoToNorth(roads, dog_, new_y, w_road);
-							}
-							break;
-						case model::Direction::DIR_SOUTH:
-							if (dog_->GetSpeed().y != 0) {
-								distance = GoToSouth(roads, dog_, new_y, w_road);
-							}
-							break;
-						case model::Direction::DIR_WEST:
-							if (dog_->GetSpeed().x != 0) {
-								distance = GoToWest(roads, dog_, new_x, w_road);
-							}
-							break;
-						case model::Direction::DIR_EAST:
-							if (dog_->GetSpeed().x != 0) {
-								distance = GoToEast(roads, dog_, new_x, w_road);
-							}
-							break;
-						}
-
-						auto end_pos = dog_->GetPosition();
-
-						if (distance != 0.) {
-							gatherers.emplace_back(start_pos, end_pos, gatherer_width / 2.);
-							temp_list_dogs.push_back(dog_);
-						}
+					catch (...) {
+						tick_errors_[i] = std::current_exception();
 					}
+					done.count_down();
+					});
+			}
+			done.wait();
 
-					GathererProvider provider(items, gatherers);
-					std::set<size_t> set_item_id;
-
-					if (auto events = collision_detector::FindGatherEvents(provider); !events.empty()) {
-						for (const auto& event : events) {
-
-							if (event.item_id < loots.size() && set_item_id.count(event.item_id) && !temp_list_dogs[event.gatherer_id]->IsBagFull()) {
-								temp_list_dogs[event.gatherer_id]->PutItemIntoBag(loots[event.item_id]);
-								set_item_id.insert(event.item_id);
-								map->ExtractLoot(loots[event.item_id].id);
-							}
-							else {
-								temp_list_dogs[event.gatherer_id]->CalcScoreAndEraseBag();
-							}
-						}
-					}
+			for (const auto& error : tick_errors_) {
+				if (error) {
+					std::rethrow_exception(error);
 				}
 			}
 		}
@@ -520,177 +710,109 @@ namespace app {
 		}
 	}
 
-	const std::shared_ptr<model::Game> Application::GetGame() {
-		return game_;
+	size_t Application::GetLastTickAllocations() const noexcept {
+		return last_tick_allocations_;
 	}
 
-	double Application::GoToSouth(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road) {
-		double res = 0.;
-		auto curr_road = dog->GetCurrentRoad();
-		auto cur_dog_pos = dog->GetPosition();
-		int max_pos = std::max(curr_road->GetStart().y, curr_road->GetEnd().y);
+	void Application::UpdateSession(model::GameSession& session, std::chrono::milliseconds delta, model::Loots& spawned, bool replay) {
+		const size_t allocations_before = alloc_counter::GetThreadAllocations();
 
-		if (new_pos <= max_pos + w_road) {
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, new_pos));
-			return res;
-		}
+		auto time = delta.count();
+		const auto& map = session.GetMap();
 
-		model::Map::Roadmap::iterator road;
-		if (curr_road->IsHorizontal()) {
-			if (cur_dog_pos.x >= curr_road->GetStart().x - w_road && cur_dog_pos.x <= curr_road->GetStart().x + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetStart(), model::Direction::DIR_SOUTH });
-			}
-			else if (cur_dog_pos.x >= curr_road->GetEnd().x - w_road && cur_dog_pos.x <= curr_road->GetEnd().x + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetEnd(), model::Direction::DIR_SOUTH });
+		if (replay) {
+			// Положение трофеев случайно, поэтому при повторе берется из журнала
+			for (const auto& loot : spawned) {
+				map->AddLoot(loot);
 			}
 		}
 		else {
-			road = roadmap.find(std::pair{ model::Point{curr_road->GetEnd().x, max_pos}, model::Direction::DIR_SOUTH });
-		}
+			auto* loot_generator = session.GetLootGenerator();
 
-		while (road != roadmap.end() && new_pos > (max_pos = std::max(road->second->GetStart().y, road->second->GetEnd().y))) {
-			road = roadmap.find(std::pair{ model::Point{curr_road->GetEnd().x, max_pos}, model::Direction::DIR_SOUTH });
-		}
+			if (!loot_generator) {
+				throw std::invalid_argument("Invalid ptr loot_generator = nullptr");;
+			}
 
-		if (road != roadmap.end()) {
-			dog->SetNewRoad(road->second);
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, new_pos));
-			res = new_pos;
-		}
-		else {
-			dog->SetSpeed(geom::Vec2D{ 0, 0 });
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, max_pos + w_road));
-			res = max_pos + w_road;
-		}
-		return res;
-	}
+			auto count = loot_generator->Generate(delta, map->GetLootCount(), session.GetDogCount());
 
-	double Application::GoToNorth(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road) {
-		double res = 0.;
-		auto curr_road = dog->GetCurrentRoad();
-		auto cur_dog_pos = dog->GetPosition();
-		int min_pos = std::min(curr_road->GetStart().y, curr_road->GetEnd().y);
+			const auto& roads = map->GetRoads();
+			auto& gen = session.GetRandomGenerator();
+			const auto& loot_desc = map->GetDescription();
 
-		if (new_pos >= min_pos - w_road) {
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, new_pos));
-			return res;
+			spawned.clear();
+			for (auto i = 0; i < count; ++i) {
+				std::uniform_int_distribution<size_t> road_dis(0, roads.size() - 1);
+				auto loot = CreateLoot(gen, roads[road_dis(gen)], i % loot_desc.size(), loot_desc);
+				if (journal_) {
+					spawned.push_back(loot);
+				}
+				map->AddLoot(std::move(loot));
+			}
 		}
 
-		model::Map::Roadmap::iterator road;
-		if (curr_road->IsHorizontal()) {
-			if (cur_dog_pos.x >= curr_road->GetStart().x - w_road && cur_dog_pos.x <= curr_road->GetStart().x + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetStart(), model::Direction::DIR_NORTH });
+		const auto loots = map->GetLoots();
 
-			}
-			else if (cur_dog_pos.x >= curr_road->GetEnd().x - w_road && cur_dog_pos.x <= curr_road->GetEnd().x + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetEnd(), model::Direction::DIR_NORTH });
-			}
-		}
-		else {
-			road = roadmap.find(std::pair{ model::Point{curr_road->GetEnd().x, min_pos}, model::Direction::DIR_NORTH });
-		}
+		// Буферы переиспользуются между тиками, поэтому после прогрева тик не выделяет память
+		auto& scratch = tick_scratch;
+		scratch.Clear();
 
-		while (road != roadmap.end() && new_pos > (min_pos = std::min(road->second->GetStart().y, road->second->GetEnd().y))) {
-			road = roadmap.find(std::pair{ model::Point{curr_road->GetEnd().x, min_pos}, model::Direction::DIR_NORTH });
+		for (const auto& loot : loots) {
+			AddItem(loot.position, item_width, scratch.item_xs, scratch.item_ys, scratch.item_widths);
 		}
 
-		if (road != roadmap.end()) {
-			dog->SetNewRoad(road->second);
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, new_pos));
-			res = new_pos;
-		}
-		else {
-			dog->SetSpeed(geom::Vec2D{ 0, 0 });
-			dog->SetPosition(geom::Point2D(dog->GetPosition().x, min_pos - w_road));
-			res = min_pos - w_road;
+		for (const auto& office : map->GetOffices()) {
+			AddItem(office.GetPosition(), item_width, scratch.item_xs, scratch.item_ys, scratch.item_widths);
 		}
-		return res;
-	}
 
-	double Application::GoToWest(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road) {
-		double res = 0.;
-		auto curr_road = dog->GetCurrentRoad();
-		auto cur_dog_pos = dog->GetPosition();
-		int min_pos = std::min(curr_road->GetStart().x, curr_road->GetEnd().x);
+		MoveDogs(session, static_cast<double>(time), scratch);
 
-		if (new_pos >= min_pos - w_road) {
-			dog->SetPosition(geom::Point2D(new_pos, dog->GetPosition().y));
-			return res;
-		}
+		collision_detector::FindGatherEvents(
+			collision_detector::ItemsView{ scratch.item_xs, scratch.item_ys, scratch.item_widths },
+			collision_detector::GatherersView{ scratch.start_xs, scratch.start_ys, scratch.end_xs, scratch.end_ys, scratch.gatherer_widths },
+			scratch.events);
 
-		model::Map::Roadmap::iterator road;
-		if (curr_road->IsVertical()) {
-
-			if (cur_dog_pos.y >= curr_road->GetStart().y - w_road && cur_dog_pos.y <= curr_road->GetStart().y + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetStart(), model::Direction::DIR_WEST });
+		// Трофеи удаляются после обработки всех событий, чтобы индексы событий оставались верными
+		scratch.collected.assign(loots.size(), false);
+		for (const auto& event : scratch.events) {
+			auto gatherer = session.GetDog(scratch.gatherers[event.gatherer_id]);
 
+			if (event.item_id < loots.size() && scratch.collected[event.item_id] && !gatherer.IsBagFull()) {
+				gatherer.PutItemIntoBag(loots[event.item_id]);
+				scratch.collected[event.item_id] = true;
+				scratch.extracted.push_back(loots[event.item_id].id);
 			}
-			else if (cur_dog_pos.y >= curr_road->GetEnd().y - w_road && cur_dog_pos.y <= curr_road->GetEnd().y + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetEnd(), model::Direction::DIR_WEST });
+			else {
+				gatherer.CalcScoreAndEraseBag();
 			}
 		}
-		else {
-			road = roadmap.find(std::pair{ model::Point{min_pos, curr_road->GetEnd().y}, model::Direction::DIR_WEST });
-		}
 
-		while (road != roadmap.end() && new_pos > (min_pos = std::min(road->second->GetStart().x, road->second->GetEnd().x))) {
-			road = roadmap.find(std::pair{ model::Point{min_pos, curr_road->GetEnd().y}, model::Direction::DIR_WEST });
+		for (const auto& loot_id : scratch.extracted) {
+			map->ExtractLoot(loot_id);
 		}
 
-		if (road != roadmap.end()) {
-			dog->SetNewRoad(road->second);
-			dog->SetPosition(geom::Point2D(new_pos, dog->GetPosition().y));
-			res = new_pos;
-		}
-		else {
-			dog->SetSpeed(geom::Vec2D{ 0, 0 });
-			dog->SetPosition(geom::Point2D(min_pos - w_road, dog->GetPosition().y));
-			res = min_pos - w_road;
-		}
-		return res;
-	}
+		last_tick_allocations_ += alloc_counter::GetThreadAllocations() - allocations_before;
 
-	double Application::GoToEast(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road) {
-		double res = 0.;
-		auto curr_road = dog->GetCurrentRoad();
-		auto cur_dog_pos = dog->GetPosition();
-		int max_pos = std::max(curr_road->GetStart().x, curr_road->GetEnd().x);
+		session.CommitTick();
 
-		if (new_pos <= max_pos + w_road) {
-			dog->SetPosition(geom::Point2D(new_pos, dog->GetPosition().y));
-			return res;
-		}
-
-		model::Map::Roadmap::iterator road;
-		if (curr_road->IsVertical()) {
-			if (cur_dog_pos.y >= curr_road->GetStart().y - w_road && cur_dog_pos.y <= curr_road->GetStart().y + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetStart(), model::Direction::DIR_EAST });
+		// Снимок собирается в потоке обновления сессии, чтобы запросы состояния до следующего тика
+		// обслуживались без strand. Старый снимок освобождается, когда его отпустит последний читатель
+		PublishStateSnapshot(session);
+	}
 
-			}
-			else if (cur_dog_pos.y >= curr_road->GetEnd().y - w_road && cur_dog_pos.y <= curr_road->GetEnd().y + w_road) {
-				road = roadmap.find(std::pair{ curr_road->GetEnd(), model::Direction::DIR_EAST });
-			}
+	model::StateSnapshot::Ptr Application::PublishStateSnapshot(model::GameSession& session) {
+		std::string buffer;
+		if (auto previous = session.GetStateSnapshot()) {
+			buffer.reserve(previous->size());
 		}
-		else {
-			road = roadmap.find(std::pair{ model::Point{max_pos, curr_road->GetEnd().y}, model::Direction::DIR_EAST });
-		}
-
-		while (road != roadmap.end() && new_pos > (max_pos = std::max(road->second->GetStart().x, road->second->GetEnd().x))) {
+		state_writer::WriteGameState(session, buffer);
 
-			road = roadmap.find(std::pair{ model::Point{max_pos, road->second->GetEnd().y}, model::Direction::DIR_EAST });
-		}
+		auto snapshot = std::make_shared<const std::string>(std::move(buffer));
+		session.PublishStateSnapshot(snapshot);
+		return snapshot;
+	}
 
-		if (road != roadmap.end()) {
-			dog->SetNewRoad(road->second);
-			dog->SetPosition(geom::Point2D(new_pos, dog->GetPosition().y));
-			res = new_pos;
-		}
-		else {
-			dog->SetSpeed(geom::Vec2D{ 0, 0 });
-			dog->SetPosition(geom::Point2D(max_pos + w_road, dog->GetPosition().y));
-			res = max_pos + w_road;
-		}
-		return res;
+	const std::shared_ptr<model::Game> Application::GetGame() {
+		return game_;
 	}
 }
 
@@ -9,9 +9,14 @@
 #include <random>
 #include <unordered_map>
 #include <memory>
+#include <span>
+#include <mutex>
+#include <atomic>
+#include <shared_mutex>
 #include "boost_includes.h"
 #include "ticker.h"
 #include "collision_detector.h"
+#include "token.h"
 
 namespace app {
 	using namespace std::literals;
@@ -65,16 +70,19 @@ namespace app {
 		ErrorReason reason_;
 	};
 
-	namespace detail {
-		struct TokenTag {};
-	}  // namespace detail
+	class Player;
 
-	using Token = util::Tagged<std::string, detail::TokenTag>;
-
-	struct TokenHash {
-		size_t operator()(const Token& token) const {
-			return std::hash<std::string>()(*token);
-		}
+	// Журнал действий, изменяющих состояние игры. Методы вызываются под блокировкой состояния:
+	// OnJoin и OnPlayerAction - под общей из strand сессий, OnTick - под эксклюзивной
+	class ActionJournal {
+	public:
+		// Игрок вошел в игру: собака в точке появления и выданный токен
+		virtual void OnJoin(const model::Map::Id& map_id, model::DogRef dog, const Player& player) = 0;
+		virtual void OnPlayerAction(const Token& token, std::string_view move) = 0;
+		// spawned[i] - предметы, появившиеся за тик на карте сессии sessions[i]
+		virtual void OnTick(std::chrono::milliseconds delta,
+			const model::Game::GameSessions& sessions, const std::vector<model::Loots>& spawned) = 0;
+		virtual ~ActionJournal() = default;
 	};
 
 	class Player {
@@ -83,10 +91,10 @@ namespace app {
 
 		Player(Id id,
 			model::GameSession* game_session = nullptr,
-			std::shared_ptr<model::Dog> dog = nullptr) noexcept
+			model::Dog::Id dog_id = model::Dog::Id{ 0u }) noexcept
 			: id_(std::move(id))
 			, game_session_(game_session)
-			, dog_(dog) {
+			, dog_id_(dog_id) {
 		}
 
 		Player()
@@ -98,33 +106,40 @@ namespace app {
 
 		model::GameSession* GetGameSession() const noexcept;
 
-		std::shared_ptr<model::Dog> GetDogName() const;
+		model::DogRef GetDog() const;
 
-		const geom::Vec2D& GetSpeed() const noexcept;
+		const geom::Vec2D& GetSpeed() const;
 
 		void SetSpeed(geom::Vec2D speed);
 
 		void SetDir(model::Direction dir);
 
-		model::Direction GetDir() const noexcept;
+		model::Direction GetDir() const;
 
 		void SetToken(Token token);
 
 		Token GetToken() const noexcept;
 	private:
 		model::GameSession* game_session_;
-		std::shared_ptr<model::Dog> dog_;
+		// Собака ищется в сессии по постоянному id
+		model::Dog::Id dog_id_{ 0u };
 		Id id_;
-		Token token_ = Token{ std::to_string(0) };
+		Token token_;
 	};
 
 	class Players {
 	public:
-		Player& Add(std::shared_ptr<model::Dog> dog, model::GameSession* game_session);
+		Player& Add(model::DogRef dog, model::GameSession* game_session);
+
+		// Добавляет игроков собак сессии с индексами first_dog, first_dog + 1, ... под одной блокировкой.
+		// Игрок собаки first_dog + i получает токен tokens[i]. Возвращает добавленных игроков
+		std::vector<const Player*> Add(model::GameSession* game_session, size_t first_dog, std::span<const Token> tokens);
 
 		const Player* FindByDogIdAndMapId(const std::string& name, model::Map::Id map_id);
 
 	private:
+		// Игроки разных сессий добавляются из разных strand
+		std::mutex mutex_;
 		std::unordered_map<std::pair<std::string, std::string>, Player, PlayersHash> players_;
 	};
 
@@ -144,30 +159,51 @@ namespace app {
 
 		template<typename NewPlayer>
 		Token AddPlayer(NewPlayer&& player) {
+			std::lock_guard lock(mutex_);
 
-			std::uint64_t num1 = generator1_();
-			std::uint64_t num2 = generator2_();
-			std::stringstream ss;
-			ss << std::hex << std::setfill('0') << std::setw(16) << num1
-				<< std::hex << std::setfill('0') << std::setw(16) << num2;
+			// Совпадение случайных 128-битных токенов практически исключено,
+			// но выданный токен не должен перейти к другому игроку
+			Token token;
+			do {
+				token = Token(generator1_(), generator2_());
+			} while (token_to_player_.Find(token));
 
-			auto token = Token(ss.str());
 			player.SetToken(token);
-			token_to_player_[token] = std::make_shared<Player>(std::forward<NewPlayer>(player));
+			Insert(token, std::make_shared<Player>(std::forward<NewPlayer>(player)));
 			return token;
 		}
 
-		std::shared_ptr<Player> FindPlayerByToken(Token token);
+		std::shared_ptr<Player> FindPlayerByToken(const Token& token) const;
 
 		Token FindTokenByPlayer(const Player* player) const;
 
+		// Добавляет токены игроков под одной блокировкой
+		void AddTokens(std::span<const Player* const> players);
+
 		template<typename Player>
 		void AddToken(Token token, Player player) {
-			token_to_player_[token] = std::make_shared<Player>(player);
+			std::lock_guard lock(mutex_);
+			Insert(token, std::make_shared<Player>(player));
 		}
 
 	private:
-		std::unordered_map<Token, std::shared_ptr<Player>, TokenHash> token_to_player_;
+		// id собак, а значит и игроков, уникальны только внутри сессии
+		using PlayerKey = std::pair<const model::GameSession*, std::uint32_t>;
+
+		struct PlayerKeyHash {
+			size_t operator()(const PlayerKey& key) const {
+				return std::hash<const void*>()(key.first) ^ (std::hash<std::uint32_t>()(key.second) << 1);
+			}
+		};
+
+		// Вызывается под эксклюзивной блокировкой
+		void Insert(const Token& token, std::shared_ptr<Player> player);
+
+		// Токены читаются из strand всех сессий, а добавляются при входе в игру
+		mutable std::shared_mutex mutex_;
+		TokenTable<std::shared_ptr<Player>> token_to_player_;
+		// Обратный индекс для FindTokenByPlayer
+		std::unordered_map<PlayerKey, Token, PlayerKeyHash> player_to_token_;
 	};
 
 	class GameResult {
@@ -199,7 +235,11 @@ namespace app {
 
 		GameResult JoinGame(const std::string& map_id, const std::string& name);
 
-		void JoinGame(std::shared_ptr<model::Dog> dog, model::GameSession* game_session, Token token);
+		void JoinGame(model::DogRef dog, model::GameSession* game_session, Token token);
+
+		// Возвращает в сессию собак вместе с токенами их игроков. Место в сессии резервируется сразу,
+		// таблицы игроков и токенов заполняются каждая под одной блокировкой
+		void RestorePlayers(model::GameSession* game_session, std::span<const std::pair<model::Dog, Token>> dogs);
 
 		std::shared_ptr<Players> GetListPlayersUseCase() const noexcept;
 	private:
@@ -221,6 +261,10 @@ namespace app {
 
 		const std::shared_ptr<Player> FindPlayerByToken(const Token& token) const;
 
+		// Игрок по заголовку Authorization или nullptr. В отличие от пары TryExtractToken
+		// и FindPlayerByToken не бросает исключений, поэтому подходит для выбора маршрута запроса
+		std::shared_ptr<Player> FindPlayer(std::string_view authorization_body) const;
+
 	private:
 		std::shared_ptr<PlayerTokens> player_tokens_;
 	};
@@ -246,73 +290,81 @@ namespace app {
 
 		GameResult JoinGame(const std::string& map_id, const std::string& name);
 		
-		void JoinGame(std::shared_ptr<model::Dog> dog, model::GameSession* game_session, Token token);
+		void JoinGame(model::DogRef dog, model::GameSession* game_session, Token token);
+
+		// Массовое восстановление собак сессии с токенами игроков. Сессии разных карт можно
+		// восстанавливать параллельно
+		void RestorePlayers(model::GameSession& game_session, std::span<const std::pair<model::Dog, Token>> dogs);
 		
 		void Tick(std::chrono::milliseconds delta);
 
 		std::shared_ptr<Players> GetListPlayersUseCase() const noexcept;
 
+		// Возвращает id карты сессии, которой адресован запрос игрока, или nullptr для неизвестного токена
+		const model::Map::Id* FindSessionMapId(std::string_view authorization_body) noexcept;
+
 		std::string GetPlayers(std::string_view authorization_body);
 
 		std::string GetGameState(std::string_view authorization_body);
 
-		std::string SetPlayerAction(std::string_view authorization_body, const std::string& base_body);
+		// Готовое состояние сессии игрока без обращения к strand и блокировки состояния.
+		// nullptr, если снимка нет или токен не найден - тогда запрос обрабатывается через GetGameState
+		model::StateSnapshot::Ptr FindStateSnapshot(std::string_view authorization_body) noexcept;
 
-		std::string SetTimeDelta(const std::string& base_body);
+		// Изменения сессии игрока после тика since или полное состояние, если since не задан или устарел
+		std::string GetStateChanges(std::string_view authorization_body, std::optional<std::uint64_t> since);
 
-		void UpdateGameState(std::chrono::milliseconds delta);
+		std::string SetPlayerAction(std::string_view authorization_body, std::string_view base_body);
 
-		void SetApplicationListener(std::shared_ptr<ApplicationListener> listener);
+		// Действие игрока с токеном token: "L", "R", "U", "D" или "" для остановки
+		void ApplyPlayerAction(const Token& token, std::string_view move);
 
-		const std::shared_ptr<model::Game> GetGame();
+		std::string SetTimeDelta(std::string_view base_body);
 
-	private:
-		double GoToSouth(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road);
+		void UpdateGameState(std::chrono::milliseconds delta);
 
-		double GoToNorth(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road);
+		// Повторяет тик из журнала: вместо генерации трофеев на карту сессии i кладутся spawned[i]
+		void ReplayTick(std::chrono::milliseconds delta, std::vector<model::Loots> spawned);
 
-		double GoToWest(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road);
+		// Количество потоков для параллельного обновления игровых сессий. 0 и 1 - обновление в текущем потоке
+		void SetTickThreads(unsigned num_threads);
 
-		double GoToEast(model::Map::Roadmap& roadmap, const std::shared_ptr<model::Dog>& dog, double new_pos, double w_road);
-	private:
-		std::shared_ptr<model::Game> game_;
-		JoinGameUseCase& join_game_use_case_;
-		std::shared_ptr<ApplicationListener> listener_;
-	};
+		// Количество выделений памяти при обновлении сессий в последнем тике.
+		// Всегда 0, если сервер собран без счетчика выделений (GAME_SERVER_COUNT_ALLOCATIONS=OFF)
+		size_t GetLastTickAllocations() const noexcept;
 
-	class GathererProvider : public collision_detector::ItemGathererProvider {
-	public:
+		// Слушатели вызываются после каждого тика в порядке добавления
+		void AddApplicationListener(std::shared_ptr<ApplicationListener> listener);
 
-		GathererProvider(std::vector<collision_detector::Item> items, std::vector<collision_detector::Gatherer> gatherers)
-			: items_(std::move(items))
-			, gatherers_(std::move(gatherers)) {
+		// Игровая сессия игрока с этим токеном или nullptr, если токен не найден
+		model::GameSession* FindPlayerSession(std::string_view authorization_body) noexcept;
 
-		}
+		// Журнал получает вход игроков, их действия и тики. Задается до начала обработки запросов
+		void SetActionJournal(std::shared_ptr<ActionJournal> journal) noexcept;
 
-		size_t ItemsCount() const override {
-			return items_.size();
-		}
+		const std::shared_ptr<model::Game> GetGame();
 
-		collision_detector::Item GetItem(size_t idx) const override {
-			if (idx >= items_.size()) {
-				throw std::logic_error("Invalid item idx!"s);
-			}
-			return items_.at(idx);
-		}
+	private:
+		void UpdateSessions(std::chrono::milliseconds delta, bool replay);
 
-		size_t GatherersCount() const override {
-			return gatherers_.size();
-		}
+		// replay - трофеи берутся из spawned, иначе генерируются и, если ведется журнал, записываются в spawned
+		void UpdateSession(model::GameSession& session, std::chrono::milliseconds delta, model::Loots& spawned, bool replay);
 
-		collision_detector::Gatherer GetGatherer(size_t idx) const override {
-			if (idx >= gatherers_.size()) {
-				throw std::logic_error("Invalid gatherer idx!"s);
-			}
-			return gatherers_.at(idx);
-		}
+		void ApplyMove(Player& player, std::string_view move);
 
+		model::StateSnapshot::Ptr PublishStateSnapshot(model::GameSession& session);
 	private:
-		std::vector<collision_detector::Item> items_;
-		std::vector<collision_detector::Gatherer> gatherers_;
+		std::shared_ptr<model::Game> game_;
+		JoinGameUseCase& join_game_use_case_;
+		std::vector<std::shared_ptr<ApplicationListener>> listeners_;
+		std::unique_ptr<net::thread_pool> tick_pool_;
+		std::vector<std::exception_ptr> tick_errors_;
+		std::shared_ptr<ActionJournal> journal_;
+		// Трофеи, появившиеся в последнем тике, по индексам сессий
+		std::vector<model::Loots> tick_loots_;
+		std::atomic<size_t> last_tick_allocations_ = 0;
+		// Запросы к разным сессиям выполняются параллельно под общей блокировкой,
+		// обновление и сохранение состояния всех сессий - под эксклюзивной
+		std::shared_mutex state_mutex_;
 	};
 }
\ No newline at end of file
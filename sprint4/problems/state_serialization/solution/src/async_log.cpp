@@ -0,0 +1,200 @@
+﻿#include "async_log.h"
+
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/log/core/core.hpp>
+#include <boost/log/utility/formatting_ostream.hpp>
+
+namespace logger {
+	namespace logging = boost::log;
+
+	namespace {
+		// Backend подключенного AsyncLogGuard для записей журнала HTTP-запросов
+		std::atomic<AsyncLogBackend*> access_backend = nullptr;
+	}  // namespace
+
+	bool AccessLogEntry::SetRequest(const boost::asio::ip::address& address, std::string_view method, std::string_view uri) noexcept {
+		if (method.size() + uri.size() > text_size) {
+			return false;
+		}
+		kind = Kind::REQUEST;
+		timestamp = boost::posix_time::microsec_clock::local_time();
+		ip = address;
+		first_size = static_cast<std::uint16_t>(method.size());
+		second_size = static_cast<std::uint16_t>(uri.size());
+		std::copy(method.begin(), method.end(), text);
+		std::copy(uri.begin(), uri.end(), text + first_size);
+		return true;
+	}
+
+	bool AccessLogEntry::SetResponse(int response_code, std::string_view content_type, long long response_time_ms) noexcept {
+		if (content_type.size() > text_size) {
+			return false;
+		}
+		kind = Kind::RESPONSE;
+		timestamp = boost::posix_time::microsec_clock::local_time();
+		code = response_code;
+		response_time = response_time_ms;
+		first_size = static_cast<std::uint16_t>(content_type.size());
+		second_size = 0;
+		std::copy(content_type.begin(), content_type.end(), text);
+		return true;
+	}
+
+	AsyncLogBackend::AsyncLogBackend(std::ostream& out, logging::formatter formatter, AsyncLogOptions options,
+		AccessLogFormatter access_formatter)
+		: out_(out)
+		, formatter_(std::move(formatter))
+		, access_formatter_(access_formatter)
+		, overflow_(options.overflow)
+		, batch_bytes_(options.batch_bytes)
+		, ring_(options.capacity)
+		, writer_([this] { Run(); }) {
+	}
+
+	AsyncLogBackend::~AsyncLogBackend() {
+		Stop();
+	}
+
+	void AsyncLogBackend::consume(const logging::record_view& rec) {
+		Push(Entry{ rec, {} });
+	}
+
+	bool AsyncLogBackend::LogAccess(const AccessLogEntry& entry) {
+		if (!access_formatter_) {
+			return false;
+		}
+		Push(Entry{ {}, entry });
+		return true;
+	}
+
+	void AsyncLogBackend::Push(const Entry& entry) {
+		if (stop_requested_.load(std::memory_order_acquire)) {
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		if (!ring_.TryPush(entry)) {
+			if (overflow_ == OverflowPolicy::DROP) {
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			// Ждем, пока поток записи не прочитает из буфера очередную группу записей
+			blocked_writers_.fetch_add(1);
+			while (true) {
+				const auto popped = popped_.load();
+				WakeWriter();
+				if (ring_.TryPush(entry)) {
+					break;
+				}
+				popped_.wait(popped);
+			}
+			blocked_writers_.fetch_sub(1);
+		}
+		WakeWriter();
+	}
+
+	void AsyncLogBackend::flush() {
+		const auto pushed = ring_.GetPushedCount();
+		WakeWriter();
+		for (auto written = written_.load(std::memory_order_acquire); written < pushed; written = written_.load(std::memory_order_acquire)) {
+			written_.wait(written);
+		}
+	}
+
+	void AsyncLogBackend::Stop() {
+		if (!stop_requested_.exchange(true)) {
+			WakeWriter();
+		}
+		if (writer_.joinable() && writer_.get_id() != std::this_thread::get_id()) {
+			writer_.join();
+		}
+	}
+
+	void AsyncLogBackend::WakeWriter() {
+		// Барьер упорядочивает запись в буфер с чтением флага, как и барьер потока записи перед сном:
+		// либо поток записи увидит запись, либо мы увидим, что он уснул
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (writer_sleeping_.load(std::memory_order_relaxed)) {
+			writer_sleeping_.store(false, std::memory_order_relaxed);
+			writer_sleeping_.notify_one();
+		}
+	}
+
+	void AsyncLogBackend::Run() {
+		logging::formatting_ostream strm(batch_);
+		Entry entry;
+		std::uint64_t popped = 0;
+
+		while (true) {
+			const auto batch_start = popped;
+			while (batch_.size() < batch_bytes_ && ring_.TryPop(entry)) {
+				if (entry.record) {
+					formatter_(entry.record, strm);
+				}
+				else {
+					access_formatter_(entry.access, strm);
+				}
+				++popped;
+			}
+			entry.record = logging::record_view();
+			strm.flush();
+
+			if (popped != batch_start) {
+				popped_.store(popped);
+				if (blocked_writers_.load() > 0) {
+					popped_.notify_all();
+				}
+			}
+
+			if (!batch_.empty()) {
+				WriteBatch();
+				written_.store(popped, std::memory_order_release);
+				written_.notify_all();
+				continue;
+			}
+
+			// Буфер пуст. После остановки дожидаемся только потоков, которые уже ждут места в буфере
+			if (stop_requested_.load() && blocked_writers_.load() == 0 && ring_.GetPushedCount() == popped) {
+				break;
+			}
+
+			writer_sleeping_.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ring_.GetPushedCount() != popped || stop_requested_.load()) {
+				writer_sleeping_.store(false, std::memory_order_relaxed);
+				continue;
+			}
+			writer_sleeping_.wait(true);
+		}
+	}
+
+	void AsyncLogBackend::WriteBatch() {
+		out_.write(batch_.data(), static_cast<std::streamsize>(batch_.size()));
+		out_.flush();
+		batch_.clear();
+	}
+
+	AsyncLogGuard::AsyncLogGuard(boost::shared_ptr<AsyncLogSink> sink)
+		: sink_(std::move(sink))
+		, backend_(sink_->locked_backend()) {
+		logging::core::get()->add_sink(sink_);
+		access_backend.store(backend_.get(), std::memory_order_release);
+	}
+
+	AsyncLogGuard::~AsyncLogGuard() {
+		if (sink_) {
+			AsyncLogBackend* expected = backend_.get();
+			access_backend.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+			logging::core::get()->remove_sink(sink_);
+			backend_->Stop();
+		}
+	}
+
+	bool LogAccess(const AccessLogEntry& entry) {
+		AsyncLogBackend* backend = access_backend.load(std::memory_order_acquire);
+		return backend && backend->LogAccess(entry);
+	}
+}  // namespace logger
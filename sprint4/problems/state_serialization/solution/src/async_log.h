@@ -0,0 +1,258 @@
+﻿#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include <boost/asio/ip/address.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/log/core/record_view.hpp>
+#include <boost/log/expressions/formatter.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
+#include <boost/log/utility/formatting_ostream_fwd.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+
+namespace logger {
+
+	// Кольцевой буфер фиксированного размера без блокировок: писать могут многие потоки, читает один.
+	// Каждая ячейка хранит номер позиции, для которой она свободна или заполнена, поэтому писатели
+	// захватывают позиции одним CAS и не ждут друг друга (схема Д. Вьюкова)
+	template <typename T>
+	class MpscRing {
+	public:
+		// capacity округляется вверх до степени двойки
+		explicit MpscRing(size_t capacity)
+			: mask_(RoundUpToPowerOfTwo(capacity) - 1)
+			, cells_(std::make_unique<Cell[]>(mask_ + 1)) {
+			for (size_t i = 0; i <= mask_; ++i) {
+				cells_[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		MpscRing(const MpscRing&) = delete;
+		MpscRing& operator=(const MpscRing&) = delete;
+
+		size_t GetCapacity() const noexcept {
+			return mask_ + 1;
+		}
+
+		// false, если буфер заполнен. Можно вызывать из любого потока
+		bool TryPush(const T& value) {
+			size_t pos = push_pos_.load(std::memory_order_relaxed);
+			Cell* cell;
+			while (true) {
+				cell = &cells_[pos & mask_];
+				const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+				const auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+				if (diff == 0) {
+					if (push_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				}
+				else if (diff < 0) {
+					return false;
+				}
+				else {
+					pos = push_pos_.load(std::memory_order_relaxed);
+				}
+			}
+			cell->value = value;
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// false, если буфер пуст. Вызывается только из потока-читателя
+		bool TryPop(T& value) {
+			Cell& cell = cells_[pop_pos_ & mask_];
+			if (cell.sequence.load(std::memory_order_acquire) != pop_pos_ + 1) {
+				return false;
+			}
+			value = std::move(cell.value);
+			cell.value = T{};
+			cell.sequence.store(pop_pos_ + mask_ + 1, std::memory_order_release);
+			++pop_pos_;
+			return true;
+		}
+
+		// Сколько элементов записано в буфер за все время, включая еще не прочитанные
+		std::uint64_t GetPushedCount() const noexcept {
+			return push_pos_.load(std::memory_order_acquire);
+		}
+
+	private:
+		static size_t RoundUpToPowerOfTwo(size_t n) {
+			size_t result = 2;
+			while (result < n) {
+				result *= 2;
+			}
+			return result;
+		}
+
+		struct Cell {
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		const size_t mask_;
+		std::unique_ptr<Cell[]> cells_;
+		// Позиции писателей и читателя на разных кэш-линиях, чтобы не мешать друг другу
+		alignas(64) std::atomic<size_t> push_pos_ = 0;
+		alignas(64) size_t pop_pos_ = 0;
+	};
+
+	// Запись журнала HTTP-запросов фиксированного размера. Поток сервера заполняет ее без выделения памяти,
+	// а в JSON ее превращает поток записи лога
+	struct AccessLogEntry {
+		enum class Kind : std::uint8_t {
+			NONE,
+			REQUEST,
+			RESPONSE
+		};
+
+		static constexpr size_t text_size = 224;
+
+		// false, если метод и URI не помещаются в запись
+		bool SetRequest(const boost::asio::ip::address& address, std::string_view method, std::string_view uri) noexcept;
+
+		// false, если Content-Type не помещается в запись
+		bool SetResponse(int code, std::string_view content_type, long long response_time_ms) noexcept;
+
+		std::string_view GetMethod() const noexcept {
+			return { text, first_size };
+		}
+
+		std::string_view GetUri() const noexcept {
+			return { text + first_size, second_size };
+		}
+
+		std::string_view GetContentType() const noexcept {
+			return { text, first_size };
+		}
+
+		Kind kind = Kind::NONE;
+		boost::posix_time::ptime timestamp;
+		boost::asio::ip::address ip;
+		int code = 0;
+		long long response_time = 0;
+		std::uint16_t first_size = 0;
+		std::uint16_t second_size = 0;
+		char text[text_size];
+	};
+
+	using AccessLogFormatter = void (*)(const AccessLogEntry& entry, boost::log::formatting_ostream& strm);
+
+	// Что делать с записью, когда буфер лога заполнен
+	enum class OverflowPolicy {
+		// Поток, который пишет в лог, ждет, пока поток записи освободит место. Записи не теряются
+		BLOCK,
+		// Запись отбрасывается и учитывается в GetDroppedCount. Потоки сервера никогда не ждут лог
+		DROP
+	};
+
+	struct AsyncLogOptions {
+		size_t capacity = 8192;
+		OverflowPolicy overflow = OverflowPolicy::BLOCK;
+		// Отформатированные записи копятся и пишутся в поток одним вызовом, пока их не больше batch_bytes
+		// или пока буфер не опустел
+		size_t batch_bytes = 64 * 1024;
+	};
+
+	// Backend Boost.Log, который только кладет запись в кольцевой буфер. Форматирует записи и пишет их
+	// в out отдельный поток, поэтому потоки сервера не тратят время ни на JSON, ни на вывод.
+	// Вызовы consume не требуют блокировки, поэтому backend подключается через unlocked_sink
+	// Записи журнала HTTP-запросов идут в тот же буфер мимо Boost.Log, который выделяет память на каждую запись
+	class AsyncLogBackend : public boost::log::sinks::basic_sink_backend<boost::log::sinks::concurrent_feeding> {
+	public:
+		AsyncLogBackend(std::ostream& out, boost::log::formatter formatter, AsyncLogOptions options = {},
+			AccessLogFormatter access_formatter = nullptr);
+
+		AsyncLogBackend(const AsyncLogBackend&) = delete;
+		AsyncLogBackend& operator=(const AsyncLogBackend&) = delete;
+
+		// Записывает принятые записи и останавливает поток записи
+		~AsyncLogBackend();
+
+		void consume(const boost::log::record_view& rec);
+
+		// Кладет запись журнала HTTP-запросов в буфер по тем же правилам, что и consume.
+		// false, если backend создан без форматтера таких записей
+		bool LogAccess(const AccessLogEntry& entry);
+
+		// Ждет, пока все принятые до вызова записи не будут записаны в out
+		void flush();
+
+		// Записывает принятые записи и останавливает поток записи. Записи, пришедшие после, отбрасываются
+		void Stop();
+
+		size_t GetDroppedCount() const noexcept {
+			return dropped_.load(std::memory_order_relaxed);
+		}
+
+	private:
+		// Запись Boost.Log или, если record пуст, запись журнала HTTP-запросов
+		struct Entry {
+			boost::log::record_view record;
+			AccessLogEntry access;
+		};
+
+		void Push(const Entry& entry);
+
+		void Run();
+
+		void WakeWriter();
+
+		// Пишет накопленную группу в out
+		void WriteBatch();
+
+	private:
+		std::ostream& out_;
+		boost::log::formatter formatter_;
+		const AccessLogFormatter access_formatter_;
+		const OverflowPolicy overflow_;
+		const size_t batch_bytes_;
+		MpscRing<Entry> ring_;
+		std::string batch_;
+
+		std::atomic<bool> writer_sleeping_ = false;
+		std::atomic<bool> stop_requested_ = false;
+		std::atomic<bool> stopped_ = false;
+		// Сколько записей прочитано из буфера и сколько из них уже записано в out
+		std::atomic<std::uint64_t> popped_ = 0;
+		std::atomic<std::uint64_t> written_ = 0;
+		std::atomic<size_t> blocked_writers_ = 0;
+		std::atomic<size_t> dropped_ = 0;
+		std::thread writer_;
+	};
+
+	using AsyncLogSink = boost::log::sinks::unlocked_sink<AsyncLogBackend>;
+
+	// Подключает sink к ядру Boost.Log и отключает его при уничтожении, дописав принятые записи.
+	// Ядро живет до конца программы, поэтому без явного отключения последние записи могли бы потеряться.
+	// Пока guard жив, его backend принимает записи LogAccess
+	class AsyncLogGuard {
+	public:
+		explicit AsyncLogGuard(boost::shared_ptr<AsyncLogSink> sink);
+
+		AsyncLogGuard(AsyncLogGuard&& other) noexcept = default;
+		AsyncLogGuard& operator=(AsyncLogGuard&&) = delete;
+
+		~AsyncLogGuard();
+
+		AsyncLogBackend& GetBackend() const {
+			return *backend_;
+		}
+
+	private:
+		boost::shared_ptr<AsyncLogSink> sink_;
+		boost::shared_ptr<AsyncLogBackend> backend_;
+	};
+
+	// Передает запись backend подключенного AsyncLogGuard. false, если такого backend нет и запись
+	// нужно писать через Boost.Log. Guard должен пережить потоки, которые пишут в лог
+	bool LogAccess(const AccessLogEntry& entry);
+}  // namespace logger
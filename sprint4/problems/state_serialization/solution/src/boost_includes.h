@@ -19,6 +19,7 @@
 namespace boost_aliases {
 	namespace beast = boost::beast;
 	namespace http = beast::http;
+	namespace websocket = beast::websocket;
 	namespace json = boost::json;
 	namespace sys = boost::system;
 	namespace net = boost::asio;
@@ -1,5 +1,12 @@
 ﻿#include "collision_detector.h"
 #include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 namespace collision_detector {
 
@@ -22,38 +29,350 @@ CollectionResult TryCollectPoint(geom::Point2D a, geom::Point2D b, geom::Point2D
     return CollectionResult(sq_distance, proj_ratio);
 }
 
-std::vector<GatheringEvent> FindGatherEvents(const ItemGathererProvider& provider) {
-    std::vector<GatheringEvent> result;
-    size_t gatherers_count = provider.GatherersCount();
-    size_t items_count = provider.ItemsCount();
+namespace {
+
+// При малом числе пар построение сетки не окупается, перебираем всё подряд
+constexpr size_t broad_phase_min_pairs = 256;
+
+// Запас для грубой фазы: TryCollectPoint считает квадрат расстояния с погрешностью,
+// поэтому предмет на самой границе области не должен выпасть из кандидатов
+constexpr double broad_phase_margin = 1e-6;
+
+// Предмет, который собиратель задевает при движении
+struct Hit {
+    size_t item_id;
+    double sq_distance;
+    double proj_ratio;
+};
+
+// Параметры движения одного собирателя, общие для всех проверяемых предметов
+struct Segment {
+    double a_x;
+    double a_y;
+    double v_x;
+    double v_y;
+    double v_len2;
+    double width;
+};
+
+// Скалярная проверка одного предмета. Формулы и порядок операций те же, что в TryCollectPoint
+inline void CheckItem(const Segment& seg, double c_x, double c_y, double item_width, size_t item_id, std::vector<Hit>& hits) {
+    const double u_x = c_x - seg.a_x;
+    const double u_y = c_y - seg.a_y;
+    const double u_dot_v = u_x * seg.v_x + u_y * seg.v_y;
+    const double u_len2 = u_x * u_x + u_y * u_y;
+    const double proj_ratio = u_dot_v / seg.v_len2;
+    const double sq_distance = u_len2 - (u_dot_v * u_dot_v) / seg.v_len2;
+    const CollectionResult result{ sq_distance, proj_ratio };
+    if (result.IsCollected(item_width + seg.width)) {
+        hits.push_back({ item_id, sq_distance, proj_ratio });
+    }
+}
+
+// Проверяет предметы [0, count) и добавляет попадания в hits.
+// Предмету с номером i соответствует id ids[i] (или first_id + i, если ids == nullptr).
+// Векторные ветки выполняют те же IEEE-операции в том же порядке, что и скалярная,
+// поэтому результаты совпадают побитово (сжатие в FMA отключено в CMakeLists.txt).
+void CheckItems(const Segment& seg, const double* xs, const double* ys, const double* ws,
+    size_t count, const size_t* ids, size_t first_id, std::vector<Hit>& hits) {
+    size_t i = 0;
+    auto id_of = [&](size_t k) {
+        return ids ? ids[k] : first_id + k;
+    };
+
+#if defined(__AVX__)
+    const __m256d a_x = _mm256_set1_pd(seg.a_x);
+    const __m256d a_y = _mm256_set1_pd(seg.a_y);
+    const __m256d v_x = _mm256_set1_pd(seg.v_x);
+    const __m256d v_y = _mm256_set1_pd(seg.v_y);
+    const __m256d v_len2 = _mm256_set1_pd(seg.v_len2);
+    const __m256d g_width = _mm256_set1_pd(seg.width);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.);
+
+    for (; i + 4 <= count; i += 4) {
+        const __m256d u_x = _mm256_sub_pd(_mm256_loadu_pd(xs + i), a_x);
+        const __m256d u_y = _mm256_sub_pd(_mm256_loadu_pd(ys + i), a_y);
+        const __m256d u_dot_v = _mm256_add_pd(_mm256_mul_pd(u_x, v_x), _mm256_mul_pd(u_y, v_y));
+        const __m256d u_len2 = _mm256_add_pd(_mm256_mul_pd(u_x, u_x), _mm256_mul_pd(u_y, u_y));
+        const __m256d proj_ratio = _mm256_div_pd(u_dot_v, v_len2);
+        const __m256d sq_distance = _mm256_sub_pd(u_len2, _mm256_div_pd(_mm256_mul_pd(u_dot_v, u_dot_v), v_len2));
+        const __m256d radius = _mm256_add_pd(_mm256_loadu_pd(ws + i), g_width);
+
+        const __m256d collected = _mm256_and_pd(
+            _mm256_and_pd(_mm256_cmp_pd(proj_ratio, zero, _CMP_GE_OQ), _mm256_cmp_pd(proj_ratio, one, _CMP_LE_OQ)),
+            _mm256_cmp_pd(sq_distance, _mm256_mul_pd(radius, radius), _CMP_LE_OQ));
+
+        if (int mask = _mm256_movemask_pd(collected); mask != 0) {
+            alignas(32) double sq[4];
+            alignas(32) double proj[4];
+            _mm256_store_pd(sq, sq_distance);
+            _mm256_store_pd(proj, proj_ratio);
+            for (int lane = 0; lane < 4; ++lane) {
+                if (mask & (1 << lane)) {
+                    hits.push_back({ id_of(i + lane), sq[lane], proj[lane] });
+                }
+            }
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128d a_x = _mm_set1_pd(seg.a_x);
+    const __m128d a_y = _mm_set1_pd(seg.a_y);
+    const __m128d v_x = _mm_set1_pd(seg.v_x);
+    const __m128d v_y = _mm_set1_pd(seg.v_y);
+    const __m128d v_len2 = _mm_set1_pd(seg.v_len2);
+    const __m128d g_width = _mm_set1_pd(seg.width);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1.);
+
+    for (; i + 2 <= count; i += 2) {
+        const __m128d u_x = _mm_sub_pd(_mm_loadu_pd(xs + i), a_x);
+        const __m128d u_y = _mm_sub_pd(_mm_loadu_pd(ys + i), a_y);
+        const __m128d u_dot_v = _mm_add_pd(_mm_mul_pd(u_x, v_x), _mm_mul_pd(u_y, v_y));
+        const __m128d u_len2 = _mm_add_pd(_mm_mul_pd(u_x, u_x), _mm_mul_pd(u_y, u_y));
+        const __m128d proj_ratio = _mm_div_pd(u_dot_v, v_len2);
+        const __m128d sq_distance = _mm_sub_pd(u_len2, _mm_div_pd(_mm_mul_pd(u_dot_v, u_dot_v), v_len2));
+        const __m128d radius = _mm_add_pd(_mm_loadu_pd(ws + i), g_width);
+
+        const __m128d collected = _mm_and_pd(
+            _mm_and_pd(_mm_cmpge_pd(proj_ratio, zero), _mm_cmple_pd(proj_ratio, one)),
+            _mm_cmple_pd(sq_distance, _mm_mul_pd(radius, radius)));
+
+        if (int mask = _mm_movemask_pd(collected); mask != 0) {
+            alignas(16) double sq[2];
+            alignas(16) double proj[2];
+            _mm_store_pd(sq, sq_distance);
+            _mm_store_pd(proj, proj_ratio);
+            for (int lane = 0; lane < 2; ++lane) {
+                if (mask & (1 << lane)) {
+                    hits.push_back({ id_of(i + lane), sq[lane], proj[lane] });
+                }
+            }
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        CheckItem(seg, xs[i], ys[i], ws[i], id_of(i), hits);
+    }
+}
+
+// Равномерная сетка по позициям предметов.
+// Каждый предмет попадает ровно в одну ячейку. Координаты предметов переложены в порядке ячеек,
+// поэтому предметы соседних ячеек одной строки лежат в памяти подряд и проверяются одним проходом.
+class ItemGrid {
+public:
+    void Build(const ItemsView& items, double min_cell_size) {
+        const size_t count = items.xs.size();
+        min_x_ = max_x_ = items.xs[0];
+        min_y_ = max_y_ = items.ys[0];
+        for (size_t i = 0; i < count; ++i) {
+            min_x_ = std::min(min_x_, items.xs[i]);
+            max_x_ = std::max(max_x_, items.xs[i]);
+            min_y_ = std::min(min_y_, items.ys[i]);
+            max_y_ = std::max(max_y_, items.ys[i]);
+        }
+
+        const double width = max_x_ - min_x_;
+        const double height = max_y_ - min_y_;
+
+        // В среднем около одного предмета на ячейку, но ячейка не меньше радиуса сбора
+        cell_size_ = std::max({ std::sqrt(width * height / count), min_cell_size, 1e-3 });
+        // Предметы на дорогах лежат вдоль линий, поэтому ограничиваем и общее число ячеек
+        while ((width / cell_size_ + 1.) * (height / cell_size_ + 1.) > 4. * count + 16.) {
+            cell_size_ *= 2.;
+        }
+        cols_ = static_cast<size_t>(width / cell_size_) + 1;
+        rows_ = static_cast<size_t>(height / cell_size_) + 1;
+
+        item_cells_.resize(count);
+        cell_start_.assign(cols_ * rows_ + 1, 0);
+        for (size_t i = 0; i < count; ++i) {
+            item_cells_[i] = Row(items.ys[i]) * cols_ + Col(items.xs[i]);
+            ++cell_start_[item_cells_[i] + 1];
+        }
+        for (size_t cell = 1; cell < cell_start_.size(); ++cell) {
+            cell_start_[cell] += cell_start_[cell - 1];
+        }
+
+        fill_.assign(cell_start_.begin(), cell_start_.end() - 1);
+        ids_.resize(count);
+        xs_.resize(count);
+        ys_.resize(count);
+        ws_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            const size_t pos = fill_[item_cells_[i]]++;
+            ids_[pos] = i;
+            xs_[pos] = items.xs[i];
+            ys_[pos] = items.ys[i];
+            ws_[pos] = items.widths[i];
+        }
+    }
+
+    // Проверяет предметы из ячеек, которые пересекает прямоугольник
+    void CheckItemsInRect(const Segment& seg, double left, double top, double right, double bottom, std::vector<Hit>& hits) const {
+        if (right < min_x_ || left > max_x_ || bottom < min_y_ || top > max_y_) {
+            return;
+        }
+        const size_t col_begin = Col(left);
+        const size_t col_end = Col(right);
+        const size_t row_end = Row(bottom);
+        for (size_t row = Row(top); row <= row_end; ++row) {
+            const size_t first = cell_start_[row * cols_ + col_begin];
+            const size_t last = cell_start_[row * cols_ + col_end + 1];
+            CheckItems(seg, xs_.data() + first, ys_.data() + first, ws_.data() + first,
+                last - first, ids_.data() + first, 0, hits);
+        }
+    }
+
+private:
+    size_t Col(double x) const {
+        return ToIndex((x - min_x_) / cell_size_, cols_);
+    }
+
+    size_t Row(double y) const {
+        return ToIndex((y - min_y_) / cell_size_, rows_);
+    }
+
+    static size_t ToIndex(double pos, size_t count) {
+        if (!(pos > 0.)) {
+            return 0;
+        }
+        return std::min(static_cast<size_t>(pos), count - 1);
+    }
+
+    double min_x_ = 0.;
+    double min_y_ = 0.;
+    double max_x_ = 0.;
+    double max_y_ = 0.;
+    double cell_size_ = 1.;
+    size_t cols_ = 0;
+    size_t rows_ = 0;
+    std::vector<size_t> cell_start_;
+    std::vector<size_t> item_cells_;
+    std::vector<size_t> fill_;
+    std::vector<size_t> ids_;
+    std::vector<double> xs_;
+    std::vector<double> ys_;
+    std::vector<double> ws_;
+};
+
+// Рабочие буферы переиспользуются между вызовами, своя копия у каждого потока
+struct Scratch {
+    ItemGrid grid;
+    std::vector<Hit> hits;
+};
+
+thread_local Scratch scratch;
+
+}  // namespace
+
+void FindGatherEvents(const ItemsView& items, const GatherersView& gatherers, std::vector<GatheringEvent>& events) {
+    using namespace std::literals;
+    events.clear();
+
+    const size_t items_count = items.xs.size();
+    const size_t gatherers_count = gatherers.start_xs.size();
+
+    if (items.ys.size() != items_count || items.widths.size() != items_count) {
+        throw std::invalid_argument("Items arrays have different sizes"s);
+    }
+    if (gatherers.start_ys.size() != gatherers_count || gatherers.end_xs.size() != gatherers_count
+        || gatherers.end_ys.size() != gatherers_count || gatherers.widths.size() != gatherers_count) {
+        throw std::invalid_argument("Gatherers arrays have different sizes"s);
+    }
 
     if (gatherers_count == 0 || items_count == 0) {
-        return result;
+        return;
+    }
+
+    const bool use_grid = gatherers_count * items_count >= broad_phase_min_pairs;
+    double max_item_width = 0.;
+    if (use_grid) {
+        for (double width : items.widths) {
+            max_item_width = std::max(max_item_width, width);
+        }
+        double max_gatherer_width = 0.;
+        for (double width : gatherers.widths) {
+            max_gatherer_width = std::max(max_gatherer_width, width);
+        }
+        scratch.grid.Build(items, max_item_width + max_gatherer_width);
     }
-       
-    for (int g_idx = 0; g_idx < gatherers_count; ++g_idx) {
-        auto gatherer = provider.GetGatherer(g_idx);
 
-        if (gatherer.start_pos.x == gatherer.end_pos.x &&
-            gatherer.start_pos.y == gatherer.end_pos.y) {
+    auto& hits = scratch.hits;
+    for (size_t g_idx = 0; g_idx < gatherers_count; ++g_idx) {
+        const double a_x = gatherers.start_xs[g_idx];
+        const double a_y = gatherers.start_ys[g_idx];
+        const double b_x = gatherers.end_xs[g_idx];
+        const double b_y = gatherers.end_ys[g_idx];
+        if (a_x == b_x && a_y == b_y) {
             continue;
         }
 
-        for (int i_idx = 0; i_idx < items_count; ++i_idx) {
-            auto item = provider.GetItem(i_idx);
+        const double v_x = b_x - a_x;
+        const double v_y = b_y - a_y;
+        const Segment seg{ a_x, a_y, v_x, v_y, v_x * v_x + v_y * v_y, gatherers.widths[g_idx] };
 
-            auto collection_result = TryCollectPoint(gatherer.start_pos, gatherer.end_pos, item.position);
-            if (collection_result.IsCollected(item.width + gatherer.width)) {
-                result.emplace_back( i_idx, g_idx , collection_result.sq_distance, collection_result.proj_ratio );
-            }
+        hits.clear();
+        if (use_grid) {
+            // Грубая фаза: собиратель проверяется только с предметами из ячеек, через которые проходит
+            // его отрезок, расширенный на радиус сбора
+            const double radius = seg.width + max_item_width
+                + broad_phase_margin * (1. + std::abs(v_x) + std::abs(v_y) + seg.width + max_item_width);
+            scratch.grid.CheckItemsInRect(seg, std::min(a_x, b_x) - radius, std::min(a_y, b_y) - radius,
+                std::max(a_x, b_x) + radius, std::max(a_y, b_y) + radius, hits);
+            // События добавляются в том же порядке, что и при полном переборе,
+            // поэтому итоговая сортировка даёт тот же результат
+            std::sort(hits.begin(), hits.end(), [](const Hit& l, const Hit& r) {
+                return l.item_id < r.item_id;
+                });
+        }
+        else {
+            CheckItems(seg, items.xs.data(), items.ys.data(), items.widths.data(), items_count, nullptr, 0, hits);
+        }
+
+        for (const auto& hit : hits) {
+            events.emplace_back(hit.item_id, g_idx, hit.sq_distance, hit.proj_ratio);
         }
     }
 
-    std::sort(result.begin(), result.end(), [](const GatheringEvent& r, const GatheringEvent& l) {
+    std::sort(events.begin(), events.end(), [](const GatheringEvent& r, const GatheringEvent& l) {
         return r.time < l.time;
         });
+}
+
+std::vector<GatheringEvent> FindGatherEvents(const ItemsView& items, const GatherersView& gatherers) {
+    std::vector<GatheringEvent> events;
+    FindGatherEvents(items, gatherers, events);
+    return events;
+}
+
+std::vector<GatheringEvent> FindGatherEvents(const ItemGathererProvider& provider) {
+    const size_t items_count = provider.ItemsCount();
+    const size_t gatherers_count = provider.GatherersCount();
+
+    // Каждый предмет и собирателя запрашиваем у провайдера один раз, а не на каждую пару
+    std::vector<double> item_xs(items_count), item_ys(items_count), item_widths(items_count);
+    for (size_t i_idx = 0; i_idx < items_count; ++i_idx) {
+        const auto item = provider.GetItem(i_idx);
+        item_xs[i_idx] = item.position.x;
+        item_ys[i_idx] = item.position.y;
+        item_widths[i_idx] = item.width;
+    }
+
+    std::vector<double> start_xs(gatherers_count), start_ys(gatherers_count);
+    std::vector<double> end_xs(gatherers_count), end_ys(gatherers_count), gatherer_widths(gatherers_count);
+    for (size_t g_idx = 0; g_idx < gatherers_count; ++g_idx) {
+        const auto gatherer = provider.GetGatherer(g_idx);
+        start_xs[g_idx] = gatherer.start_pos.x;
+        start_ys[g_idx] = gatherer.start_pos.y;
+        end_xs[g_idx] = gatherer.end_pos.x;
+        end_ys[g_idx] = gatherer.end_pos.y;
+        gatherer_widths[g_idx] = gatherer.width;
+    }
 
-    return result;
+    return FindGatherEvents(ItemsView{ item_xs, item_ys, item_widths },
+        GatherersView{ start_xs, start_ys, end_xs, end_ys, gatherer_widths });
 }
 
 
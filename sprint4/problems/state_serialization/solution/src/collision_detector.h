@@ -3,6 +3,7 @@
 #include "geom.h"
 
 #include <algorithm>
+#include <span>
 #include <vector>
 
 namespace collision_detector {
@@ -56,4 +57,27 @@ struct GatheringEvent {
 // При проверке ваших тестов она не нужна - функция будет линковаться снаружи.
 std::vector<GatheringEvent> FindGatherEvents(const ItemGathererProvider& provider);
 
+// Предметы в виде структуры массивов: i-й предмет находится в (xs[i], ys[i]) и имеет ширину widths[i]
+struct ItemsView {
+    std::span<const double> xs;
+    std::span<const double> ys;
+    std::span<const double> widths;
+};
+
+// Собиратели в виде структуры массивов: i-й движется из (start_xs[i], start_ys[i]) в (end_xs[i], end_ys[i])
+struct GatherersView {
+    std::span<const double> start_xs;
+    std::span<const double> start_ys;
+    std::span<const double> end_xs;
+    std::span<const double> end_ys;
+    std::span<const double> widths;
+};
+
+// То же, что FindGatherEvents(provider), но без виртуальных вызовов на каждую пару.
+// Внутренний цикл векторизован (AVX/SSE2), результат побитово совпадает с TryCollectPoint.
+// События записываются в events, чтобы вызывающий код мог переиспользовать память.
+void FindGatherEvents(const ItemsView& items, const GatherersView& gatherers, std::vector<GatheringEvent>& events);
+
+std::vector<GatheringEvent> FindGatherEvents(const ItemsView& items, const GatherersView& gatherers);
+
 }  // namespace collision_detector
\ No newline at end of file
@@ -1,23 +1,81 @@
 ﻿#include "http_server.h"
 
 
+#include <algorithm>
 #include <iostream>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
 
 namespace http_server {
 
+	SessionBase::SessionBase(tcp::socket&& socket)
+		: stream_(std::move(socket)) {
+		// Заголовок и общее тело каждого ответа
+		write_buffers_.reserve(2 * max_pipelined_requests);
+		for (auto& slot : slots_) {
+			slot.data = ArenaString(ArenaAllocator<char>(arena_));
+		}
+		// Ответы уже собираются в пачки самой сессией, ожидание подтверждений от Нейгла только добавляет задержку
+		beast::error_code ec;
+		stream_.socket().set_option(tcp::no_delay(true), ec);
+	}
+
+	SessionBase::~SessionBase() {
+		arena_->Release();
+	}
+
 	void SessionBase::OnRead(beast::error_code ec, [[maybe_unused]] std::size_t bytes_read) {
 		using namespace std::literals;
+		reading_ = false;
+		batching_ = false;
 		if (ec == http::error::end_of_stream) {
-			// Нормальная ситуация - клиент закрыл соединение
-			return Close();
+			// Нормальная ситуация - клиент закрыл соединение. Ответы на прочитанные запросы еще отправляются
+			stop_reading_ = true;
+			if (write_sequence_ == read_sequence_) {
+				return Close();
+			}
+			if (!writing_) {
+				WriteReady();
+			}
+			return;
 		}
 		if (ec) {
-			return ReportError(ec, "read"sv);
+			stop_reading_ = true;
+			ReportError(ec, "read"sv);
+		}
+		else if (HttpRequest request = parser_->release(); websocket::is_upgrade(request) && write_sequence_ != read_sequence_) {
+			deferred_upgrade_ = std::move(request);
+		}
+		else {
+			Dispatch(std::move(request));
+		}
+
+		// Ответы, накопленные пока разбирались запросы из buffer_, уходят одной записью
+		if (!writing_ && !batching_) {
+			WriteReady();
 		}
-		HandleRequest(std::move(request_));
+	}
+
+	void SessionBase::Dispatch(HttpRequest&& request) {
+		// После запроса без keep-alive клиент ничего не ждет, а соединение закроется после ответа
+		stop_reading_ = stop_reading_ || !request.keep_alive();
+		if (!HandleRequest(std::move(request), read_sequence_++)) {
+			return;
+		}
+		Read();
 	}
 
 	void SessionBase::Close() {
+		if (closed_) {
+			return;
+		}
+		closed_ = true;
 		beast::error_code ec;
 		stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
 		if (ec) {
@@ -28,27 +86,309 @@ namespace http_server {
 
 	void SessionBase::Read() {
 		using namespace std::literals;
-		// Очищаем запрос от прежнего значения (метод Read может быть вызван несколько раз)
-		request_ = {};
+		// Следующий запрос читается, пока предыдущие еще обрабатываются, но не дальше max_pipelined_requests
+		if (reading_ || stop_reading_ || closed_ || deferred_upgrade_ || read_sequence_ - write_sequence_ >= max_pipelined_requests) {
+			return;
+		}
+		reading_ = true;
+		// Если в buffer_ уже лежит следующий запрос, он будет разобран сразу, и запись ответов ждет его
+		const auto buffered = buffer_.data();
+		batching_ = std::string_view(static_cast<const char*>(buffered.data()), buffered.size()).find("\r\n\r\n"sv) != std::string_view::npos;
+		const ArenaAllocator<char> allocator(arena_);
+		parser_.emplace(std::piecewise_construct, std::make_tuple(allocator), std::make_tuple(allocator));
 		stream_.expires_after(30s);
-		// Считываем request_ из stream_, используя buffer_ для хранения считанных данных
-		http::async_read(stream_, buffer_, request_,
+		// Считываем запрос из stream_, используя buffer_ для хранения считанных данных.
+		// Запросы, уже лежащие в buffer_, разбираются без обращения к сокету
+		http::async_read(stream_, buffer_, *parser_,
 			// По окончании операции будет вызван метод OnRead
-			beast::bind_front_handler(&SessionBase::OnRead, GetSharedThis()));
+			ArenaHandler(beast::bind_front_handler(&SessionBase::OnRead, GetSharedThis()), arena_));
+	}
+
+	void SessionBase::OnResponseReady(ResponseSlot& slot) {
+		slot.ready = true;
+		if (!writing_ && !batching_) {
+			WriteReady();
+		}
 	}
 
-	void SessionBase::OnWrite(bool close, beast::error_code ec, [[maybe_unused]] std::size_t bytes_written) {
+	void SessionBase::WriteReady() {
+		if (closed_) {
+			return;
+		}
+		write_buffers_.clear();
+		writing_count_ = 0;
+		for (auto sequence = write_sequence_; sequence != read_sequence_; ++sequence) {
+			const auto& slot = GetSlot(sequence);
+			if (!slot.ready) {
+				break;
+			}
+			++writing_count_;
+			write_buffers_.emplace_back(slot.data.data(), slot.data.size());
+			if (slot.shared_body && !slot.shared_body->empty()) {
+				write_buffers_.emplace_back(slot.shared_body->data(), slot.shared_body->size());
+			}
+			// Тело из файла уходит отдельным sendfile, а после закрывающего ответа писать нечего
+			if (slot.file || slot.close) {
+				break;
+			}
+		}
+		if (writing_count_ == 0) {
+			return;
+		}
+
+		writing_ = true;
+		// Пока читается следующий запрос, таймаут чтения не трогает запись, поэтому у записи свой таймаут
+		stream_.expires_after(30s);
+		// buffers_range_ref не копирует вектор буферов в операцию записи
+		net::async_write(stream_, beast::buffers_range_ref(write_buffers_),
+			ArenaHandler([self = GetSharedThis()](beast::error_code ec, std::size_t bytes_written) {
+				const auto& last = self->GetSlot(self->write_sequence_ + self->writing_count_ - 1);
+				if (!ec && last.file) {
+					// Заголовок записан, тело идет из файла напрямую в сокет
+					return self->SendFile(last.file, 0, last.file_size);
+				}
+				self->OnWrite(ec, bytes_written);
+			}, arena_));
+	}
+
+	void SessionBase::OnWrite(beast::error_code ec, [[maybe_unused]] std::size_t bytes_written) {
 		if (ec) {
 			return ReportError(ec, "write"sv);
 		}
 
-		if (close) {
-			// Семантика ответа требует закрыть соединение
+		bool close = false;
+		for (; writing_count_ > 0; --writing_count_) {
+			auto& slot = GetSlot(write_sequence_++);
+			close = close || slot.close;
+			slot.data.clear();
+			slot.shared_body.reset();
+			slot.file.reset();
+			slot.ready = false;
+		}
+		writing_ = false;
+
+		if (close || (stop_reading_ && !reading_ && write_sequence_ == read_sequence_ && !deferred_upgrade_)) {
+			// Семантика ответа требует закрыть соединение, или клиент уже закрыл свою сторону
 			return Close();
 		}
 
-		// Считываем следующий запрос
+		if (deferred_upgrade_ && write_sequence_ == read_sequence_) {
+			HttpRequest request = std::move(*deferred_upgrade_);
+			deferred_upgrade_.reset();
+			return Dispatch(std::move(request));
+		}
+
+		// Если чтение остановилось на переполненной очереди, продолжаем его
+		Read();
+		if (!batching_) {
+			WriteReady();
+		}
+	}
+
+	void SessionBase::SendFile(std::shared_ptr<const FileDescriptor> file, std::uint64_t offset, std::uint64_t size) {
+#ifdef __linux__
+		auto& socket = stream_.socket();
+		beast::error_code ec;
+		// sendfile не должен блокировать поток io_context, когда клиент читает медленно
+		socket.native_non_blocking(true, ec);
+		while (!ec && offset < size) {
+			off_t file_offset = static_cast<off_t>(offset);
+			const ssize_t sent = ::sendfile(socket.native_handle(), file->Get(), &file_offset, static_cast<size_t>(size - offset));
+			if (sent > 0) {
+				offset = static_cast<std::uint64_t>(file_offset);
+			}
+			else if (sent < 0 && errno == EINTR) {
+				continue;
+			}
+			else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				socket.async_wait(tcp::socket::wait_write,
+					[self = GetSharedThis(), file = std::move(file), offset, size](beast::error_code ec) mutable {
+						if (ec) {
+							return self->OnWrite(ec, 0);
+						}
+						self->SendFile(std::move(file), offset, size);
+					});
+				return;
+			}
+			else {
+				// Файл стал короче, чем при загрузке кэша: дописать ответ уже нельзя
+				ec = sent == 0 ? beast::error_code(net::error::eof) : beast::error_code(errno, sys::system_category());
+			}
+		}
+		OnWrite(ec, static_cast<std::size_t>(offset));
+#else
+		OnWrite(net::error::operation_not_supported, 0);
+#endif
+	}
+
+	SessionArena::SessionArena()
+		: pool_(std::pmr::pool_options{ 0, largest_pooled_block }, std::pmr::new_delete_resource()) {
+	}
+
+	void SessionArena::Release() noexcept {
+		std::unique_lock lock(mutex_);
+		released_ = true;
+		if (blocks_ == 0) {
+			lock.unlock();
+			delete this;
+		}
+	}
+
+	void* SessionArena::do_allocate(std::size_t bytes, std::size_t alignment) {
+		std::lock_guard lock(mutex_);
+		void* p = pool_.allocate(bytes, alignment);
+		++blocks_;
+		return p;
+	}
+
+	void SessionArena::do_deallocate(void* p, std::size_t bytes, std::size_t alignment) {
+		std::unique_lock lock(mutex_);
+		pool_.deallocate(p, bytes, alignment);
+		if (--blocks_ == 0 && released_) {
+			lock.unlock();
+			delete this;
+		}
+	}
+
+	FileDescriptor::FileDescriptor(const std::string& path)
+		: fd_(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+		if (fd_ < 0) {
+			throw sys::system_error(beast::error_code(errno, sys::system_category()), path);
+		}
+	}
+
+	FileDescriptor::~FileDescriptor() {
+		::close(fd_);
+	}
+
+	void PushSession::Accept(HttpRequest&& request) {
+		request_ = std::move(request);
+		// Таймаут чтения HTTP не подходит для долгоживущего соединения, у WebSocket свои таймауты
+		beast::get_lowest_layer(ws_).expires_never();
+		ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+		ws_.text(true);
+		ws_.async_accept(request_, beast::bind_front_handler(&PushSession::OnAccept, shared_from_this()));
+	}
+
+	void PushSession::OnAccept(beast::error_code ec) {
+		if (ec) {
+			return Close(ec, "websocket accept"sv);
+		}
+		open_ = true;
 		Read();
+		if (pending_) {
+			Write(std::exchange(pending_, nullptr));
+		}
+	}
+
+	void PushSession::Push(Message message) {
+		net::post(ws_.get_executor(), [self = shared_from_this(), message = std::move(message)]() mutable {
+			self->DoPush(std::move(message));
+			});
+	}
+
+	void PushSession::DoPush(Message message) {
+		if (closed_) {
+			return;
+		}
+		if (!open_ || writing_) {
+			if (pending_) {
+				++dropped_;
+			}
+			pending_ = std::move(message);
+			return;
+		}
+		Write(std::move(message));
+	}
+
+	void PushSession::Write(Message message) {
+		writing_ = std::move(message);
+		ws_.async_write(net::buffer(*writing_), beast::bind_front_handler(&PushSession::OnWrite, shared_from_this()));
+	}
+
+	void PushSession::OnWrite(beast::error_code ec, [[maybe_unused]] std::size_t bytes_written) {
+		writing_.reset();
+		if (ec) {
+			return Close(ec, "websocket write"sv);
+		}
+		if (pending_) {
+			Write(std::exchange(pending_, nullptr));
+		}
+	}
+
+	void PushSession::Read() {
+		// Клиент ничего не присылает, но чтение нужно, чтобы обрабатывать ping и закрытие соединения
+		ws_.async_read(read_buffer_, beast::bind_front_handler(&PushSession::OnRead, shared_from_this()));
+	}
+
+	void PushSession::OnRead(beast::error_code ec, [[maybe_unused]] std::size_t bytes_read) {
+		if (ec) {
+			return Close(ec, "websocket read"sv);
+		}
+		read_buffer_.consume(read_buffer_.size());
+		Read();
+	}
+
+	void PushSession::Close(beast::error_code ec, std::string_view what) {
+		closed_ = true;
+		pending_.reset();
+		if (ec != websocket::error::closed && ec != net::error::operation_aborted && ec != net::error::eof) {
+			ReportError(ec, what);
+		}
+	}
+
+	void SetReusePort(tcp::acceptor& acceptor) {
+#ifdef SO_REUSEPORT
+		acceptor.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+		throw sys::system_error(net::error::operation_not_supported, "SO_REUSEPORT");
+#endif
+	}
+
+	IoContextPool::IoContextPool(unsigned size) {
+		size = std::max(1u, size);
+		contexts_.reserve(size);
+		for (unsigned i = 0; i < size; ++i) {
+			// Подсказка 1: io_context выполняется одним потоком, и внутренние блокировки ему не нужны
+			contexts_.push_back(std::make_unique<net::io_context>(1));
+		}
+	}
+
+	IoContextPool::~IoContextPool() {
+		Stop();
+		Join();
+	}
+
+	void IoContextPool::Run() {
+		const unsigned num_cpus = std::max(1u, std::thread::hardware_concurrency());
+		threads_.reserve(contexts_.size());
+		for (size_t i = 0; i < contexts_.size(); ++i) {
+			threads_.emplace_back([this, i, cpu = static_cast<unsigned>(i % num_cpus)] {
+#ifdef __linux__
+				// Привязка не обязательна: если ее не разрешили, поток просто остается без нее
+				cpu_set_t cpu_set;
+				CPU_ZERO(&cpu_set);
+				CPU_SET(cpu, &cpu_set);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+#endif
+				contexts_[i]->run();
+				});
+		}
+	}
+
+	void IoContextPool::Stop() {
+		for (auto& context : contexts_) {
+			context->stop();
+		}
+	}
+
+	void IoContextPool::Join() {
+		for (auto& thread : threads_) {
+			if (thread.joinable()) {
+				thread.join();
+			}
+		}
+		threads_.clear();
 	}
 
 	void SessionBase::Run() {
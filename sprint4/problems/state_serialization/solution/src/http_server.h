@@ -5,6 +5,18 @@
 #include "sdk.h"
 #include "boost_includes.h"
 #include <iostream>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace http_server {
 	using namespace std::literals;
@@ -24,8 +36,272 @@ namespace http_server {
 			<< logging::add_value(message, msg);
 	}
 
+	// Память соединения для запросов и ответов. Освобожденные блоки возвращаются в пулы арены и выдаются снова,
+	// поэтому keep-alive соединение после первых запросов не обращается к глобальному аллокатору.
+	// Запрос может пережить сессию (он уходит в strand игры или в WebSocket), поэтому арена удаляет себя сама,
+	// когда сессия от нее отказалась и последний блок вернулся
+	class SessionArena final : public std::pmr::memory_resource {
+	public:
+		// Блоки больше этого размера берутся у глобального аллокатора при каждом выделении
+		static constexpr size_t largest_pooled_block = 64 * 1024;
+
+		static SessionArena* Create() {
+			return new SessionArena();
+		}
+
+		// Владелец больше не выделяет память из арены. Арена живет, пока ей не вернут все блоки
+		void Release() noexcept;
+
+	private:
+		SessionArena();
+
+		void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+		void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+			return this == &other;
+		}
+
+	private:
+		// Блоки освобождаются и в других потоках: запрос уничтожается там, где его обработали
+		std::mutex mutex_;
+		std::pmr::unsynchronized_pool_resource pool_;
+		size_t blocks_ = 0;
+		bool released_ = false;
+	};
+
+	// Аллокатор поверх memory_resource. В отличие от std::pmr::polymorphic_allocator он присваивается
+	// и переходит к контейнеру при присваивании, чего требуют сообщения Beast (resp = MakeStringResponse(...)).
+	// Созданный по умолчанию берет память у глобального аллокатора
+	template <typename T>
+	class ArenaAllocator {
+	public:
+		using value_type = T;
+		using propagate_on_container_copy_assignment = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+		using is_always_equal = std::false_type;
+
+		ArenaAllocator() noexcept = default;
+
+		ArenaAllocator(std::pmr::memory_resource* resource) noexcept
+			: resource_(resource) {
+		}
+
+		template <typename U>
+		ArenaAllocator(const ArenaAllocator<U>& other) noexcept
+			: resource_(other.GetResource()) {
+		}
+
+		T* allocate(std::size_t n) {
+			return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+		}
+
+		void deallocate(T* p, std::size_t n) noexcept {
+			resource_->deallocate(p, n * sizeof(T), alignof(T));
+		}
+
+		std::pmr::memory_resource* GetResource() const noexcept {
+			return resource_;
+		}
+
+		template <typename U>
+		bool operator==(const ArenaAllocator<U>& other) const noexcept {
+			return resource_ == other.GetResource() || resource_->is_equal(*other.GetResource());
+		}
+
+	private:
+		std::pmr::memory_resource* resource_ = std::pmr::new_delete_resource();
+	};
+
+	using ArenaFields = http::basic_fields<ArenaAllocator<char>>;
+	using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+	using ArenaStringBody = http::basic_string_body<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+	// Поля и тело запроса размещаются в арене соединения. Ответ, созданный с req.get_allocator(), тоже
+	using HttpRequest = http::request<ArenaStringBody, ArenaFields>;
+	using HttpResponse = http::response<ArenaStringBody, ArenaFields>;
+
+	// Обработчик завершения, состояние асинхронной операции которого asio размещает в арене.
+	// Своего кэша asio хватает на одну операцию потока, а у соединения одновременно ждут чтение, запись и таймер
+	template <typename Handler>
+	class ArenaHandler {
+	public:
+		using allocator_type = ArenaAllocator<char>;
+
+		ArenaHandler(Handler handler, std::pmr::memory_resource* arena)
+			: handler_(std::move(handler))
+			, arena_(arena) {
+		}
+
+		allocator_type get_allocator() const noexcept {
+			return allocator_type(arena_);
+		}
+
+		template <typename... Args>
+		void operator()(Args&&... args) {
+			handler_(std::forward<Args>(args)...);
+		}
+
+	private:
+		Handler handler_;
+		std::pmr::memory_resource* arena_;
+	};
+
+#ifdef __linux__
+	constexpr bool sendfile_supported = true;
+#else
+	constexpr bool sendfile_supported = false;
+#endif
+
+	// Файл, открытый только для чтения. Бросает system_error, если файл не удалось открыть
+	class FileDescriptor {
+	public:
+		explicit FileDescriptor(const std::string& path);
+
+		FileDescriptor(const FileDescriptor&) = delete;
+		FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+		~FileDescriptor();
+
+		int Get() const noexcept {
+			return fd_;
+		}
+
+	private:
+		int fd_ = -1;
+	};
+
+	// Тело ответа, которое сессия отправляет из файла вызовом sendfile, не копируя его в память процесса.
+	// Сериализатор beast пишет только заголовок. Без file (ответ на HEAD) тело не отправляется
+	struct SendFileBody {
+		struct value_type {
+			std::shared_ptr<const FileDescriptor> file;
+			std::uint64_t size = 0;
+		};
+
+		static std::uint64_t size(const value_type& body) noexcept {
+			return body.size;
+		}
+
+		class writer {
+		public:
+			using const_buffers_type = net::const_buffer;
+
+			template <bool isRequest, class Fields>
+			writer(const http::header<isRequest, Fields>&, const value_type&) {
+			}
+
+			void init(beast::error_code& ec) {
+				ec = {};
+			}
+
+			boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+				ec = {};
+				return boost::none;
+			}
+		};
+	};
+
+	using SendFileResponse = http::response<SendFileBody, ArenaFields>;
+
+	// Тело ответа - неизменяемый буфер, общий для всех ответов с этим документом
+	struct SharedStringBody {
+		using value_type = std::shared_ptr<const std::string>;
+
+		static std::uint64_t size(const value_type& body) noexcept {
+			return body ? body->size() : 0;
+		}
+
+		class writer {
+		public:
+			using const_buffers_type = net::const_buffer;
+
+			template <bool isRequest, class Fields>
+			writer(const http::header<isRequest, Fields>&, const value_type& body)
+				: body_(body) {
+			}
+
+			void init(beast::error_code& ec) {
+				ec = {};
+			}
+
+			boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+				ec = {};
+				if (!body_ || body_->empty()) {
+					return boost::none;
+				}
+				return { { const_buffers_type(body_->data(), body_->size()), false } };
+			}
+
+		private:
+			const value_type& body_;
+		};
+	};
+
+	// Разрешает нескольким сокетам слушать один порт. Бросает system_error, если ОС этого не поддерживает
+	void SetReusePort(tcp::acceptor& acceptor);
+
+	// Обработчик запроса на переход к WebSocket. Возвращает true, если забрал соединение себе
+	using UpgradeHandler = std::function<bool(beast::tcp_stream& stream, HttpRequest& request)>;
+
+	// WebSocket-соединение, в которое сервер только отправляет сообщения.
+	// Пока предыдущее сообщение пишется, новое ждет своей очереди, а ожидавшее до него отбрасывается:
+	// медленный клиент получает только последнее состояние
+	class PushSession : public std::enable_shared_from_this<PushSession> {
+	public:
+		using Message = std::shared_ptr<const std::string>;
+
+		explicit PushSession(beast::tcp_stream&& stream)
+			: ws_(std::move(stream)) {
+		}
+
+		// Завершает рукопожатие WebSocket по уже прочитанному запросу
+		void Accept(HttpRequest&& request);
+
+		// Ставит сообщение в очередь на отправку. Можно вызывать из любого потока
+		void Push(Message message);
+
+		bool IsClosed() const noexcept {
+			return closed_;
+		}
+
+		// Сколько сообщений отброшено, потому что клиент не успевал их принимать
+		size_t GetDroppedMessages() const noexcept {
+			return dropped_;
+		}
+
+	private:
+		void OnAccept(beast::error_code ec);
+
+		void DoPush(Message message);
+
+		void Write(Message message);
+
+		void OnWrite(beast::error_code ec, [[maybe_unused]] std::size_t bytes_written);
+
+		void Read();
+
+		void OnRead(beast::error_code ec, [[maybe_unused]] std::size_t bytes_read);
+
+		void Close(beast::error_code ec, std::string_view what);
+
+	private:
+		websocket::stream<beast::tcp_stream> ws_;
+		HttpRequest request_;
+		beast::flat_buffer read_buffer_;
+		// Состояние записи меняется только в executor соединения
+		bool open_ = false;
+		Message writing_;
+		Message pending_;
+		std::atomic<bool> closed_ = false;
+		std::atomic<size_t> dropped_ = 0;
+	};
+
 	class SessionBase {
 	public:
+		// Сколько запросов соединения может ждать ответа одновременно. Дальше сессия перестает читать
+		static constexpr size_t max_pipelined_requests = 16;
+
 		// Запрещаем копирование и присваивание объектов SessionBase и его наследников
 		SessionBase(const SessionBase&) = delete;
 		SessionBase& operator=(const SessionBase&) = delete;
@@ -33,44 +309,123 @@ namespace http_server {
 		void Run();
 
 	protected:
-		using HttpRequest = http::request<http::string_body>;
-
-		~SessionBase() = default;
+		~SessionBase();
 
-		explicit SessionBase(tcp::socket&& socket)
-			: stream_(std::move(socket)) {
-		}
+		explicit SessionBase(tcp::socket&& socket);
 	protected:
+		// sequence - номер запроса, на который отвечает response. Ответы уходят клиенту в порядке запросов
 		template <typename Body, typename Fields>
-		void Write(http::response<Body, Fields>&& response) {
-			// Запись выполняется асинхронно, поэтому response перемещаем в область кучи
-			auto safe_response = std::make_shared<http::response<Body, Fields>>(std::move(response));
-
-			auto self = GetSharedThis();
-			http::async_write(stream_, *safe_response,
-				[safe_response, self](beast::error_code ec, std::size_t bytes_written) {
-					self->OnWrite(safe_response->need_eof(), ec, bytes_written);
+		void Write(http::response<Body, Fields>&& response, std::uint64_t sequence) {
+			// Ответ может быть готов в strand игровой сессии, а очередь ответов и сокет принадлежат executor соединения:
+			// с сокетом работает только тот поток, который его принял
+			net::dispatch(stream_.get_executor(), [self = GetSharedThis(), response = std::move(response), sequence]() mutable {
+				self->Enqueue(response, sequence);
 				});
 		}
 	private:
+		// Ответ в очереди сессии. Строки сохраняют выделенную память между запросами, а растут в арене
+		struct ResponseSlot {
+			// Сериализованный ответ целиком или, если тело передается отдельно, только заголовок
+			ArenaString data;
+			std::shared_ptr<const std::string> shared_body;
+			std::shared_ptr<const FileDescriptor> file;
+			std::uint64_t file_size = 0;
+			bool ready = false;
+			bool close = false;
+		};
+
+		template <typename Body, typename Fields>
+		void Enqueue(http::response<Body, Fields>& response, std::uint64_t sequence) {
+			auto& slot = GetSlot(sequence);
+			slot.close = response.need_eof();
+
+			beast::error_code ec;
+			if constexpr (std::is_same_v<Body, SharedStringBody>) {
+				// Общий буфер не копируется, он пишется тем же writev сразу после заголовка
+				Serialize(response, slot.data, true, ec);
+				slot.shared_body = response.body();
+			}
+			else if constexpr (std::is_same_v<Body, SendFileBody>) {
+				Serialize(response, slot.data, true, ec);
+				slot.file = response.body().file;
+				slot.file_size = response.body().size;
+			}
+			else {
+				Serialize(response, slot.data, false, ec);
+			}
+
+			if (ec) {
+				ReportError(ec, "serialize"sv);
+				slot.data.clear();
+				slot.close = true;
+			}
+			OnResponseReady(slot);
+		}
+
+		template <typename Body, typename Fields>
+		static void Serialize(http::response<Body, Fields>& response, ArenaString& out, bool header_only, beast::error_code& ec) {
+			http::response_serializer<Body, Fields> serializer{ response };
+			serializer.split(header_only);
+			while (!ec && !(header_only ? serializer.is_header_done() : serializer.is_done())) {
+				serializer.next(ec, [&serializer, &out](beast::error_code&, const auto& buffers) {
+					for (auto buffer : beast::buffers_range_ref(buffers)) {
+						out.append(static_cast<const char*>(buffer.data()), buffer.size());
+					}
+					serializer.consume(beast::buffer_bytes(buffers));
+					});
+			}
+		}
+
+		ResponseSlot& GetSlot(std::uint64_t sequence) {
+			return slots_[sequence % max_pipelined_requests];
+		}
+
+		void OnResponseReady(ResponseSlot& slot);
+
+		// Пишет одним writev все готовые ответы, идущие подряд от самого раннего
+		void WriteReady();
+
+		// Отправляет байты файла [offset, size). Когда буфер сокета заполнен, ждет возможности писать дальше
+		void SendFile(std::shared_ptr<const FileDescriptor> file, std::uint64_t offset, std::uint64_t size);
 
 		void OnRead(beast::error_code ec, [[maybe_unused]] std::size_t bytes_read);
 
 		void Close();
 
-		// Обработку запроса делегируем подклассу
-		virtual void HandleRequest(HttpRequest&& request) = 0;
+		// Передает запрос подклассу и читает следующий, не дожидаясь ответа
+		void Dispatch(HttpRequest&& request);
+
+		// Обработку запроса делегируем подклассу. Возвращает false, если подкласс забрал соединение себе
+		virtual bool HandleRequest(HttpRequest&& request, std::uint64_t sequence) = 0;
 
 		void Read();
 
 		virtual std::shared_ptr<SessionBase> GetSharedThis() = 0;
 
-		void OnWrite(bool close, beast::error_code ec, [[maybe_unused]] std::size_t bytes_written);
+		void OnWrite(beast::error_code ec, [[maybe_unused]] std::size_t bytes_written);
 
 	private:
 		// tcp_stream содержит внутри себя сокет и добавляет поддержку таймаутов
 		beast::flat_buffer buffer_;
-		HttpRequest request_;
+		// Парсер пересоздается на месте для каждого запроса, без выделения памяти под него
+		SessionArena* arena_ = SessionArena::Create();
+		std::optional<http::request_parser<ArenaStringBody, ArenaAllocator<char>>> parser_;
+		// Запрос на переход к WebSocket ждет, пока не будут отправлены ответы на предыдущие запросы
+		std::optional<HttpRequest> deferred_upgrade_;
+
+		// Состояние очереди меняется только в executor соединения.
+		// Ответы на запросы [write_sequence_, read_sequence_) еще не отправлены
+		std::array<ResponseSlot, max_pipelined_requests> slots_;
+		std::vector<net::const_buffer> write_buffers_;
+		std::uint64_t read_sequence_ = 0;
+		std::uint64_t write_sequence_ = 0;
+		size_t writing_count_ = 0;
+		bool reading_ = false;
+		// Читается запрос, который уже лежит в buffer_. Запись откладывается, чтобы ответить на все сразу
+		bool batching_ = false;
+		bool writing_ = false;
+		bool stop_reading_ = false;
+		bool closed_ = false;
 	protected:
 		beast::tcp_stream stream_;
 	};
@@ -79,38 +434,91 @@ namespace http_server {
 	class Session : public SessionBase, public std::enable_shared_from_this<Session<RequestHandler>> {
 	public:
 		template <typename Handler>
-		Session(tcp::socket&& socket, Handler&& request_handler)
+		Session(tcp::socket&& socket, Handler&& request_handler, UpgradeHandler upgrade_handler = {})
 			: SessionBase(std::move(socket))
-			, request_handler_(std::forward<Handler>(request_handler)) {
+			, request_handler_(std::forward<Handler>(request_handler))
+			, upgrade_handler_(std::move(upgrade_handler)) {
 		}
 	private:
 		std::shared_ptr<SessionBase> GetSharedThis() override {
 			return this->shared_from_this();
 		}
 
-		void HandleRequest(HttpRequest&& request) override {
+		bool HandleRequest(HttpRequest&& request, std::uint64_t sequence) override {
+			if (upgrade_handler_ && websocket::is_upgrade(request) && upgrade_handler_(stream_, request)) {
+				// Соединение передано WebSocket-сессии, эта сессия больше ничего не читает
+				return false;
+			}
+
 			// Захватываем умный указатель на текущий объект Session в лямбде,
 			// чтобы продлить время жизни сессии до вызова лямбды.
 			// Используется generic-лямбда функция, способная принять response произвольного типа
 			//Rvalue-ссылку на запрос. + Функцию, отправляющую ответ клиенту. 
-			request_handler_(stream_.socket().remote_endpoint(), std::move(request), [self = this->shared_from_this()](auto&& response) {
-				self->Write(std::move(response));
+			request_handler_(stream_.socket().remote_endpoint(), std::move(request), [self = this->shared_from_this(), sequence](auto&& response) {
+				self->Write(std::move(response), sequence);
 				});
+			return true;
 		}
 
 	private:
 		RequestHandler request_handler_;
+		UpgradeHandler upgrade_handler_;
+	};
+
+	// Набор io_context, по одному на ядро. Каждый выполняется в своем потоке, привязанном к ядру,
+	// поэтому соединение, принятое в io_context, обслуживается одним потоком без strand
+	class IoContextPool {
+	public:
+		explicit IoContextPool(unsigned size);
+
+		IoContextPool(const IoContextPool&) = delete;
+		IoContextPool& operator=(const IoContextPool&) = delete;
+
+		~IoContextPool();
+
+		size_t GetSize() const noexcept {
+			return contexts_.size();
+		}
+
+		net::io_context& Get(size_t index) {
+			return *contexts_.at(index);
+		}
+
+		// Запускает потоки io_context и сразу возвращает управление
+		void Run();
+
+		// Останавливает io_context. Можно вызывать из любого потока
+		void Stop();
+
+		// Дожидается завершения потоков после Stop
+		void Join();
+
+	private:
+		std::vector<std::unique_ptr<net::io_context>> contexts_;
+		std::vector<std::thread> threads_;
+	};
+
+	enum class ListenerMode {
+		// Один acceptor на общем io_context, соединения обслуживаются в своих strand на любом из потоков
+		SHARED,
+		// acceptor в группе SO_REUSEPORT: ядро ОС само распределяет новые соединения между acceptor
+		// разных io_context, а соединение остается в потоке своего io_context
+		REUSE_PORT,
 	};
 
 	template <typename RequestHandler>
 	class Listener : public std::enable_shared_from_this<Listener<RequestHandler>> {
 	public:
 		template <typename Handler>
-		Listener(net::io_context& ioc, const tcp::endpoint& endpoint, Handler&& request_handler)
+		Listener(net::io_context& ioc, const tcp::endpoint& endpoint, Handler&& request_handler, UpgradeHandler upgrade_handler = {},
+			ListenerMode mode = ListenerMode::SHARED)
 			: ioc_(ioc)
-			// Обработчики асинхронных операций acceptor_ будут вызываться в своём strand
-			, acceptor_(net::make_strand(ioc))
-			, request_handler_(std::forward<Handler>(request_handler)) {
+			, mode_(mode)
+			// Обработчики асинхронных операций acceptor_ будут вызываться в своём strand.
+			// io_context группы SO_REUSEPORT выполняется в одном потоке, и strand ему не нужен
+			, acceptor_(MakeExecutor())
+			, request_handler_(std::forward<Handler>(request_handler))
+			, upgrade_handler_(std::move(upgrade_handler)) {
 			// Открываем acceptor, используя протокол (IPv4 или IPv6), указанный в endpoint
 			acceptor_.open(endpoint.protocol());
 
@@ -119,6 +527,9 @@ namespace http_server {
 			// Однако это может помешать повторно открыть сокет в полузакрытом состоянии.
 			// Флаг reuse_address разрешает открыть сокет, когда он "наполовину закрыт"
 			acceptor_.set_option(net::socket_base::reuse_address(true));
+			if (mode_ == ListenerMode::REUSE_PORT) {
+				SetReusePort(acceptor_);
+			}
 			// Привязываем acceptor к адресу и порту endpoint
 			acceptor_.bind(endpoint);
 			// Переводим acceptor в состояние, в котором он способен принимать новые соединения
@@ -133,9 +544,9 @@ namespace http_server {
 	private:
 		void DoAccept() {
 			acceptor_.async_accept(
-				// Передаём последовательный исполнитель, в котором будут вызываться обработчики
+				// Передаём исполнитель, в котором будут вызываться обработчики
 				// асинхронных операций сокета
-				net::make_strand(ioc_),
+				MakeExecutor(),
 				// С помощью bind_front_handler создаём обработчик, привязанный к методу OnAccept
 				// текущего объекта.
 				// Так как Listener — шаблонный класс, нужно подсказать компилятору, что
@@ -163,21 +574,40 @@ namespace http_server {
 		}
 
 		void AsyncRunSession(tcp::socket&& socket) {
-			std::make_shared<Session<RequestHandler>>(std::move(socket), request_handler_)->Run();
+			std::make_shared<Session<RequestHandler>>(std::move(socket), request_handler_, upgrade_handler_)->Run();
+		}
+
+		net::any_io_executor MakeExecutor() {
+			if (mode_ == ListenerMode::REUSE_PORT) {
+				return ioc_.get_executor();
+			}
+			return net::make_strand(ioc_);
 		}
 
 	private:
 		net::io_context& ioc_;
+		ListenerMode mode_;
 		tcp::acceptor acceptor_;
 		RequestHandler request_handler_;
+		UpgradeHandler upgrade_handler_;
 	};
 
 	template <typename RequestHandler>
-	void ServeHttp(net::io_context& ioc, const tcp::endpoint& endpoint, RequestHandler&& handler) {
+	void ServeHttp(net::io_context& ioc, const tcp::endpoint& endpoint, RequestHandler&& handler, UpgradeHandler upgrade_handler = {}) {
 		// При помощи decay_t исключим ссылки из типа RequestHandler,
 		// чтобы Listener хранил RequestHandler по значению
 		using MyListener = Listener<std::decay_t<RequestHandler>>;
 
-		std::make_shared<MyListener>(ioc, endpoint, std::forward<RequestHandler>(handler))->Run();
+		std::make_shared<MyListener>(ioc, endpoint, std::forward<RequestHandler>(handler), std::move(upgrade_handler))->Run();
+	}
+
+	// Запускает по acceptor с SO_REUSEPORT в каждом io_context набора
+	template <typename RequestHandler>
+	void ServeHttp(IoContextPool& pool, const tcp::endpoint& endpoint, RequestHandler&& handler, UpgradeHandler upgrade_handler = {}) {
+		using MyListener = Listener<std::decay_t<RequestHandler>>;
+
+		for (size_t i = 0; i < pool.GetSize(); ++i) {
+			std::make_shared<MyListener>(pool.Get(i), endpoint, handler, upgrade_handler, ListenerMode::REUSE_PORT)->Run();
+		}
 	}
 }  // namespace http_server
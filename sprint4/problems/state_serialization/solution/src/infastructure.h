@@ -2,141 +2,352 @@
 #include "app.h"
 #include <chrono>
 #include <boost/serialization/vector.hpp>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include "action_journal.h"
 #include "model_serialization.h"
+#include "state_file.h"
 #include <boost/archive/text_iarchive.hpp>
-#include <boost/archive/text_oarchive.hpp>
 
 using namespace std::literals;
 
 namespace infrastructure {
+	// Текстовый архив прежнего формата файла состояния, читается только при восстановлении
 	using InputArchive = boost::archive::text_iarchive;
-	using OutputArchive = boost::archive::text_oarchive;
 
-	class SerializingListener : public app::ApplicationListener {
+	// Фоновый поток записи файла состояния. Снимок сериализуется и пишется во временный файл,
+	// который после fsync атомарно заменяет файл состояния. Снимок, переданный пока предыдущий
+	// еще ждет записи, заменяет его - на диск попадает только самое свежее состояние.
+	// on_saved вызывается в потоке записи после того, как снимок надежно записан
+	class StateFileWriter {
 	public:
-		SerializingListener(const std::string& state_file, app::Application& app, std::chrono::milliseconds save_period)
-			: state_file_(state_file)
-			, app_(app)
-			, save_period_(save_period) {
+		using SavedHandler = std::function<void(const serialization::StateRepr&)>;
+
+		explicit StateFileWriter(std::string state_file, SavedHandler on_saved = {})
+			: state_file_(std::move(state_file))
+			, on_saved_(std::move(on_saved))
+			, thread_([this] { Run(); }) {
 		}
 
-		void OnTick(std::chrono::milliseconds timestamp) override {
-			if (timestamp - time_since_save_ >= save_period_) {
-				SaveState();
-				time_since_save_ = timestamp;
+		StateFileWriter(const StateFileWriter&) = delete;
+		StateFileWriter& operator=(const StateFileWriter&) = delete;
+
+		// Записывает последний переданный снимок и останавливает поток
+		~StateFileWriter() {
+			{
+				std::lock_guard lock(mutex_);
+				stop_ = true;
 			}
+			work_cv_.notify_one();
+			thread_.join();
 		}
 
-		void SaveState() {
-			std::string tmp_file = state_file_ + ".tmp"s;
-			try {
-				std::ofstream ofs(tmp_file, std::ios::binary);
-				if (!ofs) {
-					throw std::runtime_error("Cannot open temp file!");
+		void Schedule(serialization::StateRepr state) {
+			std::optional<serialization::StateRepr> replaced;
+			{
+				std::lock_guard lock(mutex_);
+				if (pending_) {
+					replaced = std::move(pending_);
+					++coalesced_saves_;
 				}
-				OutputArchive output_archive(ofs);
-				const auto& game = app_.GetGame();
-				const auto& maps = game->GetMaps();
+				pending_ = std::move(state);
+			}
+			work_cv_.notify_one();
+		}
 
-				if (!game) {
-					throw std::logic_error("Ptr game if null!");
-				}
+		// Ждет записи всех переданных снимков
+		void Flush() {
+			std::unique_lock lock(mutex_);
+			idle_cv_.wait(lock, [this] { return !pending_ && !busy_; });
+		}
 
-				auto players = app_.GetListPlayersUseCase();
-				std::vector<serialization::MapRepr> maps_repr;
-				for (auto map : maps) {
-					std::vector<serialization::DogRepr> dogs_repr;
-					std::vector<serialization::LootRepr> loots_repr;
-					std::vector<serialization::PlayerRepr> players_repr;
-
-					if (auto* session = game->FindGameSessions(map->GetId()); session) {
-						auto dogs = session->GetDogs();
-
-						for (const auto& dog : dogs) {
-							dogs_repr.emplace_back(*dog.second);
-							const app::Player* player = players->FindByDogIdAndMapId(dog.second->GetName(), map->GetId());
-							players_repr.emplace_back(player, player->GetToken());
-						}
-
-						auto loots = map->GetLoots();
-						for (const auto& loot : loots) {
-							loots_repr.emplace_back(loot);
-						}
-					}
-					maps_repr.push_back(serialization::MapRepr{ map->GetId(), players_repr, loots_repr, dogs_repr });
+		bool IsIdle() const {
+			std::lock_guard lock(mutex_);
+			return !pending_ && !busy_;
+		}
+
+		size_t GetCompletedSaves() const {
+			std::lock_guard lock(mutex_);
+			return completed_saves_;
+		}
+
+		size_t GetCoalescedSaves() const {
+			std::lock_guard lock(mutex_);
+			return coalesced_saves_;
+		}
+
+	private:
+		void Run() {
+			std::unique_lock lock(mutex_);
+			while (true) {
+				work_cv_.wait(lock, [this] { return stop_ || pending_; });
+				if (!pending_) {
+					return;
 				}
+				auto state = std::move(*pending_);
+				pending_.reset();
+				busy_ = true;
 
-				output_archive << maps_repr;
+				lock.unlock();
+				if (Write(state) && on_saved_) {
+					on_saved_(state);
+				}
+				state.maps_.clear();
+				lock.lock();
 
-				ofs.flush();
-				ofs.close();
+				busy_ = false;
+				++completed_saves_;
+				idle_cv_.notify_all();
+			}
+		}
 
+		bool Write(const serialization::StateRepr& state) {
+			const std::string tmp_file = state_file_ + ".tmp"s;
+			try {
+				serialization::state_file::WriteFileDurably(tmp_file, serialization::state_file::Encode(state));
 				std::filesystem::rename(tmp_file, state_file_);
-
 				std::filesystem::permissions(state_file_,
 					std::filesystem::perms::owner_read | std::filesystem::perms::owner_write,
 					std::filesystem::perm_options::replace);
+				serialization::state_file::SyncDirectory(std::filesystem::path(state_file_).parent_path());
+				return true;
+			}
+			catch (const std::exception& exc) {
+				std::cerr << "Save error: " << exc.what() << std::endl;
+				std::error_code ec;
+				std::filesystem::remove(tmp_file, ec);
+				return false;
+			}
+		}
+
+	private:
+		const std::string state_file_;
+		const SavedHandler on_saved_;
+		mutable std::mutex mutex_;
+		std::condition_variable work_cv_;
+		std::condition_variable idle_cv_;
+		std::optional<serialization::StateRepr> pending_;
+		bool busy_ = false;
+		bool stop_ = false;
+		size_t completed_saves_ = 0;
+		size_t coalesced_saves_ = 0;
+		std::thread thread_;
+	};
+
+	struct RestoreResult {
+		std::uint64_t journal_generation = 0;
+		size_t dogs = 0;
+		size_t loots = 0;
+	};
+
+	class SerializingListener : public app::ApplicationListener {
+	public:
+		SerializingListener(const std::string& state_file, app::Application& app, std::chrono::milliseconds save_period)
+			: state_file_(state_file)
+			, app_(app)
+			, save_period_(save_period)
+			, writer_(state_file, [this](const serialization::StateRepr& state) {
+				// Действия поколений журнала до снимка в нем уже учтены
+				RemoveJournalBefore(state_file_, state.journal_generation_);
+				}) {
+		}
+
+		// Номер поколения журнала после восстановления и сам журнал, если он ведется.
+		// Снимок запоминает поколение, с которого начинаются не вошедшие в него действия
+		void SetJournal(std::uint64_t generation, std::shared_ptr<ActionJournal> journal) {
+			journal_generation_ = generation;
+			journal_ = std::move(journal);
+		}
+
+		// Тик только снимает копию состояния, сериализация и запись на диск идут в потоке writer_.
+		// Пока писатель занят, копия не снимается: сохранения за это время сливаются в одно
+		// со свежим состоянием на первом тике после освобождения писателя
+		void OnTick(std::chrono::milliseconds timestamp) override {
+			if (timestamp - time_since_save_ >= save_period_ && writer_.IsIdle()) {
+				writer_.Schedule(CaptureState());
+				time_since_save_ = timestamp;
+			}
+		}
+
+		// Сохраняет состояние и дожидается окончания записи
+		void SaveState() {
+			try {
+				writer_.Schedule(CaptureState());
 			}
 			catch (const std::exception& exc) {
 				std::cerr << "Save error: " << exc.what() << std::endl;
-				std::filesystem::remove(tmp_file);
 			}
+			writer_.Flush();
 		}
 
-		void RestoreGameState(const std::string& state_file) {
+		// Согласованная копия сессий, собак, предметов и токенов. Вызывается под блокировкой
+		// состояния игры, поэтому копирует представления, не сериализуя их.
+		// Действия после копии журнал пишет уже в следующее поколение
+		serialization::StateRepr CaptureState() {
+			serialization::StateRepr state;
+			state.journal_generation_ = journal_ ? journal_->Rotate() : journal_generation_;
+			state.maps_ = CaptureMaps();
+			return state;
+		}
+
+		// Восстанавливает состояние из файла. Поколение журнала в результате - то, с которого
+		// нужно повторить действия, не вошедшие в снимок
+		RestoreResult RestoreGameState(const std::string& state_file) {
+			RestoreResult result;
 			try {
 				if (!std::filesystem::exists(state_file_)) {
-					return;
+					return result;
 				}
-				std::ifstream ifs(state_file);
-				if (!ifs.is_open()) { 
-					return;
-				}
-				auto size = std::filesystem::file_size(state_file_);
+				const serialization::StateRepr state = LoadStateRepr(state_file);
+				result.journal_generation = state.journal_generation_;
 
-				InputArchive input_archive(ifs);
-				std::vector<serialization::MapRepr> maps_repr;
-			
-				input_archive >> maps_repr;
+				// Сессии разных карт независимы, поэтому восстанавливаются параллельно
 				const auto& game = app_.GetGame();
-				for (auto& map_repr : maps_repr) {
-					auto map_data = map_repr.Restore();
-					if (auto* session = game->FindGameSessions(map_data.id_); session) {
-
-						const auto& map = session->GetMap();
-						std::vector<app::Player> players;
-						for (auto player_repr : map_data.players_) {
-							players.emplace_back(player_repr.Restore());
-						}
-
-						for (auto dog_repr : map_data.dogs_) {
-							model::Dog dog = dog_repr.Restore();
-
-							auto road = map->GetRoads().at(*dog.GetRoadId());
-							dog.SetNewRoad(road);
-							auto f_player = std::find_if(players.begin(), players.end(), [&](const app::Player& player) {
-								return *dog.GetId() == *player.GetId();
-								});
-
-							if (f_player != players.end()) {
-								app_.JoinGame(session->AddDog(dog), session, f_player->GetToken());
+				std::vector<std::exception_ptr> errors(state.maps_.size());
+				{
+					const auto num_threads = static_cast<unsigned>(std::min<size_t>(
+						std::max(1u, std::thread::hardware_concurrency()), std::max<size_t>(1, state.maps_.size())));
+					boost::asio::thread_pool pool(num_threads);
+					for (size_t i = 0; i < state.maps_.size(); ++i) {
+						boost::asio::post(pool, [this, &game, &state, &errors, i] {
+							try {
+								RestoreMap(*game, state.maps_[i]);
+							}
+							catch (...) {
+								errors[i] = std::current_exception();
 							}
-						}
-						for (auto loot_repr : map_data.loots_) {
-							map->AddLoot(loot_repr.Restore());
-						}
+							});
 					}
+					pool.join();
+				}
+				for (const auto& error : errors) {
+					if (error) {
+						std::rethrow_exception(error);
+					}
+				}
+
+				for (const auto& map_repr : state.maps_) {
+					result.dogs += map_repr.dogs_.size();
+					result.loots += map_repr.loots_.size();
 				}
 			}
 			catch (const std::exception& exc) {
 				std::cerr << exc.what() << std::endl;
 			}
+			return result;
 		}
+	private:
+		void RestoreMap(model::Game& game, const serialization::MapRepr& map_repr) {
+			auto* session = game.FindGameSessions(map_repr.id_);
+			if (!session) {
+				return;
+			}
+			const auto& map = session->GetMap();
+			const auto& roads = map->GetRoads();
+			const auto& players = map_repr.players_;
+
+			// Игроки сохраняются в порядке собак, поэтому пара обычно лежит по тому же индексу.
+			// Иначе игрок ищется по индексу id, который строится один раз
+			std::unordered_map<std::uint32_t, const serialization::PlayerRepr*> players_by_id;
+			const auto find_player = [&](size_t index, model::Dog::Id dog_id) -> const serialization::PlayerRepr* {
+				if (index < players.size() && *players[index].GetId() == *dog_id) {
+					return &players[index];
+				}
+				if (players_by_id.empty()) {
+					players_by_id.reserve(players.size());
+					for (const auto& player_repr : players) {
+						players_by_id.emplace(*player_repr.GetId(), &player_repr);
+					}
+				}
+				const auto it = players_by_id.find(*dog_id);
+				return it != players_by_id.end() ? it->second : nullptr;
+			};
+
+			std::vector<std::pair<model::Dog, app::Token>> dogs;
+			dogs.reserve(map_repr.dogs_.size());
+			for (size_t i = 0; i < map_repr.dogs_.size(); ++i) {
+				model::Dog dog = map_repr.dogs_[i].Restore();
+				if (const auto* player_repr = find_player(i, dog.GetId())) {
+					dog.SetNewRoad(roads.at(*dog.GetRoadId()));
+					dogs.emplace_back(std::move(dog), player_repr->GetToken());
+				}
+			}
+			app_.RestorePlayers(*session, dogs);
+
+			map->ReserveLoots(map->GetLoots().size() + map_repr.loots_.size());
+			for (const auto& loot_repr : map_repr.loots_) {
+				map->AddLoot(loot_repr.Restore());
+			}
+		}
+
+		std::vector<serialization::MapRepr> CaptureMaps() const {
+			const auto& game = app_.GetGame();
+			if (!game) {
+				throw std::logic_error("Ptr game if null!");
+			}
+			const auto& maps = game->GetMaps();
+
+			auto players = app_.GetListPlayersUseCase();
+			std::vector<serialization::MapRepr> maps_repr;
+			maps_repr.reserve(maps.size());
+			for (auto map : maps) {
+				std::vector<serialization::DogRepr> dogs_repr;
+				std::vector<serialization::LootRepr> loots_repr;
+				std::vector<serialization::PlayerRepr> players_repr;
+
+				if (auto* session = game->FindGameSessions(map->GetId()); session) {
+					dogs_repr.reserve(session->GetDogCount());
+					players_repr.reserve(session->GetDogCount());
+					for (size_t i = 0; i < session->GetDogCount(); ++i) {
+						const auto dog = session->GetDog(i);
+						dogs_repr.emplace_back(dog);
+						const app::Player* player = players->FindByDogIdAndMapId(dog.GetName(), map->GetId());
+						players_repr.emplace_back(player, player->GetToken());
+					}
+
+					const auto loots = map->GetLoots();
+					loots_repr.reserve(loots.size());
+					for (const auto& loot : loots) {
+						loots_repr.emplace_back(loot);
+					}
+				}
+				maps_repr.emplace_back(map->GetId(), std::move(players_repr), std::move(loots_repr), std::move(dogs_repr));
+			}
+			return maps_repr;
+		}
+
+		// Файл нового формата читается прямо из отображения в память,
+		// файл без сигнатуры - текстовым архивом прежних версий сервера
+		static serialization::StateRepr LoadStateRepr(const std::string& state_file) {
+			serialization::StateRepr state;
+			{
+				serialization::state_file::MappedFile mapped_file(state_file);
+				if (serialization::state_file::HasSignature(mapped_file.GetData())) {
+					serialization::state_file::Decode(mapped_file.GetData(), state);
+					return state;
+				}
+			}
+			std::ifstream ifs(state_file);
+			if (!ifs.is_open()) {
+				throw std::runtime_error("Cannot open state file!");
+			}
+			InputArchive input_archive(ifs);
+			input_archive >> state.maps_;
+			return state;
+		}
+
 	private:
 		std::string state_file_;
 		app::Application& app_;
-		std::chrono::milliseconds time_since_save_;
+		std::chrono::milliseconds time_since_save_{ 0 };
 		std::chrono::milliseconds save_period_;
+		std::uint64_t journal_generation_ = 0;
+		std::shared_ptr<ActionJournal> journal_;
+		StateFileWriter writer_;
 	};
 }
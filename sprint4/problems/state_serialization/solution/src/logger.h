@@ -4,6 +4,9 @@
 
 #include <string>
 #include <optional>
+#include <iostream>
+#include <boost/make_shared.hpp>
+#include "async_log.h"
 #include "boost_includes.h"
 
 namespace logger {
@@ -33,6 +36,7 @@ namespace logger {
 	const std::string key_text = "text"s;
 	const std::string key_where = "where"s;
 	const std::string key_error = "error"s;
+	const std::string key_dropped_records = "dropped_log_records"s;
 
 	BOOST_LOG_ATTRIBUTE_KEYWORD(data, key_data, boost::json::value)
 		BOOST_LOG_ATTRIBUTE_KEYWORD(message, key_message, std::string)
@@ -59,17 +63,37 @@ namespace logger {
 			obj[key_message] = *new_message;
 		}
 
-		std::string json_str = boost::json::serialize(std::move(obj));
-		strm << boost::json::serialize(std::move(obj)) << std::endl;
+		strm << boost::json::serialize(obj) << std::endl;
 	}
 
-	inline void InitBoostLogFilter() {
-		logging::add_console_log(
-			std::clog,
-			boost::log::keywords::format = &MyFormatter,
-			boost::log::keywords::auto_flush = true
-		);
+	//    HTTP-  ,  MyFormatter -  Boost.Log
+	inline void MyAccessFormatter(const AccessLogEntry& entry, logging::formatting_ostream& strm) {
+		boost::json::object obj;
+		obj[key_timestamp] = to_iso_extended_string(entry.timestamp);
+
+		if (entry.kind == AccessLogEntry::Kind::REQUEST) {
+			obj[key_data] = { {key_ip, entry.ip.to_string()},
+							  {key_uri, entry.GetUri()},
+							  {key_method, entry.GetMethod()} };
+			obj[key_message] = key_request_received;
+		}
+		else {
+			obj[key_data] = { {key_response_time, std::to_string(entry.response_time)},
+							  {key_code, entry.code},
+							  {key_content_type, entry.GetContentType()} };
+			obj[key_message] = key_response_sent;
+		}
+
+		strm << boost::json::serialize(obj) << std::endl;
+	}
+
+	//       std::clog  .    
+	//    :      
+	[[nodiscard]] inline AsyncLogGuard InitBoostLogFilter(const AsyncLogOptions& options = {}) {
+		auto backend = boost::make_shared<AsyncLogBackend>(std::clog, &MyFormatter, options, &MyAccessFormatter);
+		AsyncLogGuard guard(boost::make_shared<AsyncLogSink>(backend));
 		logging::add_common_attributes();
+		return guard;
 	}
 
 	inline boost::json::value CreateJsonExc(const int code, std::optional<std::string> ex = std::nullopt) {
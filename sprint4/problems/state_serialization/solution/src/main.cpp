@@ -38,6 +38,9 @@ struct Args {
 	std::optional<bool> is_random_positions;
 	std::optional<std::string> state_file;
 	std::optional<std::chrono::milliseconds> save_state_period_ms;
+	std::optional<std::chrono::milliseconds> journal_commit_period_ms;
+	bool per_core_io = false;
+	AsyncLogOptions log_options;
 };
 
 [[nodiscard]] std::optional<Args> ParseCommandLine(int argc, const char* const argv[]) {
@@ -59,7 +62,25 @@ struct Args {
 		//Файл в который приложение должно сохранять своё состояние в процессе работы, а при старте — восстанавливать
 		("state-file", po::value<std::string>()->notifier([&](const std::string& v) { args.state_file = v; })->value_name("state file"s), "set state file path")
 		//Задаёт период автоматического сохранения состояния сервера.
-		("save-state-period", po::value<int>()->notifier([&](const int& v) { args.save_state_period_ms = std::chrono::milliseconds{ v }; })->value_name("save state period"s), "set save state period");
+		("save-state-period", po::value<int>()->notifier([&](const int& v) { args.save_state_period_ms = std::chrono::milliseconds{ v }; })->value_name("save state period"s), "set save state period")
+		//Включает журнал действий игроков рядом с файлом состояния и задаёт период группового сброса журнала на диск
+		("journal-commit-period", po::value<int>()->notifier([&](const int& v) { args.journal_commit_period_ms = std::chrono::milliseconds{ v }; })->value_name("milliseconds"s), "write action journal, commit it every period")
+		//Принимает и обслуживает соединения в отдельном io_context на каждом ядре, acceptor которых слушают порт через SO_REUSEPORT
+		("per-core-io", po::bool_switch(&args.per_core_io), "serve connections on an io_context per core")
+		//Что делать с записью лога, когда буфер лога заполнен: ждать потока записи или отбросить запись
+		("log-overflow", po::value<std::string>()->notifier([&](const std::string& v) {
+			if (v == "block"sv) {
+				args.log_options.overflow = OverflowPolicy::BLOCK;
+			}
+			else if (v == "drop"sv) {
+				args.log_options.overflow = OverflowPolicy::DROP;
+			}
+			else {
+				throw po::validation_error(po::validation_error::invalid_option_value, "log-overflow"s, v);
+			}
+			})->value_name("block|drop"s), "block server threads or drop records when the log buffer is full")
+		//Количество записей в буфере асинхронного лога
+		("log-capacity", po::value(&args.log_options.capacity)->value_name("records"s), "set log buffer capacity");
 
 	// variables_map хранит значения опций после разбора
 	po::variables_map vm;
@@ -83,11 +104,31 @@ struct Args {
 }
 
 int main(int argc, const char* argv[]) {
-	InitBoostLogFilter();
+	// Параметры лога задаются в командной строке, поэтому она разбирается до запуска лога
+	std::optional<Args> args;
+	try {
+		args = ParseCommandLine(argc, argv);
+	}
+	catch (const std::exception& ex) {
+		const auto log_guard = InitBoostLogFilter();
+		BOOST_LOG_TRIVIAL(fatal) << logging::add_value(data, CreateJsonExc(EXIT_FAILURE, ex.what()))
+			<< logging::add_value(message, key_server_exited);
+
+		return EXIT_FAILURE;
+	}
+
+	// Лог пишет отдельный поток. Записи, принятые до выхода из main, дописываются при уничтожении log_guard
+	const auto log_guard = InitBoostLogFilter(args ? args->log_options : AsyncLogOptions{});
+	// Сколько записей лога отброшено из-за заполненного буфера (--log-overflow=drop)
+	const auto exit_data = [&log_guard](const int code, std::optional<std::string> ex = std::nullopt) {
+		auto result = CreateJsonExc(code, std::move(ex));
+		result.as_object()[key_dropped_records] = log_guard.GetBackend().GetDroppedCount();
+		return result;
+	};
 
 	try {
 
-		if (auto args = ParseCommandLine(argc, argv)) {
+		if (args) {
 			// 1. Загружаем карту из файла и построить модель игры
 			std::shared_ptr<model::Game> game = std::make_shared<model::Game>(json_loader::LoadGame(args->cfg_file));
 			std::shared_ptr<infrastructure::SerializingListener> serializing_listener;
@@ -96,18 +137,26 @@ int main(int argc, const char* argv[]) {
 			net::io_context ioc(num_threads);
 			// strand для выполнения запросов к API
 			auto api_strand = net::make_strand(ioc);
+			// В режиме --per-core-io соединения живут в своих io_context, а ioc выполняет только запросы к игре и тики
+			std::unique_ptr<http_server::IoContextPool> io_pool;
+			if (args->per_core_io) {
+				io_pool = std::make_unique<http_server::IoContextPool>(num_threads);
+			}
 
 			// 3. Добавляем асинхронный обработчик сигналов SIGINT и SIGTERM
 			net::signal_set signals(ioc, SIGINT, SIGTERM);
-			signals.async_wait([&ioc, &args](const sys::error_code& ec, [[maybe_unused]] int signal_number) {
+			signals.async_wait([&ioc, &io_pool, &exit_data](const sys::error_code& ec, [[maybe_unused]] int signal_number) {
 				if (!ec) {
 					ioc.stop();
+					if (io_pool) {
+						io_pool->Stop();
+					}
 
-					BOOST_LOG_TRIVIAL(info) << logging::add_value(data, CreateJsonExc(0))
+					BOOST_LOG_TRIVIAL(info) << logging::add_value(data, exit_data(0))
 						<< logging::add_value(message, key_server_exited);
 				}
 				else {
-					BOOST_LOG_TRIVIAL(fatal) << logging::add_value(data, CreateJsonExc(ec.value(), ec.what()))
+					BOOST_LOG_TRIVIAL(fatal) << logging::add_value(data, exit_data(ec.value(), ec.what()))
 						<< logging::add_value(message, key_server_exited);
 				}
 
@@ -122,19 +171,47 @@ int main(int argc, const char* argv[]) {
 	
 			
 			app::Application application(game, join_game_use_case, player_tokens);
+			application.SetTickThreads(num_threads);
 			http_handler::ApiHandler api_handler(application);
 
 			if (args->state_file.has_value()) {
 				auto period = args->save_state_period_ms.value_or(std::chrono::milliseconds::zero());
 				serializing_listener = std::make_shared<infrastructure::SerializingListener>(
 					args->state_file.value(), application, period);
-				serializing_listener->RestoreGameState(args->state_file.value());
+				const auto restore_start = std::chrono::steady_clock::now();
+				const auto restored = serializing_listener->RestoreGameState(args->state_file.value());
+				const auto replay_start = std::chrono::steady_clock::now();
+
+				// Действия после снимка повторяются из журнала, даже если сейчас он не ведется
+				const auto replay = infrastructure::ReplayJournal(args->state_file.value(), restored.journal_generation, application);
+				const auto replay_end = std::chrono::steady_clock::now();
+
+				using Milliseconds = std::chrono::duration<double, std::milli>;
+				boost::json::value restore_data{
+					{"dogs"s, restored.dogs},
+					{"loots"s, restored.loots},
+					{"journal_records"s, replay.records},
+					{"restore_ms"s, Milliseconds(replay_start - restore_start).count()},
+					{"replay_ms"s, Milliseconds(replay_end - replay_start).count()} };
+				BOOST_LOG_TRIVIAL(info) << logging::add_value(data, restore_data)
+					<< logging::add_value(message, "state restored"s);
+				std::shared_ptr<infrastructure::ActionJournal> journal;
+				if (args->journal_commit_period_ms.has_value()) {
+					journal = std::make_shared<infrastructure::ActionJournal>(
+						args->state_file.value(), replay.next_generation, *args->journal_commit_period_ms);
+					application.SetActionJournal(journal);
+				}
+				serializing_listener->SetJournal(replay.next_generation, journal);
 			}
 
 			if (args->save_state_period_ms.has_value() && serializing_listener) {
-				application.SetApplicationListener(serializing_listener);
+				application.AddApplicationListener(serializing_listener);
 			}
 
+			// Клиенты WebSocket получают состояние своей сессии после каждого тика
+			auto state_streamer = std::make_shared<state_stream::StateStreamer>();
+			application.AddApplicationListener(state_streamer);
+
 
 			// Настраиваем вызов метода Application::Tick
 			std::shared_ptr<Ticker> ticker;
@@ -152,7 +229,7 @@ int main(int argc, const char* argv[]) {
 			// 4. Создаём обработчик HTTP-запросов и связываем его с моделью игры
 			// Создаём обработчик запросов в куче, управляемый shared_ptr
 			auto handler = std::make_shared<http_handler::RequestHandler>(
-				args->root_file, api_strand, api_handler, args->tick_period_ms.has_value());
+				args->root_file, api_strand, api_handler, args->tick_period_ms.has_value(), state_streamer);
 			
 			auto lambda = [handler](auto&& endpoint, auto&& req, auto&& send) {
 				// Обработка запроса
@@ -169,7 +246,16 @@ int main(int argc, const char* argv[]) {
 			const auto address = net::ip::make_address("0.0.0.0");
 			constexpr net::ip::port_type port = 8080;
 
-			http_server::ServeHttp(ioc, { address, port }, logging_handler);
+			http_server::UpgradeHandler upgrade_handler = [handler](beast::tcp_stream& stream, http_server::HttpRequest& req) {
+				return handler->TryUpgrade(stream, req);
+				};
+			if (io_pool) {
+				http_server::ServeHttp(*io_pool, { address, port }, logging_handler, upgrade_handler);
+				io_pool->Run();
+			}
+			else {
+				http_server::ServeHttp(ioc, { address, port }, logging_handler, upgrade_handler);
+			}
 
 			// Эта надпись сообщает тестам о том, что сервер запущен и готов обрабатывать запросы
 			boost::json::value custom_data{ {"port"s,port},{"address"s, "0.0.0.0"s} };
@@ -183,6 +269,10 @@ int main(int argc, const char* argv[]) {
 			RunWorkers(std::max(1u, num_threads), [&ioc] {
 				ioc.run();
 				});
+			if (io_pool) {
+				io_pool->Stop();
+				io_pool->Join();
+			}
 
 			if (serializing_listener) {
 				serializing_listener->SaveState();
@@ -190,7 +280,7 @@ int main(int argc, const char* argv[]) {
 		}
 	}
 	catch (const std::exception& ex) {
-		BOOST_LOG_TRIVIAL(fatal) << logging::add_value(data, CreateJsonExc(EXIT_FAILURE, ex.what()))
+		BOOST_LOG_TRIVIAL(fatal) << logging::add_value(data, exit_data(EXIT_FAILURE, ex.what()))
 			<< logging::add_value(message, key_server_exited);
 
 		return EXIT_FAILURE;
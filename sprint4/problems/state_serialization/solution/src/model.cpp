@@ -1,9 +1,147 @@
 ﻿#include "model.h"
 #include <iostream>
+#include <iterator>
 
 namespace model {
 using namespace std::literals;
 
+Loot::Id LootTable::Insert(Loot loot) {
+    if (next_sequence_ > max_sequence) {
+        throw std::length_error("Loot ids are exhausted"s);
+    }
+    std::uint32_t slot = free_head_;
+    if (slot != npos) {
+        free_head_ = slots_[slot].index;
+    }
+    else {
+        if (slots_.size() > slot_mask) {
+            throw std::length_error("Too many loot items"s);
+        }
+        slot = static_cast<std::uint32_t>(slots_.size());
+        slots_.emplace_back();
+    }
+
+    Slot& target = slots_[slot];
+    target.index = static_cast<std::uint32_t>(items_.size());
+    target.occupied = true;
+    target.id = (next_sequence_++ << slot_bits) | slot;
+
+    loot.id = Loot::Id{ target.id };
+    items_.push_back(std::move(loot));
+    item_slots_.push_back(slot);
+    return items_.back().id;
+}
+
+bool LootTable::Erase(Loot::Id id) noexcept {
+    if (!FindSlot(id)) {
+        return false;
+    }
+    const auto slot = static_cast<std::uint32_t>(*id & slot_mask);
+    Slot& erased = slots_[slot];
+    const std::uint32_t index = erased.index;
+    const std::uint32_t last = static_cast<std::uint32_t>(items_.size() - 1);
+
+    // Последний предмет занимает место удаленного
+    if (index != last) {
+        items_[index] = std::move(items_[last]);
+        item_slots_[index] = item_slots_[last];
+        slots_[item_slots_[index]].index = index;
+    }
+    items_.pop_back();
+    item_slots_.pop_back();
+
+    erased.occupied = false;
+    erased.index = free_head_;
+    free_head_ = slot;
+    return true;
+}
+
+const Loot* LootTable::Find(Loot::Id id) const noexcept {
+    const Slot* slot = FindSlot(id);
+    return slot ? &items_[slot->index] : nullptr;
+}
+
+void LootTable::Reserve(size_t count) {
+    items_.reserve(count);
+    item_slots_.reserve(count);
+    slots_.reserve(count);
+}
+
+void LootTable::Clear() noexcept {
+    items_.clear();
+    item_slots_.clear();
+    slots_.clear();
+    free_head_ = npos;
+}
+
+const LootTable::Slot* LootTable::FindSlot(Loot::Id id) const noexcept {
+    const size_t slot = *id & slot_mask;
+    if (slot >= slots_.size()) {
+        return nullptr;
+    }
+    const Slot& result = slots_[slot];
+    return result.occupied && result.id == *id ? &result : nullptr;
+}
+
+void RoadGraph::AddRoad(const Road& road) {
+    const size_t index = roads_.size();
+    const Point start = road.GetStart();
+    const Point end = road.GetEnd();
+    roads_.push_back(RoadInfo{ start, end, road.IsHorizontal(), road.IsVertical(),
+        std::min(start.x, end.x), std::max(start.x, end.x),
+        std::min(start.y, end.y), std::max(start.y, end.y), {} });
+
+    roads_at_point_[start].push_back(index);
+    if (!(end == start)) {
+        roads_at_point_[end].push_back(index);
+    }
+
+    // Подхватываем связи, добавленные ранее в концах новой дороги
+    constexpr Direction directions[] = { Direction::DIR_NORTH, Direction::DIR_SOUTH, Direction::DIR_WEST, Direction::DIR_EAST };
+    for (const Point& point : { start, end }) {
+        for (Direction dir : directions) {
+            if (auto it = links_.find(std::pair{ point, dir }); it != links_.end()) {
+                SetJunction(index, roads_[index].horizontal ? point.x : point.y, dir, it->second);
+            }
+        }
+    }
+}
+
+void RoadGraph::AddLink(Point point, Direction dir, size_t road) {
+    links_[std::pair{ point, dir }] = road;
+    if (auto it = roads_at_point_.find(point); it != roads_at_point_.end()) {
+        for (size_t index : it->second) {
+            SetJunction(index, roads_[index].horizontal ? point.x : point.y, dir, road);
+        }
+    }
+}
+
+size_t RoadGraph::FindJunction(size_t road, Coord position, Direction dir) const noexcept {
+    const auto& junctions = roads_[road].junctions;
+    auto it = std::lower_bound(junctions.begin(), junctions.end(), std::pair{ position, dir },
+        [](const Junction& junction, const std::pair<Coord, Direction>& key) {
+            return std::pair{ junction.position, junction.direction } < key;
+        });
+    if (it != junctions.end() && it->position == position && it->direction == dir) {
+        return it->road;
+    }
+    return npos;
+}
+
+void RoadGraph::SetJunction(size_t road, Coord position, Direction dir, size_t target) {
+    auto& junctions = roads_[road].junctions;
+    auto it = std::lower_bound(junctions.begin(), junctions.end(), std::pair{ position, dir },
+        [](const Junction& junction, const std::pair<Coord, Direction>& key) {
+            return std::pair{ junction.position, junction.direction } < key;
+        });
+    if (it != junctions.end() && it->position == position && it->direction == dir) {
+        it->road = target;
+    }
+    else {
+        junctions.insert(it, Junction{ position, dir, target });
+    }
+}
+
 void Map::AddOffice(Office office) {
     if (warehouse_id_to_index_.contains(office.GetId())) {
         throw std::invalid_argument("Duplicate warehouse");
@@ -28,6 +166,9 @@ void Game::AddMap(Map map) {
         try {
             maps_.emplace_back(std::make_shared<Map>(std::move((map))));
             sessions_.emplace_back(maps_.back());
+            if (loot_generator_) {
+                sessions_.back().SetLootGenerator(*loot_generator_);
+            }
         } catch (...) {
             map_id_to_index_.erase(it);
             throw;
@@ -37,6 +178,9 @@ void Game::AddMap(Map map) {
 void Game::AddLootGenerator(loot_gen::LootGenerator loot_generator) {
     if (!loot_generator_) {
         loot_generator_ = std::make_shared<loot_gen::LootGenerator>(std::move(loot_generator));
+        for (auto& session : sessions_) {
+            session.SetLootGenerator(*loot_generator_);
+        }
     }
 }
 
@@ -46,4 +190,65 @@ const std::shared_ptr<loot_gen::LootGenerator> Game::GetLootGenerator() const {
     }
     return loot_generator_;
 }
+
+void GameSession::CommitTick() {
+    ++tick_;
+    if (tick_changes_.size() < max_tick_changes) {
+        tick_changes_.resize(max_tick_changes);
+    }
+    // Ячейка переиспользуется, поэтому после заполнения кольца тик не выделяет память
+    TickChanges& changes = tick_changes_[tick_ % max_tick_changes];
+    changes.tick = tick_;
+    changes.dogs.clear();
+    changes.loots.clear();
+
+    for (size_t i = 0; i < dog_infos_.size(); ++i) {
+        const CommittedDog current{ dog_positions_[i], dog_speeds_[i], dog_directions_[i],
+            dog_infos_[i].bag.size(), dog_infos_[i].score };
+        if (i == committed_dogs_.size()) {
+            committed_dogs_.push_back(current);
+            changes.dogs.push_back(dog_infos_[i].id);
+            continue;
+        }
+
+        CommittedDog& committed = committed_dogs_[i];
+        if (committed.position.x != current.position.x || committed.position.y != current.position.y
+            || committed.speed.x != current.speed.x || committed.speed.y != current.speed.y
+            || committed.direction != current.direction || committed.bag_size != current.bag_size
+            || committed.score != current.score) {
+            committed = current;
+            changes.dogs.push_back(dog_infos_[i].id);
+        }
+    }
+
+    current_loots_.clear();
+    for (const auto& loot : map_->GetLoots()) {
+        current_loots_.push_back(loot.id);
+    }
+    std::sort(current_loots_.begin(), current_loots_.end());
+    std::set_symmetric_difference(committed_loots_.begin(), committed_loots_.end(),
+        current_loots_.begin(), current_loots_.end(), std::back_inserter(changes.loots));
+    std::swap(committed_loots_, current_loots_);
+}
+
+bool GameSession::CollectChanges(std::uint64_t since, std::vector<Dog::Id>& dogs, std::vector<Loot::Id>& loots) const {
+    if (since > tick_ || tick_ - since > max_tick_changes) {
+        return false;
+    }
+
+    for (std::uint64_t tick = since + 1; tick <= tick_; ++tick) {
+        const TickChanges& changes = tick_changes_[tick % max_tick_changes];
+        if (changes.tick != tick) {
+            return false;
+        }
+        dogs.insert(dogs.end(), changes.dogs.begin(), changes.dogs.end());
+        loots.insert(loots.end(), changes.loots.begin(), changes.loots.end());
+    }
+
+    std::sort(dogs.begin(), dogs.end());
+    dogs.erase(std::unique(dogs.begin(), dogs.end()), dogs.end());
+    std::sort(loots.begin(), loots.end());
+    loots.erase(std::unique(loots.begin(), loots.end()), loots.end());
+    return true;
+}
 }  // namespace model
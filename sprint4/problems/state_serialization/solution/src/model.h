@@ -4,6 +4,12 @@
 #include <vector>
 #include <memory>
 #include <iostream>
+#include <optional>
+#include <algorithm>
+#include <random>
+#include <span>
+#include <atomic>
+#include <cstdint>
 #include "tagged.h"
 #include <stdexcept>
 #include "loot_generator.h"
@@ -77,6 +83,59 @@ namespace model {
 
 	using Loots = std::vector<Loot>;
 
+	// Хранилище предметов карты со стабильными id.
+	// Id предмета - порядковый номер вставки в старших битах и номер слота в младших slot_bits битах,
+	// поэтому id растут монотонно и не превышают 2^53 (точно представимы в double у JS-клиентов).
+	// Предел - 2^slot_bits предметов на карте одновременно и 2^(53 - slot_bits) вставок за время жизни карты.
+	// Предметы лежат плотным массивом, удаление - перестановкой последнего на место удаленного
+	class LootTable {
+	public:
+		static constexpr unsigned slot_bits = 20;
+		static constexpr size_t max_id = (size_t{ 1 } << 53) - 1;
+
+		Loot::Id Insert(Loot loot);
+
+		// Удаляет предмет за O(1). Устаревший или неизвестный id игнорируется
+		bool Erase(Loot::Id id) noexcept;
+
+		const Loot* Find(Loot::Id id) const noexcept;
+
+		std::span<const Loot> GetItems() const noexcept {
+			return items_;
+		}
+
+		size_t Size() const noexcept {
+			return items_.size();
+		}
+
+		// Готовит место для count предметов, например перед восстановлением карты
+		void Reserve(size_t count);
+
+		// Удаляет все предметы. Нумерация id продолжается, чтобы клиенты не увидели повторных id
+		void Clear() noexcept;
+
+	private:
+		static constexpr std::uint32_t npos = static_cast<std::uint32_t>(-1);
+		static constexpr size_t slot_mask = (size_t{ 1 } << slot_bits) - 1;
+		static constexpr size_t max_sequence = max_id >> slot_bits;
+
+		struct Slot {
+			// Id текущего предмета слота. Сверяется в Find и Erase, чтобы отбросить устаревшие id
+			size_t id = 0;
+			// Индекс предмета в items_ для занятого слота, следующий свободный слот для свободного
+			std::uint32_t index = npos;
+			bool occupied = false;
+		};
+
+		const Slot* FindSlot(Loot::Id id) const noexcept;
+
+		std::vector<Loot> items_;
+		std::vector<std::uint32_t> item_slots_;
+		std::vector<Slot> slots_;
+		std::uint32_t free_head_ = npos;
+		size_t next_sequence_ = 0;
+	};
+
 	class Road {
 		struct HorizontalTag {
 			explicit HorizontalTag() = default;
@@ -168,6 +227,54 @@ namespace model {
 		Offset offset_;
 	};
 
+	// Граф дорог карты с целочисленными индексами дорог. Строится один раз при загрузке карты
+	// и позволяет переходить на соседнюю дорогу без поиска в Roadmap по хешу
+	class RoadGraph {
+	public:
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		// Примыкание дороги road в точке position (координата вдоль оси текущей дороги)
+		// для движения в направлении direction
+		struct Junction {
+			Coord position;
+			Direction direction;
+			size_t road;
+		};
+
+		struct RoadInfo {
+			Point start, end;
+			bool horizontal, vertical;
+			// Протяжённость дороги по осям
+			Coord min_x, max_x, min_y, max_y;
+			// Отсортированы по position, затем по direction
+			std::vector<Junction> junctions;
+		};
+
+		void AddRoad(const Road& road);
+
+		// Связывает точку и направление движения с дорогой, как Roadmap. Повторная связь заменяет прежнюю
+		void AddLink(Point point, Direction dir, size_t road);
+
+		const RoadInfo& GetRoad(size_t index) const noexcept {
+			return roads_[index];
+		}
+
+		size_t GetRoadCount() const noexcept {
+			return roads_.size();
+		}
+
+		// Возвращает индекс дороги, примыкающей к дороге road в точке position, или npos
+		size_t FindJunction(size_t road, Coord position, Direction dir) const noexcept;
+
+	private:
+		void SetJunction(size_t road, Coord position, Direction dir, size_t target);
+
+		std::vector<RoadInfo> roads_;
+		// Нужны только при построении графа
+		std::unordered_map<std::pair<Point, Direction>, size_t, HashPointDir> links_;
+		std::unordered_map<Point, std::vector<size_t>, HashPoint> roads_at_point_;
+	};
+
 	class Map {
 	public:
 		using Id = util::Tagged<std::string, Map>;
@@ -207,6 +314,7 @@ namespace model {
 
 		void AddRoad(const Road road) {
 			roads_.emplace_back(std::make_shared<Road>(road));
+			road_graph_.AddRoad(*roads_.back());
 			CreateRoadmap(roads_.back());
 		}
 
@@ -228,34 +336,40 @@ namespace model {
 			return roadmap_;
 		}
 
+		const RoadGraph& GetRoadGraph() const noexcept {
+			return road_graph_;
+		}
+
 		void AddLootDescription(LootDescription loot_description) {
 			loot_description_.emplace_back(std::make_shared<LootDescription>(std::move(loot_description)));
 		}
 
-		void AddLoot(Loot loot) {
-			loot.id = Loot::Id{ loots_.size() };
-			loots_.emplace_back(std::move(loot));
+		Loot::Id AddLoot(Loot loot) {
+			return loots_.Insert(std::move(loot));
 		}
 
-		Loots GetLoots() const noexcept {
-			return loots_;
+		void ReserveLoots(size_t count) {
+			loots_.Reserve(count);
 		}
 
-		LootsDescription GetDescription() const noexcept {
+		std::span<const Loot> GetLoots() const noexcept {
+			return loots_.GetItems();
+		}
+
+		const LootsDescription& GetDescription() const noexcept {
 			return loot_description_;
 		}
 
-		void ExtractLoot(Loot::Id idx) {
-			auto res = std::find_if(loots_.begin(), loots_.end(), [&](const Loot& loot) {
-				return loot.id == idx ;
-				});
-			if (res != loots_.end()) {
-				loots_.erase(res);
-			}
+		bool ExtractLoot(Loot::Id id) noexcept {
+			return loots_.Erase(id);
+		}
+
+		const Loot* FindLoot(Loot::Id id) const noexcept {
+			return loots_.Find(id);
 		}
 
 		size_t GetLootCount() const noexcept {
-			return loots_.size();
+			return loots_.Size();
 		}
 
 		size_t GetBagCapacity() const noexcept {
@@ -265,13 +379,18 @@ namespace model {
 	private:
 		template<typename Comparator>
 		void LoadRoadmap(const ConstPtrRoad& road, Comparator comp, std::pair<Direction, Direction> dir) {
+			const size_t index = roads_.size() - 1;
 			if (comp(road)) {
 				roadmap_[std::pair{ road->GetStart(), dir.second }] = road;
 				roadmap_[std::pair{ road->GetEnd(), dir.first }] = road;
+				road_graph_.AddLink(road->GetStart(), dir.second, index);
+				road_graph_.AddLink(road->GetEnd(), dir.first, index);
 			}
 			else {
 				roadmap_[std::pair{ road->GetEnd(), dir.second }] = road;
 				roadmap_[std::pair{ road->GetStart(), dir.first }] = road;
+				road_graph_.AddLink(road->GetEnd(), dir.second, index);
+				road_graph_.AddLink(road->GetStart(), dir.first, index);
 			}
 		}
 
@@ -296,7 +415,8 @@ namespace model {
 		Offices offices_;
 		Speed speed_;
 		Roadmap roadmap_;
-		Loots loots_;
+		RoadGraph road_graph_;
+		LootTable loots_;
 		LootsDescription loot_description_;
 		size_t bag_capacity_;
 	};
@@ -358,7 +478,7 @@ namespace model {
 			speed_ = std::move(speed);
 		}
 
-		void SetNewRoad(ConstPtrRoad& road) {
+		void SetNewRoad(const ConstPtrRoad& road) {
 			road_ = road;
 			SetRoadId(road->GetId());
 		}
@@ -429,65 +549,361 @@ namespace model {
 		int road_id_;
 	};
 
+	class GameSession;
+
+	// Ссылка на собаку в таблице игровой сессии. Повторяет интерфейс Dog,
+	// но читает и изменяет данные прямо в массивах сессии
+	class DogRef {
+	public:
+		DogRef(GameSession& session, size_t index) noexcept
+			: session_(&session)
+			, index_(index) {
+		}
+
+		size_t GetIndex() const noexcept {
+			return index_;
+		}
+
+		const Dog::Id& GetId() const noexcept;
+
+		const std::string& GetName() const noexcept;
+
+		const geom::Point2D& GetPosition() const noexcept;
+
+		void SetPosition(geom::Point2D pos) noexcept;
+
+		const geom::Vec2D& GetSpeed() const noexcept;
+
+		void SetSpeed(geom::Vec2D speed) noexcept;
+
+		Direction GetDirection() const noexcept;
+
+		void SetDirection(Direction dir) noexcept;
+
+		const ConstPtrRoad& GetCurrentRoad() const noexcept;
+
+		void SetNewRoad(const ConstPtrRoad& road);
+
+		size_t GetRoadIndex() const noexcept;
+
+		void SetRoadIndex(size_t road_index) noexcept;
+
+		Road::Id GetRoadId() const noexcept;
+
+		[[nodiscard]] bool PutItemIntoBag(Loot item);
+
+		bool IsBagFull() const noexcept;
+
+		const Loots& GetBagContent() const noexcept;
+
+		void CalcScoreAndEraseBag();
+
+		int GetScore() const noexcept;
+
+		void AddScore(Score score) noexcept;
+
+		size_t GetBagCapacity() const noexcept;
+
+	private:
+		GameSession* session_;
+		size_t index_;
+	};
+
+	// Сериализованное состояние сессии. Публикуется потоком, изменяющим сессию,
+	// и читается из любых потоков без блокировок
+	class StateSnapshot {
+	public:
+		using Ptr = std::shared_ptr<const std::string>;
+
+		StateSnapshot() = default;
+
+		StateSnapshot(const StateSnapshot& other)
+			: snapshot_(other.Load()) {
+		}
+
+		StateSnapshot& operator=(const StateSnapshot& other) {
+			Store(other.Load());
+			return *this;
+		}
+
+		Ptr Load() const noexcept {
+			return std::atomic_load_explicit(&snapshot_, std::memory_order_acquire);
+		}
+
+		void Store(Ptr snapshot) noexcept {
+			std::atomic_store_explicit(&snapshot_, std::move(snapshot), std::memory_order_release);
+		}
+
+	private:
+		// std::atomic<std::shared_ptr> нет в libstdc++ 11 (образ gcc:11.3),
+		// поэтому используются свободные атомарные функции для shared_ptr
+		Ptr snapshot_;
+	};
+
 	class GameSession {
 	public:
-		using Dogs = std::unordered_map<std::uint64_t, std::shared_ptr<Dog>>;
+		// Данные собак, которые редко меняются в тике
+		struct DogInfo {
+			Dog::Id id;
+			std::string name;
+			size_t bag_capacity = 0;
+			Loots bag;
+			Score score = 0;
+		};
 
 		explicit GameSession(std::shared_ptr<Map> map) noexcept
 			: map_{ map } {
 		}
 
-		const std::shared_ptr<Dog> AddDog(geom::Point2D point, const std::string& name, ConstPtrRoad road, size_t capacity) {
+		DogRef AddDog(geom::Point2D point, const std::string& name, ConstPtrRoad road, size_t capacity) {
 			using namespace std::literals;
 			if (!road) {
 				throw std::invalid_argument("Invalid ptr road = nullptr"s);
 			}
+			const Dog::Id id{ static_cast<uint32_t>(dog_infos_.size()) };
+			return AddDog(DogInfo{ id, name, capacity }, point, {}, Direction::DIR_NORTH, FindRoadIndex(road));
+		}
 
-			const size_t index = dogs_.size();
-			if (dogs_.count(index)) {
-				throw std::invalid_argument("Dog with id "s + std::to_string(index));
-			}
-			else {
-				try {
-					dogs_.emplace(index, std::make_shared<Dog>(std::move(point), name, static_cast<model::Dog::Id>( index ), road, capacity));
-					return dogs_[index];
-				}
-				catch (...) {
-					dogs_.erase(index);
-					throw;
-				}
-			}
+		// Готовит место для count собак, чтобы массивы сессии не перевыделялись при массовом добавлении
+		void ReserveDogs(size_t count) {
+			dog_positions_.reserve(count);
+			dog_speeds_.reserve(count);
+			dog_directions_.reserve(count);
+			dog_road_indices_.reserve(count);
+			dog_infos_.reserve(count);
+			dog_id_to_index_.reserve(count);
 		}
 
-		const std::shared_ptr<Dog> AddDog(Dog dog) {
-			auto idx = *dog.GetId();
-			if (dogs_.count(idx)) {
-				throw std::invalid_argument("Dog with id "s + std::to_string(idx));
+		DogRef AddDog(const Dog& dog) {
+			using namespace std::literals;
+			if (!dog.GetCurrentRoad()) {
+				throw std::invalid_argument("Invalid ptr road = nullptr"s);
 			}
-			else {
-				try {
-					dogs_.emplace(idx, std::make_shared<Dog>(std::move(dog)));
-					return dogs_[idx];
-				}
-				catch (...) {
-					dogs_.erase(idx);
-					throw;
-				}
+			DogInfo info{ dog.GetId(), dog.GetName(), dog.GetBagCapacity(), dog.GetBagContent(), static_cast<Score>(dog.GetScore()) };
+			return AddDog(std::move(info), dog.GetPosition(), dog.GetSpeed(), dog.GetDirection(), FindRoadIndex(dog.GetCurrentRoad()));
+		}
+
+		size_t GetDogCount() const noexcept {
+			return dog_infos_.size();
+		}
+
+		DogRef GetDog(size_t index) noexcept {
+			return DogRef{ *this, index };
+		}
+
+		std::optional<DogRef> FindDog(Dog::Id id) noexcept {
+			if (auto it = dog_id_to_index_.find(id); it != dog_id_to_index_.end()) {
+				return DogRef{ *this, it->second };
 			}
+			return std::nullopt;
 		}
 
 		const std::shared_ptr<Map> GetMap() const noexcept {
 			return map_;
 		}
 
-		const Dogs& GetDogs() const noexcept {
-			return dogs_;
+		// У каждой сессии свой генератор трофеев и случайных чисел,
+		// чтобы сессии можно было обновлять параллельно
+		void SetLootGenerator(loot_gen::LootGenerator loot_generator) {
+			loot_generator_ = std::move(loot_generator);
+		}
+
+		loot_gen::LootGenerator* GetLootGenerator() noexcept {
+			return loot_generator_ ? &*loot_generator_ : nullptr;
+		}
+
+		std::mt19937& GetRandomGenerator() noexcept {
+			return random_generator_;
+		}
+
+		// Последнее опубликованное состояние или nullptr, если сессия изменилась после публикации
+		StateSnapshot::Ptr GetStateSnapshot() const noexcept {
+			return state_snapshot_.Load();
+		}
+
+		void PublishStateSnapshot(StateSnapshot::Ptr snapshot) noexcept {
+			state_snapshot_.Store(std::move(snapshot));
+		}
+
+		void ResetStateSnapshot() noexcept {
+			state_snapshot_.Store(nullptr);
 		}
+
+		// Сколько последних тиков хранится для запросов изменений состояния
+		static constexpr size_t max_tick_changes = 64;
+
+		// Номер последнего завершенного тика. До первого тика - 0
+		std::uint64_t GetTick() const noexcept {
+			return tick_;
+		}
+
+		// Завершает тик: сравнивает собак и предметы с концом прошлого тика
+		// и запоминает, что изменилось, в кольце последних тиков
+		void CommitTick();
+
+		// Собирает без повторов id собак и предметов, изменившихся после тика since.
+		// Возвращает false, если since впереди текущего тика или его изменения уже вытеснены из кольца
+		bool CollectChanges(std::uint64_t since, std::vector<Dog::Id>& dogs, std::vector<Loot::Id>& loots) const;
 	private:
-		Dogs dogs_;
+		friend class DogRef;
+
+		// Что изменилось за один тик. Добавленные и удаленные предметы не различаются:
+		// удаленный предмет просто отсутствует на карте
+		struct TickChanges {
+			std::uint64_t tick = 0;
+			std::vector<Dog::Id> dogs;
+			std::vector<Loot::Id> loots;
+		};
+
+		// Видимое клиентам состояние собаки в конце прошлого тика
+		struct CommittedDog {
+			geom::Point2D position;
+			geom::Vec2D speed;
+			Direction direction;
+			size_t bag_size;
+			Score score;
+		};
+
+		DogRef AddDog(DogInfo info, geom::Point2D pos, geom::Vec2D speed, Direction dir, size_t road_index) {
+			using namespace std::literals;
+			if (dog_id_to_index_.count(info.id)) {
+				throw std::invalid_argument("Dog with id "s + std::to_string(*info.id));
+			}
+			const size_t index = dog_infos_.size();
+			dog_id_to_index_.emplace(info.id, index);
+			dog_infos_.emplace_back(std::move(info));
+			dog_positions_.emplace_back(pos);
+			dog_speeds_.emplace_back(speed);
+			dog_directions_.emplace_back(dir);
+			dog_road_indices_.emplace_back(road_index);
+			return DogRef{ *this, index };
+		}
+
+		size_t FindRoadIndex(const ConstPtrRoad& road) const {
+			using namespace std::literals;
+			const auto& roads = map_->GetRoads();
+			// Дороги загружаются с id, равным их индексу на карте
+			if (const auto index = static_cast<size_t>(*road->GetId()); index < roads.size() && roads[index] == road) {
+				return index;
+			}
+			if (auto it = std::find(roads.begin(), roads.end(), road); it != roads.end()) {
+				return static_cast<size_t>(it - roads.begin());
+			}
+			throw std::invalid_argument("Road does not belong to map "s + *map_->GetId());
+		}
+
+		// Данные, которые обновляются каждый тик, лежат в параллельных массивах
+		// и проходятся линейно. Индекс собаки постоянен, так как собаки из сессии не удаляются
+		std::vector<geom::Point2D> dog_positions_;
+		std::vector<geom::Vec2D> dog_speeds_;
+		std::vector<Direction> dog_directions_;
+		std::vector<size_t> dog_road_indices_;
+		std::vector<DogInfo> dog_infos_;
+		std::unordered_map<Dog::Id, size_t, util::TaggedHasher<Dog::Id>> dog_id_to_index_;
+
 		std::shared_ptr<Map> map_;
+		std::optional<loot_gen::LootGenerator> loot_generator_;
+		std::mt19937 random_generator_{ std::random_device{}() };
+		StateSnapshot state_snapshot_;
+
+		std::uint64_t tick_ = 0;
+		// Кольцо изменений: тик t лежит в ячейке t % max_tick_changes
+		std::vector<TickChanges> tick_changes_;
+		std::vector<CommittedDog> committed_dogs_;
+		// Отсортированные id предметов на карте в конце прошлого тика
+		std::vector<Loot::Id> committed_loots_;
+		std::vector<Loot::Id> current_loots_;
 	};
 
+	inline const Dog::Id& DogRef::GetId() const noexcept {
+		return session_->dog_infos_[index_].id;
+	}
+
+	inline const std::string& DogRef::GetName() const noexcept {
+		return session_->dog_infos_[index_].name;
+	}
+
+	inline const geom::Point2D& DogRef::GetPosition() const noexcept {
+		return session_->dog_positions_[index_];
+	}
+
+	inline void DogRef::SetPosition(geom::Point2D pos) noexcept {
+		session_->dog_positions_[index_] = pos;
+	}
+
+	inline const geom::Vec2D& DogRef::GetSpeed() const noexcept {
+		return session_->dog_speeds_[index_];
+	}
+
+	inline void DogRef::SetSpeed(geom::Vec2D speed) noexcept {
+		session_->dog_speeds_[index_] = speed;
+	}
+
+	inline Direction DogRef::GetDirection() const noexcept {
+		return session_->dog_directions_[index_];
+	}
+
+	inline void DogRef::SetDirection(Direction dir) noexcept {
+		session_->dog_directions_[index_] = dir;
+	}
+
+	inline const ConstPtrRoad& DogRef::GetCurrentRoad() const noexcept {
+		return session_->map_->GetRoads()[session_->dog_road_indices_[index_]];
+	}
+
+	inline void DogRef::SetNewRoad(const ConstPtrRoad& road) {
+		session_->dog_road_indices_[index_] = session_->FindRoadIndex(road);
+	}
+
+	inline size_t DogRef::GetRoadIndex() const noexcept {
+		return session_->dog_road_indices_[index_];
+	}
+
+	inline void DogRef::SetRoadIndex(size_t road_index) noexcept {
+		session_->dog_road_indices_[index_] = road_index;
+	}
+
+	inline Road::Id DogRef::GetRoadId() const noexcept {
+		return GetCurrentRoad()->GetId();
+	}
+
+	inline bool DogRef::PutItemIntoBag(Loot item) {
+		if (IsBagFull()) {
+			return false;
+		}
+		session_->dog_infos_[index_].bag.emplace_back(std::move(item));
+		return true;
+	}
+
+	inline bool DogRef::IsBagFull() const noexcept {
+		const auto& info = session_->dog_infos_[index_];
+		return info.bag.size() >= info.bag_capacity;
+	}
+
+	inline const Loots& DogRef::GetBagContent() const noexcept {
+		return session_->dog_infos_[index_].bag;
+	}
+
+	inline void DogRef::CalcScoreAndEraseBag() {
+		auto& info = session_->dog_infos_[index_];
+		for (const auto& item : info.bag) {
+			info.score += item.score;
+		}
+		info.bag.clear();
+	}
+
+	inline int DogRef::GetScore() const noexcept {
+		return session_->dog_infos_[index_].score;
+	}
+
+	inline void DogRef::AddScore(Score score) noexcept {
+		session_->dog_infos_[index_].score += score;
+	}
+
+	inline size_t DogRef::GetBagCapacity() const noexcept {
+		return session_->dog_infos_[index_].bag_capacity;
+	}
+
 	class Game {
 	public:
 		using Maps = std::vector<std::shared_ptr<Map>>;
@@ -514,6 +930,10 @@ namespace model {
 			return nullptr;
 		}
 
+		GameSessions& GetGameSessions() noexcept {
+			return sessions_;
+		}
+
 		void AddLootGenerator(loot_gen::LootGenerator loot_generator);
 
 		const std::shared_ptr<loot_gen::LootGenerator> GetLootGenerator() const;
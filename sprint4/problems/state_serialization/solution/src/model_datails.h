@@ -45,4 +45,7 @@ namespace model_details {
 	const std::string key_score = "score"s;
 	const std::string key_move = "move"s;
 	const std::string key_time_delta = "timeDelta"s;
+	const std::string key_tick = "tick"s;
+	const std::string key_full = "full"s;
+	const std::string key_removed_lost_objects = "removedLostObjects"s;
 }
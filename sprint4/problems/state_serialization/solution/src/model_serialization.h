@@ -1,4 +1,5 @@
-﻿#include <boost/serialization/vector.hpp>
+﻿#pragma once
+#include <boost/serialization/vector.hpp>
 #include <boost/serialization/string.hpp>
 #include "model.h"
 #include "app.h"
@@ -39,7 +40,9 @@ class DogRepr {
 public:
     DogRepr() = default;
 
-    explicit DogRepr(const model::Dog& dog)
+    // Принимает как model::Dog, так и model::DogRef собаки из игровой сессии
+    template <typename SomeDog>
+    explicit DogRepr(const SomeDog& dog)
         : id_(dog.GetId())
         , name_(dog.GetName())
         , pos_(dog.GetPosition())
@@ -132,6 +135,14 @@ public:
         , token_(player->GetToken()) {
     }
  
+    const app::Player::Id& GetId() const noexcept {
+        return id_;
+    }
+
+    const app::Token& GetToken() const noexcept {
+        return token_;
+    }
+
     [[nodiscard]] app::Player Restore() const {
         app::Player player(id_);
         player.SetToken(token_);
@@ -141,12 +152,15 @@ public:
     template <typename Archive>
     void serialize(Archive& ar, [[maybe_unused]] const unsigned version) {
         ar&* id_;
-        ar&* token_;
+        // В файле токен остается строкой из 32 шестнадцатеричных цифр
+        std::string token = token_.ToString();
+        ar& token;
+        token_ = app::Token::FromString(token);
     }
 
 private:
     app::Player::Id id_ = app::Player::Id{ 0u };
-    app::Token token_ = app::Token{ std::to_string(0)};
+    app::Token token_;
    
 };
 
@@ -155,14 +169,14 @@ public:
 
     MapRepr() = default;
 
-    explicit MapRepr(const model::Map::Id& id, 
-        const std::vector<PlayerRepr>& players, 
-        const std::vector<LootRepr>& loots, 
-        const std::vector<DogRepr>& dogs)
-        : id_(id)
-        , players_(players)
-        , loots_(loots)
-        , dogs_(dogs) {
+    explicit MapRepr(model::Map::Id id,
+        std::vector<PlayerRepr> players,
+        std::vector<LootRepr> loots,
+        std::vector<DogRepr> dogs)
+        : id_(std::move(id))
+        , players_(std::move(players))
+        , loots_(std::move(loots))
+        , dogs_(std::move(dogs)) {
     }
 
     [[nodiscard]] MapRepr Restore() const {
@@ -183,6 +197,31 @@ public:
     std::vector<LootRepr> loots_;
     std::vector<DogRepr> dogs_;
 };
+
+// Содержимое файла состояния: карты и номер поколения журнала действий,
+// с которого начинаются действия, не вошедшие в этот снимок
+class StateRepr {
+public:
+    template<class Archive>
+    void serialize(Archive& ar, const unsigned int version) {
+        // Файлы первой версии формата содержали только карты
+        if (version >= 2) {
+            ar& journal_generation_;
+        }
+        ar& maps_;
+    }
+public:
+    std::uint64_t journal_generation_ = 0;
+    std::vector<MapRepr> maps_;
+};
+
+// Возвращает в сессию собаку игрока вместе с его токеном
+inline void RestorePlayer(app::Application& app, model::GameSession& session,
+    const DogRepr& dog_repr, const PlayerRepr& player_repr) {
+    model::Dog dog = dog_repr.Restore();
+    dog.SetNewRoad(session.GetMap()->GetRoads().at(*dog.GetRoadId()));
+    app.JoinGame(session.AddDog(dog), &session, player_repr.Restore().GetToken());
+}
 }  // namespace serialization
 
 
@@ -2,29 +2,21 @@
 
 namespace http_handler {
 
-	StringResponse MakeStringResponse(http::status status, std::string_view body, unsigned http_version,
-		bool keep_alive,
+	StringResponse MakeStringResponse(http::status status, std::string_view body, const StringRequest& req,
 		std::string_view content_type) {
 
-		StringResponse response(status, http_version);
-		response.set(http::field::content_type, content_type.data());
+		StringResponse response = MakeResponse<StringResponse>(status, req);
+		response.set(http::field::content_type, content_type);
 		response.set(http::field::cache_control, "no-cache"sv);
 		response.body() = body;
 		response.content_length(response.body().size());
-		response.keep_alive(keep_alive);
 
 		return response;
 	}
 
 
-	std::string GetContentType(const StringRequest& req) {
-		auto content_type_it = req.base().find(boost::beast::http::field::content_type);
-		std::string content_type = "null"s;
-
-		if (content_type_it != req.base().end()) {
-			content_type = content_type_it->value();
-		}
-		return content_type;
+	std::string_view GetContentType(const StringRequest& req) {
+		return req[http::field::content_type];
 	}
 
 	json::array ApiHandler::LoadRoadsToJson(const model::Game::MapPtr map) const {
@@ -100,252 +92,526 @@ namespace http_handler {
 		return loot_types;
 	}
 
-	bool ApiHandler::IsApiRequest(StringRequest req) {
-		std::string_view uri(req.target().data(), req.target().size());
-		return uri.find(api, 0) == 0;
+	ApiHandler::CachedDocument ApiHandler::MakeCachedDocument(std::string body) {
+		// FNV-1a: ETag зависит только от содержимого документа
+		std::uint64_t hash = 14695981039346656037ull;
+		for (unsigned char c : body) {
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+
+		std::stringstream ss;
+		ss << '"' << std::hex << std::setfill('0') << std::setw(16) << hash << '"';
+
+		return CachedDocument{ std::make_shared<const std::string>(std::move(body)), ss.str() };
 	}
 
-	StringResponse ApiHandler::HandlerApiHandler(const StringRequest& req) const {
+	void ApiHandler::BuildMapsCache() {
+		json::array arr;
+		for (auto& map : app_.GetMaps()) {
+			json::object obj;
+			obj[key_id] = *(map->GetId());
+			obj[key_name] = map->GetName();
+			arr.push_back(obj);
+
+			json::object map_obj;
+			map_obj[key_id] = *(map->GetId());
+			map_obj[key_name] = map->GetName();
+			map_obj[key_roads] = LoadRoadsToJson(map);
+			map_obj[key_buildings] = LoadBuildingsToJson(map);
+			map_obj[key_offices] = LoadOfficesToJson(map);
+			map_obj[key_loot_types] = LoadLootTypes(map);
+
+			map_documents_.insert_or_assign(*(map->GetId()), MakeCachedDocument(json::serialize(map_obj)));
+		}
+		maps_list_ = MakeCachedDocument(json::serialize(arr));
+	}
+
+	static bool MatchesETag(std::string_view if_none_match, std::string_view etag) {
+		// Заголовок содержит список ETag через запятую, возможно со слабыми W/
+		while (!if_none_match.empty()) {
+			auto comma = if_none_match.find(',');
+			auto tag = if_none_match.substr(0, comma);
+			if_none_match = comma == std::string_view::npos ? std::string_view{} : if_none_match.substr(comma + 1);
 
+			while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) {
+				tag.remove_prefix(1);
+			}
+			while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) {
+				tag.remove_suffix(1);
+			}
+			if (tag.starts_with("W/"sv)) {
+				tag.remove_prefix(2);
+			}
+			if (tag == "*"sv || tag == etag) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	ApiHandler::MapsRequestResult ApiHandler::HandleMapsRequest(const StringRequest& req) const {
 		std::string_view uri(req.target().data(), req.target().size());
-		auto content_type = GetContentType(req);
-		StringResponse resp;
+		std::string_view map_name = uri.substr(api_get_map.size());
 
-		//Вход в игру
-		if (!uri.compare(0, api_post_join.size(), api_post_join)) {
+		if (req.method() != http::verb::get && req.method() != http::verb::head) {
+			auto resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, "GET, HEAD"sv);
+			return resp;
+		}
 
-			if (req.method() != http::verb::post && req.method() != http::verb::get && req.method() != http::verb::head) {
+		if (auto content_type = req[http::field::content_type]; !content_type.empty()) {
+			return MakeStringResponse(http::status::bad_request, bad_request, req, ContentType::APP_JSON);
+		}
 
-				resp = MakeStringResponse(http::status::method_not_allowed, post_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, REQ_POST);
-				return resp;
-			}
-			else if (content_type == ContentType::APP_JSON) {//Для входа в игру 
-				try {
-					auto body_str = req.body();
-					auto json_obj = json::parse(body_str).as_object();
+		const CachedDocument* document = nullptr;
+		if (map_name.empty()) {
+			document = &maps_list_;
+		}
+		else if (auto it = map_documents_.find(map_name.substr(1)); it != map_documents_.end()) {
+			document = &it->second;
+		}
+		else {
+			return MakeStringResponse(http::status::not_found, json_not_found, req, ContentType::APP_JSON);
+		}
 
-					auto user_name = json_obj.at("userName").as_string().c_str();
-					std::string map_id = json_obj.at("mapId").as_string().c_str();
+		if (MatchesETag(req[http::field::if_none_match], document->etag)) {
+			EmptyResponse resp = MakeResponse<EmptyResponse>(http::status::not_modified, req);
+			resp.set(http::field::etag, document->etag);
+			resp.set(http::field::cache_control, "no-cache"sv);
+			return resp;
+		}
 
-					auto res_join = app_.JoinGame(map_id, user_name);
+		SharedResponse resp = MakeResponse<SharedResponse>(http::status::ok, req);
+		resp.set(http::field::content_type, ContentType::APP_JSON);
+		resp.set(http::field::cache_control, "no-cache"sv);
+		resp.set(http::field::etag, document->etag);
+		resp.body() = document->body;
+		resp.content_length(document->body->size());
+		return resp;
+	}
 
-					json::object obj;
-					obj[key_auth_token] = *(res_join.GetPlayerTokens());
-					obj[key_player_id] = *(res_join.GetPlayerId());
+	std::optional<SharedResponse> ApiHandler::TryHandleStateFromSnapshot(const StringRequest& req) const {
+		std::string_view uri(req.target().data(), req.target().size());
 
-					resp = MakeStringResponse(http::status::ok, json::serialize(obj), req.version(), req.keep_alive(), ContentType::APP_JSON);
-				}
-				catch (app::GameError<app::JoinGameErrorReason> err) {
-
-					if (err.GetErrorReason() == app::INVALIDE_NAME) {//несуществующий id карты
-						resp = MakeStringResponse(http::status::bad_request, json_invalid_name, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
-					else if (err.GetErrorReason() == app::INVALIDE_MAP) {//пустое имя игрока,
-						resp = MakeStringResponse(http::status::not_found, json_not_found, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
-				}
-				catch (...) {//Если при парсинге JSON или получении его свойств произошла ошибка
-					resp = MakeStringResponse(http::status::bad_request, json_parse_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				}
+		if (FindApiRoute(uri) != ApiRoute::GAME_STATE
+			|| (req.method() != http::verb::get && req.method() != http::verb::head)) {
+			return std::nullopt;
+		}
 
-			}
+		auto snapshot = app_.FindStateSnapshot(req[http::field::authorization]);
+		if (!snapshot) {
+			return std::nullopt;
 		}
-		else if (!uri.compare(0, api_get_map.size(), api_get_map)) {//полчение списка карт
-			std::string_view  map_name = uri.substr(api_get_map.size());
-			auto maps = app_.GetMaps();
 
-			if (req.method() != http::verb::get && req.method() != http::verb::head) {
-				resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, "GET, HEAD"sv);
-				return resp;
-			}
+		SharedResponse resp = MakeResponse<SharedResponse>(http::status::ok, req);
+		resp.set(http::field::content_type, ContentType::APP_JSON);
+		resp.set(http::field::cache_control, "no-cache"sv);
+		resp.content_length(snapshot->size());
+		resp.body() = std::move(snapshot);
+		return resp;
+	}
 
-			if (auto content_type = req[boost::beast::http::field::content_type]; !content_type.empty()) {
-				resp = MakeStringResponse(http::status::bad_request, bad_request, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				return resp;
+	bool ApiHandler::IsApiRequest(const StringRequest& req) const noexcept {
+		std::string_view uri(req.target().data(), req.target().size());
+		return uri.starts_with(api);
+	}
+
+	bool ApiHandler::IsStatelessApiRequest(const StringRequest& req) const noexcept {
+		std::string_view uri(req.target().data(), req.target().size());
+		return FindApiRoute(uri) == ApiRoute::MAPS;
+	}
+
+	const model::Map::Id* ApiHandler::FindTargetSession(const StringRequest& req) const {
+		std::string_view uri(req.target().data(), req.target().size());
+
+		switch (FindApiRoute(uri)) {
+		case ApiRoute::JOIN:
+			try {
+				auto json_obj = json::parse(req.body()).as_object();
+				auto map = app_.FindMap(model::Map::Id(std::string(json_obj.at("mapId").as_string().c_str())));
+				return map ? &map->GetId() : nullptr;
 			}
-			else if (map_name.empty()) {
-				json::array arr;
-				for (auto& map : maps) {
-					json::object obj;
-					obj[key_id] = *(map->GetId());
-					obj[key_name] = map->GetName();
-					arr.push_back(obj);
-				}
-				resp = MakeStringResponse(http::status::ok, json::serialize(arr), req.version(), req.keep_alive(), ContentType::APP_JSON);
+			catch (...) {
+				return nullptr;
 			}
-			else if (auto map = app_.FindMap(model::Map::Id(std::string(map_name).substr(1))); map != nullptr) {
-				json::object obj;
-				obj[key_id] = *(map->GetId());
-				obj[key_name] = map->GetName();
-				obj[key_roads] = LoadRoadsToJson(map);
-				obj[key_buildings] = LoadBuildingsToJson(map);
-				obj[key_offices] = LoadOfficesToJson(map);
-				obj[key_loot_types] = LoadLootTypes(map);
-				
-				resp = MakeStringResponse(http::status::ok, json::serialize(obj), req.version(), req.keep_alive(), ContentType::APP_JSON);
+		case ApiRoute::PLAYERS:
+		case ApiRoute::GAME_STATE:
+		case ApiRoute::GAME_CHANGES:
+		case ApiRoute::PLAYER_ACTION:
+			return app_.FindSessionMapId(req[http::field::authorization]);
+		default:
+			return nullptr;
+		}
+	}
+
+	const model::Game::Maps ApiHandler::GetMaps() const noexcept {
+		return app_.GetMaps();
+	}
+
+	model::GameSession* ApiHandler::FindPlayerSession(const StringRequest& req) const noexcept {
+		return app_.FindPlayerSession(req[http::field::authorization]);
+	}
+
+	// Разбирает строку запроса вида ?since=N. Отсутствующий параметр оставляет since пустым
+	static bool ParseSinceParam(std::string_view query, std::optional<std::uint64_t>& since) {
+		if (query.empty()) {
+			return true;
+		}
+		if (query.front() != '?') {
+			return false;
+		}
+		query.remove_prefix(1);
+
+		while (!query.empty()) {
+			auto amp = query.find('&');
+			auto param = query.substr(0, amp);
+			query = amp == std::string_view::npos ? std::string_view{} : query.substr(amp + 1);
+
+			constexpr auto since_key = "since="sv;
+			if (!param.starts_with(since_key)) {
+				continue;
 			}
-			else {
-				resp = MakeStringResponse(http::status::not_found, json_not_found, req.version(), req.keep_alive(), ContentType::APP_JSON);
+			param.remove_prefix(since_key.size());
+
+			std::uint64_t value = 0;
+			auto [ptr, ec] = std::from_chars(param.data(), param.data() + param.size(), value);
+			if (ec != std::errc{} || ptr != param.data() + param.size()) {
+				return false;
 			}
+			since = value;
 		}
-		else if (!uri.compare(0, api_get_players.size(), api_get_players)) {//Получение списка игроков
+		return true;
+	}
 
-			std::string_view uri(req.target().data(), req.target().size());
-			auto content_type = GetContentType(req);
+	StringResponse ApiHandler::HandlerApiHandler(const StringRequest& req) const {
+		using RouteHandler = StringResponse(ApiHandler::*)(const StringRequest&, std::string_view) const;
+		// Порядок совпадает с ApiRoute. Список карт сюда не попадает: его отдает HandleMapsRequest
+		static constexpr std::array<RouteHandler, api_route_count + 1> route_handlers{
+			&ApiHandler::HandleBadRequest,
+			&ApiHandler::HandleJoin,
+			&ApiHandler::HandlePlayers,
+			&ApiHandler::HandleGameState,
+			&ApiHandler::HandleGameChanges,
+			&ApiHandler::HandlePlayerAction,
+			&ApiHandler::HandleGameStream,
+			&ApiHandler::HandleGameTick,
+			&ApiHandler::HandleBadRequest,
+		};
 
-			if (req.method() != http::verb::get && req.method() != http::verb::head) {
-				resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, "GET, HEAD"sv);
-				return resp;
+		std::string_view uri(req.target().data(), req.target().size());
+		return (this->*route_handlers[static_cast<size_t>(FindApiRoute(uri))])(req, uri);
+	}
 
-			}
-			else if (content_type == ContentType::APP_JSON) {//Для входа в игру 
+	StringResponse ApiHandler::HandleJoin(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+		auto content_type = GetContentType(req);
 
-				try {
-					auto authorization = req[http::field::authorization];
+		if (req.method() != http::verb::post && req.method() != http::verb::get && req.method() != http::verb::head) {
 
-					resp = MakeStringResponse(http::status::ok,
-						app_.GetPlayers(authorization),
-						req.version(), req.keep_alive(),
-						ContentType::APP_JSON);
-				}
-				catch (app::GameError<app::AuthorizationGameErrorReason> err) {
+			resp = MakeStringResponse(http::status::method_not_allowed, post_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, REQ_POST);
+			return resp;
+		}
+		else if (content_type == ContentType::APP_JSON) {//Для входа в игру 
+			try {
+				const auto& body_str = req.body();
+				auto json_obj = json::parse(body_str).as_object();
+
+				auto user_name = json_obj.at("userName").as_string().c_str();
+				std::string map_id = json_obj.at("mapId").as_string().c_str();
+
+				auto res_join = app_.JoinGame(map_id, user_name);
 
-					if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_MISSING) {
-						resp = MakeStringResponse(http::status::unauthorized, authorization_method_missing, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
-					else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
-						resp = MakeStringResponse(http::status::unauthorized, token_not_found, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
+				json::object obj;
+				obj[key_auth_token] = res_join.GetPlayerTokens().ToString();
+				obj[key_player_id] = *(res_join.GetPlayerId());
+
+				resp = MakeStringResponse(http::status::ok, json::serialize(obj), req, ContentType::APP_JSON);
+			}
+			catch (app::GameError<app::JoinGameErrorReason> err) {
 
+				if (err.GetErrorReason() == app::INVALIDE_NAME) {//несуществующий id карты
+					resp = MakeStringResponse(http::status::bad_request, json_invalid_name, req, ContentType::APP_JSON);
 				}
-				catch (const std::exception& exc) {
-					throw std::runtime_error(std::string("Error HandlerApiHandler: ") + exc.what());
+				else if (err.GetErrorReason() == app::INVALIDE_MAP) {//пустое имя игрока,
+					resp = MakeStringResponse(http::status::not_found, json_not_found, req, ContentType::APP_JSON);
 				}
 			}
+			catch (...) {//Если при парсинге JSON или получении его свойств произошла ошибка
+				resp = MakeStringResponse(http::status::bad_request, json_parse_error, req, ContentType::APP_JSON);
+			}
+
 		}
-		else if (!uri.compare(0, api_get_game_state.size(), api_get_game_state)) {//Запрос игрового состояния
+		return resp;
+	}
 
-			auto content_type = GetContentType(req);
+	StringResponse ApiHandler::HandlePlayers(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+		auto content_type = GetContentType(req);
 
-			if (req.method() != http::verb::get && req.method() != http::verb::head) {
-				resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, "GET, HEAD"sv);
-				return resp;
-			}
-			else {
-				try {
-					auto authorization = req[http::field::authorization];
-
-					resp = MakeStringResponse(http::status::ok,
-						app_.GetGameState(authorization),
-						req.version(),
-						req.keep_alive(),
-						ContentType::APP_JSON);
-				}
-				catch (app::GameError<app::AuthorizationGameErrorReason> err) {
+		if (req.method() != http::verb::get && req.method() != http::verb::head) {
+			resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, "GET, HEAD"sv);
+			return resp;
+
+		}
+		else if (content_type == ContentType::APP_JSON) {//Для входа в игру 
 
-					if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
+			try {
+				auto authorization = req[http::field::authorization];
+
+				resp = MakeStringResponse(http::status::ok,
+					app_.GetPlayers(authorization),
+					req,
+					ContentType::APP_JSON);
+			}
+			catch (app::GameError<app::AuthorizationGameErrorReason> err) {
 
-						resp = MakeStringResponse(http::status::unauthorized, token_not_found, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
-					else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ) {
-						resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
+				if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_MISSING) {
+					resp = MakeStringResponse(http::status::unauthorized, authorization_method_missing, req, ContentType::APP_JSON);
 				}
-				catch (const std::exception& exc) {
-					throw std::runtime_error(std::string("Error HandlerApiHandler: ") + exc.what());
+				else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
+					resp = MakeStringResponse(http::status::unauthorized, token_not_found, req, ContentType::APP_JSON);
 				}
+
+			}
+			catch (const std::exception& exc) {
+				throw std::runtime_error(std::string("Error HandlerApiHandler: ") + exc.what());
 			}
+		}
+		return resp;
+	}
 
+	StringResponse ApiHandler::HandleGameState(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+
+		if (req.method() != http::verb::get && req.method() != http::verb::head) {
+			resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, "GET, HEAD"sv);
+			return resp;
 		}
-		else if (!uri.compare(0, api_game_player_action.size(), api_game_player_action)) {//Управление действиями своего персонажа
+		else {
+			try {
+				auto authorization = req[http::field::authorization];
 
-			auto content_type = GetContentType(req);
-			if (req.method() != http::verb::post) {
-				resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, REQ_POST);
-				return resp;
+				resp = MakeStringResponse(http::status::ok,
+					app_.GetGameState(authorization),
+					req,
+					ContentType::APP_JSON);
 			}
-			else if (content_type == ContentType::APP_JSON) {
-				try {
-					auto authorization = req[http::field::authorization];
+			catch (app::GameError<app::AuthorizationGameErrorReason> err) {
 
-					resp = MakeStringResponse(http::status::ok,
-						app_.SetPlayerAction(authorization, req.body()),
-						req.version(),
-						req.keep_alive(),
-						ContentType::APP_JSON);
+				if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
+
+					resp = MakeStringResponse(http::status::unauthorized, token_not_found, req, ContentType::APP_JSON);
+				}
+				else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ) {
+					resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req, ContentType::APP_JSON);
 				}
-				catch (app::GameError<app::AuthorizationGameErrorReason> err) {
+			}
+			catch (const std::exception& exc) {
+				throw std::runtime_error(std::string("Error HandlerApiHandler: ") + exc.what());
+			}
+		}
+		return resp;
+	}
+
+	StringResponse ApiHandler::HandleGameChanges(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+
+		std::optional<std::uint64_t> since;
+		if (req.method() != http::verb::get && req.method() != http::verb::head) {
+			resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, "GET, HEAD"sv);
+			return resp;
+		}
+		else if (!ParseSinceParam(uri.substr(api_get_game_changes.size()), since)) {
+			resp = MakeStringResponse(http::status::bad_request, invalid_since_param, req, ContentType::APP_JSON);
+		}
+		else {
+			try {
+				auto authorization = req[http::field::authorization];
 
-					if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
+				resp = MakeStringResponse(http::status::ok,
+					app_.GetStateChanges(authorization, since),
+					req,
+					ContentType::APP_JSON);
+			}
+			catch (app::GameError<app::AuthorizationGameErrorReason> err) {
 
-						resp = MakeStringResponse(http::status::unauthorized, token_not_found, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
-					else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ) {
-						resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req.version(), req.keep_alive(), ContentType::APP_JSON);
-					}
+				if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
+					resp = MakeStringResponse(http::status::unauthorized, token_not_found, req, ContentType::APP_JSON);
 				}
-				catch (...) {//Если при парсинге JSON или получении его свойств произошла ошибка
-					resp = MakeStringResponse(http::status::bad_request, failed_parse_action, req.version(), req.keep_alive(), ContentType::APP_JSON);
+				else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ) {
+					resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req, ContentType::APP_JSON);
 				}
 			}
-			else {
-				resp = MakeStringResponse(http::status::bad_request, invalid_content_type, req.version(), req.keep_alive(), ContentType::APP_JSON);
+			catch (const std::exception& exc) {
+				throw std::runtime_error(std::string("Error HandlerApiHandler: ") + exc.what());
 			}
 		}
-		else if (!uri.compare(0, api_game_tick.size(), api_game_tick)) {
+		return resp;
+	}
 
-			if (api_ignore_list_.count(api_game_tick) && api_ignore_list_.at(api_game_tick)) {
-				resp = MakeStringResponse(http::status::bad_request, bad_request_invalid_endpoint, req.version(), req.keep_alive(), ContentType::APP_JSON);
-			}
-			else if (req.method() != http::verb::post) {
-				resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req.version(), req.keep_alive(), ContentType::APP_JSON);
-				resp.set(http::field::allow, REQ_POST);
+	StringResponse ApiHandler::HandlePlayerAction(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+		auto content_type = GetContentType(req);
+
+		if (req.method() != http::verb::post) {
+			resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, REQ_POST);
+			return resp;
+		}
+		else if (content_type == ContentType::APP_JSON) {
+			try {
+				auto authorization = req[http::field::authorization];
+
+				resp = MakeStringResponse(http::status::ok,
+					app_.SetPlayerAction(authorization, req.body()),
+					req,
+					ContentType::APP_JSON);
 			}
-			else {
-				try {
+			catch (app::GameError<app::AuthorizationGameErrorReason> err) {
+
+				if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_TOKEN_NOT_FOUND) {
 
-					resp = MakeStringResponse(http::status::ok,
-						app_.SetTimeDelta(req.body()),
-						req.version(),
-						req.keep_alive(),
-						ContentType::APP_JSON);
+					resp = MakeStringResponse(http::status::unauthorized, token_not_found, req, ContentType::APP_JSON);
 				}
-				catch (...) {
-					resp = MakeStringResponse(http::status::bad_request, invalid_tick_req, req.version(), req.keep_alive(), ContentType::APP_JSON);
+				else if (err.GetErrorReason() == app::AuthorizationGameErrorReason::AUTHORIZATION_HEADER_REQ) {
+					resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req, ContentType::APP_JSON);
 				}
 			}
+			catch (...) {//Если при парсинге JSON или получении его свойств произошла ошибка
+				resp = MakeStringResponse(http::status::bad_request, failed_parse_action, req, ContentType::APP_JSON);
+			}
 		}
 		else {
-			resp = MakeStringResponse(http::status::bad_request, bad_request, req.version(), req.keep_alive(), ContentType::APP_JSON);
+			resp = MakeStringResponse(http::status::bad_request, invalid_content_type, req, ContentType::APP_JSON);
 		}
 		return resp;
 	}
 
+	StringResponse ApiHandler::HandleGameStream(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+
+		if (req[http::field::authorization].empty()) {
+			resp = MakeStringResponse(http::status::unauthorized, authorization_header_req, req, ContentType::APP_JSON);
+		}
+		else if (!app_.FindPlayerSession(req[http::field::authorization])) {
+			resp = MakeStringResponse(http::status::unauthorized, token_not_found, req, ContentType::APP_JSON);
+		}
+		else {
+			resp = MakeStringResponse(http::status::upgrade_required, upgrade_required, req, ContentType::APP_JSON);
+			resp.set(http::field::upgrade, "websocket"sv);
+		}
+		return resp;
+	}
+
+	StringResponse ApiHandler::HandleGameTick(const StringRequest& req, std::string_view uri) const {
+		StringResponse resp = MakeResponse<StringResponse>(http::status::ok, req);
+
+		if (ignored_routes_[static_cast<size_t>(ApiRoute::GAME_TICK)]) {
+			resp = MakeStringResponse(http::status::bad_request, bad_request_invalid_endpoint, req, ContentType::APP_JSON);
+		}
+		else if (req.method() != http::verb::post) {
+			resp = MakeStringResponse(http::status::method_not_allowed, invalid_method_error, req, ContentType::APP_JSON);
+			resp.set(http::field::allow, REQ_POST);
+		}
+		else {
+			try {
+
+				resp = MakeStringResponse(http::status::ok,
+					app_.SetTimeDelta(req.body()),
+					req,
+					ContentType::APP_JSON);
+			}
+			catch (...) {
+				resp = MakeStringResponse(http::status::bad_request, invalid_tick_req, req, ContentType::APP_JSON);
+			}
+		}
+		return resp;
+	}
+
+	StringResponse ApiHandler::HandleBadRequest(const StringRequest& req, std::string_view) const {
+		return MakeStringResponse(http::status::bad_request, bad_request, req, ContentType::APP_JSON);
+	}
+
 	void ApiHandler::AddApiIgnore(std::string_view api, bool is_ignore) {
-		api_ignore_list_[api] = is_ignore;
+		ignored_routes_[static_cast<size_t>(FindApiRoute(api))] = is_ignore;
 	}
 
-	FileResponse RequestHandler::MakeFileResponse(http::status status, fs::path abs_path, unsigned http_version,
-		bool keep_alive,
-		std::string_view content_type) const {
+	template <typename Response>
+	static void SetStaticFileHeaders(Response& resp, const StaticFile& file, const StaticFileVariant& variant) {
+		resp.set(http::field::etag, variant.etag);
+		resp.set(http::field::last_modified, variant.last_modified);
+		if (file.HasEncodedVariants()) {
+			// Кэши между сервером и клиентом должны различать ответы с разным Content-Encoding
+			resp.set(http::field::vary, "Accept-Encoding"sv);
+		}
+	}
 
-		http::file_body::value_type file;
-		FileResponse response(status, http_version);
-		response.set(http::field::content_type, content_type.data());
+	FileRequestResult HandleStaticFileRequest(const StaticCache& cache, const StringRequest& req) {
+		std::string_view uri(req.target().data(), req.target().size());
+		auto url_encoded = UrlEncoded(uri);
 
-		if (sys::error_code ec_; response.body().open(abs_path.string().c_str(), beast::file_mode::read, ec_), ec_) {
-			std::cout << "Failed to open file "sv << abs_path.string() << std::endl;
+		if (url_encoded.empty()) {
+			return MakeStringResponse(http::status::not_found, json_not_found, req, ContentType::TEXT_PLAIN);
 		}
 
-		response.prepare_payload();
-		response.content_length(response.body().size());
-		response.keep_alive(keep_alive);
-		return response;
+		std::optional<std::string> path;
+		if (uri.back() == '/') {
+			path = "/index.html"s;
+		}
+		else if (path = StaticCache::NormalizePath(url_encoded); !path) {
+			return MakeStringResponse(http::status::not_found, bad_request, req, ContentType::TEXT_PLAIN);
+		}
+
+		const StaticFile* file = cache.Find(*path);
+		if (!file) {
+			return MakeStringResponse(http::status::not_found, json_not_found, req, ContentType::TEXT_PLAIN);
+		}
+
+		const auto& variant = file->SelectVariant(req[http::field::accept_encoding]);
+
+		if (req.method() == http::verb::get || req.method() == http::verb::head) {
+			// If-Modified-Since проверяется, только если клиент не прислал If-None-Match
+			auto if_none_match = req[http::field::if_none_match];
+			bool not_modified = if_none_match.empty()
+				? req[http::field::if_modified_since] == variant.last_modified
+				: MatchesETag(if_none_match, variant.etag);
+			if (not_modified) {
+				EmptyResponse resp = MakeResponse<EmptyResponse>(http::status::not_modified, req);
+				SetStaticFileHeaders(resp, *file, variant);
+				return resp;
+			}
+		}
+
+		const bool send_body = req.method() != http::verb::head;
+		auto make_response = [&](auto resp) {
+			resp.set(http::field::content_type, file->mime_type);
+			if (!variant.encoding.empty()) {
+				resp.set(http::field::content_encoding, variant.encoding);
+			}
+			SetStaticFileHeaders(resp, *file, variant);
+			resp.content_length(variant.size);
+			return resp;
+			};
+
+		if (variant.data) {
+			SharedResponse resp = MakeResponse<SharedResponse>(http::status::ok, req);
+			if (send_body) {
+				resp.body() = variant.data;
+			}
+			return make_response(std::move(resp));
+		}
+
+		SendFileResponse resp = MakeResponse<SendFileResponse>(http::status::ok, req);
+		resp.body().size = variant.size;
+		if (send_body) {
+			resp.body().file = variant.file;
+		}
+		return make_response(std::move(resp));
 	}
 
 	std::string GetExtType(fs::path path) {
@@ -3,13 +3,22 @@
 #define BOOST_BEAST_USE_STD_STRING_VIEW
 #include "http_server.h"
 #include "app.h"
+#include "state_stream.h"
+#include "static_cache.h"
 #include "boost_includes.h"
 #include "logger.h"
 #include <filesystem>
+#include <array>
 #include <cassert>
+#include <cstdint>
 #include <unordered_map>
+#include <map>
 #include <variant>
 #include <chrono>
+#include <charconv>
+#include <optional>
+#include <tuple>
+#include <type_traits>
 
 // boost.beast будет использовать std::string_view вместо boost::string_view
 #define BOOST_BEAST_USE_STD_STRING_VIEW
@@ -23,10 +32,34 @@ namespace http_handler {
 	using namespace logger;
 
 	// Запрос, тело которого представлено в виде строки
-	using StringRequest = http::request<http::string_body>;
-	using StringResponse = http::response<http::string_body>;
-	using FileResponse = http::response<http::file_body>;
-	using EmptyResponse = http::response<http::empty_body>;
+	using StringRequest = http_server::HttpRequest;
+	using StringResponse = http_server::HttpResponse;
+	using EmptyResponse = http::response<http::empty_body, http_server::ArenaFields>;
+
+	using SharedStringBody = http_server::SharedStringBody;
+	using SharedResponse = http::response<SharedStringBody, http_server::ArenaFields>;
+	using SendFileResponse = http_server::SendFileResponse;
+
+	// Пустой ответ на req. Его поля и тело размещаются в арене соединения, из которого пришел запрос
+	template <typename Response>
+	Response MakeResponse(http::status status, const StringRequest& req) {
+		using BodyValue = typename Response::body_type::value_type;
+		const auto allocator = req.get_allocator();
+		auto body_args = [&allocator] {
+			if constexpr (std::is_constructible_v<BodyValue, decltype(allocator)>) {
+				return std::make_tuple(allocator);
+			}
+			else {
+				return std::tuple<>{};
+			}
+		}();
+
+		Response resp(std::piecewise_construct, std::move(body_args), std::make_tuple(allocator));
+		resp.result(status);
+		resp.version(req.version());
+		resp.keep_alive(req.keep_alive());
+		return resp;
+	}
 
 	constexpr auto json_not_found = R"({"code": "mapNotFound", "message" : "Map not found"})";
 	constexpr auto json_invalid_name = R"({"code": "invalidArgument", "message": "Invalid name"})";
@@ -39,6 +72,8 @@ namespace http_handler {
 	constexpr auto invalid_content_type = R"({"code": "invalidArgument", "message": "Invalid content type"})";
 	constexpr auto invalid_tick_req = R"({"code": "invalidArgument", "message": "Failed to parse tick request JSON"})";
 	constexpr auto bad_request_invalid_endpoint = R"({"code": "badRequest", "message": "Invalid endpoint"})";
+	constexpr auto upgrade_required = R"({"code": "upgradeRequired", "message": "WebSocket upgrade is required"})";
+	constexpr auto invalid_since_param = R"({"code": "invalidArgument", "message": "Invalid since parameter"})";
 
 	constexpr auto authorization_method_missing = R"({"code": "invalidToken", "message": "Authorization header is missing"})";
 	constexpr auto token_not_found = R"({"code": "unknownToken", "message": "Player token has not been found"})";
@@ -50,8 +85,121 @@ namespace http_handler {
 	constexpr std::string_view api_post_join = "/api/v1/game/join"sv; //Для входа в игру 
 	constexpr std::string_view api_get_players = "/api/v1/game/players"sv; //Получение списка игроков
 	constexpr std::string_view api_get_game_state = "/api/v1/game/state"sv; //Запрос игрового состояния
+	constexpr std::string_view api_get_game_changes = "/api/v1/game/changes"sv; //Изменения игрового состояния после тика ?since=N
 	constexpr std::string_view api_game_player_action = "/api/v1/game/player/action"sv; //Управление действиями своего персонажа
 	constexpr std::string_view api_game_tick = "/api/v1/game/tick"sv; //Установить время
+	constexpr std::string_view api_game_stream = "/api/v1/game/stream"sv; //WebSocket с состоянием сессии после каждого тика
+
+	// Маршруты API. Путь маршрута сравнивается с началом uri, поэтому /api/v1/maps/map1 - это MAPS,
+	// а /api/v1/game/changes?since=N - GAME_CHANGES
+	enum class ApiRoute : std::uint8_t {
+		MAPS,
+		JOIN,
+		PLAYERS,
+		GAME_STATE,
+		GAME_CHANGES,
+		PLAYER_ACTION,
+		GAME_STREAM,
+		GAME_TICK,
+		UNKNOWN,
+	};
+
+	constexpr size_t api_route_count = static_cast<size_t>(ApiRoute::UNKNOWN);
+
+	namespace detail {
+		struct ApiRouteEntry {
+			std::string_view path;
+			ApiRoute route;
+		};
+
+		constexpr std::array<ApiRouteEntry, api_route_count> api_routes{ {
+			{ api_get_map, ApiRoute::MAPS },
+			{ api_post_join, ApiRoute::JOIN },
+			{ api_get_players, ApiRoute::PLAYERS },
+			{ api_get_game_state, ApiRoute::GAME_STATE },
+			{ api_get_game_changes, ApiRoute::GAME_CHANGES },
+			{ api_game_player_action, ApiRoute::PLAYER_ACTION },
+			{ api_game_stream, ApiRoute::GAME_STREAM },
+			{ api_game_tick, ApiRoute::GAME_TICK },
+		} };
+
+		// Если бы один путь был началом другого, длинный маршрут стал бы недостижим
+		constexpr bool AreApiRoutesPrefixFree() {
+			for (const auto& a : api_routes) {
+				for (const auto& b : api_routes) {
+					if (a.route != b.route && b.path.starts_with(a.path)) {
+						return false;
+					}
+				}
+			}
+			return true;
+		}
+		static_assert(AreApiRoutesPrefixFree());
+
+		// Узел префиксного дерева путей. Потомки узла связаны в список через sibling, 0 - нет узла
+		struct ApiRouteNode {
+			char c = '\0';
+			std::uint16_t child = 0;
+			std::uint16_t sibling = 0;
+			ApiRoute route = ApiRoute::UNKNOWN;
+		};
+
+		constexpr size_t CountApiRouteNodes() {
+			size_t count = 1;
+			for (const auto& entry : api_routes) {
+				count += entry.path.size();
+			}
+			return count;
+		}
+
+		// Дерево строится при компиляции, поиск маршрута не выделяет память и не сравнивает строки целиком
+		constexpr auto MakeApiRouteTrie() {
+			std::array<ApiRouteNode, CountApiRouteNodes()> nodes{};
+			std::uint16_t count = 1;
+			for (const auto& entry : api_routes) {
+				std::uint16_t node = 0;
+				for (char c : entry.path) {
+					std::uint16_t child = nodes[node].child;
+					while (child != 0 && nodes[child].c != c) {
+						child = nodes[child].sibling;
+					}
+					if (child == 0) {
+						child = count++;
+						nodes[child] = ApiRouteNode{ c, 0, nodes[node].child, ApiRoute::UNKNOWN };
+						nodes[node].child = child;
+					}
+					node = child;
+				}
+				nodes[node].route = entry.route;
+			}
+			return nodes;
+		}
+
+		inline constexpr auto api_route_trie = MakeApiRouteTrie();
+	}  // namespace detail
+
+	constexpr ApiRoute FindApiRoute(std::string_view uri) noexcept {
+		const auto& trie = detail::api_route_trie;
+		std::uint16_t node = 0;
+		for (char c : uri) {
+			std::uint16_t child = trie[node].child;
+			while (child != 0 && trie[child].c != c) {
+				child = trie[child].sibling;
+			}
+			if (child == 0) {
+				return ApiRoute::UNKNOWN;
+			}
+			node = child;
+			if (trie[node].route != ApiRoute::UNKNOWN) {
+				return trie[node].route;
+			}
+		}
+		return ApiRoute::UNKNOWN;
+	}
+
+	static_assert(FindApiRoute(api_game_player_action) == ApiRoute::PLAYER_ACTION);
+	static_assert(FindApiRoute("/api/v1/maps/map1"sv) == ApiRoute::MAPS);
+	static_assert(FindApiRoute("/api/v1/game/player"sv) == ApiRoute::UNKNOWN);
 
 	constexpr std::string_view REQ_GET = "GET"sv;
 	constexpr std::string_view REQ_HEAD = "HEAD"sv;
@@ -110,14 +258,31 @@ namespace http_handler {
 
 	std::string_view GetMimeType(std::unordered_map<std::string_view, std::string_view>& file_ext, std::string_view ext);
 
-	inline std::string GetContentType(const StringRequest& req);
+	// Пустая строка, если заголовка нет
+	std::string_view GetContentType(const StringRequest& req);
 
-	StringResponse MakeStringResponse(http::status status, std::string_view body, unsigned http_version,
-		bool keep_alive,
+	StringResponse MakeStringResponse(http::status status, std::string_view body, const StringRequest& req,
 		std::string_view content_type);
 
+	using FileRequestResult = std::variant<EmptyResponse, StringResponse, SharedResponse, SendFileResponse>;
+
+	// Отдает файл из кэша статики. Совпавший If-None-Match или If-Modified-Since дает 304 без тела
+	FileRequestResult HandleStaticFileRequest(const StaticCache& cache, const StringRequest& req);
+
 	class ApiHandler {
+	public:
+		using MapsRequestResult = std::variant<EmptyResponse, StringResponse, SharedResponse>;
 	private:
+		// Документ, сериализованный один раз при запуске
+		struct CachedDocument {
+			std::shared_ptr<const std::string> body;
+			std::string etag;
+		};
+
+		static CachedDocument MakeCachedDocument(std::string body);
+
+		void BuildMapsCache();
+
 		json::array LoadRoadsToJson(const model::Game::MapPtr map) const;
 
 		json::array LoadBuildingsToJson(const model::Game::MapPtr map) const;
@@ -125,39 +290,96 @@ namespace http_handler {
 		json::array LoadOfficesToJson(const model::Game::MapPtr map) const;
 
 		json::array LoadLootTypes(const model::Game::MapPtr map) const;
+
+		// Обработчики маршрутов HandlerApiHandler. uri - путь запроса вместе с параметрами
+		StringResponse HandleJoin(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandlePlayers(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandleGameState(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandleGameChanges(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandlePlayerAction(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandleGameStream(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandleGameTick(const StringRequest& req, std::string_view uri) const;
+		StringResponse HandleBadRequest(const StringRequest& req, std::string_view uri) const;
 	public:
 		ApiHandler(app::Application& app)
 			:app_(app) {
+			// Карты не меняются после загрузки игры, поэтому их JSON строится один раз
+			BuildMapsCache();
 		}
 
-		bool IsApiRequest(StringRequest req);
+		bool IsApiRequest(const StringRequest& req) const noexcept;
+
+		// Запросы, которые не обращаются к изменяемому состоянию игры и не требуют strand
+		bool IsStatelessApiRequest(const StringRequest& req) const noexcept;
+
+		// Возвращает id карты игровой сессии, к которой относится запрос, или nullptr, если его не удаётся определить.
+		// Для запросов игроков не выделяет память
+		const model::Map::Id* FindTargetSession(const StringRequest& req) const;
+
+		const model::Game::Maps GetMaps() const noexcept;
+
+		model::GameSession* FindPlayerSession(const StringRequest& req) const noexcept;
 
 		StringResponse HandlerApiHandler(const StringRequest& req) const;
 
+		// Отдает список карт и карты из кэша. Совпавший If-None-Match дает 304 без тела
+		MapsRequestResult HandleMapsRequest(const StringRequest& req) const;
+
+		// Отвечает на запрос состояния готовым снимком сессии, не заходя в strand.
+		// Если снимка нет или запрос некорректен, возвращает nullopt
+		std::optional<SharedResponse> TryHandleStateFromSnapshot(const StringRequest& req) const;
+
 		void AddApiIgnore(std::string_view api, bool is_ignore);
 
 	private:
 		app::Application& app_;
-		std::unordered_map<std::string_view, bool> api_ignore_list_;
+		// Отключенные маршруты отвечают как несуществующие
+		std::array<bool, api_route_count + 1> ignored_routes_{};
+		CachedDocument maps_list_;
+		std::map<std::string, CachedDocument, std::less<>> map_documents_;
 	};
 	
 
 	class RequestHandler : public std::enable_shared_from_this<RequestHandler> {
-
-		using FileRequestResult = std::variant<EmptyResponse, StringResponse, FileResponse>;
 	public:
 		using Strand = net::strand<net::io_context::executor_type>;
 
-		explicit RequestHandler(fs::path root, Strand api_strand, ApiHandler& api_handler, bool ignore_api_tick)
-			: root_{ std::move(root) }
+		// Каталог root читается целиком при создании обработчика, файлы, добавленные позже, не отдаются
+		explicit RequestHandler(const fs::path& root, Strand api_strand, ApiHandler& api_handler, bool ignore_api_tick,
+			std::shared_ptr<state_stream::StateStreamer> state_streamer = nullptr)
+			: static_cache_{ root, [](std::string_view ext) { return GetMimeType(file_ext, ext); } }
 			, api_strand_{ api_strand }
-			, api_handler_{ api_handler } {
+			, api_handler_{ api_handler }
+			, state_streamer_{ std::move(state_streamer) } {
 			api_handler.AddApiIgnore(api_game_tick, ignore_api_tick);
+			// У каждой игровой сессии свой strand, чтобы запросы к разным картам выполнялись параллельно
+			for (const auto& map : api_handler_.GetMaps()) {
+				session_strands_.emplace(map->GetId(), net::make_strand(api_strand_.get_inner_executor()));
+			}
 		}
 
 		RequestHandler(const RequestHandler&) = delete;
 		RequestHandler& operator=(const RequestHandler&) = delete;
 
+		// Переводит запрос к api_game_stream с известным токеном на WebSocket и подписывает клиента на тики.
+		// Остальные запросы на переход обрабатываются как обычные HTTP-запросы
+		bool TryUpgrade(beast::tcp_stream& stream, StringRequest& req) {
+			std::string_view uri(req.target().data(), req.target().size());
+			if (!state_streamer_ || FindApiRoute(uri) != ApiRoute::GAME_STREAM) {
+				return false;
+			}
+
+			auto* session = api_handler_.FindPlayerSession(req);
+			if (!session) {
+				return false;
+			}
+
+			auto client = std::make_shared<http_server::PushSession>(std::move(stream));
+			client->Accept(std::move(req));
+			state_streamer_->Subscribe(std::move(client), *session);
+			return true;
+		}
+
 		template <typename Body, typename Allocator, typename Send>
 		void operator()(boost::asio::ip::tcp::endpoint, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
 			auto version = req.version();
@@ -167,23 +389,36 @@ namespace http_handler {
 			try {
 				if (api_handler_.IsApiRequest(req)) {
 
-					auto handle = [self = shared_from_this(), send,
+					if (api_handler_.IsStatelessApiRequest(req)) {
+						return std::visit(
+							[&send](auto&& result) {
+								send(std::forward<decltype(result)>(result));
+							},
+							api_handler_.HandleMapsRequest(req));
+					}
+
+					if (auto response = api_handler_.TryHandleStateFromSnapshot(req)) {
+						return send(std::move(*response));
+					}
+
+					auto strand = SelectStrand(req);
+					auto handle = [self = shared_from_this(), send, strand,
 						req = std::forward<decltype(req)>(req), version, keep_alive] {
 						try {
-							assert(self->api_strand_.running_in_this_thread());
+							assert(strand.running_in_this_thread());
 							return send(self->api_handler_.HandlerApiHandler(req));
 						}
 						catch (...) {
 							send(self->ReportServerError(version, keep_alive));
 						}
 						};
-					return net::dispatch(api_strand_, handle);
+					return net::dispatch(strand, handle);
 				}
 				return std::visit(
 					[&send](auto&& result) {
 						send(std::forward<decltype(result)>(result));
 					},
-					HandleFileRequest(req));
+					HandleStaticFileRequest(static_cache_, req));
 
 			}
 			catch (...) {
@@ -193,11 +428,23 @@ namespace http_handler {
 		}
 	private:
 
-		fs::path root_;
+		StaticCache static_cache_;
 		Strand api_strand_;
 		ApiHandler& api_handler_;
+		std::unordered_map<model::Map::Id, Strand, util::TaggedHasher<model::Map::Id>> session_strands_;
+		std::shared_ptr<state_stream::StateStreamer> state_streamer_;
 
 	private:
+		// Запросы игроков выполняются в strand своей сессии, остальные - в общем api_strand_
+		Strand SelectStrand(const StringRequest& req) const {
+			if (const auto* map_id = api_handler_.FindTargetSession(req)) {
+				if (auto it = session_strands_.find(*map_id); it != session_strands_.end()) {
+					return it->second;
+				}
+			}
+			return api_strand_;
+		}
+
 		StringResponse ReportServerError(unsigned version, bool keep_alive) {
 
 			StringResponse response(http::status::internal_server_error, version);
@@ -208,82 +455,41 @@ namespace http_handler {
 
 			return response;
 		}
-
-		FileResponse MakeFileResponse(http::status status, fs::path abs_path, unsigned http_version,
-			bool keep_alive,
-			std::string_view content_type) const;
-
-		FileRequestResult HandleFileRequest(const StringRequest& req) const {
-
-			std::string_view uri(req.target().data(), req.target().size());
-			auto url_encoded = UrlEncoded(uri);
-
-			if (!url_encoded.empty()) {
-
-				fs::path abs_path = GetAbsPath(root_.string(), url_encoded);
-
-				if (!IsSubPath(abs_path, root_.string())) {
-					return MakeStringResponse(http::status::not_found, bad_request, req.version(), req.keep_alive(), ContentType::TEXT_PLAIN);
-				}
-				else {
-
-					auto ext = GetExtType(uri);
-					std::string_view mime_type;
-
-					if (!uri.empty() && uri.back() != '/') {
-						mime_type = GetMimeType(file_ext, ext);
-					}
-					else {
-						mime_type = ContentType::TEXT_HTML;
-						abs_path = root_.string() + "/index.html"s;
-					}
-
-					if (fs::exists(abs_path)) {
-						return MakeFileResponse(http::status::ok, abs_path, req.version(), req.keep_alive(), mime_type);
-					}
-					else {
-						return MakeStringResponse(http::status::not_found, json_not_found, req.version(), req.keep_alive(), ContentType::TEXT_PLAIN);
-					}
-				}
-			}
-			else {
-				return MakeStringResponse(http::status::not_found, json_not_found, req.version(), req.keep_alive(), ContentType::TEXT_PLAIN);
-			}
-		}
 	};
 
 	namespace server_logging {
 		template<class SomeRequestHandler>
 		class LoggingRequestHandler {
-			static void LogRequest(const auto& req, const auto& endpoint) {
-
-				std::string msg{ key_request_received };
-
-				boost::json::value custom_data{ {key_ip,endpoint.address().to_string() },
-												{key_uri,req.target()},
-												{key_method,req.method_string()} };
-
-				BOOST_LOG_TRIVIAL(info) << logging::add_value(data, custom_data)
-					<< logging::add_value(message, msg);
+			// Запись кладется в буфер асинхронного лога без выделения памяти. Через Boost.Log пишутся только
+			// записи, которые не помещаются в AccessLogEntry, и записи без подключенного AsyncLogGuard
+			static void LogRequest(const auto& req, const boost::asio::ip::tcp::endpoint& endpoint) {
+				const std::string_view uri = req.target();
+				const std::string_view method = req.method_string();
+
+				logger::AccessLogEntry entry;
+				if (entry.SetRequest(endpoint.address(), method, uri) && logger::LogAccess(entry)) {
+					return;
+				}
 
+				BOOST_LOG_TRIVIAL(info) << logging::add_value(data, boost::json::value{ {key_ip, endpoint.address().to_string()},
+																						{key_uri, uri},
+																						{key_method, method} })
+					<< logging::add_value(message, key_request_received);
 			}
 
 			static void LogResponse(const auto& resp, long long response_time) {
-
-				std::string msg{ key_response_sent };
 				auto content_type_it = resp.base().find(boost::beast::http::field::content_type);
-				std::string content_type = "null"s;
+				const std::string_view content_type = content_type_it != resp.base().end() ? content_type_it->value() : "null"sv;
 
-				if (content_type_it != resp.base().end()) {
-					content_type = content_type_it->value();
+				logger::AccessLogEntry entry;
+				if (entry.SetResponse(resp.result_int(), content_type, response_time) && logger::LogAccess(entry)) {
+					return;
 				}
 
-				boost::json::value custom_data{ {key_response_time, std::to_string(response_time) },
-												{key_code, resp.result_int()},
-												{key_content_type, content_type} };
-
-				BOOST_LOG_TRIVIAL(info) << logging::add_value(data, custom_data)
-					<< logging::add_value(message, msg);
+				BOOST_LOG_TRIVIAL(info) << logging::add_value(data, boost::json::value{ {key_response_time, std::to_string(response_time)},
+																						{key_code, resp.result_int()},
+																						{key_content_type, content_type} })
+					<< logging::add_value(message, key_response_sent);
 			}
 
 		public:
@@ -293,11 +499,10 @@ namespace http_handler {
 
 				LogRequest(req, endpoint);
 
-				auto handler = [endpoint, req, send, this](auto&& resp) {
-					auto start_time = std::chrono::steady_clock::now();
-					LogResponse(std::forward<decltype(resp)>(resp), std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count());
-					send(resp);
-
+				// Захватываются только функция отправки и время: копия запроса выделяла бы память на каждый запрос
+				auto handler = [send = std::forward<Send>(send), start_time = std::chrono::steady_clock::now()](auto&& resp) {
+					LogResponse(resp, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time).count());
+					send(std::forward<decltype(resp)>(resp));
 					};
 
 				decorated_(endpoint, std::move(req), std::move(handler));
@@ -0,0 +1,120 @@
+﻿#include "state_file.h"
+#include <boost/crc.hpp>
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace serialization::state_file {
+
+namespace {
+
+// Смещения полей заголовка
+constexpr size_t version_offset = 8;
+constexpr size_t flags_offset = 12;
+constexpr size_t size_offset = 16;
+constexpr size_t checksum_offset = 24;
+
+}  // namespace
+
+std::uint32_t Checksum(std::span<const char> data) noexcept {
+    boost::crc_32_type crc;
+    crc.process_bytes(data.data(), data.size());
+    return crc.checksum();
+}
+
+MappedFile::MappedFile(const std::filesystem::path& path) {
+    // Пустой файл отобразить нельзя, а проверка заголовка отклонит его и так
+    if (std::filesystem::file_size(path) == 0) {
+        return;
+    }
+    mapping_ = boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+    region_ = boost::interprocess::mapped_region(mapping_, boost::interprocess::read_only);
+    region_.advise(boost::interprocess::mapped_region::advice_sequential);
+}
+
+bool HasSignature(std::span<const char> file) noexcept {
+    return file.size() >= signature.size()
+        && std::memcmp(file.data(), signature.data(), signature.size()) == 0;
+}
+
+void WriteHeader(std::string& file) {
+    if (file.size() < header_size) {
+        throw std::invalid_argument("State file is shorter than its header");
+    }
+    const std::span<const char> payload(file.data() + header_size, file.size() - header_size);
+    char* header = file.data();
+    std::memcpy(header, signature.data(), signature.size());
+    detail::StoreLittleEndian(header + version_offset, format_version);
+    detail::StoreLittleEndian(header + flags_offset, std::uint32_t{ 0 });
+    detail::StoreLittleEndian(header + size_offset, static_cast<std::uint64_t>(payload.size()));
+    detail::StoreLittleEndian(header + checksum_offset, Checksum(payload));
+    detail::StoreLittleEndian(header + checksum_offset + 4, std::uint32_t{ 0 });
+}
+
+Payload CheckHeader(std::span<const char> file) {
+    if (file.size() < header_size || !HasSignature(file)) {
+        throw std::runtime_error("Not a binary state file");
+    }
+    const char* header = file.data();
+    const auto version = detail::LoadLittleEndian<std::uint32_t>(header + version_offset);
+    if (version < min_format_version || version > format_version) {
+        throw std::runtime_error("Unsupported state file version " + std::to_string(version));
+    }
+    const auto payload = file.subspan(header_size);
+    if (detail::LoadLittleEndian<std::uint64_t>(header + size_offset) != payload.size()) {
+        throw std::runtime_error("State file size mismatch");
+    }
+    if (detail::LoadLittleEndian<std::uint32_t>(header + checksum_offset) != Checksum(payload)) {
+        throw std::runtime_error("State file checksum mismatch");
+    }
+    return { payload, version };
+}
+
+void WriteAll(int fd, std::string_view data, const std::string& path) {
+    while (!data.empty()) {
+        const ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "Cannot write " + path);
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+}
+
+void WriteFileDurably(const std::string& path, std::string_view data) {
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+    }
+    try {
+        WriteAll(fd, data, path);
+        if (::fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot sync " + path);
+        }
+    }
+    catch (...) {
+        ::close(fd);
+        throw;
+    }
+    if (::close(fd) != 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot close " + path);
+    }
+}
+
+void SyncDirectory(const std::filesystem::path& dir) {
+    const int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot open directory " + dir.string());
+    }
+    const int result = ::fsync(fd);
+    ::close(fd);
+    if (result != 0) {
+        throw std::system_error(errno, std::generic_category(), "Cannot sync directory " + dir.string());
+    }
+}
+
+}  // namespace serialization::state_file
@@ -0,0 +1,276 @@
+﻿#pragma once
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Двоичный формат файла состояния.
+//
+// Заголовок (header_size байт): сигнатура, версия формата, флаги (0),
+// размер данных и CRC-32 данных. Все числа - little-endian.
+// Данные - поля представлений в порядке их serialize(): целые числа своей ширины,
+// double - 8 байт IEEE 754, строки - длина uint32 и байты. У каждого вектора перед
+// элементами записаны число элементов uint32 и длина секции в байтах uint64,
+// поэтому испорченная секция обнаруживается, не выходя за ее границы.
+// Версия формата передается в serialize() представлений: версия 2 добавила номер поколения журнала
+namespace serialization::state_file {
+
+inline constexpr std::array<char, 8> signature = { 'G', 'S', 'S', 'T', 'A', 'T', 'E', '\x1A' };
+inline constexpr std::uint32_t min_format_version = 1;
+inline constexpr std::uint32_t format_version = 2;
+inline constexpr size_t header_size = 32;
+
+namespace detail {
+
+template <typename T>
+struct IsVector : std::false_type {};
+
+template <typename T, typename Alloc>
+struct IsVector<std::vector<T, Alloc>> : std::true_type {};
+
+template <typename T>
+void StoreLittleEndian(char* dst, T value) noexcept {
+    static_assert(std::is_unsigned_v<T>);
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(dst, &value, sizeof(T));
+    } else {
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            dst[i] = static_cast<char>((value >> (8 * i)) & 0xFFu);
+        }
+    }
+}
+
+template <typename T>
+T LoadLittleEndian(const char* src) noexcept {
+    static_assert(std::is_unsigned_v<T>);
+    T value = 0;
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(&value, src, sizeof(T));
+    } else {
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            value |= static_cast<T>(static_cast<unsigned char>(src[i])) << (8 * i);
+        }
+    }
+    return value;
+}
+
+}  // namespace detail
+
+// Архив записи в буфер. Совместим с serialize() представлений из model_serialization.h
+class BinaryOutputArchive {
+public:
+    explicit BinaryOutputArchive(std::string& buffer, unsigned version = format_version)
+        : buffer_(buffer)
+        , version_(version) {
+    }
+
+    template <typename T>
+    BinaryOutputArchive& operator&(const T& value) {
+        Save(value);
+        return *this;
+    }
+
+    template <typename T>
+    BinaryOutputArchive& operator<<(const T& value) {
+        Save(value);
+        return *this;
+    }
+
+private:
+    template <typename T>
+    void SaveInteger(T value) {
+        using Unsigned = std::make_unsigned_t<T>;
+        const size_t pos = buffer_.size();
+        buffer_.resize(pos + sizeof(T));
+        detail::StoreLittleEndian(buffer_.data() + pos, static_cast<Unsigned>(value));
+    }
+
+    template <typename T>
+    void Save(const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            SaveInteger(static_cast<std::uint8_t>(value));
+        } else if constexpr (std::is_enum_v<T>) {
+            SaveInteger(static_cast<std::underlying_type_t<T>>(value));
+        } else if constexpr (std::is_integral_v<T>) {
+            SaveInteger(value);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            static_assert(std::is_same_v<T, double>, "only double is supported");
+            SaveInteger(std::bit_cast<std::uint64_t>(value));
+        } else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+            SaveInteger(static_cast<std::uint32_t>(value.size()));
+            buffer_.append(value);
+        } else if constexpr (detail::IsVector<T>::value) {
+            SaveInteger(static_cast<std::uint32_t>(value.size()));
+            // Длина секции известна только после записи элементов
+            const size_t length_pos = buffer_.size();
+            SaveInteger(std::uint64_t{ 0 });
+            for (const auto& item : value) {
+                Save(item);
+            }
+            detail::StoreLittleEndian(buffer_.data() + length_pos,
+                static_cast<std::uint64_t>(buffer_.size() - length_pos - sizeof(std::uint64_t)));
+        } else if constexpr (requires(T& obj, BinaryOutputArchive& ar) { obj.serialize(ar, 0u); }) {
+            // serialize() представлений общий для чтения и записи и поэтому неконстантный
+            const_cast<T&>(value).serialize(*this, version_);
+        } else {
+            serialize(*this, const_cast<T&>(value), version_);
+        }
+    }
+
+private:
+    std::string& buffer_;
+    unsigned version_;
+};
+
+// Архив чтения из непрерывной области памяти, например из отображенного в память файла.
+// При выходе за границы данных или секции выбрасывает std::runtime_error
+class BinaryInputArchive {
+public:
+    explicit BinaryInputArchive(std::span<const char> data, unsigned version = format_version)
+        : data_(data)
+        , version_(version) {
+    }
+
+    template <typename T>
+    BinaryInputArchive& operator&(T& value) {
+        Load(value);
+        return *this;
+    }
+
+    template <typename T>
+    BinaryInputArchive& operator>>(T& value) {
+        Load(value);
+        return *this;
+    }
+
+    bool AtEnd() const noexcept {
+        return pos_ == data_.size();
+    }
+
+private:
+    const char* Take(size_t size) {
+        if (data_.size() - pos_ < size) {
+            throw std::runtime_error("State file is truncated");
+        }
+        const char* ptr = data_.data() + pos_;
+        pos_ += size;
+        return ptr;
+    }
+
+    template <typename T>
+    T LoadInteger() {
+        using Unsigned = std::make_unsigned_t<T>;
+        return static_cast<T>(detail::LoadLittleEndian<Unsigned>(Take(sizeof(T))));
+    }
+
+    template <typename T>
+    void Load(T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            value = LoadInteger<std::uint8_t>() != 0;
+        } else if constexpr (std::is_enum_v<T>) {
+            value = static_cast<T>(LoadInteger<std::underlying_type_t<T>>());
+        } else if constexpr (std::is_integral_v<T>) {
+            value = LoadInteger<T>();
+        } else if constexpr (std::is_floating_point_v<T>) {
+            static_assert(std::is_same_v<T, double>, "only double is supported");
+            value = std::bit_cast<double>(LoadInteger<std::uint64_t>());
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            const auto size = LoadInteger<std::uint32_t>();
+            value.assign(Take(size), size);
+        } else if constexpr (detail::IsVector<T>::value) {
+            const auto count = LoadInteger<std::uint32_t>();
+            const auto length = LoadInteger<std::uint64_t>();
+            if (length > data_.size() - pos_ || count > length) {
+                throw std::runtime_error("State file section is corrupted");
+            }
+            const size_t section_end = pos_ + length;
+            value.clear();
+            value.reserve(count);
+            for (std::uint32_t i = 0; i < count; ++i) {
+                Load(value.emplace_back());
+            }
+            if (pos_ != section_end) {
+                throw std::runtime_error("State file section length mismatch");
+            }
+        } else if constexpr (requires(T& obj, BinaryInputArchive& ar) { obj.serialize(ar, 0u); }) {
+            value.serialize(*this, version_);
+        } else {
+            serialize(*this, value, version_);
+        }
+    }
+
+private:
+    std::span<const char> data_;
+    size_t pos_ = 0;
+    unsigned version_;
+};
+
+// Файл, отображенный в память только для чтения
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path);
+
+    std::span<const char> GetData() const noexcept {
+        return { static_cast<const char*>(region_.get_address()), region_.get_size() };
+    }
+
+private:
+    boost::interprocess::file_mapping mapping_;
+    boost::interprocess::mapped_region region_;
+};
+
+// Данные файла после проверки заголовка
+struct Payload {
+    std::span<const char> data;
+    unsigned version;
+};
+
+bool HasSignature(std::span<const char> file) noexcept;
+
+std::uint32_t Checksum(std::span<const char> data) noexcept;
+
+// Заполняет заголовок в первых header_size байтах file по данным после него
+void WriteHeader(std::string& file);
+
+// Проверяет сигнатуру, версию, размер и контрольную сумму
+Payload CheckHeader(std::span<const char> file);
+
+// Записывает все байты data в дескриптор fd. path нужен только для текста ошибки
+void WriteAll(int fd, std::string_view data, const std::string& path);
+
+// Записывает data в файл path и дожидается сброса файла на диск
+void WriteFileDurably(const std::string& path, std::string_view data);
+
+// Сбрасывает на диск запись каталога, чтобы создание или переименование файла пережило сбой питания
+void SyncDirectory(const std::filesystem::path& dir);
+
+// Содержимое файла состояния с заголовком
+template <typename T>
+std::string Encode(const T& value) {
+    std::string file(header_size, '\0');
+    BinaryOutputArchive output_archive(file);
+    output_archive << value;
+    WriteHeader(file);
+    return file;
+}
+
+template <typename T>
+void Decode(std::span<const char> file, T& value) {
+    const auto payload = CheckHeader(file);
+    BinaryInputArchive input_archive(payload.data, payload.version);
+    input_archive >> value;
+    if (!input_archive.AtEnd()) {
+        throw std::runtime_error("Unexpected data at the end of state file");
+    }
+}
+
+}  // namespace serialization::state_file
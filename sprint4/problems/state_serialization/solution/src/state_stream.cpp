@@ -0,0 +1,48 @@
+﻿#include "state_stream.h"
+
+namespace state_stream {
+
+	void StateStreamer::Subscribe(std::shared_ptr<http_server::PushSession> client, model::GameSession& session) {
+		// Клиент сразу получает последнее состояние, не дожидаясь тика
+		if (auto snapshot = session.GetStateSnapshot()) {
+			client->Push(std::move(snapshot));
+		}
+
+		std::lock_guard lock(mutex_);
+		subscribers_.push_back(Subscriber{ client, &session });
+	}
+
+	void StateStreamer::OnTick([[maybe_unused]] std::chrono::milliseconds timestamp) {
+		std::lock_guard lock(mutex_);
+
+		std::erase_if(subscribers_, [](const Subscriber& subscriber) {
+			auto client = subscriber.client.lock();
+			return !client || client->IsClosed();
+			});
+
+		for (const auto& subscriber : subscribers_) {
+			auto snapshot = subscriber.session->GetStateSnapshot();
+			auto client = subscriber.client.lock();
+			if (snapshot && client) {
+				client->Push(std::move(snapshot));
+			}
+		}
+	}
+
+	size_t StateStreamer::GetClientCount() const {
+		std::lock_guard lock(mutex_);
+		return subscribers_.size();
+	}
+
+	size_t StateStreamer::GetDroppedFrames() const {
+		std::lock_guard lock(mutex_);
+		size_t dropped = 0;
+		for (const auto& subscriber : subscribers_) {
+			if (auto client = subscriber.client.lock()) {
+				dropped += client->GetDroppedMessages();
+			}
+		}
+		return dropped;
+	}
+
+}  // namespace state_stream
@@ -0,0 +1,34 @@
+﻿#pragma once
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "app.h"
+#include "http_server.h"
+
+namespace state_stream {
+
+	// Рассылает подписанным WebSocket-клиентам состояние их игровых сессий после каждого тика.
+	// Рассылается снимок, опубликованный тиком, поэтому состояние сериализуется один раз на сессию
+	class StateStreamer : public app::ApplicationListener {
+	public:
+		void Subscribe(std::shared_ptr<http_server::PushSession> client, model::GameSession& session);
+
+		void OnTick(std::chrono::milliseconds timestamp) override;
+
+		size_t GetClientCount() const;
+
+		// Сколько кадров отброшено у подключенных сейчас клиентов из-за медленного приема
+		size_t GetDroppedFrames() const;
+
+	private:
+		struct Subscriber {
+			std::weak_ptr<http_server::PushSession> client;
+			model::GameSession* session;
+		};
+
+		mutable std::mutex mutex_;
+		std::vector<Subscriber> subscribers_;
+	};
+
+}  // namespace state_stream
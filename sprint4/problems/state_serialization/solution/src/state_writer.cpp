@@ -0,0 +1,222 @@
+﻿#include "state_writer.h"
+#include "model_datails.h"
+
+namespace state_writer {
+using namespace std::literals;
+
+void JsonWriter::Double(double value) {
+    Separate();
+    need_comma_ = true;
+
+    // Особые значения пишутся так же, как в ryu, который использует Boost.JSON
+    if (std::isnan(value)) {
+        out_.append("NaN"sv);
+        return;
+    }
+    if (std::isinf(value)) {
+        out_.append(value < 0 ? "-Infinity"sv : "Infinity"sv);
+        return;
+    }
+
+    // to_chars без точности дает кратчайшую запись, однозначно восстанавливающую число,
+    // как и ryu. Остается привести экспоненту "e+01" к виду "E1"
+    char buf[32];
+    auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::scientific);
+    std::string_view str(buf, ptr - buf);
+    const auto exp_pos = str.find('e');
+
+    out_.append(str.substr(0, exp_pos));
+    out_.push_back('E');
+
+    std::string_view exponent = str.substr(exp_pos + 1);
+    if (exponent.front() == '-') {
+        out_.push_back('-');
+    }
+    exponent.remove_prefix(1);
+    while (exponent.size() > 1 && exponent.front() == '0') {
+        exponent.remove_prefix(1);
+    }
+    out_.append(exponent);
+}
+
+void JsonWriter::WriteEscaped(std::string_view value) {
+    constexpr std::string_view hex = "0123456789abcdef"sv;
+
+    out_.push_back('"');
+    for (const char ch : value) {
+        const auto code = static_cast<unsigned char>(ch);
+        switch (ch) {
+        case '"': out_.append("\\\""sv); break;
+        case '\\': out_.append("\\\\"sv); break;
+        case '\b': out_.append("\\b"sv); break;
+        case '\f': out_.append("\\f"sv); break;
+        case '\n': out_.append("\\n"sv); break;
+        case '\r': out_.append("\\r"sv); break;
+        case '\t': out_.append("\\t"sv); break;
+        default:
+            if (code < 0x20) {
+                out_.append("\\u00"sv);
+                out_.push_back(hex[code >> 4]);
+                out_.push_back(hex[code & 0xF]);
+            }
+            else {
+                out_.push_back(ch);
+            }
+        }
+    }
+    out_.push_back('"');
+}
+
+static std::string_view DirectionToString(model::Direction dir) {
+    switch (dir) {
+    case model::Direction::DIR_NORTH:
+        return "U"sv;
+    case model::Direction::DIR_SOUTH:
+        return "D"sv;
+    case model::Direction::DIR_EAST:
+        return "R"sv;
+    case model::Direction::DIR_WEST:
+        return "L"sv;
+    }
+    return {};
+}
+
+// Ключи числовых id записываются без промежуточной строки
+template <typename Id>
+static void WriteIdKey(JsonWriter& writer, Id id) {
+    char buf[24];
+    auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), id);
+    writer.Key(std::string_view(buf, ptr - buf));
+}
+
+static void WriteDog(JsonWriter& writer, const model::DogRef& dog) {
+    using namespace model_details;
+
+    WriteIdKey(writer, *dog.GetId());
+    writer.BeginObject();
+
+    writer.Key(key_pos);
+    writer.BeginArray();
+    writer.Double(dog.GetPosition().x);
+    writer.Double(dog.GetPosition().y);
+    writer.EndArray();
+
+    writer.Key(key_speed);
+    writer.BeginArray();
+    writer.Double(dog.GetSpeed().x);
+    writer.Double(dog.GetSpeed().y);
+    writer.EndArray();
+
+    writer.Key(key_dir);
+    writer.String(DirectionToString(dog.GetDirection()));
+
+    writer.Key(key_bag);
+    writer.BeginArray();
+    for (const auto& item : dog.GetBagContent()) {
+        writer.BeginObject();
+        writer.Key(key_id);
+        writer.Integer(*item.id);
+        writer.Key(key_type);
+        writer.Integer(item.type);
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.Key(key_score);
+    writer.Integer(dog.GetScore());
+    writer.EndObject();
+}
+
+static void WriteLoot(JsonWriter& writer, const model::Loot& loot) {
+    using namespace model_details;
+
+    WriteIdKey(writer, *loot.id);
+    writer.BeginObject();
+    writer.Key(key_type);
+    writer.Integer(loot.type);
+    writer.Key(key_pos);
+    writer.BeginArray();
+    writer.Double(static_cast<double>(loot.position.x));
+    writer.Double(static_cast<double>(loot.position.y));
+    writer.EndArray();
+    writer.EndObject();
+}
+
+static void WriteStateBody(JsonWriter& writer, model::GameSession& session) {
+    using namespace model_details;
+
+    writer.Key(key_players);
+    writer.BeginObject();
+    for (size_t i = 0; i < session.GetDogCount(); ++i) {
+        WriteDog(writer, session.GetDog(i));
+    }
+    writer.EndObject();
+
+    writer.Key(key_lost_objects);
+    writer.BeginObject();
+    for (const auto& loot : session.GetMap()->GetLoots()) {
+        WriteLoot(writer, loot);
+    }
+    writer.EndObject();
+}
+
+void WriteGameState(model::GameSession& session, std::string& out) {
+    JsonWriter writer(out);
+    writer.BeginObject();
+    WriteStateBody(writer, session);
+    writer.EndObject();
+}
+
+void WriteStateChanges(model::GameSession& session, std::optional<std::uint64_t> since, std::string& out, ChangesScratch& scratch) {
+    using namespace model_details;
+
+    scratch.dogs.clear();
+    scratch.loots.clear();
+    const bool full = !since || !session.CollectChanges(*since, scratch.dogs, scratch.loots);
+
+    JsonWriter writer(out);
+    writer.BeginObject();
+    writer.Key(key_tick);
+    writer.Integer(session.GetTick());
+    writer.Key(key_full);
+    writer.Bool(full);
+
+    if (full) {
+        WriteStateBody(writer, session);
+        writer.EndObject();
+        return;
+    }
+
+    writer.Key(key_players);
+    writer.BeginObject();
+    for (const auto id : scratch.dogs) {
+        if (auto dog = session.FindDog(id)) {
+            WriteDog(writer, *dog);
+        }
+    }
+    writer.EndObject();
+
+    // Изменившийся предмет либо появился и лежит на карте, либо был подобран
+    const auto& map = *session.GetMap();
+    writer.Key(key_lost_objects);
+    writer.BeginObject();
+    for (const auto id : scratch.loots) {
+        if (const auto* loot = map.FindLoot(id)) {
+            WriteLoot(writer, *loot);
+        }
+    }
+    writer.EndObject();
+
+    writer.Key(key_removed_lost_objects);
+    writer.BeginArray();
+    for (const auto id : scratch.loots) {
+        if (!map.FindLoot(id)) {
+            writer.Integer(*id);
+        }
+    }
+    writer.EndArray();
+
+    writer.EndObject();
+}
+
+}  // namespace state_writer
@@ -0,0 +1,99 @@
+﻿#pragma once
+#include <charconv>
+#include <cmath>
+#include <concepts>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <vector>
+#include "model.h"
+
+namespace state_writer {
+
+	// Пишет JSON прямо в строку без построения json::value.
+	// Формат совпадает с json::serialize: без пробелов, double - кратчайшая запись в виде 4.2E-1
+	class JsonWriter {
+	public:
+		explicit JsonWriter(std::string& out)
+			: out_(out) {
+		}
+
+		void BeginObject() {
+			Separate();
+			out_.push_back('{');
+			need_comma_ = false;
+		}
+
+		void EndObject() {
+			out_.push_back('}');
+			need_comma_ = true;
+		}
+
+		void BeginArray() {
+			Separate();
+			out_.push_back('[');
+			need_comma_ = false;
+		}
+
+		void EndArray() {
+			out_.push_back(']');
+			need_comma_ = true;
+		}
+
+		void Key(std::string_view key) {
+			Separate();
+			WriteEscaped(key);
+			out_.push_back(':');
+			need_comma_ = false;
+		}
+
+		void String(std::string_view value) {
+			Separate();
+			WriteEscaped(value);
+			need_comma_ = true;
+		}
+
+		void Bool(bool value) {
+			Separate();
+			out_.append(value ? "true" : "false");
+			need_comma_ = true;
+		}
+
+		template <std::integral T>
+		void Integer(T value) {
+			Separate();
+			char buf[24];
+			auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+			out_.append(buf, ptr);
+			need_comma_ = true;
+		}
+
+		void Double(double value);
+
+	private:
+		void Separate() {
+			if (need_comma_) {
+				out_.push_back(',');
+			}
+		}
+
+		void WriteEscaped(std::string_view value);
+
+		std::string& out_;
+		bool need_comma_ = false;
+	};
+
+	// Дописывает в out состояние сессии в формате ответа /api/v1/game/state
+	void WriteGameState(model::GameSession& session, std::string& out);
+
+	// Буферы для сбора изменений, переиспользуемые между запросами
+	struct ChangesScratch {
+		std::vector<model::Dog::Id> dogs;
+		std::vector<model::Loot::Id> loots;
+	};
+
+	// Дописывает в out изменения сессии после тика since в формате ответа /api/v1/game/changes.
+	// Если since не задан или изменений за этот период уже нет, пишется полное состояние с "full":true
+	void WriteStateChanges(model::GameSession& session, std::optional<std::uint64_t> since, std::string& out, ChangesScratch& scratch);
+
+}  // namespace state_writer
@@ -0,0 +1,186 @@
+﻿#include "static_cache.h"
+
+#include <charconv>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+namespace http_handler {
+	using namespace std::literals;
+	using namespace boost_aliases;
+
+	namespace {
+		std::string FormatHttpDate(fs::file_time_type time) {
+			const auto sys_time = std::chrono::file_clock::to_sys(time);
+			const std::time_t t = std::chrono::system_clock::to_time_t(
+				std::chrono::time_point_cast<std::chrono::system_clock::duration>(sys_time));
+			std::tm tm{};
+			gmtime_r(&t, &tm);
+
+			char buffer[32];
+			const auto size = std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+			return std::string(buffer, size);
+		}
+
+		// ETag в духе nginx: время изменения и размер. Представления одного файла различаются кодированием
+		std::string MakeETag(fs::file_time_type time, std::uint64_t size, std::string_view encoding) {
+			const auto sys_time = std::chrono::file_clock::to_sys(time);
+			const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(sys_time.time_since_epoch()).count();
+
+			char buffer[64];
+			char* end = buffer;
+			*end++ = '"';
+			end = std::to_chars(end, buffer + sizeof(buffer), static_cast<std::uint64_t>(seconds), 16).ptr;
+			*end++ = '-';
+			end = std::to_chars(end, buffer + sizeof(buffer), size, 16).ptr;
+
+			std::string etag(buffer, end);
+			if (!encoding.empty()) {
+				etag += '-';
+				etag += encoding;
+			}
+			etag += '"';
+			return etag;
+		}
+
+		std::string_view Trim(std::string_view s) {
+			while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+				s.remove_prefix(1);
+			}
+			while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+				s.remove_suffix(1);
+			}
+			return s;
+		}
+
+		// q кодирования encoding в Accept-Encoding: 0 - клиент его не принимает
+		double GetEncodingQuality(std::string_view accept_encoding, std::string_view encoding) {
+			std::optional<double> exact;
+			std::optional<double> any;
+			while (!accept_encoding.empty()) {
+				auto comma = accept_encoding.find(',');
+				auto item = accept_encoding.substr(0, comma);
+				accept_encoding = comma == std::string_view::npos ? std::string_view{} : accept_encoding.substr(comma + 1);
+
+				auto semicolon = item.find(';');
+				auto name = Trim(item.substr(0, semicolon));
+				double quality = 1.0;
+				if (semicolon != std::string_view::npos) {
+					auto params = Trim(item.substr(semicolon + 1));
+					if (params.starts_with("q="sv) || params.starts_with("Q="sv)) {
+						params.remove_prefix(2);
+						if (std::from_chars(params.data(), params.data() + params.size(), quality).ec != std::errc{}) {
+							quality = 0.0;
+						}
+					}
+				}
+
+				if (beast::iequals(name, encoding)) {
+					exact = quality;
+				}
+				else if (name == "*"sv) {
+					any = quality;
+				}
+			}
+			return exact.value_or(any.value_or(0.0));
+		}
+
+		std::shared_ptr<const std::string> ReadFile(const fs::path& path, std::uint64_t size) {
+			std::ifstream in(path, std::ios::binary);
+			std::string data(size, '\0');
+			if (!in.read(data.data(), static_cast<std::streamsize>(size))) {
+				throw std::runtime_error("Failed to read static file "s + path.string());
+			}
+			return std::make_shared<const std::string>(std::move(data));
+		}
+	}  // namespace
+
+	const StaticFileVariant& StaticFile::SelectVariant(std::string_view accept_encoding) const {
+		if (!HasEncodedVariants() || accept_encoding.empty()) {
+			return identity;
+		}
+
+		const double br_quality = br ? GetEncodingQuality(accept_encoding, "br"sv) : 0.0;
+		const double gzip_quality = gzip ? GetEncodingQuality(accept_encoding, "gzip"sv) : 0.0;
+		if (br_quality > 0.0 && br_quality >= gzip_quality) {
+			return *br;
+		}
+		if (gzip_quality > 0.0) {
+			return *gzip;
+		}
+		return identity;
+	}
+
+	StaticCache::StaticCache(const fs::path& root, const MimeTypeResolver& mime_types, std::uint64_t memory_limit) {
+		if constexpr (!http_server::sendfile_supported) {
+			// Без sendfile отдавать файлы из памяти все равно быстрее, чем читать их на каждый запрос
+			memory_limit = std::numeric_limits<std::uint64_t>::max();
+		}
+
+		const auto options = fs::directory_options::follow_directory_symlink;
+		for (const auto& entry : fs::recursive_directory_iterator(root, options)) {
+			if (!entry.is_regular_file()) {
+				continue;
+			}
+
+			const auto& path = entry.path();
+			std::string extension = path.extension().string();
+			if (!extension.empty()) {
+				extension.erase(0, 1);
+			}
+
+			StaticFile file{ mime_types(extension), LoadVariant(path, {}, memory_limit) };
+
+			auto gzip_path = path;
+			gzip_path += ".gz";
+			if (fs::is_regular_file(gzip_path)) {
+				file.gzip = LoadVariant(gzip_path, "gzip"sv, memory_limit);
+			}
+
+			auto br_path = path;
+			br_path += ".br";
+			if (fs::is_regular_file(br_path)) {
+				file.br = LoadVariant(br_path, "br"sv, memory_limit);
+			}
+
+			files_.insert_or_assign("/"s + fs::relative(path, root).generic_string(), std::move(file));
+		}
+	}
+
+	StaticFileVariant StaticCache::LoadVariant(const fs::path& path, std::string_view encoding, std::uint64_t memory_limit) const {
+		StaticFileVariant variant;
+		variant.encoding = encoding;
+		variant.size = fs::file_size(path);
+
+		const auto modified = fs::last_write_time(path);
+		variant.etag = MakeETag(modified, variant.size, encoding);
+		variant.last_modified = FormatHttpDate(modified);
+
+		if (variant.size <= memory_limit) {
+			variant.data = ReadFile(path, variant.size);
+		}
+		else {
+			variant.file = std::make_shared<const http_server::FileDescriptor>(path.string());
+		}
+		return variant;
+	}
+
+	std::optional<std::string> StaticCache::NormalizePath(std::string_view path) {
+		if (path.starts_with('/')) {
+			path.remove_prefix(1);
+		}
+
+		std::string normal = fs::path(path).lexically_normal().generic_string();
+		if (normal == ".."sv || normal.starts_with("../"sv)) {
+			return std::nullopt;
+		}
+		return "/"s + normal;
+	}
+
+	const StaticFile* StaticCache::Find(std::string_view path) const {
+		auto it = files_.find(path);
+		return it == files_.end() ? nullptr : &it->second;
+	}
+}  // namespace http_handler
@@ -0,0 +1,69 @@
+﻿#pragma once
+#include "http_server.h"
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace http_handler {
+	namespace fs = std::filesystem;
+
+	// Одно представление файла: исходное или заранее сжатое (рядом с файлом лежат file.gz, file.br)
+	struct StaticFileVariant {
+		// Значение Content-Encoding, пустое для исходного файла
+		std::string_view encoding;
+		std::string etag;
+		std::string last_modified;
+		std::uint64_t size = 0;
+		// Небольшие файлы целиком хранятся в памяти, большие отдаются из открытого файла через sendfile
+		std::shared_ptr<const std::string> data;
+		std::shared_ptr<const http_server::FileDescriptor> file;
+	};
+
+	struct StaticFile {
+		std::string_view mime_type;
+		StaticFileVariant identity;
+		std::optional<StaticFileVariant> gzip;
+		std::optional<StaticFileVariant> br;
+
+		bool HasEncodedVariants() const noexcept {
+			return gzip || br;
+		}
+
+		// Выбирает представление по заголовку Accept-Encoding. При равном q предпочитает br
+		const StaticFileVariant& SelectVariant(std::string_view accept_encoding) const;
+	};
+
+	// Неизменяемый кэш каталога статических файлов, собирается один раз при запуске
+	class StaticCache {
+	public:
+		using MimeTypeResolver = std::function<std::string_view(std::string_view extension)>;
+
+		static constexpr std::uint64_t default_memory_limit = 64 * 1024;
+
+		// Файлы не больше memory_limit читаются в память, остальные открываются для sendfile.
+		// Бросает system_error, если каталог или файл не удалось прочитать
+		StaticCache(const fs::path& root, const MimeTypeResolver& mime_types, std::uint64_t memory_limit = default_memory_limit);
+
+		// Приводит декодированный путь запроса к ключу кэша: /js/../index.html -> /index.html.
+		// Возвращает nullopt, если путь выходит за пределы корня
+		static std::optional<std::string> NormalizePath(std::string_view path);
+
+		// path - ключ кэша, полученный от NormalizePath
+		const StaticFile* Find(std::string_view path) const;
+
+		size_t GetSize() const noexcept {
+			return files_.size();
+		}
+
+	private:
+		StaticFileVariant LoadVariant(const fs::path& path, std::string_view encoding, std::uint64_t memory_limit) const;
+
+	private:
+		std::map<std::string, StaticFile, std::less<>> files_;
+	};
+}  // namespace http_handler
@@ -0,0 +1,184 @@
+﻿#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace app {
+
+	// Токен игрока - 128-битное число. В запросах, ответах и файлах состояния
+	// он записывается 32 шестнадцатеричными цифрами в нижнем регистре
+	class Token {
+	public:
+		static constexpr size_t hex_length = 32;
+
+		constexpr Token() noexcept = default;
+
+		constexpr Token(std::uint64_t high, std::uint64_t low) noexcept
+			: high_(high)
+			, low_(low) {
+		}
+
+		// Разбирает запись токена без выделения памяти. Возвращает nullopt,
+		// если это не 32 цифры 0-9a-f
+		static constexpr std::optional<Token> Parse(std::string_view hex) noexcept {
+			if (hex.size() != hex_length) {
+				return std::nullopt;
+			}
+			std::uint64_t parts[2] = { 0, 0 };
+			for (size_t i = 0; i < hex_length; ++i) {
+				const char c = hex[i];
+				std::uint64_t digit = 0;
+				if (c >= '0' && c <= '9') {
+					digit = c - '0';
+				}
+				else if (c >= 'a' && c <= 'f') {
+					digit = c - 'a' + 10;
+				}
+				else {
+					return std::nullopt;
+				}
+				auto& part = parts[i / 16];
+				part = (part << 4) | digit;
+			}
+			return Token(parts[0], parts[1]);
+		}
+
+		static Token FromString(std::string_view hex) {
+			if (auto token = Parse(hex)) {
+				return *token;
+			}
+			throw std::invalid_argument("Invalid token " + std::string(hex));
+		}
+
+		std::array<char, hex_length> ToChars() const noexcept {
+			constexpr std::string_view digits = "0123456789abcdef";
+			std::array<char, hex_length> chars;
+			for (size_t i = 0; i < hex_length; ++i) {
+				const std::uint64_t part = i < 16 ? high_ : low_;
+				chars[i] = digits[(part >> (4 * (15 - i % 16))) & 0xF];
+			}
+			return chars;
+		}
+
+		std::string ToString() const {
+			const auto chars = ToChars();
+			return std::string(chars.data(), chars.size());
+		}
+
+		constexpr std::uint64_t GetHigh() const noexcept {
+			return high_;
+		}
+
+		constexpr std::uint64_t GetLow() const noexcept {
+			return low_;
+		}
+
+		auto operator<=>(const Token&) const = default;
+
+	private:
+		std::uint64_t high_ = 0;
+		std::uint64_t low_ = 0;
+	};
+
+	struct TokenHash {
+		size_t operator()(const Token& token) const noexcept {
+			// Токены случайны, поэтому их биты и так распределены равномерно
+			return static_cast<size_t>(token.GetHigh() ^ token.GetLow());
+		}
+	};
+
+	// Таблица с открытой адресацией и линейным пробированием, ключ - сам токен.
+	// Токены не удаляются, поэтому ячейки не нуждаются в пометках об удалении.
+	// Заполненность держится не выше половины, чтобы цепочки проб оставались короткими
+	template <typename Value>
+	class TokenTable {
+	public:
+		Value* Find(const Token& token) noexcept {
+			return const_cast<Value*>(std::as_const(*this).Find(token));
+		}
+
+		const Value* Find(const Token& token) const noexcept {
+			if (slots_.empty()) {
+				return nullptr;
+			}
+			for (size_t index = GetIndex(token); ; index = (index + 1) & (slots_.size() - 1)) {
+				const auto& slot = slots_[index];
+				if (!slot.used) {
+					return nullptr;
+				}
+				if (slot.token == token) {
+					return &slot.value;
+				}
+			}
+		}
+
+		// Добавляет значение или заменяет значение уже известного токена
+		Value& InsertOrAssign(const Token& token, Value value) {
+			Reserve(size_ + 1);
+			Slot& slot = FindSlot(slots_, token);
+			if (!slot.used) {
+				slot.used = true;
+				slot.token = token;
+				++size_;
+			}
+			slot.value = std::move(value);
+			return slot.value;
+		}
+
+		void Reserve(size_t count) {
+			if (count * 2 <= slots_.size()) {
+				return;
+			}
+			size_t capacity = slots_.empty() ? min_capacity : slots_.size();
+			while (capacity < count * 2) {
+				capacity *= 2;
+			}
+			std::vector<Slot> slots(capacity);
+			for (auto& slot : slots_) {
+				if (slot.used) {
+					FindSlot(slots, slot.token) = std::move(slot);
+				}
+			}
+			slots_ = std::move(slots);
+		}
+
+		size_t Size() const noexcept {
+			return size_;
+		}
+
+	private:
+		static constexpr size_t min_capacity = 16;
+
+		struct Slot {
+			Token token;
+			Value value{};
+			bool used = false;
+		};
+
+		size_t GetIndex(const Token& token) const noexcept {
+			return GetIndex(token, slots_.size());
+		}
+
+		static size_t GetIndex(const Token& token, size_t capacity) noexcept {
+			return TokenHash{}(token) & (capacity - 1);
+		}
+
+		// Ячейка токена или первая свободная ячейка его цепочки
+		static Slot& FindSlot(std::vector<Slot>& slots, const Token& token) noexcept {
+			size_t index = GetIndex(token, slots.size());
+			while (slots[index].used && slots[index].token != token) {
+				index = (index + 1) & (slots.size() - 1);
+			}
+			return slots[index];
+		}
+
+		std::vector<Slot> slots_;
+		size_t size_ = 0;
+	};
+
+}  // namespace app
@@ -0,0 +1,141 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "../src/action_journal.h"
+#include "../src/state_writer.h"
+#include "test-game.h"
+
+using namespace std::literals;
+
+namespace {
+
+	using model::Road;
+
+	struct JournalFixture : test_game::TestGame {
+		// Случайные точки появления собак должны восстанавливаться из журнала, а не генерироваться заново
+		JournalFixture()
+			: TestGame({ test_game::MakeMap("map1"s, "Map 1"s, 2., {
+					Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)),
+					Road(Road::VERTICAL, model::Point{ 40, 0 }, 20, Road::Id(1)),
+					Road(Road::HORIZONTAL, model::Point{ 0, 20 }, 40, Road::Id(2)) }) },
+				{ .loot_probability = 1.0, .random_positions = true }) {
+		}
+
+		std::string GetState() {
+			std::string state;
+			state_writer::WriteGameState(game->GetGameSessions().front(), state);
+			return state;
+		}
+	};
+
+	std::string Bearer(const app::Token& token) {
+		return "Bearer "s + token.ToString();
+	}
+
+}  // namespace
+
+SCENARIO("Action journal") {
+	GIVEN("a game writing its actions to a journal") {
+		const auto dir = std::filesystem::temp_directory_path() / "action-journal-tests";
+		std::filesystem::remove_all(dir);
+		std::filesystem::create_directories(dir);
+		const std::string state_file = (dir / "state.bin").string();
+		const auto journal_file = [&state_file](int generation) {
+			return state_file + ".journal."s + std::to_string(generation);
+		};
+
+		JournalFixture original;
+		// Период больше времени теста: записи попадают на диск только по Flush
+		auto journal = std::make_shared<infrastructure::ActionJournal>(state_file, 0, 1h);
+		original.application->SetActionJournal(journal);
+
+		const auto rex = original.application->JoinGame("map1"s, "Rex"s);
+		const auto bob = original.application->JoinGame("map1"s, "Bob"s);
+		original.application->SetPlayerAction(Bearer(rex.GetPlayerTokens()), R"({"move":"R"})"s);
+		original.application->Tick(1500ms);
+		original.application->SetPlayerAction(Bearer(bob.GetPlayerTokens()), R"({"move":"L"})"s);
+		original.application->Tick(2000ms);
+		journal->Flush();
+
+		THEN("all records are committed by one group commit") {
+			CHECK(journal->GetCommittedRecords() == 6);
+			CHECK(journal->GetCommits() == 1);
+			CHECK(std::filesystem::exists(journal_file(0)));
+		}
+
+		WHEN("the journal is replayed into a fresh game") {
+			JournalFixture restored;
+			const auto result = infrastructure::ReplayJournal(state_file, 0, *restored.application);
+
+			THEN("the game reaches the same state with the same tokens") {
+				CHECK(result.records == 6);
+				CHECK(result.next_generation == 1);
+				CHECK(restored.GetState() == original.GetState());
+				CHECK(restored.GetState().find("lostObjects\":{}"s) == std::string::npos);
+				CHECK(restored.application->FindPlayerSession(Bearer(bob.GetPlayerTokens())) != nullptr);
+			}
+		}
+
+		WHEN("the journal is rotated before more actions") {
+			CHECK(journal->Rotate() == 1);
+			original.application->SetPlayerAction(Bearer(rex.GetPlayerTokens()), R"({"move":""})"s);
+			original.application->Tick(500ms);
+			journal->Flush();
+
+			THEN("later actions go to the next generation") {
+				CHECK(std::filesystem::exists(journal_file(1)));
+
+				JournalFixture restored;
+				const auto result = infrastructure::ReplayJournal(state_file, 0, *restored.application);
+				CHECK(result.records == 8);
+				CHECK(result.next_generation == 2);
+				CHECK(restored.GetState() == original.GetState());
+			}
+
+			THEN("generations covered by a snapshot are skipped and removed") {
+				JournalFixture restored;
+				const auto result = infrastructure::ReplayJournal(state_file, 1, *restored.application);
+				CHECK(result.next_generation == 2);
+				CHECK_FALSE(std::filesystem::exists(journal_file(0)));
+			}
+		}
+
+		WHEN("records of a new generation can not be written") {
+			CHECK(journal->Rotate() == 1);
+			original.application->SetPlayerAction(Bearer(rex.GetPlayerTokens()), R"({"move":""})"s);
+			original.application->Tick(500ms);
+			std::filesystem::remove_all(dir);
+
+			THEN("Flush reports the failure and the records stay queued until the write succeeds") {
+				CHECK_THROWS_AS(journal->Flush(), std::runtime_error);
+				CHECK(journal->GetCommittedRecords() == 6);
+
+				std::filesystem::create_directories(dir);
+				journal->Flush();
+				CHECK(journal->GetCommittedRecords() == 8);
+				CHECK(std::filesystem::exists(journal_file(1)));
+			}
+		}
+
+		WHEN("the last record was torn by a crash") {
+			const auto size = std::filesystem::file_size(journal_file(0));
+			std::ofstream(journal_file(0), std::ios::binary | std::ios::app) << "\x10\x00\x00\x00garbage"s;
+
+			JournalFixture restored;
+			const auto result = infrastructure::ReplayJournal(state_file, 0, *restored.application);
+
+			THEN("complete records are replayed and the tail is cut off") {
+				CHECK(result.records == 6);
+				CHECK(restored.GetState() == original.GetState());
+				CHECK(std::filesystem::file_size(journal_file(0)) == size);
+			}
+		}
+
+		original.application->SetActionJournal(nullptr);
+		journal.reset();
+		std::filesystem::remove_all(dir);
+	}
+}
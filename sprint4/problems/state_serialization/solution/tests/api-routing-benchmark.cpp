@@ -0,0 +1,94 @@
+﻿#include "../src/alloc_counter.h"
+#include "../src/request_handler.h"
+#include "test-game.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <array>
+
+// Поиск маршрута API по дереву путей против цепочки сравнений префиксов, которой он заменил.
+// Запуск: game_server_benchmarks "[!benchmark][routing]" --benchmark-samples 10
+
+using namespace std::literals;
+namespace http = boost::beast::http;
+
+namespace {
+
+using http_handler::ApiRoute;
+
+// Прежний способ: сравнение uri с каждым путем по очереди
+ApiRoute FindApiRouteByCompare(std::string_view uri) {
+	using namespace http_handler;
+	if (!uri.compare(0, api_get_map.size(), api_get_map)) return ApiRoute::MAPS;
+	if (!uri.compare(0, api_post_join.size(), api_post_join)) return ApiRoute::JOIN;
+	if (!uri.compare(0, api_get_players.size(), api_get_players)) return ApiRoute::PLAYERS;
+	if (!uri.compare(0, api_get_game_state.size(), api_get_game_state)) return ApiRoute::GAME_STATE;
+	if (!uri.compare(0, api_get_game_changes.size(), api_get_game_changes)) return ApiRoute::GAME_CHANGES;
+	if (!uri.compare(0, api_game_player_action.size(), api_game_player_action)) return ApiRoute::PLAYER_ACTION;
+	if (!uri.compare(0, api_game_stream.size(), api_game_stream)) return ApiRoute::GAME_STREAM;
+	if (!uri.compare(0, api_game_tick.size(), api_game_tick)) return ApiRoute::GAME_TICK;
+	return ApiRoute::UNKNOWN;
+}
+
+constexpr std::array uris{
+	"/api/v1/maps/map1"sv,
+	"/api/v1/game/state"sv,
+	"/api/v1/game/player/action"sv,
+	"/api/v1/game/changes?since=42"sv,
+	"/api/v1/game/tick"sv,
+	"/api/v1/game/unknown"sv,
+};
+
+}  // namespace
+
+TEST_CASE("API route lookup", "[!benchmark][routing]") {
+	for (auto uri : uris) {
+		REQUIRE(http_handler::FindApiRoute(uri) == FindApiRouteByCompare(uri));
+	}
+
+	BENCHMARK("prefix comparisons") {
+		size_t sum = 0;
+		for (auto uri : uris) {
+			sum += static_cast<size_t>(FindApiRouteByCompare(uri));
+		}
+		return sum;
+	};
+	BENCHMARK("compile-time trie") {
+		size_t sum = 0;
+		for (auto uri : uris) {
+			sum += static_cast<size_t>(http_handler::FindApiRoute(uri));
+		}
+		return sum;
+	};
+}
+
+TEST_CASE("API request routing path", "[!benchmark][routing]") {
+	using model::Road;
+	test_game::TestGame fixture({ test_game::MakeMap("map1"s, "Map 1"s, 1., { Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)) }, false) });
+	app::Application& application = *fixture.application;
+	for (int i = 0; i < 1000; ++i) {
+		application.JoinGame("map1"s, "dog"s + std::to_string(i));
+	}
+	http_handler::ApiHandler api_handler(application);
+
+	http_handler::StringRequest req(http::verb::post, "/api/v1/game/player/action"sv, 11);
+	req.set(http::field::authorization, "Bearer "s + application.JoinGame("map1"s, "Rex"s).GetPlayerTokens().ToString());
+	req.set(http::field::content_type, http_handler::ContentType::APP_JSON);
+
+	// То, что RequestHandler делает с каждым запросом до выбора strand
+	const auto route = [&] {
+		return api_handler.IsApiRequest(req) && !api_handler.IsStatelessApiRequest(req)
+			&& api_handler.FindTargetSession(req) != nullptr;
+	};
+
+	const auto allocations = alloc_counter::GetThreadAllocations();
+	int routed = 0;
+	for (int i = 0; i < 1000; ++i) {
+		routed += route();
+	}
+	CHECK(alloc_counter::GetThreadAllocations() == allocations);
+	CHECK(routed == 1000);
+
+	BENCHMARK("route and select session") {
+		return route();
+	};
+}
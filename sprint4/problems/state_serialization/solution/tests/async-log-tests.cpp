@@ -0,0 +1,212 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/logger.h"
+
+using namespace std::literals;
+namespace logging = boost::log;
+
+namespace {
+	// Поток вывода, первая запись в который ждет Release. Так поток записи лога можно задержать
+	class BlockingBuf : public std::stringbuf {
+	public:
+		void WaitEntered() {
+			entered_future_.wait();
+		}
+
+		void Release() {
+			released_.set_value();
+		}
+
+	protected:
+		std::streamsize xsputn(const char* s, std::streamsize n) override {
+			if (!blocked_) {
+				blocked_ = true;
+				entered_.set_value();
+				released_future_.wait();
+			}
+			return std::stringbuf::xsputn(s, n);
+		}
+
+	private:
+		bool blocked_ = false;
+		std::promise<void> entered_;
+		std::shared_future<void> entered_future_ = entered_.get_future().share();
+		std::promise<void> released_;
+		std::shared_future<void> released_future_ = released_.get_future().share();
+	};
+
+	void Log(std::string_view text, boost::json::value custom_data) {
+		BOOST_LOG_TRIVIAL(info) << logging::add_value(logger::data, custom_data)
+			<< logging::add_value(logger::message, std::string(text));
+	}
+
+	std::vector<std::string> SplitLines(const std::string& text) {
+		std::vector<std::string> lines;
+		std::istringstream in(text);
+		for (std::string line; std::getline(in, line);) {
+			lines.push_back(line);
+		}
+		return lines;
+	}
+
+	logger::AsyncLogGuard MakeLog(std::ostream& out, logger::AsyncLogOptions options) {
+		auto backend = boost::make_shared<logger::AsyncLogBackend>(out, &logger::MyFormatter, options);
+		return logger::AsyncLogGuard(boost::make_shared<logger::AsyncLogSink>(backend));
+	}
+}  // namespace
+
+SCENARIO("MPSC ring buffer") {
+	GIVEN("a ring with a capacity that is not a power of two") {
+		logger::MpscRing<int> ring(5);
+
+		THEN("the capacity is rounded up, and elements come out in order until the ring is empty") {
+			CHECK(ring.GetCapacity() == 8);
+			for (int i = 0; i < 8; ++i) {
+				CHECK(ring.TryPush(i));
+			}
+			CHECK_FALSE(ring.TryPush(8));
+
+			int value = -1;
+			for (int i = 0; i < 8; ++i) {
+				REQUIRE(ring.TryPop(value));
+				CHECK(value == i);
+			}
+			CHECK_FALSE(ring.TryPop(value));
+			CHECK(ring.GetPushedCount() == 8);
+		}
+	}
+
+	GIVEN("several producers and one consumer") {
+		logger::MpscRing<int> ring(16);
+		constexpr int producer_count = 4;
+		constexpr int per_producer = 20000;
+
+		WHEN("producers push concurrently, retrying while the ring is full") {
+			std::vector<std::thread> producers;
+			for (int p = 0; p < producer_count; ++p) {
+				producers.emplace_back([&ring, p] {
+					for (int i = 0; i < per_producer; ++i) {
+						while (!ring.TryPush(p * per_producer + i)) {
+							std::this_thread::yield();
+						}
+					}
+					});
+			}
+
+			std::vector<int> next(producer_count, 0);
+			int received = 0;
+			bool in_order = true;
+			while (received < producer_count * per_producer) {
+				int value = 0;
+				if (!ring.TryPop(value)) {
+					std::this_thread::yield();
+					continue;
+				}
+				const int producer = value / per_producer;
+				in_order = in_order && value % per_producer == next[producer]++;
+				++received;
+			}
+			for (auto& producer : producers) {
+				producer.join();
+			}
+
+			THEN("every element is received once, in the order of its producer") {
+				CHECK(in_order);
+				CHECK(next == std::vector<int>(producer_count, per_producer));
+			}
+		}
+	}
+}
+
+SCENARIO("Asynchronous log backend") {
+	logging::add_common_attributes();
+
+	GIVEN("a log that blocks producers while the ring is full") {
+		std::ostringstream out;
+
+		WHEN("several threads log more records than the ring holds") {
+			constexpr int thread_count = 4;
+			constexpr int per_thread = 500;
+			size_t dropped = 0;
+			{
+				auto guard = MakeLog(out, { .capacity = 4, .overflow = logger::OverflowPolicy::BLOCK, .batch_bytes = 256 });
+				std::vector<std::thread> threads;
+				for (int t = 0; t < thread_count; ++t) {
+					threads.emplace_back([t] {
+						for (int i = 0; i < per_thread; ++i) {
+							Log("record"sv, { {"thread"s, t}, {"i"s, i} });
+						}
+						});
+				}
+				for (auto& thread : threads) {
+					thread.join();
+				}
+				dropped = guard.GetBackend().GetDroppedCount();
+			}
+
+			THEN("nothing is lost, and each thread's records keep their order") {
+				const auto lines = SplitLines(out.str());
+				CHECK(dropped == 0);
+				REQUIRE(lines.size() == thread_count * per_thread);
+
+				std::vector<int> next(thread_count, 0);
+				bool in_order = true;
+				for (const auto& line : lines) {
+					const auto obj = boost::json::parse(line).as_object();
+					const auto& custom_data = obj.at(logger::key_data).as_object();
+					const auto t = custom_data.at("thread"s).as_int64();
+					in_order = in_order && custom_data.at("i"s).as_int64() == next[t]++;
+				}
+				CHECK(in_order);
+			}
+		}
+
+		WHEN("a record is logged") {
+			{
+				auto guard = MakeLog(out, {});
+				Log("server started"sv, { {"port"s, 8080} });
+				guard.GetBackend().flush();
+				THEN("flush returns once it is written") {
+					CHECK_FALSE(out.str().empty());
+				}
+			}
+
+			THEN("the line has the same JSON layout as before") {
+				const auto lines = SplitLines(out.str());
+				REQUIRE(lines.size() == 1);
+				CHECK(lines[0].starts_with(R"({"timestamp":")"sv));
+				CHECK(lines[0].ends_with(R"(","data":{"port":8080},"message":"server started"})"sv));
+			}
+		}
+	}
+
+	GIVEN("a log that drops records while the ring is full") {
+		BlockingBuf buf;
+		std::ostream out(&buf);
+		auto guard = MakeLog(out, { .capacity = 4, .overflow = logger::OverflowPolicy::DROP });
+
+		WHEN("the writer thread is stuck on the output") {
+			Log("first"sv, boost::json::object{});
+			buf.WaitEntered();
+			for (int i = 0; i < 10; ++i) {
+				Log("next"sv, { {"i"s, i} });
+			}
+			const size_t dropped = guard.GetBackend().GetDroppedCount();
+			buf.Release();
+			guard.GetBackend().flush();
+
+			THEN("the records that did not fit are counted and the rest are written") {
+				CHECK(dropped == 6);
+				const auto lines = SplitLines(buf.str());
+				REQUIRE(lines.size() == 5);
+				CHECK(lines[0].ends_with(R"("message":"first"})"sv));
+				CHECK(lines[4].ends_with(R"("data":{"i":3},"message":"next"})"sv));
+			}
+		}
+	}
+}
@@ -0,0 +1,113 @@
+﻿#include "../src/collision_detector.h"
+#include "collision-reference.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+// Сравнение FindGatherEvents с полным перебором всех пар.
+// Запуск: game_server_benchmarks --benchmark-samples 10
+
+namespace {
+
+// Предметы на сетке дорог с шагом 10, собиратели проходят за тик не больше 5 единиц вдоль дороги
+GathererProvider MakeProvider(size_t items_count, size_t gatherers_count) {
+	using namespace collision_detector;
+	std::mt19937 gen(42);
+	const int map_size = static_cast<int>(std::sqrt(static_cast<double>(items_count))) * 10;
+	std::uniform_int_distribution<int> road(0, map_size / 10);
+	std::uniform_real_distribution<double> along(0., map_size);
+	std::uniform_real_distribution<double> step(-5., 5.);
+
+	std::vector<Item> items;
+	for (size_t i = 0; i < items_count; ++i) {
+		if (i % 2) {
+			items.push_back({ {along(gen), road(gen) * 10.}, 0. });
+		}
+		else {
+			items.push_back({ {road(gen) * 10., along(gen)}, 0. });
+		}
+	}
+
+	std::vector<Gatherer> gatherers;
+	for (size_t i = 0; i < gatherers_count; ++i) {
+		if (i % 2) {
+			geom::Point2D start{ along(gen), road(gen) * 10. };
+			gatherers.push_back({ start, {start.x + step(gen), start.y}, 0.3 });
+		}
+		else {
+			geom::Point2D start{ road(gen) * 10., along(gen) };
+			gatherers.push_back({ start, {start.x, start.y + step(gen)}, 0.3 });
+		}
+	}
+	return GathererProvider(std::move(items), std::move(gatherers));
+}
+
+struct SoA {
+	explicit SoA(const GathererProvider& provider) {
+		for (size_t i = 0; i < provider.ItemsCount(); ++i) {
+			const auto item = provider.GetItem(i);
+			item_xs.push_back(item.position.x);
+			item_ys.push_back(item.position.y);
+			item_widths.push_back(item.width);
+		}
+		for (size_t i = 0; i < provider.GatherersCount(); ++i) {
+			const auto gatherer = provider.GetGatherer(i);
+			start_xs.push_back(gatherer.start_pos.x);
+			start_ys.push_back(gatherer.start_pos.y);
+			end_xs.push_back(gatherer.end_pos.x);
+			end_ys.push_back(gatherer.end_pos.y);
+			gatherer_widths.push_back(gatherer.width);
+		}
+	}
+
+	collision_detector::ItemsView Items() const {
+		return { item_xs, item_ys, item_widths };
+	}
+
+	collision_detector::GatherersView Gatherers() const {
+		return { start_xs, start_ys, end_xs, end_ys, gatherer_widths };
+	}
+
+	std::vector<double> item_xs, item_ys, item_widths;
+	std::vector<double> start_xs, start_ys, end_xs, end_ys, gatherer_widths;
+};
+
+}  // namespace
+
+TEST_CASE("FindGatherEvents 1k items x 1k gatherers", "[!benchmark]") {
+	const auto provider = MakeProvider(1'000, 1'000);
+	REQUIRE(collision_detector::FindGatherEvents(provider).size() == FindGatherEventsBruteForce(provider).size());
+
+	BENCHMARK("brute force") {
+		return FindGatherEventsBruteForce(provider);
+	};
+	BENCHMARK("grid") {
+		return collision_detector::FindGatherEvents(provider);
+	};
+	const SoA soa(provider);
+	std::vector<collision_detector::GatheringEvent> events;
+	BENCHMARK("grid, structure of arrays") {
+		collision_detector::FindGatherEvents(soa.Items(), soa.Gatherers(), events);
+		return events.size();
+	};
+}
+
+TEST_CASE("FindGatherEvents 10k items x 10k gatherers", "[!benchmark]") {
+	const auto provider = MakeProvider(10'000, 10'000);
+	REQUIRE(collision_detector::FindGatherEvents(provider).size() == FindGatherEventsBruteForce(provider).size());
+
+	BENCHMARK("brute force") {
+		return FindGatherEventsBruteForce(provider);
+	};
+	BENCHMARK("grid") {
+		return collision_detector::FindGatherEvents(provider);
+	};
+	const SoA soa(provider);
+	std::vector<collision_detector::GatheringEvent> events;
+	BENCHMARK("grid, structure of arrays") {
+		collision_detector::FindGatherEvents(soa.Items(), soa.Gatherers(), events);
+		return events.size();
+	};
+}
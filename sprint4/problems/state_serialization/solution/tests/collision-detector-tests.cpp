@@ -1,11 +1,13 @@
 ﻿#define _USE_MATH_DEFINES
 
 #include "../src/collision_detector.h"
+#include "collision-reference.h"
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_templated.hpp>
 #include <stdexcept>
 #include <cmath>
 #include <sstream>
+#include <random>
 
 using namespace std::literals;
 
@@ -70,42 +72,6 @@ EqualMatcher<Range, Predicate> EqualRangeMatcher(Range&& range, Predicate&& pred
 	return EqualMatcher<Range, Predicate>{std::forward<Range>(range), std::forward<Predicate>(predicate)};
 }
 
-class GathererProvider : public collision_detector::ItemGathererProvider {
-public:
-
-	GathererProvider(std::vector<collision_detector::Item> items, std::vector<collision_detector::Gatherer> gatherers)
-		: items_(std::move(items))
-		, gatherers_(std::move(gatherers)) {
-
-	}
-
-	size_t ItemsCount() const override {
-		return items_.size();
-	}
-
-	collision_detector::Item GetItem(size_t idx) const override {
-		if (idx >= items_.size()) {
-			throw std::logic_error("Invalid item idx!");
-		}
-		return items_[idx];
-	}
-
-	size_t GatherersCount() const override {
-		return gatherers_.size();
-	}
-
-	collision_detector::Gatherer GetGatherer(size_t idx) const override {
-		if (idx >= gatherers_.size()) {
-			throw std::logic_error("Invalid gatherer idx!");
-		}
-		return gatherers_[idx];
-	} 
-	
-private:
-	std::vector<collision_detector::Item> items_;
-	std::vector<collision_detector::Gatherer> gatherers_;
-};
-
 
 SCENARIO("Collision detection") {
 	using namespace collision_detector;
@@ -188,3 +154,127 @@ SCENARIO("Collision detection") {
 		}
 	}
 }
+
+SCENARIO("Collision detection with many items and gatherers") {
+	using namespace collision_detector;
+
+	//Много собирателей и предметов на дорогах: результат должен совпадать с полным перебором
+	GIVEN("random items and gatherers moving along roads") {
+		std::mt19937 gen(42);
+		std::uniform_int_distribution<int> coord(0, 100);
+		std::uniform_real_distribution<double> offset(-0.5, 0.5);
+		std::uniform_real_distribution<double> step(-10., 10.);
+
+		std::vector<Item> items;
+		for (int i = 0; i < 500; ++i) {
+			//Половина предметов на горизонтальных дорогах, половина на вертикальных
+			if (i % 2) {
+				items.push_back({ {coord(gen) + offset(gen), static_cast<double>(coord(gen))}, 0. });
+			}
+			else {
+				items.push_back({ {static_cast<double>(coord(gen)), coord(gen) + offset(gen)}, 0.5 });
+			}
+		}
+
+		std::vector<Gatherer> gatherers;
+		for (int i = 0; i < 300; ++i) {
+			geom::Point2D start{ static_cast<double>(coord(gen)), static_cast<double>(coord(gen)) };
+			geom::Point2D end = (i % 2) ? geom::Point2D{ start.x + step(gen), start.y } : geom::Point2D{ start.x, start.y + step(gen) };
+			gatherers.push_back({ start, (i % 10) ? end : start, 0.6 });
+		}
+		GathererProvider provider(items, gatherers);
+
+		WHEN("gathering events are searched") {
+			auto events = FindGatherEvents(provider);
+
+			THEN("they are exactly the same as brute force ones") {
+				auto expected_events = FindGatherEventsBruteForce(provider);
+				REQUIRE(!expected_events.empty());
+				REQUIRE(events.size() == expected_events.size());
+				for (size_t i = 0; i < events.size(); ++i) {
+					CHECK(events[i].item_id == expected_events[i].item_id);
+					CHECK(events[i].gatherer_id == expected_events[i].gatherer_id);
+					CHECK(events[i].sq_distance == expected_events[i].sq_distance);
+					CHECK(events[i].time == expected_events[i].time);
+				}
+			}
+		}
+	}
+}
+
+SCENARIO("Collision detection with structure of arrays") {
+	using namespace collision_detector;
+
+	GIVEN("random items with different widths and gatherers") {
+		std::mt19937 gen(7);
+		std::uniform_real_distribution<double> coord(0., 50.);
+		std::uniform_real_distribution<double> step(-10., 10.);
+		std::uniform_real_distribution<double> width(0., 1.);
+
+		std::vector<double> item_xs, item_ys, item_widths;
+		std::vector<Item> items;
+		for (int i = 0; i < 301; ++i) {
+			items.push_back({ {coord(gen), coord(gen)}, width(gen) });
+			item_xs.push_back(items.back().position.x);
+			item_ys.push_back(items.back().position.y);
+			item_widths.push_back(items.back().width);
+		}
+
+		std::vector<double> start_xs, start_ys, end_xs, end_ys, gatherer_widths;
+		std::vector<Gatherer> gatherers;
+		for (int i = 0; i < 57; ++i) {
+			geom::Point2D start{ coord(gen), coord(gen) };
+			geom::Point2D end{ start.x + step(gen), start.y + step(gen) };
+			gatherers.push_back({ start, end, width(gen) });
+			start_xs.push_back(start.x);
+			start_ys.push_back(start.y);
+			end_xs.push_back(end.x);
+			end_ys.push_back(end.y);
+			gatherer_widths.push_back(gatherers.back().width);
+		}
+
+		const ItemsView items_view{ item_xs, item_ys, item_widths };
+		const GatherersView gatherers_view{ start_xs, start_ys, end_xs, end_ys, gatherer_widths };
+
+		WHEN("gathering events are searched") {
+			auto events = FindGatherEvents(items_view, gatherers_view);
+
+			THEN("they are bit-identical to TryCollectPoint and the provider version") {
+				auto expected_events = FindGatherEventsBruteForce(GathererProvider(items, gatherers));
+				REQUIRE(!expected_events.empty());
+				REQUIRE(events.size() == expected_events.size());
+				for (size_t i = 0; i < events.size(); ++i) {
+					CHECK(events[i].item_id == expected_events[i].item_id);
+					CHECK(events[i].gatherer_id == expected_events[i].gatherer_id);
+					CHECK(events[i].sq_distance == expected_events[i].sq_distance);
+					CHECK(events[i].time == expected_events[i].time);
+				}
+			}
+		}
+
+		WHEN("only a few items are given") {
+			const ItemsView few_items{ items_view.xs.first(3), items_view.ys.first(3), items_view.widths.first(3) };
+			std::vector<GatheringEvent> events;
+			FindGatherEvents(few_items, gatherers_view, events);
+
+			THEN("events are the same as brute force ones") {
+				auto expected_events = FindGatherEventsBruteForce(GathererProvider({ items.begin(), items.begin() + 3 }, gatherers));
+				REQUIRE(events.size() == expected_events.size());
+				for (size_t i = 0; i < events.size(); ++i) {
+					CHECK(events[i].item_id == expected_events[i].item_id);
+					CHECK(events[i].gatherer_id == expected_events[i].gatherer_id);
+					CHECK(events[i].sq_distance == expected_events[i].sq_distance);
+					CHECK(events[i].time == expected_events[i].time);
+				}
+			}
+		}
+
+		WHEN("arrays have different sizes") {
+			const ItemsView broken_items{ items_view.xs, items_view.ys.first(10), items_view.widths };
+
+			THEN("an exception is thrown") {
+				REQUIRE_THROWS_AS(FindGatherEvents(broken_items, gatherers_view), std::invalid_argument);
+			}
+		}
+	}
+}
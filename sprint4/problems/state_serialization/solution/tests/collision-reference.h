@@ -0,0 +1,65 @@
+﻿#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../src/collision_detector.h"
+
+class GathererProvider : public collision_detector::ItemGathererProvider {
+public:
+
+	GathererProvider(std::vector<collision_detector::Item> items, std::vector<collision_detector::Gatherer> gatherers)
+		: items_(std::move(items))
+		, gatherers_(std::move(gatherers)) {
+
+	}
+
+	size_t ItemsCount() const override {
+		return items_.size();
+	}
+
+	collision_detector::Item GetItem(size_t idx) const override {
+		if (idx >= items_.size()) {
+			throw std::logic_error("Invalid item idx!");
+		}
+		return items_[idx];
+	}
+
+	size_t GatherersCount() const override {
+		return gatherers_.size();
+	}
+
+	collision_detector::Gatherer GetGatherer(size_t idx) const override {
+		if (idx >= gatherers_.size()) {
+			throw std::logic_error("Invalid gatherer idx!");
+		}
+		return gatherers_[idx];
+	} 
+	
+private:
+	std::vector<collision_detector::Item> items_;
+	std::vector<collision_detector::Gatherer> gatherers_;
+};
+
+//Полный перебор всех пар, как до появления грубой фазы. Эталон для FindGatherEvents в тестах и бенчмарках
+inline std::vector<collision_detector::GatheringEvent> FindGatherEventsBruteForce(const collision_detector::ItemGathererProvider& provider) {
+	using namespace collision_detector;
+	std::vector<GatheringEvent> result;
+	for (size_t g_idx = 0; g_idx < provider.GatherersCount(); ++g_idx) {
+		auto gatherer = provider.GetGatherer(g_idx);
+		if (gatherer.start_pos.x == gatherer.end_pos.x && gatherer.start_pos.y == gatherer.end_pos.y) {
+			continue;
+		}
+		for (size_t i_idx = 0; i_idx < provider.ItemsCount(); ++i_idx) {
+			auto item = provider.GetItem(i_idx);
+			auto collection_result = TryCollectPoint(gatherer.start_pos, gatherer.end_pos, item.position);
+			if (collection_result.IsCollected(item.width + gatherer.width)) {
+				result.emplace_back(i_idx, g_idx, collection_result.sq_distance, collection_result.proj_ratio);
+			}
+		}
+	}
+	std::sort(result.begin(), result.end(), [](const GatheringEvent& r, const GatheringEvent& l) {
+		return r.time < l.time;
+		});
+	return result;
+}
@@ -0,0 +1,105 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <memory>
+#include <string>
+
+#include "../src/app.h"
+#include "test-game.h"
+
+using namespace std::literals;
+
+namespace {
+
+	using model::Road;
+
+	struct MovementFixture : test_game::TestGame {
+		std::string authorization;
+
+		explicit MovementFixture(model::Map map)
+			: TestGame({ std::move(map) }, { .loot_probability = 0.0 }) {
+			auto result = application->JoinGame(*game->GetMaps().front()->GetId(), "Rex"s);
+			authorization = "Bearer "s + result.GetPlayerTokens().ToString();
+		}
+
+		void Move(std::string_view dir, std::chrono::milliseconds time) {
+			application->SetPlayerAction(authorization, R"({"move": ")"s + std::string(dir) + R"("})"s);
+			application->Tick(time);
+		}
+
+		model::DogRef GetDog() {
+			return game->GetGameSessions().front().GetDog(0);
+		}
+	};
+
+	model::Map MakeSquareMap() {
+		return test_game::MakeMap("square"s, "Square"s, 4., {
+			Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)),
+			Road(Road::VERTICAL, model::Point{ 40, 0 }, 30, Road::Id(1)),
+			Road(Road::HORIZONTAL, model::Point{ 40, 30 }, 0, Road::Id(2)),
+			Road(Road::VERTICAL, model::Point{ 0, 0 }, 30, Road::Id(3)) });
+	}
+
+	model::Map MakeLineMap() {
+		return test_game::MakeMap("line"s, "Line"s, 4., {
+			Road(Road::VERTICAL, model::Point{ 0, 0 }, 10, Road::Id(0)),
+			Road(Road::VERTICAL, model::Point{ 0, 10 }, 20, Road::Id(1)) });
+	}
+
+}  // namespace
+
+SCENARIO("Dog movement along roads") {
+	GIVEN("a dog at the start of a square of roads") {
+		MovementFixture fixture(MakeSquareMap());
+
+		WHEN("the dog moves along its road") {
+			fixture.Move("R"sv, 1s);
+
+			THEN("it stays on the road") {
+				CHECK(fixture.GetDog().GetPosition() == geom::Point2D{ 4., 0. });
+				CHECK(fixture.GetDog().GetSpeed() == geom::Vec2D{ 4., 0. });
+			}
+		}
+
+		WHEN("the dog runs past the end of a road without continuation") {
+			fixture.Move("R"sv, 20s);
+
+			THEN("it stops at the road edge") {
+				CHECK(fixture.GetDog().GetPosition() == geom::Point2D{ 40.4, 0. });
+				CHECK(fixture.GetDog().GetSpeed() == geom::Vec2D{ 0., 0. });
+			}
+
+			AND_WHEN("it turns at the crossing") {
+				fixture.Move("D"sv, 2s);
+
+				THEN("it moves onto the crossing road") {
+					CHECK(fixture.GetDog().GetPosition() == geom::Point2D{ 40.4, 8. });
+					CHECK(*fixture.GetDog().GetRoadId() == 1);
+				}
+			}
+		}
+	}
+
+	GIVEN("a dog on a line of two roads") {
+		MovementFixture fixture(MakeLineMap());
+		fixture.Move("D"sv, 4s);
+		REQUIRE(fixture.GetDog().GetPosition() == geom::Point2D{ 0., 16. });
+		REQUIRE(*fixture.GetDog().GetRoadId() == 1);
+
+		WHEN("the dog moves back onto the previous road") {
+			fixture.Move("U"sv, 2s);
+
+			THEN("it continues on that road") {
+				CHECK(fixture.GetDog().GetPosition() == geom::Point2D{ 0., 8. });
+				CHECK(*fixture.GetDog().GetRoadId() == 0);
+			}
+		}
+
+		WHEN("the dog runs past the last road") {
+			fixture.Move("U"sv, 10s);
+
+			THEN("it stops at the edge of the last road") {
+				CHECK(fixture.GetDog().GetPosition() == geom::Point2D{ 0., -0.4 });
+				CHECK(fixture.GetDog().GetSpeed() == geom::Vec2D{ 0., 0. });
+			}
+		}
+	}
+}
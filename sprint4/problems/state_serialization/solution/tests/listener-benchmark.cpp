@@ -0,0 +1,182 @@
+﻿#include "../src/http_server.h"
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Скорость приема новых соединений и задержка запроса на новом соединении при одном acceptor
+// на общем io_context и при io_context на ядро с SO_REUSEPORT.
+// Запуск: game_server_benchmarks "[!benchmark][listener]"
+
+using namespace std::literals;
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = net::ip::tcp;
+
+namespace {
+
+struct Handler {
+	template <typename Send>
+	void operator()(tcp::endpoint, http_server::HttpRequest&& req, Send&& send) {
+		http::response<http::string_body> resp(http::status::ok, req.version());
+		resp.body() = "{}"s;
+		resp.prepare_payload();
+		resp.keep_alive(false);
+		send(std::move(resp));
+	}
+};
+
+struct Result {
+	double connections_per_second = 0;
+	double p50_us = 0;
+	double p99_us = 0;
+};
+
+// Каждый клиент открывает новое соединение на каждый запрос, как при шторме подключений
+Result RunClients(const tcp::endpoint& endpoint, unsigned clients, int connections_per_client) {
+	using Clock = std::chrono::steady_clock;
+	std::vector<std::vector<double>> latencies(clients);
+	std::vector<std::thread> threads;
+
+	const auto start = Clock::now();
+	for (unsigned c = 0; c < clients; ++c) {
+		threads.emplace_back([&, c] {
+			net::io_context ioc;
+			latencies[c].reserve(connections_per_client);
+			for (int i = 0; i < connections_per_client; ++i) {
+				const auto request_start = Clock::now();
+				beast::tcp_stream stream(ioc);
+				stream.connect(endpoint);
+				http::request<http::empty_body> req(http::verb::get, "/"sv, 11);
+				http::write(stream, req);
+				beast::flat_buffer buffer;
+				http::response<http::string_body> resp;
+				http::read(stream, buffer, resp);
+				latencies[c].push_back(std::chrono::duration<double, std::micro>(Clock::now() - request_start).count());
+			}
+			});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::vector<double> all;
+	for (const auto& client_latencies : latencies) {
+		all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+	}
+	std::sort(all.begin(), all.end());
+	return Result{ all.size() / seconds, all[all.size() / 2], all[all.size() * 99 / 100] };
+}
+
+tcp::endpoint FindFreeEndpoint() {
+	net::io_context ioc;
+	tcp::acceptor probe(ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+	return probe.local_endpoint();
+}
+
+void Print(std::string_view mode, const Result& result) {
+	std::cout << std::left << std::setw(28) << mode << std::right << std::fixed << std::setprecision(0)
+		<< std::setw(12) << result.connections_per_second << " conn/s"
+		<< std::setw(10) << result.p50_us << " us p50"
+		<< std::setw(10) << result.p99_us << " us p99" << std::endl;
+}
+
+// Каждый клиент держит одно keep-alive соединение и отправляет запросы пачками по depth, не дожидаясь ответов
+double RunPipelinedClients(const tcp::endpoint& endpoint, unsigned clients, int requests_per_client, int depth) {
+	using Clock = std::chrono::steady_clock;
+	std::string batch;
+	for (int i = 0; i < depth; ++i) {
+		batch += "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"s;
+	}
+
+	std::vector<std::thread> threads;
+	const auto start = Clock::now();
+	for (unsigned c = 0; c < clients; ++c) {
+		threads.emplace_back([&] {
+			net::io_context ioc;
+			beast::tcp_stream stream(ioc);
+			stream.connect(endpoint);
+			beast::flat_buffer buffer;
+			for (int sent = 0; sent < requests_per_client; sent += depth) {
+				net::write(stream, net::buffer(batch));
+				for (int i = 0; i < depth; ++i) {
+					http::response<http::string_body> resp;
+					http::read(stream, buffer, resp);
+				}
+			}
+			});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	return clients * requests_per_client / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct KeepAliveHandler {
+	template <typename Send>
+	void operator()(tcp::endpoint, http_server::HttpRequest&& req, Send&& send) {
+		http::response<http::string_body> resp(http::status::ok, req.version());
+		resp.body() = "{}"s;
+		resp.prepare_payload();
+		resp.keep_alive(req.keep_alive());
+		send(std::move(resp));
+	}
+};
+
+}  // namespace
+
+TEST_CASE("Keep-alive requests: one at a time vs pipelined", "[!benchmark][listener]") {
+	const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+	constexpr int requests_per_client = 32'000;
+
+	const auto endpoint = FindFreeEndpoint();
+	net::io_context ioc(threads);
+	http_server::ServeHttp(ioc, endpoint, KeepAliveHandler{});
+	std::vector<std::thread> workers;
+	for (unsigned i = 0; i < threads; ++i) {
+		workers.emplace_back([&ioc] { ioc.run(); });
+	}
+	for (int depth : { 1, 4, 16 }) {
+		std::cout << "pipeline depth " << std::setw(2) << depth << std::fixed << std::setprecision(0)
+			<< std::setw(12) << RunPipelinedClients(endpoint, threads, requests_per_client, depth) << " req/s" << std::endl;
+	}
+	ioc.stop();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+TEST_CASE("New connections: shared io_context vs io_context per core", "[!benchmark][listener]") {
+	const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+	const unsigned clients = threads * 2;
+	constexpr int connections_per_client = 2'000;
+
+	{
+		const auto endpoint = FindFreeEndpoint();
+		net::io_context ioc(threads);
+		http_server::ServeHttp(ioc, endpoint, Handler{});
+		std::vector<std::thread> workers;
+		for (unsigned i = 0; i < threads; ++i) {
+			workers.emplace_back([&ioc] { ioc.run(); });
+		}
+		Print("shared io_context", RunClients(endpoint, clients, connections_per_client));
+		ioc.stop();
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+	{
+		const auto endpoint = FindFreeEndpoint();
+		http_server::IoContextPool pool(threads);
+		http_server::ServeHttp(pool, endpoint, Handler{});
+		pool.Run();
+		Print("io_context per core", RunClients(endpoint, clients, connections_per_client));
+		pool.Stop();
+		pool.Join();
+	}
+}
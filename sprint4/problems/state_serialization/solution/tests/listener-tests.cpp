@@ -0,0 +1,266 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/alloc_counter.h"
+#include "../src/http_server.h"
+#include "../src/request_handler.h"
+
+using namespace std::literals;
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = net::ip::tcp;
+
+namespace {
+
+	// Отвечает номером запроса. Нечетные ответы отправляются из другого потока, как ответы из strand игры
+	struct CountingHandler {
+		struct State {
+			std::mutex mutex;
+			std::set<std::thread::id> threads;
+			int requests = 0;
+		};
+
+		std::shared_ptr<State> state = std::make_shared<State>();
+		net::thread_pool* other_thread = nullptr;
+
+		template <typename Send>
+		void operator()(tcp::endpoint, http_server::HttpRequest&& req, Send&& send) {
+			http::response<http::string_body> resp(http::status::ok, req.version());
+			{
+				std::lock_guard lock(state->mutex);
+				state->threads.insert(std::this_thread::get_id());
+				resp.body() = std::to_string(state->requests++);
+			}
+			resp.prepare_payload();
+			resp.keep_alive(false);
+			if (std::stoi(resp.body()) % 2) {
+				net::post(*other_thread, [send, resp = std::move(resp)]() mutable {
+					send(std::move(resp));
+					});
+			}
+			else {
+				send(std::move(resp));
+			}
+		}
+	};
+
+	std::string Get(const tcp::endpoint& endpoint) {
+		net::io_context ioc;
+		beast::tcp_stream stream(ioc);
+		stream.connect(endpoint);
+		http::request<http::empty_body> req(http::verb::get, "/"sv, 11);
+		http::write(stream, req);
+		beast::flat_buffer buffer;
+		http::response<http::string_body> resp;
+		http::read(stream, buffer, resp);
+		return resp.result() == http::status::ok ? resp.body() : ""s;
+	}
+
+	// Отвечает путем запроса. Ответы на /slow приходят из другого потока позже ответов на следующие запросы
+	struct EchoHandler {
+		net::thread_pool* other_thread = nullptr;
+
+		template <typename Send>
+		void operator()(tcp::endpoint, http_server::HttpRequest&& req, Send&& send) {
+			http::response<http::string_body> resp(http::status::ok, req.version());
+			resp.body() = std::string(req.target());
+			resp.prepare_payload();
+			resp.keep_alive(req.keep_alive());
+			if (req.target() == "/slow"sv) {
+				net::post(*other_thread, [send, resp = std::move(resp)]() mutable {
+					std::this_thread::sleep_for(20ms);
+					send(std::move(resp));
+					});
+			}
+			else {
+				send(std::move(resp));
+			}
+		}
+	};
+
+	// Отвечает телом запроса в памяти соединения и запоминает, сколько раз поток сервера обращался к operator new
+	struct ArenaEchoHandler {
+		std::shared_ptr<std::vector<size_t>> allocations = std::make_shared<std::vector<size_t>>();
+
+		ArenaEchoHandler() {
+			allocations->reserve(100);
+		}
+
+		template <typename Send>
+		void operator()(tcp::endpoint, http_server::HttpRequest&& req, Send&& send) {
+			allocations->push_back(alloc_counter::GetThreadAllocations());
+			http_server::HttpResponse resp(std::piecewise_construct,
+				std::make_tuple(req.body().get_allocator()), std::make_tuple(req.get_allocator()));
+			resp.result(http::status::ok);
+			resp.version(req.version());
+			resp.set(http::field::content_type, "text/plain"sv);
+			resp.body() = req.body();
+			resp.prepare_payload();
+			resp.keep_alive(req.keep_alive());
+			send(std::move(resp));
+		}
+	};
+
+}  // namespace
+
+SCENARIO("Per-connection arena") {
+	GIVEN("a server whose logged handler builds responses in the request's arena") {
+		// Исполнитель io_context без strand: strand внутри any_io_executor сам выделяет память на каждую операцию
+		http_server::IoContextPool pool(1);
+		tcp::acceptor probe(pool.Get(0), tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+		const tcp::endpoint endpoint = probe.local_endpoint();
+		probe.close();
+
+		// Журнал запросов пишется так же, как в сервере: через асинхронный лог
+		std::ostringstream log_stream;
+		std::optional<logger::AsyncLogGuard> log_guard;
+		log_guard.emplace(boost::make_shared<logger::AsyncLogSink>(boost::make_shared<logger::AsyncLogBackend>(
+			log_stream, &logger::MyFormatter, logger::AsyncLogOptions{}, &logger::MyAccessFormatter)));
+
+		ArenaEchoHandler handler;
+		http_handler::server_logging::LoggingRequestHandler<ArenaEchoHandler> logging_handler{ handler };
+		http_server::ServeHttp(pool, endpoint, logging_handler);
+		pool.Run();
+
+		WHEN("a keep-alive client sends requests one after another") {
+			net::io_context client_ioc;
+			beast::tcp_stream stream(client_ioc);
+			stream.connect(endpoint);
+			beast::flat_buffer buffer;
+
+			constexpr size_t request_count = 60;
+			for (size_t i = 0; i < request_count; ++i) {
+				http::request<http::string_body> req(http::verb::post, "/echo"sv, 11);
+				req.set(http::field::host, "localhost"sv);
+				req.body() = std::string(100 + i % 5 * 50, 'a' + i % 26);
+				req.prepare_payload();
+				http::write(stream, req);
+
+				http::response<http::string_body> resp;
+				http::read(stream, buffer, resp);
+				CHECK(resp.body() == req.body());
+			}
+
+			THEN("after warm-up the server thread allocates only for the stream's timeout timer") {
+				REQUIRE(handler.allocations->size() == request_count);
+				const auto& allocations = *handler.allocations;
+				// Таймер tcp_stream ждет через внутренний обработчик Beast, которому нельзя передать аллокатор.
+				// Без арены здесь было больше двадцати выделений на запрос
+				constexpr size_t warm_up = 20;
+				CHECK(allocations.back() - allocations[warm_up] <= request_count - 1 - warm_up);
+			}
+
+			AND_THEN("every request and response is logged") {
+				pool.Stop();
+				pool.Join();
+				log_guard.reset();
+				const std::string log = log_stream.str();
+				size_t requests = 0;
+				size_t responses = 0;
+				for (size_t pos = 0; (pos = log.find("\"message\":\"request received\""sv, pos)) != std::string::npos; ++pos) {
+					++requests;
+				}
+				for (size_t pos = 0; (pos = log.find("\"message\":\"response sent\""sv, pos)) != std::string::npos; ++pos) {
+					++responses;
+				}
+				CHECK(requests == request_count);
+				CHECK(responses == request_count);
+				CHECK(log.find("\"URI\":\"/echo\""sv) != std::string::npos);
+			}
+		}
+
+		pool.Stop();
+		pool.Join();
+	}
+}
+
+SCENARIO("Pipelined requests") {
+	GIVEN("a server whose responses can be ready out of order") {
+		net::io_context ioc(1);
+		tcp::acceptor probe(ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+		const tcp::endpoint endpoint = probe.local_endpoint();
+		probe.close();
+
+		net::thread_pool other_thread(1);
+		http_server::ServeHttp(ioc, endpoint, EchoHandler{ &other_thread });
+		std::thread server([&ioc] { ioc.run(); });
+
+		WHEN("a client sends many requests without waiting for responses") {
+			std::vector<std::string> targets;
+			std::string requests;
+			for (int i = 0; i < 40; ++i) {
+				targets.push_back(i % 3 == 0 ? "/slow"s : "/fast/"s + std::to_string(i));
+				requests += "GET "s + targets.back() + " HTTP/1.1\r\nHost: localhost\r\n"s
+					+ (i == 39 ? "Connection: close\r\n"s : ""s) + "\r\n"s;
+			}
+
+			net::io_context client_ioc;
+			beast::tcp_stream stream(client_ioc);
+			stream.connect(endpoint);
+			net::write(stream, net::buffer(requests));
+
+			THEN("responses come back in the order of requests, and the connection closes after the last one") {
+				beast::flat_buffer buffer;
+				for (const auto& target : targets) {
+					http::response<http::string_body> resp;
+					http::read(stream, buffer, resp);
+					CHECK(resp.body() == target);
+				}
+				http::response<http::string_body> extra;
+				beast::error_code ec;
+				http::read(stream, buffer, extra, ec);
+				CHECK(ec == http::error::end_of_stream);
+			}
+		}
+
+		other_thread.join();
+		ioc.stop();
+		server.join();
+	}
+}
+
+SCENARIO("Listeners on an io_context per core") {
+	GIVEN("a pool of io_contexts with SO_REUSEPORT acceptors on one port") {
+		// Свободный порт: группа SO_REUSEPORT должна слушать один и тот же порт, а не порт 0
+		net::io_context probe_ioc;
+		tcp::acceptor probe(probe_ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+		const tcp::endpoint endpoint = probe.local_endpoint();
+		probe.close();
+
+		net::thread_pool other_thread(1);
+		CountingHandler handler;
+		handler.other_thread = &other_thread;
+
+		http_server::IoContextPool pool(3);
+		http_server::ServeHttp(pool, endpoint, handler);
+		pool.Run();
+
+		WHEN("clients send requests") {
+			std::set<std::string> bodies;
+			for (int i = 0; i < 20; ++i) {
+				bodies.insert(Get(endpoint));
+			}
+
+			THEN("every request is answered once, even when the response comes from another thread") {
+				CHECK(bodies.size() == 20);
+				CHECK_FALSE(bodies.contains(""s));
+				std::lock_guard lock(handler.state->mutex);
+				CHECK(handler.state->requests == 20);
+				CHECK_FALSE(handler.state->threads.contains(std::this_thread::get_id()));
+				CHECK(handler.state->threads.size() <= pool.GetSize());
+			}
+		}
+
+		pool.Stop();
+		pool.Join();
+		other_thread.join();
+	}
+}
@@ -0,0 +1,91 @@
+﻿#include "../src/logger.h"
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Стоимость записей LoggingRequestHandler для потоков сервера: прежний синхронный консольный sink
+// с auto_flush и асинхронный backend. Вывод идет в /dev/null, чтобы мерить сам лог, а не терминал.
+// Запуск: game_server_benchmarks "[!benchmark][log]"
+
+using namespace std::literals;
+namespace logging = boost::log;
+
+namespace {
+
+// Пара записей, как на каждый запрос в LoggingRequestHandler
+void LogRequest(int i) {
+	boost::json::value request_data{ {logger::key_ip, "127.0.0.1"s}, {logger::key_uri, "/api/v1/game/state"s}, {logger::key_method, "GET"s} };
+	BOOST_LOG_TRIVIAL(info) << logging::add_value(logger::data, request_data)
+		<< logging::add_value(logger::message, logger::key_request_received);
+
+	boost::json::value response_data{ {logger::key_response_time, std::to_string(i % 3)}, {logger::key_code, 200},
+		{logger::key_content_type, "application/json"s} };
+	BOOST_LOG_TRIVIAL(info) << logging::add_value(logger::data, response_data)
+		<< logging::add_value(logger::message, logger::key_response_sent);
+}
+
+struct Result {
+	// Запросов в секунду, которые потоки сервера успевают передать в лог
+	double producer_rate = 0;
+	// То же, но до момента, когда все записи выведены
+	double written_rate = 0;
+};
+
+template <typename Flush>
+Result RunThreads(unsigned threads, int requests_per_thread, Flush&& flush) {
+	using Clock = std::chrono::steady_clock;
+	const auto start = Clock::now();
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; ++t) {
+		workers.emplace_back([requests_per_thread] {
+			for (int i = 0; i < requests_per_thread; ++i) {
+				LogRequest(i);
+			}
+			});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	const std::chrono::duration<double> produced = Clock::now() - start;
+	flush();
+	const std::chrono::duration<double> written = Clock::now() - start;
+	const double requests = threads * requests_per_thread;
+	return { requests / produced.count(), requests / written.count() };
+}
+
+}  // namespace
+
+TEST_CASE("Request logging: synchronous console sink vs asynchronous backend", "[!benchmark][log]") {
+	logging::add_common_attributes();
+	std::ofstream null_stream("/dev/null");
+	constexpr int requests_per_thread = 20'000;
+
+	for (unsigned threads : { 1u, 4u }) {
+		auto sync_sink = logging::add_console_log(null_stream,
+			logging::keywords::format = &logger::MyFormatter,
+			logging::keywords::auto_flush = true);
+		const Result sync = RunThreads(threads, requests_per_thread, [] {});
+		logging::core::get()->remove_sink(sync_sink);
+
+		Result async;
+		size_t dropped = 0;
+		{
+			// Буфер вмещает все записи прогона, поэтому потоки сервера не ждут поток записи
+			const logger::AsyncLogOptions options{ .capacity = 2 * threads * requests_per_thread };
+			auto backend = boost::make_shared<logger::AsyncLogBackend>(null_stream, &logger::MyFormatter, options);
+			logger::AsyncLogGuard guard(boost::make_shared<logger::AsyncLogSink>(backend));
+			async = RunThreads(threads, requests_per_thread, [&backend] { backend->flush(); });
+			dropped = backend->GetDroppedCount();
+		}
+		CHECK(dropped == 0);
+
+		std::cout << "threads " << threads << std::fixed << std::setprecision(0)
+			<< ": synchronous " << std::setw(8) << sync.producer_rate << " req/s"
+			<< ", asynchronous " << std::setw(8) << async.producer_rate << " req/s accepted, "
+			<< std::setw(8) << async.written_rate << " req/s written" << std::endl;
+	}
+}
@@ -209,3 +209,278 @@ SCENARIO("simulation of a real game scenario with probability=0, time=0ms and pr
 		}
 	}
 }
+
+SCENARIO("Dog table in game session") {
+	using model::Road;
+
+	GIVEN("a game session on a map with two roads") {
+		auto map = std::make_shared<model::Map>(model::Map::Id("map1"s), "Map 1"s, 1., 3);
+		map->AddRoad(Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)));
+		map->AddRoad(Road(Road::VERTICAL, model::Point{ 40, 0 }, 30, Road::Id(1)));
+		model::GameSession session(map);
+
+		WHEN("dogs are added") {
+			auto rex = session.AddDog({ 0., 0. }, "Rex"s, map->GetRoads()[0], 3);
+			auto bob = session.AddDog({ 40., 0. }, "Bob"s, map->GetRoads()[1], 3);
+
+			THEN("they get sequential ids and can be found by id") {
+				REQUIRE(session.GetDogCount() == 2);
+				CHECK(*rex.GetId() == 0);
+				CHECK(*bob.GetId() == 1);
+				REQUIRE(session.FindDog(model::Dog::Id{ 1u }).has_value());
+				CHECK(session.FindDog(model::Dog::Id{ 1u })->GetName() == "Bob"s);
+				CHECK(!session.FindDog(model::Dog::Id{ 2u }).has_value());
+			}
+
+			THEN("changes through one reference are visible through another") {
+				rex.SetSpeed({ 1., 0. });
+				rex.SetPosition({ 5., 0. });
+				rex.SetNewRoad(map->GetRoads()[1]);
+
+				auto same_rex = session.GetDog(rex.GetIndex());
+				CHECK(same_rex.GetSpeed() == geom::Vec2D{ 1., 0. });
+				CHECK(same_rex.GetPosition() == geom::Point2D{ 5., 0. });
+				CHECK(*same_rex.GetRoadId() == 1);
+				CHECK(bob.GetPosition() == geom::Point2D{ 40., 0. });
+			}
+
+			THEN("the bag is scored and emptied") {
+				CHECK(rex.PutItemIntoBag({ model::Loot::Id{ 0u }, 0u, 7u }));
+				CHECK(rex.PutItemIntoBag({ model::Loot::Id{ 1u }, 0u, 3u }));
+				rex.CalcScoreAndEraseBag();
+				CHECK(rex.GetScore() == 10);
+				CHECK(rex.GetBagContent().empty());
+			}
+		}
+
+		WHEN("a dog with an existing id is restored") {
+			session.AddDog({ 0., 0. }, "Rex"s, map->GetRoads()[0], 3);
+			model::Dog dog{ geom::Point2D{ 1., 0. }, "Pluto"s, model::Dog::Id{ 0u }, map->GetRoads()[0], 3 };
+
+			THEN("an exception is thrown") {
+				CHECK_THROWS_AS(session.AddDog(dog), std::invalid_argument);
+			}
+		}
+	}
+}
+
+SCENARIO("Road graph of a map") {
+	using model::Direction;
+	using model::Road;
+
+	GIVEN("a map with crossing, continuing and overlapping roads") {
+		model::Map map(model::Map::Id("map1"s), "Map 1"s, 1., 3);
+		map.AddRoad(Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)));
+		map.AddRoad(Road(Road::VERTICAL, model::Point{ 40, 0 }, 30, Road::Id(1)));
+		map.AddRoad(Road(Road::HORIZONTAL, model::Point{ 40, 30 }, 0, Road::Id(2)));
+		map.AddRoad(Road(Road::VERTICAL, model::Point{ 0, 0 }, 30, Road::Id(3)));
+		map.AddRoad(Road(Road::HORIZONTAL, model::Point{ 40, 0 }, 70, Road::Id(4)));
+		map.AddRoad(Road(Road::VERTICAL, model::Point{ 40, 60 }, 30, Road::Id(5)));
+		map.AddRoad(Road(Road::HORIZONTAL, model::Point{ 55, 0 }, 40, Road::Id(6)));
+		const auto& graph = map.GetRoadGraph();
+
+		THEN("every road has its extents") {
+			REQUIRE(graph.GetRoadCount() == map.GetRoads().size());
+			CHECK(graph.GetRoad(2).min_x == 0);
+			CHECK(graph.GetRoad(2).max_x == 40);
+			CHECK(graph.GetRoad(2).horizontal);
+			CHECK(graph.GetRoad(5).min_y == 30);
+			CHECK(graph.GetRoad(5).max_y == 60);
+			CHECK(graph.GetRoad(5).vertical);
+		}
+
+		THEN("junctions agree with the roadmap at every road end") {
+			const auto& roads = map.GetRoads();
+			const auto& roadmap = map.GetRoadmap();
+			for (size_t index = 0; index < roads.size(); ++index) {
+				const auto& road = roads[index];
+				for (const auto& point : { road->GetStart(), road->GetEnd() }) {
+					for (auto dir : { Direction::DIR_NORTH, Direction::DIR_SOUTH, Direction::DIR_WEST, Direction::DIR_EAST }) {
+						const auto position = road->IsHorizontal() ? point.x : point.y;
+						const size_t junction = graph.FindJunction(index, position, dir);
+
+						if (auto it = roadmap.find(std::pair{ point, dir }); it != roadmap.end()) {
+							REQUIRE(junction != model::RoadGraph::npos);
+							CHECK(roads[junction] == it->second);
+						}
+						else {
+							CHECK(junction == model::RoadGraph::npos);
+						}
+					}
+				}
+			}
+		}
+
+		THEN("the later road wins when two roads start at the same point") {
+			CHECK(graph.FindJunction(1, 0, Direction::DIR_EAST) == 6);
+		}
+	}
+}
+
+SCENARIO("Loot table of a map") {
+	using model::Loot;
+
+	GIVEN("a map with three loot items") {
+		model::Map map(model::Map::Id("map"s), "Map"s, 1., 3);
+		const auto first = map.AddLoot(Loot{ Loot::Id{ 0u }, 0u, 10, model::Point{ 1, 0 } });
+		const auto second = map.AddLoot(Loot{ Loot::Id{ 0u }, 1u, 20, model::Point{ 2, 0 } });
+		const auto third = map.AddLoot(Loot{ Loot::Id{ 0u }, 2u, 30, model::Point{ 3, 0 } });
+
+		THEN("items get increasing ids and are listed in insertion order") {
+			CHECK(*first < *second);
+			CHECK(*second < *third);
+			REQUIRE(map.GetLootCount() == 3);
+			CHECK(map.GetLoots()[1].id == second);
+		}
+
+		WHEN("an item in the middle is extracted") {
+			REQUIRE(map.ExtractLoot(first));
+
+			THEN("the other items stay reachable by id") {
+				CHECK(map.GetLootCount() == 2);
+				CHECK(map.FindLoot(first) == nullptr);
+				REQUIRE(map.FindLoot(second) != nullptr);
+				CHECK(map.FindLoot(second)->score == 20);
+				REQUIRE(map.FindLoot(third) != nullptr);
+				CHECK(map.FindLoot(third)->position == model::Point{ 3, 0 });
+			}
+
+			THEN("the stale id can not be extracted again") {
+				CHECK_FALSE(map.ExtractLoot(first));
+				CHECK(map.GetLootCount() == 2);
+			}
+
+			AND_WHEN("a new item is added") {
+				const auto fourth = map.AddLoot(Loot{ Loot::Id{ 0u }, 3u, 40, model::Point{ 4, 0 } });
+
+				THEN("it reuses the slot under a new id") {
+					CHECK(*fourth > *third);
+					CHECK(fourth != first);
+					CHECK(fourth != second);
+					CHECK(fourth != third);
+					CHECK(map.FindLoot(first) == nullptr);
+					REQUIRE(map.FindLoot(fourth) != nullptr);
+					CHECK(map.FindLoot(fourth)->type == 3u);
+					CHECK(map.GetLootCount() == 3);
+				}
+			}
+		}
+	}
+
+	GIVEN("a map where one slot is reused many times") {
+		model::Map map(model::Map::Id("map"s), "Map"s, 1., 3);
+		Loot::Id last = map.AddLoot(Loot{ Loot::Id{ 0u }, 0u, 10, model::Point{ 1, 0 } });
+
+		THEN("ids keep growing and stay exactly representable as JSON numbers") {
+			for (int i = 0; i < 100'000; ++i) {
+				REQUIRE(map.ExtractLoot(last));
+				const auto next = map.AddLoot(Loot{ Loot::Id{ 0u }, 0u, 10, model::Point{ 1, 0 } });
+				REQUIRE(*next > *last);
+				last = next;
+			}
+			CHECK(*last <= model::LootTable::max_id);
+			CHECK(static_cast<size_t>(static_cast<double>(*last)) == *last);
+		}
+	}
+
+	GIVEN("a map with many loot items") {
+		constexpr size_t item_count = 10'000;
+		model::Map map(model::Map::Id("map"s), "Map"s, 1., 3);
+		std::vector<Loot::Id> ids;
+		for (size_t i = 0; i < item_count; ++i) {
+			ids.push_back(map.AddLoot(Loot{ Loot::Id{ 0u }, 0u, static_cast<game_details::Score>(i), model::Point{ static_cast<int>(i), 0 } }));
+		}
+
+		WHEN("every other item is extracted") {
+			for (size_t i = 0; i < item_count; i += 2) {
+				REQUIRE(map.ExtractLoot(ids[i]));
+			}
+
+			THEN("only the remaining items are listed") {
+				REQUIRE(map.GetLootCount() == item_count / 2);
+				for (const auto& loot : map.GetLoots()) {
+					CHECK(loot.score % 2 == 1);
+					REQUIRE(map.FindLoot(loot.id) == &loot);
+				}
+			}
+		}
+	}
+}
+
+SCENARIO("Tick change sets of a game session") {
+	using model::Loot;
+	using model::Road;
+
+	GIVEN("a session with two dogs") {
+		auto map = std::make_shared<model::Map>(model::Map::Id("map"s), "Map"s, 1., 3);
+		map->AddRoad(Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)));
+		model::GameSession session(map);
+		const auto& road = map->GetRoads().front();
+		auto first = session.AddDog(geom::Point2D{ 0., 0. }, "first"s, road, 3);
+		auto second = session.AddDog(geom::Point2D{ 5., 0. }, "second"s, road, 3);
+		const auto loot = map->AddLoot(Loot{ Loot::Id{ 0u }, 0u, 10, model::Point{ 10, 0 } });
+
+		std::vector<model::Dog::Id> dogs;
+		std::vector<Loot::Id> loots;
+
+		WHEN("the first tick is committed") {
+			session.CommitTick();
+
+			THEN("everything present is reported as changed since tick 0") {
+				CHECK(session.GetTick() == 1);
+				REQUIRE(session.CollectChanges(0, dogs, loots));
+				CHECK(dogs == std::vector{ first.GetId(), second.GetId() });
+				CHECK(loots == std::vector{ loot });
+			}
+
+			AND_WHEN("only one dog moves during the next tick") {
+				second.SetPosition(geom::Point2D{ 6., 0. });
+				session.CommitTick();
+
+				THEN("only that dog is reported") {
+					REQUIRE(session.CollectChanges(1, dogs, loots));
+					CHECK(dogs == std::vector{ second.GetId() });
+					CHECK(loots.empty());
+				}
+			}
+
+			AND_WHEN("a loot item is picked up and another one appears") {
+				REQUIRE(map->ExtractLoot(loot));
+				const auto new_loot = map->AddLoot(Loot{ Loot::Id{ 0u }, 1u, 20, model::Point{ 20, 0 } });
+				session.CommitTick();
+
+				THEN("both items are reported") {
+					REQUIRE(session.CollectChanges(1, dogs, loots));
+					CHECK(dogs.empty());
+					CHECK(loots.size() == 2);
+					CHECK(std::find(loots.begin(), loots.end(), loot) != loots.end());
+					CHECK(std::find(loots.begin(), loots.end(), new_loot) != loots.end());
+				}
+			}
+
+			AND_WHEN("nothing changes") {
+				session.CommitTick();
+
+				THEN("the client that saw the current tick gets an empty change set") {
+					REQUIRE(session.CollectChanges(2, dogs, loots));
+					CHECK(dogs.empty());
+					CHECK(loots.empty());
+				}
+			}
+		}
+
+		WHEN("more ticks pass than the ring keeps") {
+			for (size_t i = 0; i < model::GameSession::max_tick_changes + 1; ++i) {
+				first.SetPosition(geom::Point2D{ static_cast<double>(i), 0. });
+				session.CommitTick();
+			}
+
+			THEN("a too old or future tick can not be served incrementally") {
+				CHECK_FALSE(session.CollectChanges(0, dogs, loots));
+				CHECK_FALSE(session.CollectChanges(session.GetTick() + 1, dogs, loots));
+				REQUIRE(session.CollectChanges(1, dogs, loots));
+				CHECK(dogs == std::vector{ first.GetId() });
+			}
+		}
+	}
+}
@@ -0,0 +1,93 @@
+﻿#include "../src/model_serialization.h"
+#include "../src/state_file.h"
+#include <boost/archive/text_iarchive.hpp>
+#include <boost/archive/text_oarchive.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+// Сохранение и восстановление состояния текстовым архивом boost и двоичным форматом.
+// Запуск: game_server_benchmarks "[state_file]" --benchmark-samples 10
+
+namespace {
+
+using namespace std::literals;
+
+// Карта с item_count собаками, их игроками и item_count предметами
+std::vector<serialization::MapRepr> MakeMapsRepr(size_t item_count) {
+	std::vector<serialization::PlayerRepr> players;
+	std::vector<serialization::LootRepr> loots;
+	std::vector<serialization::DogRepr> dogs;
+	players.reserve(item_count);
+	loots.reserve(item_count);
+	dogs.reserve(item_count);
+
+	for (size_t i = 0; i < item_count; ++i) {
+		const auto id = static_cast<std::uint32_t>(i);
+		model::Dog dog{ geom::Point2D{ i * 0.37, i * 0.11 }, "dog"s + std::to_string(i), model::Dog::Id{ id }, nullptr, 3 };
+		dog.SetSpeed({ 1.5, 0. });
+		dog.SetDirection(model::Direction::DIR_EAST);
+		dog.AddScore(static_cast<int>(i % 100));
+		dog.SetRoadId(model::Road::Id{ static_cast<int>(i % 20) });
+		for (size_t item = 0; item < i % 4; ++item) {
+			static_cast<void>(dog.PutItemIntoBag({ model::Loot::Id{ item }, 1u }));
+		}
+		dogs.emplace_back(dog);
+
+		app::Player player(app::Player::Id{ id });
+		player.SetToken(app::Token::FromString(std::string(32, "0123456789abcdef"[i % 16])));
+		players.emplace_back(&player, player.GetToken());
+
+		loots.emplace_back(model::Loot{ model::Loot::Id{ i }, static_cast<unsigned>(i % 3), 10u,
+			model::Point{ static_cast<int>(i % 40), static_cast<int>(i % 10) } });
+	}
+	return { serialization::MapRepr{ model::Map::Id{ "map1"s }, players, loots, dogs } };
+}
+
+}  // namespace
+
+TEST_CASE("State file 100k dogs and 100k loot", "[!benchmark][state_file]") {
+	const auto maps_repr = MakeMapsRepr(100'000);
+
+	std::stringstream text_strm;
+	{
+		boost::archive::text_oarchive output_archive(text_strm);
+		output_archive << maps_repr;
+	}
+	const std::string binary = serialization::state_file::Encode(maps_repr);
+
+	const auto dir = std::filesystem::temp_directory_path();
+	const auto text_path = dir / "state-file-benchmark.txt";
+	const auto binary_path = dir / "state-file-benchmark.bin";
+	std::ofstream(text_path, std::ios::binary) << text_strm.rdbuf();
+	std::ofstream(binary_path, std::ios::binary).write(binary.data(), binary.size());
+	WARN("text archive: " << std::filesystem::file_size(text_path) << " bytes, binary: " << binary.size() << " bytes");
+
+	BENCHMARK("save: text_oarchive") {
+		std::ostringstream strm;
+		boost::archive::text_oarchive output_archive(strm);
+		output_archive << maps_repr;
+		return strm.tellp();
+	};
+	BENCHMARK("save: binary") {
+		return serialization::state_file::Encode(maps_repr).size();
+	};
+	BENCHMARK("restore: text_iarchive from file") {
+		std::ifstream ifs(text_path);
+		boost::archive::text_iarchive input_archive(ifs);
+		std::vector<serialization::MapRepr> restored;
+		input_archive >> restored;
+		return restored.front().dogs_.size();
+	};
+	BENCHMARK("restore: binary from mapped file") {
+		serialization::state_file::MappedFile mapped_file(binary_path);
+		std::vector<serialization::MapRepr> restored;
+		serialization::state_file::Decode(mapped_file.GetData(), restored);
+		return restored.front().dogs_.size();
+	};
+
+	std::filesystem::remove(text_path);
+	std::filesystem::remove(binary_path);
+}
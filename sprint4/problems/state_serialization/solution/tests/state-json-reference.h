@@ -0,0 +1,82 @@
+﻿#pragma once
+#include <string>
+#include "../src/boost_includes.h"
+#include "../src/model.h"
+
+// Сборка состояния через json::object, как это делал GetGameState до прямой записи.
+// Служит эталоном для state_writer::WriteGameState
+inline std::string SerializeStateWithJsonObject(model::GameSession& session) {
+	using namespace model_details;
+	namespace json = boost::json;
+
+	json::object obj;
+	obj[key_players] = json::object();
+	obj[key_lost_objects] = json::object();
+
+	for (size_t i = 0; i < session.GetDogCount(); ++i) {
+		const auto dog = session.GetDog(i);
+		std::string dir;
+		switch (dog.GetDirection()) {
+		case model::Direction::DIR_NORTH:
+			dir = "U";
+			break;
+		case model::Direction::DIR_SOUTH:
+			dir = "D";
+			break;
+		case model::Direction::DIR_EAST:
+			dir = "R";
+			break;
+		case model::Direction::DIR_WEST:
+			dir = "L";
+			break;
+		}
+
+		json::array bag;
+		for (auto& item : dog.GetBagContent()) {
+			bag.push_back(json::object{ {key_id, *item.id}, {key_type, item.type} });
+		}
+
+		obj[key_players].as_object()[std::to_string(*dog.GetId())] =
+			json::object{ {key_pos, json::array{ dog.GetPosition().x, dog.GetPosition().y }},
+							{key_speed, json::array{ dog.GetSpeed().x, dog.GetSpeed().y }},
+							{key_dir, dir},
+							{key_bag, bag},
+							{key_score, dog.GetScore()} };
+	}
+
+	for (const auto& loot : session.GetMap()->GetLoots()) {
+		obj[key_lost_objects].as_object()[std::to_string(*loot.id)] =
+			json::object({ {key_type, loot.type},
+				{key_pos, json::array{ static_cast<double>(loot.position.x), static_cast<double>(loot.position.y)}} });
+	}
+	return json::serialize(obj);
+}
+
+// Сессия с dog_count собаками на карте-сетке и предметами на дорогах
+inline std::shared_ptr<model::Game> MakeStateGame(size_t dog_count, size_t loot_count) {
+	using model::Road;
+	auto game = std::make_shared<model::Game>();
+	model::Map map(model::Map::Id("map1"), "Map 1", 1.7, 3);
+	for (int i = 0; i <= 10; ++i) {
+		map.AddRoad(Road(Road::HORIZONTAL, model::Point{ 0, i * 10 }, 100, Road::Id(2 * i)));
+		map.AddRoad(Road(Road::VERTICAL, model::Point{ i * 10, 0 }, 100, Road::Id(2 * i + 1)));
+	}
+	for (size_t i = 0; i < loot_count; ++i) {
+		map.AddLoot(model::Loot{ model::Loot::Id{ 0u }, static_cast<unsigned>(i % 3), 10,
+			model::Point{ static_cast<int>(i % 101), static_cast<int>(i % 11) * 10 } });
+	}
+	game->AddMap(std::move(map));
+
+	auto& session = game->GetGameSessions().front();
+	const auto& road = session.GetMap()->GetRoads().front();
+	for (size_t i = 0; i < dog_count; ++i) {
+		auto dog = session.AddDog(geom::Point2D{ 0.1 * static_cast<double>(i % 1000), 0.2 }, "dog" + std::to_string(i), road, 3);
+		dog.SetSpeed(geom::Vec2D{ i % 2 ? 1.7 : 0., i % 3 ? -0.3 : 0. });
+		dog.SetDirection(static_cast<model::Direction>(i % 4));
+		if (i % 5 == 0) {
+			(void)dog.PutItemIntoBag(model::Loot{ model::Loot::Id{ i }, 1u, 5, model::Point{ 0, 0 } });
+		}
+		dog.AddScore(static_cast<game_details::Score>(i % 7) * 10);
+	}
+	return game;
+}
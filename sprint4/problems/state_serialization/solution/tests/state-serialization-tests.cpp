@@ -1,10 +1,16 @@
 ﻿#include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
 #include <sstream>
 
 #include "../src/model.h"
 #include "../src/model_serialization.h"
+#include "../src/state_file.h"
+#include "../src/infastructure.h"
+#include "../src/state_writer.h"
+#include "test-game.h"
 
 using namespace model;
 using namespace std::literals;
@@ -18,6 +24,27 @@ struct Fixture {
     OutputArchive output_archive{strm};
 };
 
+std::vector<Map> MakeMaps() {
+    std::vector<Map> maps;
+    for (const auto& id : {"map1"s, "map2"s}) {
+        maps.push_back(test_game::MakeMap(id, id, 2., {Road(Road::HORIZONTAL, Point{0, 0}, 40, Road::Id(0)),
+                                                      Road(Road::VERTICAL, Point{40, 0}, 20, Road::Id(1))}));
+    }
+    return maps;
+}
+
+struct GameFixture : test_game::TestGame {
+    GameFixture()
+        : TestGame(MakeMaps(), {.loot_probability = 1.0, .random_positions = true}) {
+    }
+
+    std::string GetState(size_t session_index) {
+        std::string state;
+        state_writer::WriteGameState(game->GetGameSessions().at(session_index), state);
+        return state;
+    }
+};
+
 }  // namespace
 
 SCENARIO_METHOD(Fixture, "Point serialization") {
@@ -69,3 +96,216 @@ SCENARIO_METHOD(Fixture, "Dog Serialization") {
         }
     }
 }
+
+SCENARIO("Binary state file") {
+    GIVEN("a map representation with a player, a dog and loot") {
+        Dog dog{ geom::Point2D{1.5, -0.25}, "Rex"s, Dog::Id{7}, nullptr, 2 };
+        dog.AddScore(15);
+        CHECK(dog.PutItemIntoBag({ Loot::Id{3}, 1u }));
+        dog.SetDirection(Direction::DIR_WEST);
+        dog.SetSpeed({ -1.0, 0.0 });
+        dog.SetRoadId(Road::Id{ 4 });
+
+        app::Player player(app::Player::Id{ 7 });
+        player.SetToken(app::Token::FromString("0123456789abcdef0123456789abcdef"sv));
+
+        const Loot loot{ Loot::Id{ (1ull << 32) | 5u }, 2u, 30u, Point{ 4, 9 } };
+        const std::vector<serialization::MapRepr> maps_repr{ serialization::MapRepr{ Map::Id{ "town"s },
+            { serialization::PlayerRepr{ &player, player.GetToken() } },
+            { serialization::LootRepr{ loot } },
+            { serialization::DogRepr{ dog } } } };
+
+        const std::string file = serialization::state_file::Encode(maps_repr);
+
+        THEN("the file starts with the versioned header") {
+            REQUIRE(file.size() > serialization::state_file::header_size);
+            CHECK(serialization::state_file::HasSignature(file));
+        }
+
+        THEN("it is restored to the same representation") {
+            std::vector<serialization::MapRepr> restored_repr;
+            serialization::state_file::Decode(file, restored_repr);
+
+            REQUIRE(restored_repr.size() == 1);
+            const auto& map_repr = restored_repr.front();
+            CHECK(map_repr.id_ == Map::Id{ "town"s });
+
+            REQUIRE(map_repr.players_.size() == 1);
+            const auto restored_player = map_repr.players_.front().Restore();
+            CHECK(restored_player.GetId() == player.GetId());
+            CHECK(restored_player.GetToken() == player.GetToken());
+
+            REQUIRE(map_repr.loots_.size() == 1);
+            CHECK(map_repr.loots_.front().Restore() == loot);
+
+            REQUIRE(map_repr.dogs_.size() == 1);
+            const auto restored = map_repr.dogs_.front().Restore();
+            CHECK(restored.GetId() == dog.GetId());
+            CHECK(restored.GetName() == dog.GetName());
+            CHECK(restored.GetPosition() == dog.GetPosition());
+            CHECK(restored.GetSpeed() == dog.GetSpeed());
+            CHECK(restored.GetDirection() == dog.GetDirection());
+            CHECK(restored.GetScore() == dog.GetScore());
+            CHECK(restored.GetRoadId() == dog.GetRoadId());
+            CHECK(restored.GetBagContent() == dog.GetBagContent());
+        }
+
+        THEN("it is read back through a memory mapping") {
+            const auto path = std::filesystem::temp_directory_path() / "state-file-tests.bin";
+            std::ofstream(path, std::ios::binary).write(file.data(), file.size());
+
+            std::vector<serialization::MapRepr> restored_repr;
+            {
+                serialization::state_file::MappedFile mapped_file(path);
+                serialization::state_file::Decode(mapped_file.GetData(), restored_repr);
+            }
+            std::filesystem::remove(path);
+
+            REQUIRE(restored_repr.size() == 1);
+            CHECK(restored_repr.front().dogs_.size() == 1);
+        }
+
+        THEN("damaged files are rejected") {
+            std::vector<serialization::MapRepr> restored_repr;
+
+            std::string corrupted = file;
+            corrupted.back() ^= 0x01;
+            CHECK_THROWS_AS(serialization::state_file::Decode(corrupted, restored_repr), std::runtime_error);
+
+            const std::string truncated = file.substr(0, file.size() - 1);
+            CHECK_THROWS_AS(serialization::state_file::Decode(truncated, restored_repr), std::runtime_error);
+
+            std::string newer = file;
+            newer[8] = static_cast<char>(serialization::state_file::format_version + 1);
+            CHECK_THROWS_AS(serialization::state_file::Decode(newer, restored_repr), std::runtime_error);
+        }
+
+        THEN("a file of the first format version is read as a state without journal generation") {
+            std::string first_version = file;
+            first_version[8] = 1;
+
+            serialization::StateRepr state;
+            serialization::state_file::Decode(first_version, state);
+            CHECK(state.journal_generation_ == 0);
+            REQUIRE(state.maps_.size() == 1);
+            CHECK(state.maps_.front().dogs_.size() == 1);
+        }
+
+        THEN("the text archive is not taken for a binary file") {
+            std::stringstream strm;
+            {
+                OutputArchive output_archive{ strm };
+                output_archive << maps_repr;
+            }
+            CHECK_FALSE(serialization::state_file::HasSignature(strm.str()));
+        }
+    }
+}
+
+SCENARIO("Background state file writer") {
+    GIVEN("a writer of a state file") {
+        const auto path = std::filesystem::temp_directory_path() / "state-file-writer-tests.bin";
+        std::filesystem::remove(path);
+
+        const auto make_maps_repr = [](std::string map_id) {
+            serialization::StateRepr state;
+            state.maps_.emplace_back(Map::Id{ std::move(map_id) }, std::vector<serialization::PlayerRepr>{},
+                std::vector<serialization::LootRepr>{}, std::vector<serialization::DogRepr>{});
+            return state;
+        };
+        const auto read_map_id = [&path] {
+            serialization::StateRepr restored;
+            serialization::state_file::MappedFile mapped_file(path);
+            serialization::state_file::Decode(mapped_file.GetData(), restored);
+            return *restored.maps_.at(0).id_;
+        };
+
+        infrastructure::StateFileWriter writer(path.string());
+        CHECK(writer.IsIdle());
+
+        WHEN("snapshots are scheduled") {
+            for (int i = 0; i < 10; ++i) {
+                writer.Schedule(make_maps_repr("map"s + std::to_string(i)));
+            }
+            writer.Flush();
+
+            THEN("the latest one is written and the rest are coalesced") {
+                CHECK(writer.IsIdle());
+                CHECK(read_map_id() == "map9"s);
+                CHECK(writer.GetCompletedSaves() + writer.GetCoalescedSaves() == 10);
+                CHECK_FALSE(std::filesystem::exists(path.string() + ".tmp"s));
+            }
+        }
+
+        WHEN("the writer is destroyed with a pending snapshot") {
+            {
+                infrastructure::StateFileWriter last_writer(path.string());
+                last_writer.Schedule(make_maps_repr("last"s));
+            }
+
+            THEN("the snapshot is written before the thread stops") {
+                CHECK(read_map_id() == "last"s);
+            }
+        }
+
+        std::filesystem::remove(path);
+    }
+}
+
+SCENARIO("Restoring a saved game") {
+    GIVEN("a saved game with players on two maps") {
+        const auto path = std::filesystem::temp_directory_path() / "state-restore-tests.bin";
+        std::filesystem::remove(path);
+
+        GameFixture original;
+        std::vector<app::Token> tokens;
+        for (int i = 0; i < 20; ++i) {
+            const auto map_id = i % 2 == 0 ? "map1"s : "map2"s;
+            tokens.push_back(original.application->JoinGame(map_id, "dog"s + std::to_string(i)).GetPlayerTokens());
+        }
+        original.application->SetPlayerAction("Bearer "s + tokens[0].ToString(), R"({"move":"R"})"s);
+        original.application->Tick(1500ms);
+        {
+            infrastructure::SerializingListener listener(path.string(), *original.application, 0ms);
+            listener.SaveState();
+        }
+
+        WHEN("it is restored into a new game") {
+            GameFixture restored;
+            infrastructure::SerializingListener listener(path.string(), *restored.application, 0ms);
+            const auto result = listener.RestoreGameState(path.string());
+
+            THEN("every session gets its dogs and loot back") {
+                CHECK(result.dogs == 20);
+                CHECK(result.loots == original.game->GetMaps().at(0)->GetLoots().size()
+                    + original.game->GetMaps().at(1)->GetLoots().size());
+                CHECK(restored.GetState(0) == original.GetState(0));
+                CHECK(restored.GetState(1) == original.GetState(1));
+            }
+
+            THEN("players keep their tokens") {
+                for (const auto& token : tokens) {
+                    CHECK(restored.player_tokens->FindPlayerByToken(token) != nullptr);
+                }
+            }
+
+            THEN("a new save keeps the tokens too") {
+                const auto path_again = path.string() + ".again"s;
+                {
+                    infrastructure::SerializingListener listener_again(path_again, *restored.application, 0ms);
+                    listener_again.SaveState();
+                }
+                GameFixture restored_again;
+                infrastructure::SerializingListener listener_again(path_again, *restored_again.application, 0ms);
+                listener_again.RestoreGameState(path_again);
+                for (const auto& token : tokens) {
+                    CHECK(restored_again.player_tokens->FindPlayerByToken(token) != nullptr);
+                }
+                CHECK(restored_again.GetState(1) == original.GetState(1));
+                std::filesystem::remove(path_again);
+            }
+        }
+
+        std::filesystem::remove(path);
+    }
+}
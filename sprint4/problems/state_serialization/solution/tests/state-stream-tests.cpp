@@ -0,0 +1,89 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/state_stream.h"
+
+using namespace std::literals;
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace websocket = beast::websocket;
+using tcp = net::ip::tcp;
+
+namespace {
+
+	model::StateSnapshot::Ptr MakeFrame(std::string text) {
+		return std::make_shared<const std::string>(std::move(text));
+	}
+
+}  // namespace
+
+SCENARIO("Game state streaming over WebSocket") {
+	GIVEN("a client subscribed to a session before the handshake completes") {
+		net::io_context ioc;
+		tcp::acceptor acceptor(ioc, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0));
+		websocket::stream<tcp::socket> client(ioc);
+		client.next_layer().connect(acceptor.local_endpoint());
+		beast::tcp_stream server_stream(acceptor.accept());
+
+		model::GameSession session(std::make_shared<model::Map>(model::Map::Id("map1"s), "Map 1"s, 1., 3));
+		session.PublishStateSnapshot(MakeFrame("first"s));
+		auto streamer = std::make_shared<state_stream::StateStreamer>();
+
+		std::shared_ptr<http_server::PushSession> push;
+		beast::flat_buffer server_buffer;
+		http_server::HttpRequest request;
+		http::async_read(server_stream, server_buffer, request, [&](beast::error_code ec, std::size_t) {
+			REQUIRE_FALSE(ec);
+			REQUIRE(websocket::is_upgrade(request));
+			push = std::make_shared<http_server::PushSession>(std::move(server_stream));
+			streamer->Subscribe(push, session);
+
+			// Пока рукопожатие не завершено, кадр "first" ждет отправки и вытесняется более свежим
+			session.PublishStateSnapshot(MakeFrame("second"s));
+			streamer->OnTick(0ms);
+			push->Accept(std::move(request));
+			});
+
+		std::vector<std::string> received;
+		beast::flat_buffer client_buffer;
+		std::function<void(beast::error_code, std::size_t)> on_read = [&](beast::error_code ec, std::size_t) {
+			if (ec) {
+				return;
+			}
+			received.push_back(beast::buffers_to_string(client_buffer.data()));
+			client_buffer.consume(client_buffer.size());
+
+			if (received.size() == 1) {
+				session.PublishStateSnapshot(MakeFrame("third"s));
+				streamer->OnTick(0ms);
+				client.async_read(client_buffer, on_read);
+			}
+			else {
+				client.async_close(websocket::close_code::normal, [](beast::error_code) {});
+			}
+		};
+		client.async_handshake("127.0.0.1"s, "/api/v1/game/stream"s, [&](beast::error_code ec) {
+			REQUIRE_FALSE(ec);
+			client.async_read(client_buffer, on_read);
+			});
+
+		ioc.run_for(5s);
+
+		THEN("the slow client gets only the latest frame, then every tick") {
+			CHECK(received == std::vector{ "second"s, "third"s });
+			REQUIRE(push);
+			CHECK(push->GetDroppedMessages() == 1);
+		}
+
+		THEN("a closed client is unsubscribed on the next tick") {
+			REQUIRE(push);
+			CHECK(push->IsClosed());
+			streamer->OnTick(0ms);
+			CHECK(streamer->GetClientCount() == 0);
+		}
+	}
+}
@@ -0,0 +1,41 @@
+﻿#include "../src/state_writer.h"
+#include "state-json-reference.h"
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/benchmark/catch_benchmark.hpp>
+
+// Сравнение сборки состояния через json::object с прямой записью в буфер.
+// Запуск: game_server_benchmarks "[!benchmark]" --benchmark-samples 10
+
+namespace {
+
+void BenchmarkState(size_t dog_count) {
+	auto game = MakeStateGame(dog_count, dog_count / 2);
+	auto& session = game->GetGameSessions().front();
+
+	std::string buffer;
+	state_writer::WriteGameState(session, buffer);
+	REQUIRE(buffer == SerializeStateWithJsonObject(session));
+
+	BENCHMARK("json::object + serialize") {
+		return SerializeStateWithJsonObject(session);
+	};
+	BENCHMARK("direct writer, reused buffer") {
+		buffer.clear();
+		state_writer::WriteGameState(session, buffer);
+		return buffer.size();
+	};
+}
+
+}  // namespace
+
+TEST_CASE("Game state serialization 100 dogs", "[!benchmark]") {
+	BenchmarkState(100);
+}
+
+TEST_CASE("Game state serialization 1k dogs", "[!benchmark]") {
+	BenchmarkState(1'000);
+}
+
+TEST_CASE("Game state serialization 10k dogs", "[!benchmark]") {
+	BenchmarkState(10'000);
+}
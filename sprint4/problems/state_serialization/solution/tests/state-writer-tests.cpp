@@ -0,0 +1,125 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <limits>
+
+#include "../src/state_writer.h"
+#include "state-json-reference.h"
+
+using namespace std::literals;
+namespace json = boost::json;
+
+namespace {
+
+	std::string WriteDouble(double value) {
+		std::string out;
+		state_writer::JsonWriter writer(out);
+		writer.Double(value);
+		return out;
+	}
+
+}  // namespace
+
+SCENARIO("Direct game state writer") {
+	GIVEN("doubles that need shortest round-trip formatting") {
+		THEN("they are written like json::serialize writes them") {
+			for (double value : { 0., -0., 6., 4., 0.2, 4.200000000000001, 12.199999999999989, -0.3, 1e21, 1.5e-7,
+				 123456789.125, std::numeric_limits<double>::max(), std::numeric_limits<double>::denorm_min() }) {
+				CHECK(WriteDouble(value) == json::serialize(json::value(value)));
+			}
+			CHECK(WriteDouble(6.) == "6E0"s);
+			CHECK(WriteDouble(0.2) == "2E-1"s);
+			CHECK(WriteDouble(4.200000000000001) == "4.200000000000001E0"s);
+		}
+	}
+
+	GIVEN("strings with characters that need escaping") {
+		const auto text = "a\"b\\c\n\t\x01/\xD0\xBF"sv;
+
+		THEN("they are escaped like json::serialize escapes them") {
+			std::string out;
+			state_writer::JsonWriter writer(out);
+			writer.String(text);
+			CHECK(out == json::serialize(json::value(json::string(text))));
+		}
+	}
+
+	GIVEN("an empty session") {
+		auto game = MakeStateGame(0, 0);
+		auto& session = game->GetGameSessions().front();
+
+		THEN("the state has empty players and lost objects") {
+			std::string out;
+			state_writer::WriteGameState(session, out);
+			CHECK(out == R"({"players":{},"lostObjects":{}})"s);
+			CHECK(out == SerializeStateWithJsonObject(session));
+		}
+	}
+
+	GIVEN("a session with dogs, bags and lost objects") {
+		auto game = MakeStateGame(50, 30);
+		auto& session = game->GetGameSessions().front();
+
+		WHEN("the state is written into a reused buffer") {
+			std::string out = "garbage"s;
+			out.clear();
+			state_writer::WriteGameState(session, out);
+
+			THEN("it is byte for byte the same as the json::object serialization") {
+				CHECK(out == SerializeStateWithJsonObject(session));
+			}
+		}
+	}
+}
+
+SCENARIO("Game state changes writer") {
+	GIVEN("a session after a committed tick") {
+		auto game = MakeStateGame(3, 2);
+		auto& session = game->GetGameSessions().front();
+		session.CommitTick();
+		state_writer::ChangesScratch scratch;
+
+		WHEN("the client has no tick yet") {
+			std::string out;
+			state_writer::WriteStateChanges(session, std::nullopt, out, scratch);
+
+			THEN("the full state is sent with the tick number") {
+				std::string state;
+				state_writer::WriteGameState(session, state);
+				CHECK(out == R"({"tick":1,"full":true,)"s + state.substr(1));
+			}
+		}
+
+		WHEN("one dog moves and a loot item is picked up") {
+			auto dog = session.GetDog(1);
+			dog.SetPosition(geom::Point2D{ 2.5, 0. });
+			const auto loot_id = session.GetMap()->GetLoots().front().id;
+			REQUIRE(session.GetMap()->ExtractLoot(loot_id));
+			session.CommitTick();
+
+			std::string out;
+			state_writer::WriteStateChanges(session, 1, out, scratch);
+
+			THEN("only the changes are sent") {
+				std::string dog_json;
+				{
+					auto reference = MakeStateGame(3, 0);
+					auto& reference_session = reference->GetGameSessions().front();
+					reference_session.GetDog(1).SetPosition(geom::Point2D{ 2.5, 0. });
+					state_writer::WriteGameState(reference_session, dog_json);
+				}
+				const auto dog_begin = dog_json.find(R"("1":)");
+				const auto dog_end = dog_json.find(R"(,"2":)");
+				CHECK(out == R"({"tick":2,"full":false,"players":{)"s + dog_json.substr(dog_begin, dog_end - dog_begin)
+					+ R"(},"lostObjects":{},"removedLostObjects":[)"s + std::to_string(*loot_id) + "]}"s);
+			}
+		}
+
+		WHEN("the client is ahead of the server") {
+			std::string out;
+			state_writer::WriteStateChanges(session, 100, out, scratch);
+
+			THEN("the full state is sent") {
+				CHECK(out.starts_with(R"({"tick":1,"full":true,"players":{"0":)"));
+			}
+		}
+	}
+}
@@ -0,0 +1,162 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "../src/request_handler.h"
+
+using namespace std::literals;
+namespace fs = std::filesystem;
+namespace http = boost::beast::http;
+
+namespace {
+	void WriteFile(const fs::path& path, const std::string& content) {
+		fs::create_directories(path.parent_path());
+		std::ofstream(path, std::ios::binary) << content;
+	}
+
+	http_handler::StringRequest MakeRequest(std::string_view target, http::verb method = http::verb::get) {
+		http_handler::StringRequest req(method, target, 11);
+		req.keep_alive(true);
+		return req;
+	}
+
+	std::string_view GetHeader(const auto& result, http::field field) {
+		return std::visit([field](const auto& resp) { return resp[field]; }, result);
+	}
+
+	unsigned GetStatus(const auto& result) {
+		return std::visit([](const auto& resp) { return resp.result_int(); }, result);
+	}
+}  // namespace
+
+SCENARIO("Static file cache") {
+	const fs::path root = fs::temp_directory_path() / "static-cache-tests";
+	fs::remove_all(root);
+	WriteFile(root / "index.html", "<html></html>");
+	WriteFile(root / "file with spaces.html", "spaces");
+	WriteFile(root / "js" / "game.js", "let x = 1;");
+	WriteFile(root / "js" / "game.js.gz", "gzipped");
+	WriteFile(root / "js" / "game.js.br", "brotli");
+	WriteFile(root / "assets" / "model.fbx", std::string(1000, 'm'));
+
+	const auto mime_types = [](std::string_view ext) {
+		return http_handler::GetMimeType(http_handler::file_ext, ext);
+	};
+	const http_handler::StaticCache cache(root, mime_types, 100);
+
+	GIVEN("a cache built from the www-root") {
+		THEN("request paths are normalized to cache keys") {
+			CHECK(cache.GetSize() == 6);
+			CHECK(http_handler::StaticCache::NormalizePath("/js/../index.html"sv) == "/index.html"s);
+			CHECK(http_handler::StaticCache::NormalizePath("/./js//game.js"sv) == "/js/game.js"s);
+			CHECK_FALSE(http_handler::StaticCache::NormalizePath("/../secret"sv).has_value());
+			CHECK_FALSE(http_handler::StaticCache::NormalizePath("/js/../../secret"sv).has_value());
+		}
+
+		THEN("small files are kept in memory and large ones are served from an open file") {
+			const auto* index = cache.Find("/index.html"sv);
+			REQUIRE(index != nullptr);
+			CHECK(index->mime_type == http_handler::ContentType::TEXT_HTML);
+			REQUIRE(index->identity.data != nullptr);
+			CHECK(*index->identity.data == "<html></html>"s);
+			CHECK_FALSE(index->identity.etag.empty());
+			CHECK(index->identity.last_modified.ends_with(" GMT"sv));
+
+			const auto* model = cache.Find("/assets/model.fbx"sv);
+			REQUIRE(model != nullptr);
+			CHECK(model->identity.size == 1000);
+			CHECK(model->identity.data == nullptr);
+			CHECK(model->identity.file != nullptr);
+		}
+
+		THEN("the encoded variant is chosen by Accept-Encoding") {
+			const auto* game = cache.Find("/js/game.js"sv);
+			REQUIRE(game != nullptr);
+			REQUIRE(game->HasEncodedVariants());
+			CHECK(game->SelectVariant(""sv).encoding.empty());
+			CHECK(game->SelectVariant("gzip, deflate, br"sv).encoding == "br"sv);
+			CHECK(game->SelectVariant("gzip, br;q=0.5"sv).encoding == "gzip"sv);
+			CHECK(game->SelectVariant("br;q=0, gzip;q=0"sv).encoding.empty());
+			CHECK(game->SelectVariant("*"sv).encoding == "br"sv);
+			CHECK(game->SelectVariant("identity"sv).encoding.empty());
+			CHECK(game->SelectVariant("br"sv).etag != game->identity.etag);
+		}
+	}
+
+	GIVEN("requests for static files") {
+		WHEN("a file is requested") {
+			auto result = http_handler::HandleStaticFileRequest(cache, MakeRequest("/file%20with%20spaces.html"sv));
+
+			THEN("it is answered from the cache with validators") {
+				REQUIRE(std::holds_alternative<http_handler::SharedResponse>(result));
+				const auto& resp = std::get<http_handler::SharedResponse>(result);
+				CHECK(resp.result() == http::status::ok);
+				CHECK(*resp.body() == "spaces"s);
+				CHECK(resp[http::field::content_type] == http_handler::ContentType::TEXT_HTML);
+				CHECK(resp[http::field::etag] == cache.Find("/file with spaces.html"sv)->identity.etag);
+				CHECK_FALSE(resp[http::field::last_modified].empty());
+			}
+		}
+
+		WHEN("the directory or a precompressed file is requested") {
+			auto req = MakeRequest("/js/game.js"sv);
+			req.set(http::field::accept_encoding, "gzip"sv);
+			auto compressed = http_handler::HandleStaticFileRequest(cache, req);
+			auto index = http_handler::HandleStaticFileRequest(cache, MakeRequest("/"sv));
+
+			THEN("the index page and the encoded variant are returned") {
+				CHECK(GetHeader(compressed, http::field::content_encoding) == "gzip"sv);
+				CHECK(GetHeader(compressed, http::field::vary) == "Accept-Encoding"sv);
+				CHECK(*std::get<http_handler::SharedResponse>(compressed).body() == "gzipped"s);
+				CHECK(*std::get<http_handler::SharedResponse>(index).body() == "<html></html>"s);
+			}
+		}
+
+		WHEN("a large file is requested") {
+			auto get = http_handler::HandleStaticFileRequest(cache, MakeRequest("/assets/model.fbx"sv));
+			auto head = http_handler::HandleStaticFileRequest(cache, MakeRequest("/assets/model.fbx"sv, http::verb::head));
+
+			THEN("the body is left to sendfile, and HEAD carries only the length") {
+				REQUIRE(std::holds_alternative<http_handler::SendFileResponse>(get));
+				CHECK(std::get<http_handler::SendFileResponse>(get).body().file != nullptr);
+				CHECK(GetHeader(get, http::field::content_length) == "1000"sv);
+
+				REQUIRE(std::holds_alternative<http_handler::SendFileResponse>(head));
+				CHECK(std::get<http_handler::SendFileResponse>(head).body().file == nullptr);
+				CHECK(GetHeader(head, http::field::content_length) == "1000"sv);
+			}
+		}
+
+		WHEN("the client already has the file") {
+			const auto& identity = cache.Find("/index.html"sv)->identity;
+			auto by_etag = MakeRequest("/index.html"sv);
+			by_etag.set(http::field::if_none_match, "\"other\", " + identity.etag);
+			auto by_date = MakeRequest("/index.html"sv);
+			by_date.set(http::field::if_modified_since, identity.last_modified);
+			auto stale = MakeRequest("/index.html"sv);
+			stale.set(http::field::if_none_match, "\"other\""sv);
+			stale.set(http::field::if_modified_since, identity.last_modified);
+
+			THEN("conditional requests get 304 unless the ETag differs") {
+				CHECK(GetStatus(http_handler::HandleStaticFileRequest(cache, by_etag)) == 304);
+				CHECK(GetStatus(http_handler::HandleStaticFileRequest(cache, by_date)) == 304);
+				CHECK(GetStatus(http_handler::HandleStaticFileRequest(cache, stale)) == 200);
+			}
+		}
+
+		WHEN("a missing file or a path outside the root is requested") {
+			auto missing = http_handler::HandleStaticFileRequest(cache, MakeRequest("/missing.html"sv));
+			auto outside = http_handler::HandleStaticFileRequest(cache, MakeRequest("/../etc/passwd"sv));
+
+			THEN("both are not found") {
+				CHECK(GetStatus(missing) == 404);
+				CHECK(std::get<http_handler::StringResponse>(missing).body() == http_handler::json_not_found);
+				CHECK(GetStatus(outside) == 404);
+				CHECK(std::get<http_handler::StringResponse>(outside).body() == http_handler::bad_request);
+			}
+		}
+	}
+
+	fs::remove_all(root);
+}
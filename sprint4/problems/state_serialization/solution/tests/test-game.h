@@ -0,0 +1,62 @@
+﻿#pragma once
+#include <chrono>
+#include <initializer_list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../src/app.h"
+
+// Игра с приложением для тестов и бенчмарков, которым нужны игроки, а не только модель
+namespace test_game {
+	using namespace std::literals;
+
+	// Единственный тип трофеев на тестовых картах
+	inline game_details::LootDescription MakeKeyLoot() {
+		return game_details::LootDescription{ "key"s, "assets/key.obj"s, "obj"s, 90, "#338844"s, 0.03, 10 };
+	}
+
+	// Карта с дорогами roads и рюкзаками на 3 предмета. Без with_loot на карте нет типов трофеев
+	inline model::Map MakeMap(const std::string& id, const std::string& name, double dog_speed,
+		std::initializer_list<model::Road> roads, bool with_loot = true) {
+		model::Map map(model::Map::Id(id), name, dog_speed, 3);
+		for (const auto& road : roads) {
+			map.AddRoad(road);
+		}
+		if (with_loot) {
+			map.AddLootDescription(MakeKeyLoot());
+		}
+		return map;
+	}
+
+	struct GameOptions {
+		// Вероятность появления трофея за секунду. Без значения генератор трофеев не добавляется
+		std::optional<double> loot_probability;
+		// Собаки появляются в случайных точках дорог
+		bool random_positions = false;
+	};
+
+	// Игра с картами maps и Application над ней
+	struct TestGame {
+		std::shared_ptr<model::Game> game = std::make_shared<model::Game>();
+		std::shared_ptr<app::PlayerTokens> player_tokens = std::make_shared<app::PlayerTokens>();
+		std::shared_ptr<app::Players> players = std::make_shared<app::Players>();
+		std::unique_ptr<app::JoinGameUseCase> join_game_use_case;
+		std::unique_ptr<app::Application> application;
+
+		explicit TestGame(std::vector<model::Map> maps, GameOptions options = {}) {
+			for (auto& map : maps) {
+				game->AddMap(std::move(map));
+			}
+			if (options.loot_probability) {
+				game->AddLootGenerator(loot_gen::LootGenerator{ 1s, *options.loot_probability });
+			}
+			join_game_use_case = std::make_unique<app::JoinGameUseCase>(game, player_tokens, players, options.random_positions);
+			application = std::make_unique<app::Application>(game, *join_game_use_case, player_tokens);
+		}
+
+		TestGame(const TestGame&) = delete;
+		TestGame& operator=(const TestGame&) = delete;
+	};
+}  // namespace test_game
@@ -0,0 +1,81 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../src/alloc_counter.h"
+#include "../src/app.h"
+#include "test-game.h"
+
+using namespace std::literals;
+
+namespace {
+
+	std::vector<model::Map> MakeMaps() {
+		using model::Road;
+		std::vector<model::Map> maps;
+		for (const auto& id : { "map1"s, "map2"s }) {
+			auto& map = maps.emplace_back(test_game::MakeMap(id, id, 4., {
+				Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 40, Road::Id(0)),
+				Road(Road::VERTICAL, model::Point{ 40, 0 }, 30, Road::Id(1)),
+				Road(Road::HORIZONTAL, model::Point{ 40, 30 }, 0, Road::Id(2)),
+				Road(Road::VERTICAL, model::Point{ 0, 0 }, 30, Road::Id(3)) }));
+			map.AddOffice(model::Office(model::Office::Id("o0"s), model::Point{ 40, 30 }, model::Offset{ 5, 0 }));
+		}
+		return maps;
+	}
+
+}  // namespace
+
+SCENARIO("Game tick allocations") {
+	GIVEN("a game with moving dogs on several maps") {
+		test_game::TestGame fixture(MakeMaps(), { .loot_probability = 1.0, .random_positions = true });
+		app::Application& application = *fixture.application;
+
+		const std::vector<std::string> moves{ "R"s, "D"s, "L"s, "U"s };
+		for (int i = 0; i < 40; ++i) {
+			auto result = application.JoinGame(i % 2 ? "map1"s : "map2"s, "dog"s + std::to_string(i));
+			application.SetPlayerAction("Bearer "s + result.GetPlayerTokens().ToString(),
+				R"({"move": ")"s + moves[i % moves.size()] + R"("})"s);
+		}
+
+		auto check_steady_ticks = [&application] {
+			// Прогрев: появляются трофеи и растут рабочие буферы
+			for (int i = 0; i < 20; ++i) {
+				application.Tick(100ms);
+			}
+			for (int i = 0; i < 10; ++i) {
+				application.Tick(100ms);
+				CHECK(application.GetLastTickAllocations() == 0);
+			}
+		};
+
+		WHEN("sessions are updated in the current thread") {
+			THEN("steady-state ticks do not allocate memory") {
+				check_steady_ticks();
+			}
+		}
+
+		WHEN("sessions are updated on the tick thread pool") {
+			application.SetTickThreads(2);
+
+			THEN("steady-state ticks do not allocate memory") {
+				check_steady_ticks();
+			}
+		}
+	}
+}
+
+SCENARIO("Allocation counter") {
+	GIVEN("the allocation count of the current thread") {
+		WHEN("memory is allocated") {
+			const size_t before = alloc_counter::GetThreadAllocations();
+			auto value = std::make_unique<std::vector<int>>(100);
+			const size_t allocations = alloc_counter::GetThreadAllocations() - before;
+
+			THEN("the counter is increased by the number of allocations") {
+				CHECK(allocations == 2);
+			}
+		}
+	}
+}
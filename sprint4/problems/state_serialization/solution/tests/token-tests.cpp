@@ -0,0 +1,105 @@
+﻿#include <catch2/catch_test_macros.hpp>
+#include <memory>
+#include <string>
+
+#include "../src/alloc_counter.h"
+#include "../src/app.h"
+#include "test-game.h"
+
+using namespace std::literals;
+
+SCENARIO("Player tokens") {
+	GIVEN("a token written as 32 hex digits") {
+		const auto hex = "0123456789abcdef00000000ffffffff"s;
+
+		THEN("it is parsed into two 64-bit halves and written back") {
+			const auto token = app::Token::Parse(hex);
+			REQUIRE(token.has_value());
+			CHECK(token->GetHigh() == 0x0123456789abcdefull);
+			CHECK(token->GetLow() == 0x00000000ffffffffull);
+			CHECK(token->ToString() == hex);
+		}
+
+		THEN("strings of other length or with other characters are rejected") {
+			CHECK_FALSE(app::Token::Parse(hex.substr(1)).has_value());
+			CHECK_FALSE(app::Token::Parse(hex + "0"s).has_value());
+			CHECK_FALSE(app::Token::Parse("0123456789ABCDEF00000000ffffffff"sv).has_value());
+			CHECK_FALSE(app::Token::Parse("0123456789abcdef00000000fffffffg"sv).has_value());
+			CHECK_THROWS_AS(app::Token::FromString("0"sv), std::invalid_argument);
+		}
+	}
+
+	GIVEN("a token table") {
+		app::TokenTable<int> table;
+		CHECK(table.Find(app::Token(1, 2)) == nullptr);
+
+		WHEN("many tokens are added") {
+			// Младшие половины совпадают, чтобы токены попадали в одни и те же цепочки проб
+			for (int i = 0; i < 1000; ++i) {
+				table.InsertOrAssign(app::Token(i, 0), i);
+			}
+			table.InsertOrAssign(app::Token(7, 0), -7);
+
+			THEN("each of them is found after the table has grown") {
+				CHECK(table.Size() == 1000);
+				for (int i = 0; i < 1000; ++i) {
+					const int* value = table.Find(app::Token(i, 0));
+					REQUIRE(value != nullptr);
+					CHECK(*value == (i == 7 ? -7 : i));
+				}
+				CHECK(table.Find(app::Token(0, 1)) == nullptr);
+			}
+		}
+	}
+
+	GIVEN("an application with joined players") {
+		using model::Road;
+		std::vector<model::Map> maps;
+		for (const auto& id : { "map1"s, "map2"s }) {
+			maps.push_back(test_game::MakeMap(id, id, 1., { Road(Road::HORIZONTAL, model::Point{ 0, 0 }, 10, Road::Id(0)) }, false));
+		}
+		test_game::TestGame fixture(std::move(maps));
+		const auto& game = fixture.game;
+		app::Application& application = *fixture.application;
+
+		// У первых собак обеих карт одинаковые id
+		const auto rex = application.JoinGame("map1"s, "Rex"s).GetPlayerTokens();
+		const auto bob = application.JoinGame("map2"s, "Bob"s).GetPlayerTokens();
+
+		THEN("a player is found by the token from the Authorization header") {
+			const auto authorization = "Bearer "s + bob.ToString();
+			const auto allocations = alloc_counter::GetThreadAllocations();
+			const auto token = application.TryExtractToken(authorization);
+			CHECK(alloc_counter::GetThreadAllocations() == allocations);
+			CHECK(token == bob);
+			CHECK(application.FindPlayerByToken(token)->GetGameSession() == game->FindGameSessions(model::Map::Id("map2"s)));
+		}
+
+		THEN("malformed headers and unknown tokens are told apart as before") {
+			using Error = app::GameError<app::AuthorizationGameErrorReason>;
+			const auto reason = [&application](const std::string& authorization) {
+				try {
+					application.FindPlayerByToken(application.TryExtractToken(authorization));
+				}
+				catch (const Error& error) {
+					return error.GetErrorReason();
+				}
+				FAIL("no error");
+				return app::AuthorizationGameErrorReason{};
+			};
+			CHECK(reason("Bearer"s) == app::AUTHORIZATION_INVALIDE_TOKEN);
+			CHECK(reason("Basic "s + rex.ToString()) == app::AUTHORIZATION_INVALIDE_TOKEN);
+			CHECK(reason("Bearer "s + rex.ToString() + "0"s) == app::AUTHORIZATION_INVALIDE_TOKEN);
+			CHECK(reason("Bearer "s + std::string(32, 'x')) == app::AUTHORIZATION_TOKEN_NOT_FOUND);
+			CHECK(reason("Bearer "s + std::string(32, '0')) == app::AUTHORIZATION_TOKEN_NOT_FOUND);
+		}
+
+		THEN("the token is found by the player of each session") {
+			const auto rex_player = application.FindPlayerByToken(rex);
+			const auto bob_player = application.FindPlayerByToken(bob);
+			CHECK(*rex_player->GetId() == *bob_player->GetId());
+			CHECK(application.FindTokenByPlayer(rex_player.get()) == rex);
+			CHECK(application.FindTokenByPlayer(bob_player.get()) == bob);
+		}
+	}
+}